@@ -320,6 +320,9 @@ close_event_stream(FSEventStreamRef stream, ContextData& ctx) -> bool
 
 } /*  namespace */
 
+/*  We don't take an inventory. The `watch` does. */
+inline constexpr bool has_inventory = false;
+
 /*  Lifetimes
     We will ensure that the queue, context and callback
     are alive at least until we close the event stream.
@@ -332,7 +335,8 @@ close_event_stream(FSEventStreamRef stream, ContextData& ctx) -> bool
 inline auto watch(
   std::filesystem::path const& path,
   ::wtr::watcher::event::callback const& cb,
-  semabin const& living) -> bool
+  semabin const& living,
+  ::wtr::watcher::watch_options const&) -> bool
 {
   auto seen_created_paths = ContextData::pathset{};
   auto last_rename_path = ContextData::fspath{};
@@ -16,36 +16,61 @@
 #include <string>
 #include <sys/epoll.h>
 #include <sys/fanotify.h>
+#include <sys/vfs.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace detail::wtr::watcher::adapter::fanotify {
 
 /*  We request post-event reporting, non-blocking
-    IO and unlimited marks for fanotify. We need
-    sudo mode for the unlimited marks. If we were
-    making a filesystem auditor, we might use:
-      FAN_CLASS_PRE_CONTENT
-      | FAN_UNLIMITED_QUEUE
-      | FAN_UNLIMITED_MARKS
-    and some writable fields within the callback.
+    IO and, when we're privileged, an unlimited queue
+    and unlimited marks for fanotify.
+    Since Linux 5.13, unprivileged users can ask for
+    everything else. They have the same queue and mark
+    limits as inotify does, and we handle those limits
+    the same way: with overflow diagnostics and with
+    the poller.
+    Unprivileged users can't open the handles we are
+    given, so we keep a map of our directories' handles
+    to their paths. We need the directory itself to
+    tell us when it's destroyed to keep that map tidy.
+    Since Linux 5.17, a rename can be reported as one
+    event with both names and the handle of the object
+    which was renamed. We use it when we can. Otherwise,
+    we're left to pair the moved-from and moved-to
+    events ourselves, which can't always be done.
+    If we were making a filesystem auditor, we might
+    use FAN_CLASS_PRE_CONTENT and some writable fields
+    within the callback.
 */
 
 // clang-format off
 struct ke_fa_ev {
-  static constexpr auto buf_len = 4096;
-  static constexpr auto c_ulim = buf_len / sizeof(fanotify_event_metadata);
+  /*  The default size of our buffer, and the least we
+      allow, which is enough for a rename's two names
+      and their directories' handles. */
+  static constexpr unsigned buf_len = 4096;
+  static constexpr unsigned buf_len_floor = 1024;
+  /*  How many events the kernel holds for us, unless
+      we're privileged, when it holds all of them */
+  static constexpr auto q_len_path = "/proc/sys/fs/fanotify/max_queued_events";
+  static constexpr unsigned long long q_len = 16384;
   static constexpr auto init_io_flags
     = O_RDONLY
     | O_CLOEXEC
     | O_NONBLOCK;
-  static constexpr auto init_flags
+  static constexpr auto init_flags_unprivileged
     = FAN_CLASS_NOTIF
     | FAN_REPORT_FID
     | FAN_REPORT_DIR_FID
     | FAN_REPORT_NAME
-    | FAN_UNLIMITED_QUEUE
-    | FAN_UNLIMITED_MARKS
     | FAN_NONBLOCK;
+  static constexpr auto init_flags
+    = init_flags_unprivileged
+    | FAN_UNLIMITED_QUEUE
+    | FAN_UNLIMITED_MARKS;
   /*  todo: Support change of ownership w/ FAN_ATTRIB */
   static constexpr auto recv_flags
     = FAN_ONDIR
@@ -53,10 +78,49 @@ struct ke_fa_ev {
     | FAN_MODIFY
     | FAN_MOVE
     | FAN_DELETE
+    | FAN_DELETE_SELF
     | FAN_EVENT_ON_CHILD;
+#if defined(FAN_RENAME) && defined(FAN_REPORT_TARGET_FID)
+  static constexpr auto init_flags_target = FAN_REPORT_TARGET_FID;
+  static constexpr auto recv_flags_rename
+    = (recv_flags & ~FAN_MOVE)
+    | FAN_RENAME;
+  static constexpr int info_old_dir = FAN_EVENT_INFO_TYPE_OLD_DFID_NAME;
+  static constexpr int info_new_dir = FAN_EVENT_INFO_TYPE_NEW_DFID_NAME;
+#else
+  static constexpr auto init_flags_target = 0;
+  static constexpr auto recv_flags_rename = recv_flags;
+  static constexpr int info_old_dir = -1;
+  static constexpr int info_new_dir = -1;
+#endif
+  /*  In the close-write mode, we're told when a file
+      which was written to is closed, instead of about
+      each write. */
+  static constexpr auto recv_flags_close_write
+    = FAN_CLOSE_WRITE;
+  static constexpr auto mark_ignore_legacy
+    = FAN_MARK_IGNORED_MASK
+    | FAN_MARK_IGNORED_SURV_MODIFY;
+#ifdef FAN_MARK_IGNORE_SURV
+  static constexpr auto mark_ignore = FAN_MARK_IGNORE_SURV;
+#else
+  static constexpr auto mark_ignore = mark_ignore_legacy;
+#endif
+  /*  Directory handles (and their filesystem's id)
+      to paths */
+  using paths = std::unordered_map<std::string, std::string>;
 
   int fd = -1;
-  alignas(fanotify_event_metadata) char buf[buf_len]{0};
+  unsigned long long recv = recv_flags;
+  /*  Whether we may open the handles of what changed,
+      for the stats mode, until we're told otherwise */
+  bool is_by_handle = true;
+  paths dm{};
+  std::vector<char> buf = std::vector<char>(buf_len);
+
+  /*  The most events which could fit in our buffer */
+  inline auto c_ulim() const -> size_t
+  { return buf.size() / sizeof(fanotify_event_metadata); }
 };
 
 // clang-format on
@@ -65,48 +129,227 @@ struct sysres {
   result ok = result::e;
   ke_fa_ev ke{};
   semabin const& il{};
+  ::wtr::watcher::watch_options opts{};
+  std::string base{};
+  adapter::pl pl{};
+  adapter::cw cw{};
+  adapter::ct ct{};
+  adapter::fo fo{};
+  adapter::st st{};
   adapter::ep ep{};
+  adapter::shard shard{};
+  adapter::bl bl{};
 };
 
-inline auto do_mark =
-  [](char const* const dirpath, int fa_fd, auto const& cb) -> result
+/*  A handle is only unique within its filesystem,
+    so our keys begin with the filesystem's id. */
+inline auto dm_key(void const* fsid, file_handle const* fh) -> std::string
+{
+  static_assert(sizeof(__kernel_fsid_t) == sizeof(fsid_t));
+  auto k = std::string((char const*)fsid, sizeof(__kernel_fsid_t));
+  k.append((char const*)&fh->handle_type, sizeof(fh->handle_type));
+  k.append((char const*)fh->f_handle, fh->handle_bytes);
+  return k;
+}
+
+/*  The key which an event's directory would have.
+    Empty if we can't identify the path. */
+inline auto dm_key_of(char const* const path, struct statfs const& sfs)
+  -> std::string
+{
+  alignas(file_handle) char buf[sizeof(file_handle) + MAX_HANDLE_SZ];
+  auto fh = (file_handle*)buf;
+  fh->handle_bytes = MAX_HANDLE_SZ;
+  int mount_id = 0;
+  if (name_to_handle_at(AT_FDCWD, path, fh, &mount_id, 0) != 0) return {};
+  return dm_key(&sfs.f_fsid, fh);
+}
+
+inline auto dm_key_of(char const* const path) -> std::string
+{
+  struct statfs sfs;
+  return statfs(path, &sfs) == 0 ? dm_key_of(path, sfs) : std::string{};
+}
+
+/*  Marks a directory. Hands it to the poller if it
+    lives on a filesystem which won't tell us about
+    changes, if we're out of marks, or if fanotify
+    can't identify the filesystem's objects for us.
+    Some overlays are like that. */
+inline auto do_mark = [](
+                        char const* const dirpath,
+                        ke_fa_ev& ke,
+                        pl& pl,
+                        auto const& cb) -> result
 {
   auto e = result::w_sys_not_watched;
+  auto is_unmarkable = [](int ec)
+  { return ec == ENOSPC || ec == ENODEV || ec == EOPNOTSUPP || ec == EXDEV; };
   char real[PATH_MAX];
+  struct statfs sfs;
+  if (! realpath(dirpath, real) || ! is_dir(real) || statfs(real, &sfs) != 0)
+    return send_msg(e, dirpath, cb), e;
+  if (is_pollfs(sfs)) return do_poll_mark(real, pl, cb);
+  auto key = dm_key_of(real, sfs);
+  if (key.empty())
+    return is_unmarkable(errno) ? do_poll_mark(real, pl, cb)
+                                : (send_msg(e, dirpath, cb), e);
   int anonymous_wd =
-    realpath(dirpath, real) && is_dir(real)
-      ? fanotify_mark(fa_fd, FAN_MARK_ADD, ke_fa_ev::recv_flags, AT_FDCWD, real)
-      : -1;
+    fanotify_mark(ke.fd, FAN_MARK_ADD, ke.recv, AT_FDCWD, real);
   if (anonymous_wd == 0)
-    return result::complete;
+    return ke.dm.insert_or_assign(std::move(key), real), result::complete;
+  else if (is_unmarkable(errno))
+    return do_poll_mark(real, pl, cb);
   else
     return send_msg(e, dirpath, cb), e;
 };
 
+/*  Asks the kernel to keep changes to an excluded file
+    to itself. The file's parent is marked, so we'd
+    hear about it otherwise. (We never mark excluded
+    directories, so nothing beneath them is reported.)
+    Creation, destruction and renaming are reported on
+    the parent alone, so we drop those ourselves.
+    `FAN_MARK_IGNORE` (Linux 6.0) is the newer form of
+    the ignored mask. We fall back to the older one. */
+inline auto do_ignore(char const* const path, ke_fa_ev const& ke) -> bool
+{
+  auto add = [&](unsigned flags)
+  {
+    auto fl = FAN_MARK_ADD | flags;
+    auto msk = FAN_MODIFY | FAN_CLOSE_WRITE;
+    return fanotify_mark(ke.fd, fl, msk, AT_FDCWD, path) == 0;
+  };
+  if (is_dir(path)) return false;
+  return add(ke_fa_ev::mark_ignore)
+      || (errno == EINVAL && add(ke_fa_ev::mark_ignore_legacy));
+}
+
+/*  Whether fanotify can report on the filesystem the
+    base path lives on. Some filesystems can't encode
+    the handles we need. Others are marked, without
+    complaint, but never report anything. We'd rather
+    the inotify adapter handle those than the poller. */
+inline auto is_fa_capable(ke_fa_ev const& ke, char const* const base_path)
+  -> bool
+{
+  auto ec =
+    fanotify_mark(ke.fd, FAN_MARK_ADD, ke.recv, AT_FDCWD, base_path) == 0
+      ? 0
+      : errno;
+  return is_pollfs(base_path)
+      || ! (ec == ENODEV || ec == EOPNOTSUPP || ec == EXDEV);
+}
+
 /*  Grabs the resources we need from `fanotify`
     and `epoll`. Marks itself invalid on errors,
     sends diagnostics on warnings and errors.
+    We ask for the privileged flags first, and
+    try again without them if we're refused. The
+    same goes for the flags older kernels lack.
     Walks the given base path, recursively,
-    marking each directory along the way. */
+    marking each directory along the way, and
+    taking an inventory if we were asked to.
+    With a set of files, we only mark the
+    directories they're in. We don't walk any
+    deeper than we were asked to watch. As one
+    of a few shards, we only walk into what's
+    ours. See `shard`. */
 inline auto make_sysres = [](
                             char const* const base_path,
                             auto const& cb,
-                            semabin const& living) -> sysres
+                            semabin const& living,
+                            ::wtr::watcher::watch_options const& opts,
+                            shard sh) -> sysres
 {
-  int fa_fd = fanotify_init(ke_fa_ev::init_flags, ke_fa_ev::init_io_flags);
-  if (fa_fd < 1) return sysres{.ok = result::e_sys_api_fanotify, .il = living};
-  walkdir_do(base_path, [&](auto dir) { do_mark(dir, fa_fd, cb); });
-  auto ep = make_ep(fa_fd, living.fd);
+  using ke_t = ke_fa_ev;
+  constexpr unsigned init_flags_by_preference[] = {
+    ke_t::init_flags | ke_t::init_flags_target,
+    ke_t::init_flags,
+    ke_t::init_flags_unprivileged | ke_t::init_flags_target,
+    ke_t::init_flags_unprivileged,
+  };
+  auto ke = ke_t{};
+  auto flags = 0u;
+  for (auto f : init_flags_by_preference) {
+    ke.fd = fanotify_init(flags = f, ke_t::init_io_flags);
+    if (ke.fd >= 0 || (errno != EPERM && errno != EINVAL)) break;
+  }
+  if (ke.fd < 1) return sysres{.ok = result::e_sys_api_fanotify, .il = living};
+  if (flags & ke_t::init_flags_target) ke.recv = ke_t::recv_flags_rename;
+  if (opts.close_write)
+    ke.recv = (ke.recv & ~FAN_MODIFY) | ke_t::recv_flags_close_write;
+  int fa_fd = ke.fd;
+  if (! is_fa_capable(ke, base_path))
+    return close(fa_fd), sysres{.ok = result::e_sys_api_fanotify, .il = living};
+  auto pl = make_pl();
+  if (pl.fd < 0)
+    return close(fa_fd), sysres{.ok = result::e_sys_api_timerfd, .il = living};
+  auto iv = adapter::iv{opts};
+  auto base = realpath_of(base_path);
+  auto mark = [&](char const* const dir)
+  {
+    if (is_excluded(opts, dir) || ! is_ours(sh, base, dir)) return false;
+    auto r = do_mark(dir, ke, pl, cb);
+    if (r == result::w_sys_polled) pl_inventory(pl, dir, iv);
+    return r != result::w_sys_polled;
+  };
+  auto ent = [&](char const* const dir, dirent const* const de)
+  {
+    if (sh.nth == 0 || strcmp(dir, base_path) != 0) iv.push(dir, de);
+  };
+  walk_do(base_path, opts, mark, ent);
+  iv.send();
+  for (auto const& ex : opts.exclude) do_ignore(ex.c_str(), ke);
+  auto sr_opts = opts;
+  if (opts.exclude_self) sr_opts.exclude_pids.push_back(getpid());
+  auto ep = make_ep(fa_fd, living.fd, pl.fd, opts.epoll_q_len);
+  auto q_len = flags & FAN_UNLIMITED_QUEUE
+               ? 0
+               : number_of(ke_t::q_len_path, ke_t::q_len);
+  ke.buf.resize(buf_len_of(opts, ke_t::buf_len_floor));
   if (ep.fd < 1)
-    return close(fa_fd), sysres{.ok = result::e_sys_api_epoll, .il = living};
+    return close(fa_fd), close(pl.fd),
+           sysres{.ok = result::e_sys_api_epoll, .il = living};
   return sysres{
     .ok = result::pending,
-    .ke{.fd = fa_fd},
+    .ke = std::move(ke),
     .il = living,
+    .opts = std::move(sr_opts),
+    .base = std::move(base),
+    .pl = std::move(pl),
+    .ct = make_ct(opts),
     .ep = ep,
+    .shard = std::move(sh),
+    .bl = make_bl(opts, q_len),
   };
 };
 
+/*  The path of an event's directory, without the name
+    of the directory entry. We look the directory up in
+    our own map first. Only privileged users can open
+    the handle. */
+inline auto dirof(
+  fanotify_event_info_fid const* const dir_info,
+  ke_fa_ev::paths const& dm,
+  int* ec) -> std::string
+{
+  constexpr size_t path_ulim = PATH_MAX - sizeof('\0');
+  constexpr int ofl = O_RDONLY | O_CLOEXEC | O_PATH;
+  auto dir_fh = (file_handle*)(dir_info->handle);
+  auto at = dm.find(dm_key(&dir_info->fsid, dir_fh));
+  if (at != dm.end()) return at->second;
+  int fd = open_by_handle_at(AT_FDCWD, dir_fh, ofl);
+  if (fd <= 0) return *ec = errno, std::string{};
+  char path_buf[PATH_MAX];
+  char fs_ev_pidpath[32] = {0};
+  snprintf(fs_ev_pidpath, sizeof(fs_ev_pidpath), "/proc/self/fd/%d", fd);
+  auto path_len = readlink(fs_ev_pidpath, path_buf, path_ulim);
+  if (path_len <= 0) *ec = errno;
+  close(fd);
+  return path_len > 0 ? std::string{path_buf, (size_t)path_len} : std::string{};
+}
+
 /*  Parses a full path from an event's metadata.
     The shenanigans we do here depend on this event being
     `FAN_EVENT_INFO_TYPE_DFID_NAME`. The kernel passes us
@@ -136,38 +379,90 @@ inline auto make_sysres = [](
     The kernel guarentees that there is a null-terminated
     character string to the event's directory entry
     after the file handle to the directory.
-    Confusing, right? */
-inline auto
-pathof(fanotify_event_metadata const* const mtd, int* ec) -> std::string
+    Confusing, right?
+    The old and new names of a `FAN_RENAME` event have
+    the same layout. */
+inline auto pathof(
+  fanotify_event_info_fid const* const dir_info,
+  ke_fa_ev::paths const& dm,
+  int* ec) -> std::string
 {
-  constexpr size_t path_ulim = PATH_MAX - sizeof('\0');
-  constexpr int ofl = O_RDONLY | O_CLOEXEC | O_PATH;
-  auto dir_info = (fanotify_event_info_fid*)(mtd + 1);
   auto dir_fh = (file_handle*)(dir_info->handle);
-  char path_buf[PATH_MAX];
-  ssize_t file_name_offset = 0;
-  /*  Directory name */
-  int fd = open_by_handle_at(AT_FDCWD, dir_fh, ofl);
-  if (fd <= 0) {
-    *ec = errno;
-    return {};
-  }
-  char fs_ev_pidpath[32] = {0};
-  snprintf(fs_ev_pidpath, sizeof(fs_ev_pidpath), "/proc/self/fd/%d", fd);
-  file_name_offset = readlink(fs_ev_pidpath, path_buf, path_ulim);
-  close(fd);
-  path_buf[file_name_offset] = 0;
-  /*  File name ("Directory entry")
-      If we wrote the directory name before here, we
-      can start writing the file name after its offset. */
-  if (file_name_offset > 0) {
-    char* file_name = ((char*)dir_fh->f_handle + dir_fh->handle_bytes);
-    auto not_selfdir = strcmp(file_name, ".") != 0;
-    auto beg = path_buf + file_name_offset;
-    auto end = PATH_MAX - file_name_offset;
-    if (file_name && not_selfdir) snprintf(beg, end, "/%s", file_name);
+  char* file_name = ((char*)dir_fh->f_handle + dir_fh->handle_bytes);
+  auto is_selfdir = strcmp(file_name, ".") == 0;
+  auto dir = dirof(dir_info, dm, ec);
+  return dir.empty() || is_selfdir ? dir : dir + '/' + file_name;
+}
+
+/*  The records which follow an event's metadata.
+    Most events have the directory and name of what
+    happened. A `FAN_RENAME` event has the old name
+    (if we watch the directory it was in) and the new
+    name (if we watch the directory it's in now).
+    We may also have the object's own handle. */
+struct infos {
+  fanotify_event_info_fid const* dir = nullptr;
+  fanotify_event_info_fid const* old_dir = nullptr;
+  fanotify_event_info_fid const* new_dir = nullptr;
+  fanotify_event_info_fid const* self = nullptr;
+};
+
+inline auto infos_of(fanotify_event_metadata const* const m) -> infos
+{
+  auto ifs = infos{};
+  auto at = (char const*)m + m->metadata_len;
+  auto end = (char const*)m + m->event_len;
+  while (at + sizeof(fanotify_event_info_header) <= end) {
+    auto info = (fanotify_event_info_fid const*)at;
+    auto type = info->hdr.info_type;
+    if (info->hdr.len == 0) break;
+    if (type == FAN_EVENT_INFO_TYPE_DFID_NAME) ifs.dir = info;
+    if (type == ke_fa_ev::info_old_dir) ifs.old_dir = info;
+    if (type == ke_fa_ev::info_new_dir) ifs.new_dir = info;
+    if (type == FAN_EVENT_INFO_TYPE_FID) ifs.self = info;
+    at += info->hdr.len;
   }
-  return {path_buf};
+  return ifs;
+}
+
+/*  A descriptor for what changed, for the stats mode,
+    or -1. Only privileged users can open the handle,
+    so we stop trying once we're told we can't. */
+/*  As one of a few shards, the names of a rename whose
+    directories we don't watch belong to someone else
+    (or to what's outside the tree), so we leave them
+    out. Without both, it isn't ours at all. */
+inline auto seen_of(infos ifs, sysres const& sr) -> infos
+{
+  auto is_seen = [&](fanotify_event_info_fid const* const i)
+  { return i && sr.ke.dm.count(dm_key(&i->fsid, (file_handle*)i->handle)); };
+  if (sr.shard.count < 2) return ifs;
+  if (! is_seen(ifs.old_dir)) ifs.old_dir = nullptr;
+  if (! is_seen(ifs.new_dir)) ifs.new_dir = nullptr;
+  return ifs;
+}
+
+inline auto self_fd_of(infos const& ifs, ke_fa_ev& ke) -> int
+{
+  constexpr int ofl = O_RDONLY | O_CLOEXEC | O_PATH;
+  if (! ifs.self || ! ke.is_by_handle) return -1;
+  int fd = open_by_handle_at(AT_FDCWD, (file_handle*)ifs.self->handle, ofl);
+  if (fd < 0 && errno == EPERM) ke.is_by_handle = false;
+  return fd;
+}
+
+inline auto effect_of(unsigned long long msk, infos const& ifs)
+  -> enum ::wtr::watcher::event::effect_type
+{
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  return msk & FAN_CREATE      ? ev_et::create
+       : msk & FAN_DELETE      ? ev_et::destroy
+       : msk & FAN_MODIFY      ? ev_et::modify
+       : msk & FAN_CLOSE_WRITE ? ev_et::modify
+       : msk & FAN_MOVE        ? ev_et::rename
+       : ifs.old_dir           ? ev_et::rename
+       : ifs.new_dir           ? ev_et::rename
+                               : ev_et::other;
 }
 
 inline auto peek(fanotify_event_metadata const* const m, size_t read_len)
@@ -188,48 +483,196 @@ struct Parsed {
   unsigned this_len = 0;
 };
 
-inline auto
-parse_ev(fanotify_event_metadata const* const m, size_t read_len, int* ec)
-  -> Parsed
+inline auto parse_ev(
+  fanotify_event_metadata const* const m,
+  infos const& ifs,
+  size_t read_len,
+  ke_fa_ev::paths const& dm,
+  int* ec) -> Parsed
 {
   using ev = ::wtr::watcher::event;
   using ev_pt = enum ev::path_type;
   using ev_et = enum ev::effect_type;
   auto n = peek(m, read_len);
   auto pt = m->mask & FAN_ONDIR ? ev_pt::dir : ev_pt::file;
-  auto et = m->mask & FAN_CREATE ? ev_et::create
-          : m->mask & FAN_DELETE ? ev_et::destroy
-          : m->mask & FAN_MODIFY ? ev_et::modify
-          : m->mask & FAN_MOVE   ? ev_et::rename
-                                 : ev_et::other;
+  auto et = effect_of(m->mask, ifs);
   auto isfromto = [et](unsigned a, unsigned b) -> bool
   { return et == ev_et::rename && a & FAN_MOVED_FROM && b & FAN_MOVED_TO; };
+  auto at = [&](auto* info) { return ev(pathof(info, dm, ec), et, pt); };
   auto one = [&](auto* m) -> Parsed
-  { return {ev(pathof(m, ec), et, pt), n, m->event_len}; };
+  { return {at(infos_of(m).dir), n, m->event_len}; };
   auto assoc = [&](auto* m, auto* n) -> Parsed
   {
     auto nn = peek(n, read_len);
     auto here_to_nnn = m->event_len + n->event_len;
-    auto e = ev(ev(pathof(m, ec), et, pt), ev(pathof(n, ec), et, pt));
+    auto e = ev(at(infos_of(m).dir), at(infos_of(n).dir));
     return {e, nn, here_to_nnn};
   };
-  return ! n                        ? one(m)
+  auto renamed = [&](auto* from, auto* to) -> Parsed
+  {
+    return from && to ? Parsed{ev(at(from), at(to)), n, m->event_len}
+         : from       ? Parsed{at(from), n, m->event_len}
+                      : Parsed{at(to), n, m->event_len};
+  };
+  return ifs.old_dir || ifs.new_dir ? renamed(ifs.old_dir, ifs.new_dir)
+       : ! n                        ? one(m)
        : isfromto(m->mask, n->mask) ? assoc(m, n)
        : isfromto(n->mask, m->mask) ? assoc(n, m)
                                     : one(m);
 }
 
-inline auto do_mark_if_newdir =
-  [](::wtr::watcher::event const& ev, int fa_fd, auto const& cb) -> result
+inline auto do_mark_if_newdir = [](
+                                   ::wtr::watcher::event const& ev,
+                                   ke_fa_ev& ke,
+                                   pl& pl,
+                                   auto const& cb) -> result
 {
   auto is_newdir = ev.effect_type == ::wtr::watcher::event::effect_type::create
                 && ev.path_type == ::wtr::watcher::event::path_type::dir;
   if (is_newdir)
-    return do_mark(ev.path_name.c_str(), fa_fd, cb);
+    return do_mark(ev.path_name.c_str(), ke, pl, cb);
   else
     return result::complete;
 };
 
+inline auto do_ignore_if_newfile =
+  [](::wtr::watcher::event const& ev, ke_fa_ev const& ke) -> bool
+{
+  auto is_newfile = ev.effect_type == ::wtr::watcher::event::effect_type::create
+                 && ev.path_type != ::wtr::watcher::event::path_type::dir;
+  return is_newfile && do_ignore(ev.path_name.c_str(), ke);
+};
+
+/*  A directory keeps its handle when it's renamed, so
+    we move it, along with everything beneath it, in our
+    map. We're given the handle with `FAN_RENAME`, and
+    look it up by the directory's new name otherwise. */
+inline auto dm_move_if_dir(
+  ::wtr::watcher::event const& ev,
+  infos const& ifs,
+  ke_fa_ev::paths& dm) -> void
+{
+  auto is_dir_rename =
+    ev.effect_type == ::wtr::watcher::event::effect_type::rename
+    && ev.path_type == ::wtr::watcher::event::path_type::dir;
+  if (! is_dir_rename) return;
+  auto to = (ev.associated ? ev.associated->path_name : ev.path_name).string();
+  auto at = dm.find(
+    ifs.self ? dm_key(&ifs.self->fsid, (file_handle*)ifs.self->handle)
+             : dm_key_of(to.c_str()));
+  if (at == dm.end() || at->second == to) return;
+  auto from = at->second;
+  auto is_beneath = [&](std::string const& p)
+  { return p.size() > from.size() && p[from.size()] == '/'; };
+  for (auto& [_, path] : dm)
+    if (path.compare(0, from.size(), from) == 0)
+      if (path.size() == from.size() || is_beneath(path))
+        path = to + path.substr(from.size());
+}
+
+/*  A directory which we only saw (or claimed) one name
+    of was moved into, or out of, what we watch (or what
+    this shard watches). What was moved in is marked, as
+    far down as we watch. What was moved out is unmarked,
+    along with everything beneath it, when we know where
+    it went. Otherwise, we keep its paths until we do. */
+inline auto do_remark_if_moved = [](
+                                    ::wtr::watcher::event const& ev,
+                                    ::wtr::watcher::event const& whole,
+                                    sysres& sr,
+                                    auto const& cb) -> void
+{
+  auto mark = [&](char const* const dir)
+  {
+    if (is_excluded(sr.opts, dir)) return false;
+    if (is_too_deep_to_mark(sr.opts, sr.base, dir)) return false;
+    return do_mark(dir, sr.ke, sr.pl, cb) != result::w_sys_polled;
+  };
+  auto const& path = ev.path_name.native();
+  if (! is_half_moved_dir(ev))
+    return;
+  else if (is_moved_in(ev)) {
+    if (sr.opts.files.empty()) walkdir_do(path.c_str(), mark);
+  }
+  else if (whole.associated) {
+    auto const& to = whole.associated->path_name.native();
+    for (auto at = sr.ke.dm.begin(); at != sr.ke.dm.end();)
+      if (is_at_or_beneath(path, at->second)) {
+        auto now = to + at->second.substr(path.size());
+        fanotify_mark(
+          sr.ke.fd,
+          FAN_MARK_REMOVE,
+          sr.ke.recv,
+          AT_FDCWD,
+          now.c_str());
+        at = sr.ke.dm.erase(at);
+      }
+      else
+        ++at;
+  }
+};
+
+/*  Whether two records are about the same directory. */
+inline auto is_same_dir(
+  fanotify_event_info_fid const* const a,
+  fanotify_event_info_fid const* const b) -> bool
+{
+  auto fa = (file_handle const*)a->handle;
+  auto fb = (file_handle const*)b->handle;
+  return memcmp(&a->fsid, &b->fsid, sizeof(a->fsid)) == 0
+      && fa->handle_type == fb->handle_type
+      && fa->handle_bytes == fb->handle_bytes
+      && memcmp(fa->f_handle, fb->f_handle, fa->handle_bytes) == 0;
+}
+
+/*  The directories which changed in a batch of events,
+    and how many of each effect happened in them. For
+    the coarse and the counting modes. We compare their
+    handles, and only look for their paths once the
+    batch is read.
+    A record names one directory, or two for renames.
+    (Handles point into the buffer we read into, which
+    is why we can't hold onto them past this batch.) */
+struct batch_dirs {
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  std::vector<fanotify_event_info_fid const*> dirs{};
+  std::vector<std::array<unsigned, ct::effect_c>> counts{};
+
+  inline auto push(fanotify_event_info_fid const* const info, ev_et et)
+    -> void
+  {
+    if (! info) return;
+    size_t i = 0;
+    while (i < dirs.size() && ! is_same_dir(dirs[i], info)) ++i;
+    if (i == dirs.size()) dirs.push_back(info), counts.emplace_back();
+    counts[i][(size_t)et]++;
+  }
+
+  /*  Each record in the `len` bytes beginning at `m` */
+  inline auto push(fanotify_event_metadata const* m, size_t len) -> void
+  {
+    for (auto end = (char const*)m + len; (char const*)m < end;) {
+      auto ifs = infos_of(m);
+      auto et = effect_of(m->mask, ifs);
+      push(ifs.dir, et), push(ifs.old_dir, et), push(ifs.new_dir, et);
+      m = (fanotify_event_metadata const*)((char const*)m + m->event_len);
+    }
+  }
+
+  inline auto send(ke_fa_ev::paths const& dm, cw& cw, ct& ct) -> void
+  {
+    for (size_t i = 0; i < dirs.size(); ++i) {
+      int ec = 0;
+      auto path = dirof(dirs[i], dm, &ec);
+      if (ec || path.empty()) continue;
+      if (ct.period_ms)
+        ct_push(ct, std::move(path), counts[i]);
+      else
+        cw_push(cw, std::move(path));
+    }
+  }
+};
+
 /*  Read some events from what fanotify gives
     us. Sends (the valid) events to the user's
     callback. Send a diagnostic to the user on
@@ -250,45 +693,123 @@ inline auto do_mark_if_newdir =
     events by their file handles.
     The `metadata->vers` field may differ between
     kernel versions, so we check it against the
-    version we were compiled with. */
-inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
+    version we were compiled with.
+    A queue overflow is reported, but it isn't the
+    end of this batch. Neither is a directory being
+    destroyed, which we only use to forget about it.
+    (Its parent tells the user.)
+    Changes made by the processes we were asked to
+    ignore are dropped before we look for their path,
+    unless they change which directories we watch.
+    In the coarse and counting modes, we only look for
+    the paths of events which change which directories
+    we watch, or which might be excluded. The rest only
+    tell us which directories changed, and how.
+    In the fold mode, what's destroyed is held onto,
+    and folded into the directory it was beneath.
+    In the stats and dirs-first modes, everything is
+    held onto until the loop looks at it, once we're
+    done reading.
+    As one of a few shards, we only handle what's ours.
+    See `shard`. */
+inline auto do_ev_recv_buf = [](
+                              auto const& cb,
+                              sysres& sr,
+                              ssize_t read_len) -> result
 {
-  auto ev_info = [](fanotify_event_metadata const* const m)
-  { return (fanotify_event_info_fid*)(m + 1); };
-  auto ev_has_dirname = [&](fanotify_event_metadata const* const m) -> bool
-  { return ev_info(m)->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME; };
+  auto ev_has_dirname = [](fanotify_event_metadata const* const m) -> bool
+  {
+    auto ifs = infos_of(m);
+    return ifs.dir || ifs.old_dir || ifs.new_dir;
+  };
+  auto is_quiet = [&](fanotify_event_metadata const* const m) -> bool
+  { return is_excluded_pid(sr.opts, m->pid); };
+  auto is_unseen = [&](fanotify_event_metadata const* const m) -> bool
+  {
+    auto ifs = infos_of(m);
+    auto seen = seen_of(ifs, sr);
+    auto is_renamed = ifs.old_dir || ifs.new_dir;
+    return is_renamed && ! seen.old_dir && ! seen.new_dir;
+  };
 
+  auto batch = batch_dirs{};
+  auto is_batched = sr.opts.coarse || sr.ct.period_ms;
+  auto is_unnamed = is_batched && sr.opts.exclude.empty();
   unsigned read_ev_count = 0;
-  int read_len = read(sr.ke.fd, sr.ke.buf, sr.ke.buf_len);
-  auto const* mtd = (fanotify_event_metadata*)(sr.ke.buf);
+  auto const whole_read_len = read_len;
+  auto const* mtd = (fanotify_event_metadata*)(sr.ke.buf.data());
   if (read_len <= 0 && errno != EAGAIN)
     return result::pending;
   else if (read_len < 0)
     return result::e_sys_api_read;
   else
     while (mtd && FAN_EVENT_OK(mtd, read_len))
-      if (read_ev_count++ > sr.ke.c_ulim)
+      if (read_ev_count++ > sr.ke.c_ulim())
         return result::e_sys_ret;
       else if (mtd->vers != FANOTIFY_METADATA_VERSION)
         return result::e_sys_lim_kernel_version;
       else if (mtd->fd != FAN_NOFD)
         return result::w_sys_bad_fd;
-      else if (mtd->mask & FAN_Q_OVERFLOW)
-        return result::w_sys_q_overflow;
+      else if (mtd->mask & FAN_Q_OVERFLOW) {
+        sr.bl.st.overflows++;
+        send_msg(result::w_sys_q_overflow, sr.base.c_str(), cb);
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
+      }
       else if (! ev_has_dirname(mtd))
         return result::w_sys_bad_meta;
+      else if (mtd->mask & FAN_DELETE_SELF) {
+        if (auto self = infos_of(mtd).dir)
+          sr.ke.dm.erase(dm_key(&self->fsid, (file_handle*)self->handle));
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
+      }
+      else if (is_quiet(mtd) && ! (mtd->mask & FAN_ONDIR))
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
+      else if (is_unnamed && ! (mtd->mask & FAN_ONDIR)) {
+        batch.push(mtd, mtd->event_len);
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
+      }
+      else if (is_unseen(mtd))
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
       else {
         int ec = 0;
-        auto [ev, n, l] = parse_ev(mtd, read_len, &ec);
+        auto ifs = seen_of(infos_of(mtd), sr);
+        auto [whole, n, l] = parse_ev(mtd, ifs, read_len, sr.ke.dm, &ec);
         if (ec) return result::w_sys_bad_fd;
-        do_mark_if_newdir(ev, sr.ke.fd, cb);
-        cb(ev);
+        auto part = claim_of(sr.shard, sr.base, whole);
+        auto ev = part_of(whole, part);
+        auto is_ex = is_excluded(sr.opts, ev.path_name.native());
+        auto quiet = is_ex || is_quiet(mtd) || ! (part.from || part.to);
+        if (part.from || part.to) dm_move_if_dir(ev, ifs, sr.ke.dm);
+        if (part.from || part.to) do_remark_if_moved(ev, whole, sr, cb);
+        if (is_ex)
+          do_ignore_if_newfile(ev, sr.ke);
+        else if (
+          sr.opts.files.empty() && (part.from || part.to)
+          && ! is_too_deep_to_mark(sr.opts, sr.base, ev.path_name.native()))
+          do_mark_if_newdir(ev, sr.ke, sr.pl, cb);
+        if (! quiet && ! is_batched)
+          do_send(
+            cb,
+            sr,
+            ev,
+            sr.opts.stats ? self_fd_of(infos_of(mtd), sr.ke) : -1);
+        if (! quiet && is_batched) batch.push(mtd, l);
         mtd = n;
         read_len -= l;
       }
+  bl_read(sr.bl, whole_read_len, read_ev_count);
+  batch.send(sr.ke.dm, sr.cw, sr.ct);
   return result::pending;
 };
 
+/*  Reads, then looks at what we read. In the io-uring
+    mode, the ring reads for us. See `ur`. */
+inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
+{
+  auto read_len = read(sr.ke.fd, sr.ke.buf.data(), sr.ke.buf.size());
+  return do_ev_recv_buf(cb, sr, read_len);
+};
+
 } /*  namespace detail::wtr::watcher::adapter::fanotify */
 
 #endif
@@ -8,6 +8,7 @@
 #if (KERNEL_VERSION(2, 7, 0) <= LINUX_VERSION_CODE) || __ANDROID_API__
 
 #include "wtr/watcher.hpp"
+#include <errno.h>
 #include <filesystem>
 #include <limits.h>
 #include <string.h>
@@ -16,6 +17,7 @@
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 namespace detail::wtr::watcher::adapter::inotify {
 
@@ -43,18 +45,16 @@ struct ke_in_ev {
       `epoll` event loop and everything
       to do with `read()` calls which
       fill a buffer with batched events.
+      This is the default. The user may
+      ask for another (`read_buf_len`),
+      but never less than `one_ulim`.
   */
   static constexpr unsigned buf_len = 4096;
   static_assert(buf_len > one_ulim * 8, "capacity");
-  /*  The upper limit of how many events
-      we could possibly read into a buffer
-      which is `buf_len` bytes large.
-      Practically, if we come half-way
-      close to this value, we should
-      be skeptical of the `read`.
-  */
-  static constexpr unsigned c_ulim = buf_len / sizeof(inotify_event);
-  static_assert(c_ulim == 256);
+  static constexpr unsigned buf_len_floor = one_ulim;
+  /*  How many events the kernel holds for us */
+  static constexpr auto q_len_path = "/proc/sys/fs/inotify/max_queued_events";
+  static constexpr unsigned long long q_len = 16384;
   /*  These are the kinds of events which
       we're intersted in. Inotify *should*
       only send us these events, but that's
@@ -85,14 +85,32 @@ struct ke_in_ev {
     | IN_MOVE_SELF
     | IN_MOVED_FROM
     | IN_MOVED_TO;
+  /*  In the close-write mode, we're told
+      when a file which was written to is
+      closed, instead of about each write.
+      That's one event for each completed
+      write, however large it was.
+  */
+  static constexpr unsigned recv_mask_close_write
+    = (recv_mask & ~IN_MODIFY)
+    | IN_CLOSE_WRITE;
 
   int fd = -1;
+  unsigned recv = recv_mask;
   using paths = std::unordered_map<int, std::filesystem::path>;
   paths dm{};
-  alignas(inotify_event) char ev_buf[buf_len]{0};
-  int rm_wd_buf[buf_len]{0};
+  std::vector<char> buf = std::vector<char>(buf_len);
+  std::vector<int> rm_wd_buf = std::vector<int>(buf_len);
 
-  static_assert(sizeof(ev_buf) % sizeof(inotify_event) == 0, "alignment");
+  /*  The upper limit of how many events
+      we could possibly read into our
+      buffer.
+      Practically, if we come half-way
+      close to this value, we should
+      be skeptical of the `read`.
+  */
+  inline auto c_ulim() const -> size_t
+  { return buf.size() / sizeof(inotify_event); }
 };
 
 // clang-format on
@@ -101,19 +119,39 @@ struct sysres {
   result ok = result::e;
   ke_in_ev ke{};
   semabin const& il{};
+  ::wtr::watcher::watch_options opts{};
+  std::string base{};
+  adapter::pl pl{};
+  adapter::cw cw{};
+  adapter::ct ct{};
+  adapter::fo fo{};
+  adapter::st st{};
   adapter::ep ep{};
+  adapter::shard shard{};
+  adapter::bl bl{};
 };
 
-inline auto do_mark =
-  [](char const* const dirpath, int dirfd, auto& dm, auto const& cb) -> result
+/*  Marks a directory. Hands it to the poller if
+    it lives on a filesystem which won't tell us
+    about changes, or if we're out of watches. */
+inline auto do_mark = [](
+                        char const* const dirpath,
+                        int dirfd,
+                        unsigned recv,
+                        auto& dm,
+                        pl& pl,
+                        auto const& cb) -> result
 {
   auto e = result::w_sys_not_watched;
   char real[PATH_MAX];
-  int wd = realpath(dirpath, real) && is_dir(real)
-           ? inotify_add_watch(dirfd, real, ke_in_ev::recv_mask)
-           : -1;
+  if (! realpath(dirpath, real) || ! is_dir(real))
+    return send_msg(e, dirpath, cb), e;
+  if (is_pollfs(real)) return do_poll_mark(real, pl, cb);
+  int wd = inotify_add_watch(dirfd, real, recv);
   if (wd > 0)
     return dm.emplace(wd, real), result::complete;
+  else if (errno == ENOSPC)
+    return do_poll_mark(real, pl, cb);
   else
     return send_msg(e, dirpath, cb), e;
 };
@@ -121,7 +159,9 @@ inline auto do_mark =
 inline auto make_sysres = [](
                             char const* const base_path,
                             auto const& cb,
-                            semabin const& living) -> sysres
+                            semabin const& living,
+                            ::wtr::watcher::watch_options const& opts,
+                            shard sh) -> sysres
 {
   auto make_inotify = [](result* ok) -> int
   {
@@ -131,35 +171,71 @@ inline auto make_sysres = [](
     return in_fd;
   };
 
-  auto make_dm = [&](result* ok, int in_fd) -> ke_in_ev::paths
+  auto make_pl = [](result* ok) -> pl
+  {
+    if (*ok >= result::e) return pl{};
+    auto pl = adapter::make_pl();
+    if (pl.fd < 0) *ok = result::e_sys_api_timerfd;
+    return pl;
+  };
+
+  auto recv = opts.close_write ? ke_in_ev::recv_mask_close_write
+                               : ke_in_ev::recv_mask;
+
+  auto make_dm = [&](result* ok, int in_fd, pl& pl) -> ke_in_ev::paths
   {
     auto dm = ke_in_ev::paths{};
     if (*ok >= result::e) return dm;
-    walkdir_do(base_path, [&](auto dir) { do_mark(dir, in_fd, dm, cb); });
-    if (dm.empty()) *ok = result::e_self_noent;
+    auto iv = adapter::iv{opts};
+    auto base = realpath_of(base_path);
+    auto mark = [&](char const* const dir)
+    {
+      if (is_excluded(opts, dir) || ! is_ours(sh, base, dir)) return false;
+      auto r = do_mark(dir, in_fd, recv, dm, pl, cb);
+      if (r == result::w_sys_polled) pl_inventory(pl, dir, iv);
+      return r != result::w_sys_polled;
+    };
+    auto ent = [&](char const* const dir, dirent const* const de)
+    {
+      if (sh.nth == 0 || strcmp(dir, base_path) != 0) iv.push(dir, de);
+    };
+    walk_do(base_path, opts, mark, ent);
+    iv.send();
+    if (dm.empty() && pl.roots.empty()) *ok = result::e_self_noent;
     return dm;
   };
 
-  auto make_ep = [&](result* ok, int in_fd, int il_fd) -> ep
+  auto make_ep = [&](result* ok, int in_fd, int il_fd, int pl_fd) -> ep
   {
     if (*ok >= result::e) return ep{};
-    auto ep = adapter::make_ep(in_fd, il_fd);
+    auto ep = adapter::make_ep(in_fd, il_fd, pl_fd, opts.epoll_q_len);
     if (ep.fd < 0) *ok = result::e_sys_api_epoll;
     return ep;
   };
 
   auto ok = result::pending;
   auto in_fd = make_inotify(&ok);
-  auto dm = make_dm(&ok, in_fd);
-  auto ep = make_ep(&ok, in_fd, living.fd);
+  auto pl = make_pl(&ok);
+  auto dm = make_dm(&ok, in_fd, pl);
+  auto ep = make_ep(&ok, in_fd, living.fd, pl.fd);
+  auto buf_len = buf_len_of(opts, ke_in_ev::buf_len_floor);
   return sysres{
     .ok = ok,
     .ke{
         .fd = in_fd,
+        .recv = recv,
         .dm = std::move(dm),
+        .buf = std::vector<char>(buf_len),
+        .rm_wd_buf = std::vector<int>(buf_len),
         },
     .il = living,
+    .opts = opts,
+    .base = realpath_of(base_path),
+    .pl = std::move(pl),
+    .ct = make_ct(opts),
     .ep = ep,
+    .shard = std::move(sh),
+    .bl = make_bl(opts, number_of(ke_in_ev::q_len_path, ke_in_ev::q_len)),
   };
 };
 
@@ -172,12 +248,26 @@ inline auto peek = [](
   return next < ev_tail ? next : nullptr;
 };
 
+inline auto effect_of(unsigned msk) -> enum ::wtr::watcher::event::effect_type
+{
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  return msk & IN_CREATE      ? ev_et::create
+       : msk & IN_DELETE      ? ev_et::destroy
+       : msk & IN_MOVE        ? ev_et::rename
+       : msk & IN_MODIFY      ? ev_et::modify
+       : msk & IN_CLOSE_WRITE ? ev_et::modify
+                              : ev_et::other;
+}
+
 struct parsed {
   ::wtr::watcher::event ev;
   inotify_event* next = nullptr;
 };
 
+/*  The halves of a rename may be in different
+    directories, so we look for each one's own */
 inline auto parse_ev = [](
+                         ke_in_ev::paths const& dm,
                          std::filesystem::path const& dirname,
                          inotify_event const* const in,
                          inotify_event const* const tail) -> parsed
@@ -186,13 +276,13 @@ inline auto parse_ev = [](
   using ev_pt = enum ev::path_type;
   using ev_et = enum ev::effect_type;
   auto pathof = [&](inotify_event const* const m)
-  { return dirname / std::filesystem::path{m->name}; };
+  {
+    auto at = m->wd == in->wd ? dm.end() : dm.find(m->wd);
+    auto const& dir = at == dm.end() ? dirname : at->second;
+    return dir / std::filesystem::path{m->name};
+  };
   auto pt = in->mask & IN_ISDIR ? ev_pt::dir : ev_pt::file;
-  auto et = in->mask & IN_CREATE ? ev_et::create
-          : in->mask & IN_DELETE ? ev_et::destroy
-          : in->mask & IN_MOVE   ? ev_et::rename
-          : in->mask & IN_MODIFY ? ev_et::modify
-                                 : ev_et::other;
+  auto et = effect_of(in->mask);
   auto isassoc = [&](auto* a, auto* b) -> bool
   { return b && b->cookie && b->cookie == a->cookie && et == ev_et::rename; };
   auto isfromto = [](auto* a, auto* b) -> bool
@@ -208,6 +298,59 @@ inline auto parse_ev = [](
                              : one(in, next);
 };
 
+/*  A directory keeps its watch descriptor when it's
+    renamed, so we move it, along with everything
+    beneath it, in our map. Otherwise, what happens
+    beneath it would be reported by its old name.
+    We can only do that when we've seen both names. */
+inline auto dm_move_if_dir(
+  ::wtr::watcher::event const& ev,
+  ke_in_ev::paths& dm) -> void
+{
+  auto is_dir_rename =
+    ev.effect_type == ::wtr::watcher::event::effect_type::rename
+    && ev.path_type == ::wtr::watcher::event::path_type::dir && ev.associated;
+  if (! is_dir_rename) return;
+  auto const& from = ev.path_name.native();
+  auto const& to = ev.associated->path_name.native();
+  auto is_beneath = [&](std::string const& p)
+  { return p.size() > from.size() && p[from.size()] == '/'; };
+  for (auto& [_, path] : dm)
+    if (path.native().compare(0, from.size(), from) == 0)
+      if (path.native().size() == from.size() || is_beneath(path.native()))
+        path = to + path.native().substr(from.size());
+}
+
+/*  A directory which we only saw one name of was moved
+    into, or out of, what we watch (or what this shard
+    watches). What was moved in is marked, as far down
+    as we watch. What was moved out is forgotten, along
+    with everything beneath it. Its marks go with it,
+    so we'd hear about it by its old name otherwise. */
+inline auto do_remark_if_moved =
+  [](::wtr::watcher::event const& ev, sysres& sr, auto const& cb) -> void
+{
+  auto mark = [&](char const* const dir)
+  {
+    if (is_excluded(sr.opts, dir)) return false;
+    if (is_too_deep_to_mark(sr.opts, sr.base, dir)) return false;
+    auto r = do_mark(dir, sr.ke.fd, sr.ke.recv, sr.ke.dm, sr.pl, cb);
+    return r != result::w_sys_polled;
+  };
+  auto const& path = ev.path_name.native();
+  if (! is_half_moved_dir(ev))
+    return;
+  else if (is_moved_in(ev)) {
+    if (sr.opts.files.empty()) walkdir_do(path.c_str(), mark);
+  }
+  else
+    for (auto at = sr.ke.dm.begin(); at != sr.ke.dm.end();)
+      if (is_at_or_beneath(path, at->second.native()))
+        inotify_rm_watch(sr.ke.fd, at->first), at = sr.ke.dm.erase(at);
+      else
+        ++at;
+};
+
 struct defer_dm_rm_wd {
   ke_in_ev& ke;
   size_t back_idx = 0;
@@ -219,7 +362,7 @@ struct defer_dm_rm_wd {
       system invariant has been violated. */
   inline auto push(int wd) -> bool
   {
-    if (back_idx < ke.buf_len)
+    if (back_idx < ke.rm_wd_buf.size())
       return ke.rm_wd_buf[back_idx++] = wd, true;
     else
       return false;
@@ -238,6 +381,36 @@ struct defer_dm_rm_wd {
   };
 };
 
+/*  The directories which changed in a batch of events,
+    by their watch descriptors, and how many of each
+    effect happened in them. For the coarse and the
+    counting modes. We only look for their paths once
+    we're done with the batch. */
+struct batch_wds {
+  std::vector<int> wds{};
+  std::vector<std::array<unsigned, ct::effect_c>> counts{};
+
+  inline auto push(int wd, enum ::wtr::watcher::event::effect_type et) -> void
+  {
+    size_t i = 0;
+    while (i < wds.size() && wds[i] != wd) ++i;
+    if (i == wds.size()) wds.push_back(wd), counts.emplace_back();
+    counts[i][(size_t)et]++;
+  }
+
+  inline auto send(ke_in_ev::paths const& dm, cw& cw, ct& ct) -> void
+  {
+    for (size_t i = 0; i < wds.size(); ++i) {
+      auto at = dm.find(wds[i]);
+      if (at == dm.end()) continue;
+      if (ct.period_ms)
+        ct_push(ct, at->second.string(), counts[i]);
+      else
+        cw_push(cw, at->second.string());
+    }
+  }
+};
+
 /*  Parses each event's path name,
     path type and effect.
     Looks for the directory path
@@ -309,51 +482,158 @@ struct defer_dm_rm_wd {
     won't happen in that directory.
     If this happens for some other
     reason, we're in trouble.
+    With a set of files, we don't
+    mark new directories at all.
+    Nor do we mark those deeper than
+    we were asked to watch.
+
+    Renamed Directories --
+    We keep the paths in our map up
+    to date when a directory we watch
+    is renamed, in every mode.
+    When we only see one of its names,
+    it was moved in, and we mark it,
+    or out, and we forget it.
+
+    Shards --
+    As one of a few shards, we only
+    handle what's ours. See `shard`.
+
+    Folded Events --
+    In the fold mode, what's destroyed
+    is held onto, and folded into the
+    directory it was beneath. See `fo`.
+
+    Stats and Directories First --
+    In the stats mode, what we send is
+    held onto until we're done reading,
+    then looked at by its path. So it
+    is in the dirs-first mode, which
+    sends the directories' events first.
+    Either way, we mark what's new while
+    we read, before we send anything.
+    See `st`.
+
+    Coarse and Counted Events --
+    We only look at the names of
+    new directories, which we mark,
+    and, if the user excluded some
+    paths, the names of everything
+    else. Otherwise, we only note
+    the watch descriptor and the
+    effect. Once we're done with
+    this batch, we note each of
+    their directories as changed,
+    or count what happened there.
 */
-inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
+inline auto do_ev_recv_buf = [](
+                              auto const& cb,
+                              sysres& sr,
+                              ssize_t read_len) -> result
 {
   auto is_parity_lost = [](unsigned msk) -> bool
   { return msk & IN_DELETE_SELF && ! (msk & IN_MOVE_SELF); };
   auto is_real_event = [](unsigned msk) -> bool
   {
-    bool has_any = msk & ke_in_ev::recv_mask;
+    bool has_any = msk & (ke_in_ev::recv_mask | IN_CLOSE_WRITE);
     bool is_self_info = msk & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF);
     return has_any && ! is_self_info;
   };
 
-  auto read_len = read(sr.ke.fd, sr.ke.ev_buf, sizeof(sr.ke.ev_buf));
   if (read_len < 0 && errno != EAGAIN)
     return result::e_sys_api_read;
   else {
-    auto const* in_ev = (inotify_event*)(sr.ke.ev_buf);
-    auto const* const in_ev_tail = (inotify_event*)(sr.ke.ev_buf + read_len);
+    auto const* in_ev = (inotify_event*)(sr.ke.buf.data());
+    auto const* const in_ev_tail =
+      (inotify_event*)(sr.ke.buf.data() + read_len);
     unsigned in_ev_c = 0;
     auto dmrm = defer_dm_rm_wd{sr.ke};
+    auto batch = batch_wds{};
+    auto is_batched = sr.opts.coarse || sr.ct.period_ms;
     while (in_ev && in_ev < in_ev_tail) {
       auto in_ev_next = peek(in_ev, in_ev_tail);
       unsigned msk = in_ev->mask;
       auto dmhit = sr.ke.dm.find(in_ev->wd);
-      if (in_ev_c++ > ke_in_ev::c_ulim)
+      if (in_ev_c++ > sr.ke.c_ulim())
         return result::e_sys_ret;
       else if (is_parity_lost(msk) && ! dmrm.push(in_ev->wd))
         return result::e_sys_ret;
-      else if (dmhit == sr.ke.dm.end())
-        send_msg(result::w_sys_phantom, "", cb);
-      else if (msk & IN_Q_OVERFLOW)
-        send_msg(result::w_sys_q_overflow, dmhit->second.c_str(), cb);
+      else if (msk & IN_Q_OVERFLOW) {
+        sr.bl.st.overflows++;
+        send_msg(result::w_sys_q_overflow, sr.base.c_str(), cb);
+      }
+      else if (dmhit == sr.ke.dm.end()) {
+        if (! (msk & IN_IGNORED)) send_msg(result::w_sys_phantom, "", cb);
+      }
+      else if (is_real_event(msk) && is_batched) {
+        auto is_newdir = msk & IN_ISDIR && msk & IN_CREATE;
+        auto is_named = is_newdir || ! sr.opts.exclude.empty();
+        auto path = is_named ? dmhit->second / in_ev->name : "";
+        auto is_ex = is_named && is_excluded(sr.opts, path.native());
+        if (msk & IN_ISDIR && msk & IN_MOVE) {
+          auto [moved, next] =
+            parse_ev(sr.ke.dm, dmhit->second, in_ev, in_ev_tail);
+          auto const* to = next != in_ev_next ? in_ev_next : nullptr;
+          auto tohit = to ? sr.ke.dm.find(to->wd) : sr.ke.dm.end();
+          auto to_path = tohit != sr.ke.dm.end() && is_named
+                         ? tohit->second / to->name
+                         : "";
+          dm_move_if_dir(moved, sr.ke.dm);
+          do_remark_if_moved(moved, sr, cb);
+          /*  The other half of the pair is counted here, so
+              that we don't handle the rename twice */
+          if (to && ! (is_named && is_excluded(sr.opts, to_path.native())))
+            batch.push(to->wd, effect_of(to->mask));
+          in_ev_next = next;
+        }
+        auto is_walked =
+          sr.opts.files.empty()
+          && ! is_too_deep_to_mark(sr.opts, sr.base, path.native());
+        if (is_newdir && ! is_ex && is_walked)
+          do_mark(path.c_str(), sr.ke.fd, sr.ke.recv, sr.ke.dm, sr.pl, cb);
+        if (! is_ex) batch.push(in_ev->wd, effect_of(msk));
+      }
       else if (is_real_event(msk)) {
-        auto [ev, next] = parse_ev(dmhit->second, in_ev, in_ev_tail);
-        if (msk & IN_ISDIR && msk & IN_CREATE)
-          do_mark(ev.path_name.c_str(), sr.ke.fd, sr.ke.dm, cb);
-        cb(ev);
+        auto [whole, next] =
+          parse_ev(sr.ke.dm, dmhit->second, in_ev, in_ev_tail);
+        auto part = claim_of(sr.shard, sr.base, whole);
+        auto ev = part_of(whole, part);
+        auto is_claimed = part.from || part.to;
+        auto is_newdir = is_claimed && msk & IN_ISDIR && msk & IN_CREATE;
+        auto is_walked =
+          sr.opts.files.empty()
+          && ! is_too_deep_to_mark(sr.opts, sr.base, ev.path_name.native());
+        if (
+          is_newdir && is_walked
+          && ! is_excluded(sr.opts, ev.path_name.native()))
+          do_mark(
+            ev.path_name.c_str(),
+            sr.ke.fd,
+            sr.ke.recv,
+            sr.ke.dm,
+            sr.pl,
+            cb);
+        if (is_claimed) dm_move_if_dir(ev, sr.ke.dm);
+        if (is_claimed) do_remark_if_moved(ev, sr, cb);
+        if (is_claimed) do_send(cb, sr, ev, -1);
         in_ev_next = next;
       }
       in_ev = in_ev_next;
     }
+    bl_read(sr.bl, read_len, in_ev_c);
+    batch.send(sr.ke.dm, sr.cw, sr.ct);
     return result::pending;
   }
 };
 
+/*  Reads, then looks at what we read. In the io-uring
+    mode, the ring reads for us. See `ur`. */
+inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
+{
+  auto read_len = read(sr.ke.fd, sr.ke.buf.data(), sr.ke.buf.size());
+  return do_ev_recv_buf(cb, sr, read_len);
+};
+
 } /*  namespace detail::wtr::watcher::adapter::inotify */
 
 #endif
@@ -0,0 +1,226 @@
+#pragma once
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+
+#include "wtr/watcher.hpp"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace detail::wtr::watcher::adapter {
+
+/*  A warthog-style poller for the subtrees which
+    the kernel can't (or won't) tell us about.
+
+    Some filesystems never report changes made by
+    other hosts, and some of them reject our marks
+    outright. We also run out of marks when the
+    user's limits (`fs.inotify.max_user_watches`,
+    `fs.fanotify.max_user_marks`) are exhausted.
+
+    Those subtrees are handed to us instead of being
+    left unwatched. We scan them on a timer, which
+    we give to `epoll` along with everything else.
+    The events we find are sent through the same
+    callback, on the same thread, as the events
+    from the kernel.
+
+    Scans are not free, so we take our time between
+    them. A scan on a network filesystem is at least
+    one round-trip per entry. */
+struct pl {
+  static constexpr auto wake_ms = 256;
+
+  struct ent {
+    long long mtim = 0;
+    long long size = 0;
+    unsigned gen = 0;
+    enum ::wtr::watcher::event::path_type pt {};
+  };
+
+  /*  Every path beneath some root, but not the root
+      itself. The root's parent is watched by the
+      kernel, which tells us about the root. */
+  using bucket = std::unordered_map<std::string, ent>;
+
+  int fd = -1;
+  unsigned gen = 0;
+  std::unordered_map<std::string, bucket> roots{};
+};
+
+/*  Network and userspace filesystems. Changes made
+    through the local mount *may* be reported, but
+    changes made anywhere else never are. Overlays
+    are not here: changes made through them are
+    reported, and, where fanotify can't mark them,
+    we learn about that from `fanotify_mark()`. */
+inline auto is_pollfs(struct statfs const& s) -> bool
+{
+  static constexpr uint32_t magics[] = {
+    0x6969,     /*  NFS_SUPER_MAGIC */
+    0x517b,     /*  SMB_SUPER_MAGIC */
+    0xff534d42, /*  CIFS_SUPER_MAGIC */
+    0xfe534d42, /*  SMB2_SUPER_MAGIC */
+    0x65735546, /*  FUSE_SUPER_MAGIC */
+    0x01021997, /*  V9FS_MAGIC */
+    0x00c36400, /*  CEPH_SUPER_MAGIC */
+    0x5346414f, /*  AFS_SUPER_MAGIC */
+    0x6b414653, /*  AFS_FS_MAGIC */
+    0x73757245, /*  CODA_SUPER_MAGIC */
+  };
+  for (auto magic : magics)
+    if ((uint32_t)s.f_type == magic) return true;
+  return false;
+}
+
+inline auto is_pollfs(char const* const path) -> bool
+{
+  struct statfs s;
+  return statfs(path, &s) == 0 && is_pollfs(s);
+}
+
+inline auto make_pl() -> pl
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  return pl{.fd = fd};
+}
+
+/*  Arms the timer while we have something to poll,
+    disarms it otherwise. */
+inline auto pl_arm(pl& pl) -> bool
+{
+  long ns = pl.roots.empty() ? 0 : pl::wake_ms * 1000000L;
+  auto t = timespec{.tv_sec = ns / 1000000000L, .tv_nsec = ns % 1000000000L};
+  auto it = itimerspec{.it_interval = t, .it_value = t};
+  return timerfd_settime(pl.fd, 0, &it, nullptr) == 0;
+}
+
+template<class Fn>
+inline auto pl_walk(std::string const& path, Fn const& f) -> bool
+{
+  if (DIR* d = opendir(path.c_str())) {
+    while (dirent* de = readdir(d)) {
+      struct stat s;
+      if (strcmp(de->d_name, ".") == 0) continue;
+      if (strcmp(de->d_name, "..") == 0) continue;
+      auto next = path + '/' + de->d_name;
+      if (lstat(next.c_str(), &s) != 0) continue;
+      f(next, s);
+      if (S_ISDIR(s.st_mode)) pl_walk(next, f);
+    }
+    return (void)closedir(d), true;
+  }
+  else
+    return false;
+}
+
+/*  Scans a root, comparing what we find against the
+    bucket. Anything which wasn't seen in this scan
+    (this generation) was destroyed.
+    We stay quiet while populating a new bucket.
+    Returns false when the root is gone. A root we
+    failed to read for any other reason (timeouts,
+    permissions, ...) is left as-is until later. */
+template<class Cb>
+inline auto pl_scan(
+  std::string const& root,
+  pl::bucket& bk,
+  unsigned gen,
+  Cb const& cb,
+  bool quiet) -> bool
+{
+  using ev_pt = enum ::wtr::watcher::event::path_type;
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  auto pt_of = [](mode_t m)
+  {
+    return S_ISDIR(m) ? ev_pt::dir
+         : S_ISREG(m) ? ev_pt::file
+         : S_ISLNK(m) ? ev_pt::sym_link
+                      : ev_pt::other;
+  };
+  auto on_ent = [&](std::string const& path, struct stat const& s)
+  {
+    auto mtim = s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+    auto now = pl::ent{mtim, (long long)s.st_size, gen, pt_of(s.st_mode)};
+    auto [at, is_new] = bk.try_emplace(path, now);
+    auto was = at->second;
+    auto is_mod = now.pt != ev_pt::dir
+               && (now.mtim != was.mtim || now.size != was.size);
+    at->second = now;
+    if (quiet) return;
+    if (is_new)
+      cb({path, ev_et::create, now.pt});
+    else if (is_mod)
+      cb({path, ev_et::modify, now.pt});
+  };
+  bool is_read = pl_walk(root, on_ent);
+  bool is_gone = ! is_read && (errno == ENOENT || errno == ENOTDIR);
+  for (auto at = bk.begin(); (is_read || is_gone) && at != bk.end();)
+    if (at->second.gen != gen)
+      cb({at->first, ev_et::destroy, at->second.pt}), at = bk.erase(at);
+    else
+      ++at;
+  return ! is_gone;
+}
+
+/*  Takes over a subtree which the kernel won't
+    watch for us. Lets the user know about it. */
+inline auto do_poll_mark =
+  [](char const* const dirpath, pl& pl, auto const& cb) -> result
+{
+  auto w = result::w_sys_polled;
+  auto e = result::w_sys_not_watched;
+  auto [at, is_new] = pl.roots.try_emplace(dirpath);
+  if (! is_new) return w;
+  if (pl.roots.size() == 1 && ! pl_arm(pl))
+    return pl.roots.erase(at), send_msg(e, dirpath, cb), e;
+  pl_scan(at->first, at->second, pl.gen, cb, true);
+  return send_msg(w, dirpath, cb), w;
+};
+
+/*  Everything we found beneath a root when we took
+    it over, for the inventory. */
+inline auto pl_inventory(pl const& pl, char const* const dirpath, iv& iv)
+  -> void
+{
+  char real[PATH_MAX];
+  auto at = realpath(dirpath, real) ? pl.roots.find(real) : pl.roots.end();
+  if (at == pl.roots.end()) return;
+  for (auto const& [path, ent] : at->second) iv.push(std::string{path}, ent.pt);
+}
+
+/*  Rescans everything we poll when our timer fires.
+    Roots which no longer exist are forgotten after
+    we've reported their contents as destroyed.
+    In the coarse and counting modes, the callback
+    we're given only notes the directories of what
+    we report. */
+inline auto do_poll_recv = [](auto const& cb, pl& pl) -> result
+{
+  uint64_t _ = 0;
+  if (read(pl.fd, &_, sizeof(_)) < 0 && errno != EAGAIN)
+    return result::e_sys_api_read;
+  pl.gen++;
+  for (auto at = pl.roots.begin(); at != pl.roots.end();)
+    if (pl_scan(at->first, at->second, pl.gen, cb, false))
+      ++at;
+    else
+      at = pl.roots.erase(at);
+  if (pl.roots.empty()) pl_arm(pl);
+  return result::pending;
+};
+
+} /*  namespace detail::wtr::watcher::adapter */
+
+#endif
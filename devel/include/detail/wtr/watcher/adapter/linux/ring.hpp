@@ -0,0 +1,213 @@
+#pragma once
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+
+#include "wtr/watcher.hpp"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+namespace detail::wtr::watcher::adapter {
+
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+
+/*  An io_uring, for the io-uring mode, in place of
+    `epoll` and `read`.
+
+    We keep a read of the kernel's events posted, into
+    our buffer, linked behind a poll of the kernel's
+    descriptor. When there's something to read, the
+    kernel reads it for us, and we're woken with how
+    much it read. The buffer is registered with the
+    ring, so the kernel doesn't map it on every read.
+    We also poll the living semaphore and the poller's
+    timer. Each wakeup is one `io_uring_enter`, which
+    submits whatever we've posted since the last one,
+    and waits for the next completion, or for a timeout.
+    Nothing we post is submitted before that, so our
+    buffer is ours until we wait again.
+
+    We don't link to liburing. The ring is small, and
+    we're the only ones who post to it, or reap from it.
+    Without the features we need (Linux 5.11), or where
+    io_uring is disabled, we fall back to `epoll`. */
+struct ur {
+  static constexpr unsigned q_len = 8;
+
+  enum tag : uint64_t { ke_poll = 1, ke_read, il_poll, pl_poll };
+
+  int fd = -1;
+  int ke_fd = -1;
+  int il_fd = -1;
+  int pl_fd = -1;
+  char* buf = nullptr;
+  unsigned buf_len = 0;
+  bool is_fixed = false;
+  unsigned to_submit = 0;
+
+  void* ring = nullptr;
+  size_t ring_len = 0;
+  io_uring_sqe* sqes = nullptr;
+  size_t sqes_len = 0;
+  unsigned* sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned* sq_array = nullptr;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_cqe* cqes = nullptr;
+};
+
+inline auto ur_sqe_of(ur& ur) -> io_uring_sqe*
+{
+  auto tail = *ur.sq_tail;
+  auto idx = tail & ur.sq_mask;
+  auto sqe = &ur.sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ur.sq_array[idx] = idx;
+  __atomic_store_n(ur.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ur.to_submit++;
+  return sqe;
+}
+
+inline auto ur_poll(ur& ur, int fd, uint64_t tag, bool is_linked) -> void
+{
+  auto sqe = ur_sqe_of(ur);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->flags = is_linked ? IOSQE_IO_LINK : 0;
+  sqe->user_data = tag;
+}
+
+/*  A read, once there's something to read */
+inline auto ur_read(ur& ur) -> void
+{
+  ur_poll(ur, ur.ke_fd, ur::ke_poll, true);
+  auto sqe = ur_sqe_of(ur);
+  sqe->opcode = ur.is_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = ur.ke_fd;
+  sqe->addr = (uint64_t)ur.buf;
+  sqe->len = ur.buf_len;
+  sqe->buf_index = 0;
+  sqe->user_data = ur::ke_read;
+}
+
+inline auto close_ur(ur& ur) -> void
+{
+  if (ur.sqes) munmap(ur.sqes, ur.sqes_len);
+  if (ur.ring) munmap(ur.ring, ur.ring_len);
+  if (ur.fd >= 0) close(ur.fd);
+  ur = adapter::ur{};
+}
+
+/*  A ring, or one with `fd < 0` if we can't have it */
+inline auto
+make_ur(int ke_fd, char* buf, unsigned buf_len, int il_fd, int pl_fd) -> ur
+{
+  constexpr auto prot = PROT_READ | PROT_WRITE;
+  constexpr auto fl = MAP_SHARED | MAP_POPULATE;
+  constexpr auto feats = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG;
+  auto p = io_uring_params{};
+  auto u = ur{.ke_fd = ke_fd, .il_fd = il_fd, .pl_fd = pl_fd};
+  u.buf = buf, u.buf_len = buf_len;
+  u.fd = (int)syscall(__NR_io_uring_setup, ur::q_len, &p);
+  if (u.fd < 0) return u;
+  if ((p.features & feats) != feats) return close_ur(u), u;
+  auto sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  auto cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  u.ring_len = sq_len > cq_len ? sq_len : cq_len;
+  u.ring = mmap(0, u.ring_len, prot, fl, u.fd, IORING_OFF_SQ_RING);
+  if (u.ring == MAP_FAILED) return u.ring = nullptr, close_ur(u), u;
+  u.sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+  auto sqes = mmap(0, u.sqes_len, prot, fl, u.fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return close_ur(u), u;
+  auto at = [&](unsigned off) { return (unsigned*)((char*)u.ring + off); };
+  u.sqes = (io_uring_sqe*)sqes;
+  u.sq_tail = at(p.sq_off.tail);
+  u.sq_mask = *at(p.sq_off.ring_mask);
+  u.sq_array = at(p.sq_off.array);
+  u.cq_head = at(p.cq_off.head);
+  u.cq_tail = at(p.cq_off.tail);
+  u.cq_mask = *at(p.cq_off.ring_mask);
+  u.cqes = (io_uring_cqe*)((char*)u.ring + p.cq_off.cqes);
+  auto iov = iovec{buf, buf_len};
+  u.is_fixed =
+    syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_BUFFERS, &iov, 1)
+    == 0;
+  ur_read(u);
+  ur_poll(u, il_fd, ur::il_poll, false);
+  ur_poll(u, pl_fd, ur::pl_poll, false);
+  return u;
+}
+
+/*  Submits what we've posted and waits, no longer than
+    `wake_ms` (if it isn't negative), for completions.
+    Each is given to `on` with its tag and result, once
+    we've posted whatever follows it. A read which was
+    cut short (or found nothing) is posted again without
+    bothering `on`. False on errors. */
+template<class On>
+inline auto ur_wait(ur& ur, int wake_ms, On const& on) -> bool
+{
+  auto ts = __kernel_timespec{wake_ms / 1000, (wake_ms % 1000) * 1000000LL};
+  auto arg = io_uring_getevents_arg{};
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = wake_ms < 0 ? 0 : (uint64_t)&ts;
+  constexpr auto fl = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  auto n =
+    syscall(__NR_io_uring_enter, ur.fd, ur.to_submit, 1, fl, &arg, sizeof(arg));
+  if (n > 0) ur.to_submit -= (unsigned)n;
+  if (n < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+    return false;
+  auto head = *ur.cq_head;
+  auto tail = __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    auto const& cqe = ur.cqes[head & ur.cq_mask];
+    auto tag = cqe.user_data;
+    auto res = cqe.res;
+    __atomic_store_n(ur.cq_head, head + 1, __ATOMIC_RELEASE);
+    auto is_cut = res == -EAGAIN || res == -ECANCELED || res == -EINTR;
+    if (tag == ur::ke_read) ur_read(ur);
+    if (tag == ur::pl_poll) ur_poll(ur, ur.pl_fd, ur::pl_poll, false);
+    if (tag == ur::ke_poll || (tag == ur::ke_read && is_cut)) continue;
+    on(tag, res);
+  }
+  return true;
+}
+
+#else
+
+/*  Without io_uring's headers, we never have a ring */
+struct ur {
+  enum tag : uint64_t { ke_poll = 1, ke_read, il_poll, pl_poll };
+
+  int fd = -1;
+};
+
+inline auto make_ur(int, char*, unsigned, int, int) -> ur { return ur{}; }
+
+inline auto close_ur(ur&) -> void {}
+
+template<class On>
+inline auto ur_wait(ur&, int, On const&) -> bool
+{
+  return false;
+}
+
+#endif
+
+} /*  namespace detail::wtr::watcher::adapter */
+
+#endif
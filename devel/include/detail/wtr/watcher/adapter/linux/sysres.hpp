@@ -4,17 +4,30 @@
   && ! defined(WATER_WATCHER_USE_WARTHOG)
 
 #include "wtr/watcher.hpp"
+#include <algorithm>
+#include <array>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <string_view>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 namespace detail::wtr::watcher::adapter {
 
@@ -30,10 +43,12 @@ enum class result : unsigned short {
   pending = 0,
   w,
   w_sys_not_watched,
+  w_sys_polled,
   w_sys_phantom,
   w_sys_bad_fd,
   w_sys_bad_meta,
   w_sys_q_overflow,
+  w_sys_q_near,
   complete,
   e,
   e_sys_api_inotify,
@@ -41,6 +56,8 @@ enum class result : unsigned short {
   e_sys_api_epoll,
   e_sys_api_read,
   e_sys_api_eventfd,
+  e_sys_api_timerfd,
+  e_sys_api_io_uring,
   e_sys_ret,
   e_sys_lim_kernel_version,
   e_self_noent,
@@ -57,6 +74,8 @@ struct ep {
       We don't lose events if we 'miss'
       them, the events are still waiting
       in the next call to `epoll_wait`.
+      This is the default. The user may
+      ask for another (`epoll_q_len`).
   */
   static constexpr auto q_ulim = 64;
   /*  The delay, in milliseconds, while
@@ -68,7 +87,7 @@ struct ep {
   static constexpr auto wake_ms = -1;
 
   int fd = -1;
-  epoll_event interests[q_ulim]{};
+  std::vector<epoll_event> interests{};
 };
 
 inline constexpr auto to_str(result r)
@@ -78,10 +97,12 @@ inline constexpr auto to_str(result r)
     case result::pending:                            return "pending@";
     case result::w:                                  return "w@";
     case result::w_sys_not_watched:                  return "w/sys/not_watched@";
+    case result::w_sys_polled:                       return "w/sys/polled@";
     case result::w_sys_phantom:                      return "w/sys/phantom@";
     case result::w_sys_bad_fd:                       return "w/sys/bad_fd@";
     case result::w_sys_bad_meta:                     return "w/sys/bad_meta@";
     case result::w_sys_q_overflow:                   return "w/sys/q_overflow@";
+    case result::w_sys_q_near:                       return "w/sys/q_near@";
     case result::complete:                           return "complete@";
     case result::e:                                  return "e@";
     case result::e_sys_api_inotify:                  return "e/sys/api/inotify@";
@@ -89,6 +110,8 @@ inline constexpr auto to_str(result r)
     case result::e_sys_api_epoll:                    return "e/sys/api/epoll@";
     case result::e_sys_api_read:                     return "e/sys/api/read@";
     case result::e_sys_api_eventfd:                  return "e/sys/api/eventfd@";
+    case result::e_sys_api_timerfd:                  return "e/sys/api/timerfd@";
+    case result::e_sys_api_io_uring:                 return "e/sys/api/io_uring@";
     case result::e_sys_ret:                          return "e/sys/ret@";
     case result::e_sys_lim_kernel_version:           return "e/sys/lim/kernel_version@";
     case result::e_self_noent:                       return "e/self/noent@";
@@ -106,7 +129,8 @@ inline auto send_msg = [](result r, auto path, auto const& cb)
   cb({msg + path, et::other, pt::watcher});
 };
 
-inline auto make_ep(int ev_fs_fd, int ev_il_fd) -> ep
+inline auto
+make_ep(int ev_fs_fd, int ev_il_fd, int ev_pl_fd, int q_len = ep::q_ulim) -> ep
 {
 #if __ANDROID_API__
   int fd = epoll_create(1);
@@ -115,13 +139,461 @@ inline auto make_ep(int ev_fs_fd, int ev_il_fd) -> ep
 #endif
   auto want_ev_fs = epoll_event{.events = EPOLLIN, .data{.fd = ev_fs_fd}};
   auto want_ev_il = epoll_event{.events = EPOLLIN, .data{.fd = ev_il_fd}};
+  auto want_ev_pl = epoll_event{.events = EPOLLIN, .data{.fd = ev_pl_fd}};
   bool ctl_ok = fd >= 0
              && epoll_ctl(fd, EPOLL_CTL_ADD, ev_fs_fd, &want_ev_fs) >= 0
-             && epoll_ctl(fd, EPOLL_CTL_ADD, ev_il_fd, &want_ev_il) >= 0;
+             && epoll_ctl(fd, EPOLL_CTL_ADD, ev_il_fd, &want_ev_il) >= 0
+             && epoll_ctl(fd, EPOLL_CTL_ADD, ev_pl_fd, &want_ev_pl) >= 0;
   if (! ctl_ok && fd >= 0) close(fd), fd = -1;
-  return ep{.fd = fd};
+  auto interests = std::vector<epoll_event>(q_len > 0 ? q_len : 1);
+  return ep{.fd = fd, .interests = std::move(interests)};
 }
 
+/*  How many bytes of events we read at once. Never less
+    than `floor`, which the adapters keep large enough
+    for their largest event. */
+inline auto buf_len_of(
+  ::wtr::watcher::watch_options const& opts,
+  unsigned floor) -> unsigned
+{
+  constexpr unsigned ceil = 1 << 24;
+  return std::clamp(opts.read_buf_len, floor, ceil);
+}
+
+/*  Pins the thread we're on (which reads, and calls the
+    callback) to the user's CPUs, and makes it nicer, if
+    we were asked to. Where we aren't allowed to, the
+    thread is left as it was. */
+inline auto do_reader_sched(::wtr::watcher::watch_options const& opts) -> void
+{
+  if (! opts.reader_cpus.empty()) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (auto cpu : opts.reader_cpus)
+      if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+  }
+  if (opts.reader_nice) {
+    auto tid = (id_t)syscall(SYS_gettid);
+    errno = 0;
+    int was = getpriority(PRIO_PROCESS, tid);
+    if (errno == 0) setpriority(PRIO_PROCESS, tid, was + opts.reader_nice);
+  }
+}
+
+/*  The directories which changed recently, for the
+    coarse mode. The adapters add to these as they
+    read their events. We send them along once the
+    window opened by the first of them has passed,
+    so each is sent at most once in that window.
+    Until then, `epoll` waits no longer than the end
+    of the window for us.
+    We send them in the order they first changed, and
+    look them up in a set, since a busy tree has a lot
+    of them. */
+struct cw {
+  static constexpr auto window_ms = 50;
+
+  long long due_ms = 0;
+  std::vector<std::string> dirs{};
+  std::unordered_set<std::string> seen{};
+};
+
+inline auto now_ms() -> long long
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+inline auto cw_push(cw& cw, std::string&& dir) -> void
+{
+  if (! cw.seen.insert(dir).second) return;
+  if (cw.dirs.empty()) cw.due_ms = now_ms() + cw::window_ms;
+  cw.dirs.push_back(std::move(dir));
+}
+
+inline auto cw_wait_ms(cw const& cw) -> int
+{
+  auto left = cw.due_ms - now_ms();
+  return cw.dirs.empty() ? ep::wake_ms : left > 0 ? (int)left : 0;
+}
+
+inline auto do_cw_send = [](auto const& cb, cw& cw, bool is_final) -> void
+{
+  using ev = ::wtr::watcher::event;
+  if (cw.dirs.empty() || (now_ms() < cw.due_ms && ! is_final)) return;
+  for (auto const& d : cw.dirs)
+    cb(ev(d, ev::effect_type::modify, ev::path_type::dir));
+  cw.dirs.clear();
+  cw.seen.clear();
+};
+
+/*  The event counts, by directory, for the counting
+    mode. The adapters count what they read into these
+    and, each period, we send them to the user. We keep
+    `epoll` from waiting past the end of the period.
+    A period of 0 means we aren't counting. */
+struct ct {
+  using effects = ::wtr::watcher::event_counts::effects;
+  static constexpr auto effect_c = std::tuple_size_v<effects>;
+
+  long long period_ms = 0;
+  long long due_ms = 0;
+  long long begin_time = 0;
+  std::unordered_map<std::string, effects> dirs{};
+};
+
+inline auto now_ns() -> long long
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+inline auto make_ct(::wtr::watcher::watch_options const& opts) -> ct
+{
+  if (! opts.on_counts) return ct{};
+  auto period_ms = opts.counts_period_ms > 0 ? opts.counts_period_ms : 1;
+  return ct{period_ms, now_ms() + period_ms, now_ns()};
+}
+
+inline auto ct_push(
+  ct& ct,
+  std::string&& dir,
+  enum ::wtr::watcher::event::effect_type et,
+  unsigned n) -> void
+{
+  ct.dirs[std::move(dir)][(size_t)et] += n;
+}
+
+/*  Some of each effect, in one directory */
+inline auto ct_push(
+  ct& ct,
+  std::string&& dir,
+  std::array<unsigned, ct::effect_c> const& n) -> void
+{
+  auto& effects = ct.dirs[std::move(dir)];
+  for (size_t i = 0; i < ct::effect_c; ++i) effects[i] += n[i];
+}
+
+inline auto ct_wait_ms(ct const& ct) -> int
+{
+  auto left = ct.due_ms - now_ms();
+  return ! ct.period_ms ? ep::wake_ms : left > 0 ? (int)left : 0;
+}
+
+/*  Sends what we've counted since the last period,
+    if this one is over. We start counting the next
+    period from now, not from when this one was due,
+    so that a slow user doesn't get a flurry of calls
+    to catch up. */
+inline auto do_ct_send =
+  [](::wtr::watcher::watch_options const& opts, ct& ct, bool is_final) -> void
+{
+  using ec = ::wtr::watcher::event_counts;
+  if (! ct.period_ms || (now_ms() < ct.due_ms && ! is_final)) return;
+  auto counts = ec{.begin_time = ct.begin_time, .end_time = now_ns()};
+  counts.dirs.reserve(ct.dirs.size());
+  for (auto& [dir, effects] : ct.dirs)
+    counts.dirs.push_back(ec::dir{dir, effects});
+  ct.dirs.clear();
+  ct.begin_time = counts.end_time;
+  ct.due_ms = now_ms() + ct.period_ms;
+  opts.on_counts(counts);
+};
+
+/*  How far behind the kernel we are, for the backlog
+    gauge. See `backlog_stats`.
+    Each time we're woken, we ask the kernel how many
+    bytes are waiting (with `FIONREAD`). In the io-uring
+    mode, we ask before we wait, after the ring's last
+    read. The kernel's limit is on events, not bytes,
+    so we guess how many events that is from the length
+    of the events we've read. While we're near the
+    limit, we add up the time between our looks. */
+struct bl {
+  /*  How long we guess an event is, until we've read
+      some. A header and a short name. */
+  static constexpr unsigned long long ev_len_guess = 32;
+
+  bool is_on = false;
+  unsigned long long near = 0;
+  bool is_near = false;
+  long long near_since = 0;
+  unsigned long long read_bytes = 0;
+  unsigned long long read_evs = 0;
+  ::wtr::watcher::backlog_stats st{};
+};
+
+/*  A number from a file, such as a sysctl's */
+inline auto number_of(char const* const path, unsigned long long fallback)
+  -> unsigned long long
+{
+  auto f = fopen(path, "re");
+  if (! f) return fallback;
+  auto n = fallback;
+  if (fscanf(f, "%llu", &n) != 1) n = fallback;
+  return fclose(f), n;
+}
+
+/*  The `limit` is how many events the kernel holds
+    for us, or 0 for as many as there are */
+inline auto
+make_bl(::wtr::watcher::watch_options const& opts, unsigned long long limit)
+  -> bl
+{
+  if (! opts.on_backlog) return bl{};
+  auto pct = std::clamp(opts.backlog_near_pct, 1, 100);
+  auto b = bl{.is_on = true, .near = limit * pct / 100};
+  b.st.limit = limit;
+  return b;
+}
+
+/*  What we read, for how long an event is */
+inline auto bl_read(bl& bl, ssize_t read_len, unsigned ev_c) -> void
+{
+  if (! bl.is_on || read_len <= 0) return;
+  bl.read_bytes += (unsigned long long)read_len;
+  bl.read_evs += ev_c;
+}
+
+/*  Looks at what's waiting for us. Tells the user once
+    when we come near the limit, and again only after
+    we've caught up to half of that. */
+inline auto do_bl_sample = [](
+                             ::wtr::watcher::watch_options const& opts,
+                             auto const& cb,
+                             bl& bl,
+                             int fd,
+                             std::string const& base) -> void
+{
+  int waiting = 0;
+  if (! bl.is_on || ioctl(fd, FIONREAD, &waiting) < 0) return;
+  auto& st = bl.st;
+  auto ev_len = bl.read_evs ? bl.read_bytes / bl.read_evs : bl::ev_len_guess;
+  auto now = now_ns();
+  st.bytes = (unsigned long long)(waiting > 0 ? waiting : 0);
+  st.events = st.bytes / (ev_len ? ev_len : 1);
+  st.peak_bytes = std::max(st.peak_bytes, st.bytes);
+  st.peak_events = std::max(st.peak_events, st.events);
+  st.samples++;
+  if (bl.is_near) st.near_ns += now - bl.near_since, bl.near_since = now;
+  if (bl.near && ! bl.is_near && st.events >= bl.near) {
+    bl.is_near = true, bl.near_since = now;
+    send_msg(result::w_sys_q_near, base.c_str(), cb);
+  }
+  else if (bl.is_near && st.events < bl.near / 2)
+    bl.is_near = false;
+  opts.on_backlog(st);
+};
+
+/*  What was destroyed recently, for the fold mode.
+    A directory can only be removed once it's empty,
+    so, when one is, what we hold beneath it went
+    with it. We fold those into the directory's event
+    as we go. They're usually the last ones we held.
+    We send what we hold once nothing else has been
+    destroyed for a moment, and before anything else
+    which happens, so that nothing is out of order.
+    Until then, `epoll` waits no longer than that
+    moment for us. */
+struct fo {
+  static constexpr auto window_ms = 50;
+
+  long long due_ms = 0;
+  std::vector<::wtr::watcher::event> evs{};
+};
+
+inline auto fo_wait_ms(fo const& fo) -> int
+{
+  auto left = fo.due_ms - now_ms();
+  return fo.evs.empty() ? ep::wake_ms : left > 0 ? (int)left : 0;
+}
+
+inline auto do_fo_send = [](auto const& cb, fo& fo, bool is_final) -> void
+{
+  if (fo.evs.empty() || (now_ms() < fo.due_ms && ! is_final)) return;
+  for (auto const& ev : fo.evs) cb(ev);
+  fo.evs.clear();
+};
+
+/*  Holds onto what was destroyed, folding what was
+    beneath a directory into it. Sends everything else
+    along, after whatever we held. */
+inline auto do_fo_push =
+  [](auto const& cb, fo& fo, ::wtr::watcher::event const& ev) -> void
+{
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  using ev_pt = enum ::wtr::watcher::event::path_type;
+  if (ev.effect_type != ev_et::destroy)
+    return do_fo_send(cb, fo, true), cb(ev);
+  auto const& dir = ev.path_name.native();
+  auto is_beneath = [&](::wtr::watcher::event const& e)
+  {
+    auto const& p = e.path_name.native();
+    return p.size() > dir.size() && p[dir.size()] == '/'
+        && p.compare(0, dir.size(), dir) == 0;
+  };
+  auto folded = size_t{0};
+  while (ev.path_type == ev_pt::dir && ! fo.evs.empty()
+         && is_beneath(fo.evs.back()))
+    folded += 1 + fo.evs.back().folded, fo.evs.pop_back();
+  fo.due_ms = now_ms() + fo::window_ms;
+  fo.evs.push_back(ev.with_folded(folded));
+};
+
+/*  What we've read, for the stats and the dirs-first
+    modes, until we're done reading.
+    In the stats mode, we look at all of it at once,
+    rather than between reads. Where the kernel gave
+    us a descriptor for what changed (an `O_PATH` one,
+    from the fanotify adapter), we look at that, since
+    its name may have changed since. Otherwise, we
+    look at the path, or at where it was renamed to. */
+struct st {
+  std::vector<::wtr::watcher::event> evs{};
+  std::vector<int> fds{};
+};
+
+inline auto st_push(st& st, ::wtr::watcher::event const& ev, int fd) -> void
+{
+  st.evs.emplace_back(ev);
+  st.fds.push_back(fd);
+}
+
+/*  A file with more than one link is a hard link */
+inline auto stat_of(::wtr::watcher::event const& ev, int fd)
+  -> ::wtr::watcher::event
+{
+  using ev_pt = enum ::wtr::watcher::event::path_type;
+  using file_stat = ::wtr::watcher::event::file_stat;
+  auto const& to = ev.associated ? *ev.associated : ev;
+  auto const* path = fd >= 0 ? "" : to.path_name.c_str();
+  auto at = fd >= 0 ? fd : AT_FDCWD;
+  auto fs = file_stat{};
+#if defined(STATX_BASIC_STATS)
+  auto flags = fd >= 0 ? AT_EMPTY_PATH : AT_SYMLINK_NOFOLLOW;
+  auto mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE
+            | STATX_MTIME;
+  struct statx s;
+  if (statx(at, path, flags, mask, &s) != 0) return ev;
+  fs.inode = s.stx_ino;
+  fs.device = makedev(s.stx_dev_major, s.stx_dev_minor);
+  fs.size = s.stx_size;
+  fs.mtime = s.stx_mtime.tv_sec * 1000000000LL + s.stx_mtime.tv_nsec;
+  fs.mode = s.stx_mode;
+  fs.links = s.stx_nlink;
+#else
+  auto flags = fd >= 0 ? AT_EMPTY_PATH : AT_SYMLINK_NOFOLLOW;
+  struct stat s;
+  if (fstatat(at, path, &s, flags) != 0) return ev;
+  fs.inode = s.st_ino;
+  fs.device = s.st_dev;
+  fs.size = s.st_size;
+  fs.mtime = s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+  fs.mode = s.st_mode;
+  fs.links = s.st_nlink;
+#endif
+  auto is_hard_link =
+    ev.path_type == ev_pt::file && S_ISREG(fs.mode) && fs.links > 1;
+  return ev.with_stat(is_hard_link ? ev_pt::hard_link : ev.path_type, fs);
+}
+
+/*  For the dirs-first mode, which of what we held goes
+    first: what changes which directories there are,
+    (their creation, destruction and renaming), unless
+    something before it was about its path, about
+    something beneath it, or about a directory above
+    it which changed. Then it waits its turn.
+    What waits is remembered by the hashes of its path
+    and of the directories above it, so a (rare) hash
+    collision only means something waits when it didn't
+    need to. */
+inline auto dirs_first_of(std::vector<::wtr::watcher::event> const& evs)
+  -> std::vector<bool>
+{
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  using ev_pt = enum ::wtr::watcher::event::path_type;
+  using sv = std::string_view;
+  auto is_first = std::vector<bool>(evs.size());
+  auto is_structural = [](::wtr::watcher::event const& ev) -> bool
+  {
+    return ev.path_type == ev_pt::dir
+        && (ev.effect_type == ev_et::create || ev.effect_type == ev_et::destroy
+            || ev.effect_type == ev_et::rename);
+  };
+  if (std::none_of(evs.begin(), evs.end(), is_structural)) return is_first;
+  auto hash = std::hash<sv>{};
+  auto held = std::unordered_set<size_t>{};
+  auto held_dirs = std::vector<sv>{};
+  auto hold = [&](sv p)
+  {
+    for (auto at = p.size(); at != 0 && at != sv::npos; at = p.rfind('/'))
+      held.insert(hash(p = p.substr(0, at)));
+  };
+  auto is_above = [](sv dir, sv p) -> bool
+  {
+    return p.size() > dir.size() && p[dir.size()] == '/'
+        && p.compare(0, dir.size(), dir) == 0;
+  };
+  auto is_held = [&](sv p) -> bool
+  {
+    if (held.count(hash(p))) return true;
+    for (auto dir : held_dirs)
+      if (dir == p || is_above(dir, p)) return true;
+    return false;
+  };
+  for (size_t i = 0; i < evs.size(); ++i) {
+    auto const& ev = evs[i];
+    auto p = sv{ev.path_name.native()};
+    auto to = ev.associated ? sv{ev.associated->path_name.native()} : sv{};
+    auto is_dir_ev = is_structural(ev);
+    is_first[i] = is_dir_ev && ! is_held(p) && (to.empty() || ! is_held(to));
+    if (is_first[i]) continue;
+    hold(p);
+    if (! to.empty()) hold(to);
+    if (is_dir_ev) held_dirs.push_back(p);
+    if (is_dir_ev && ! to.empty()) held_dirs.push_back(to);
+  }
+  return is_first;
+}
+
+/*  Sends an event along: to wait until we're done
+    reading, to be folded, or to the user */
+inline auto do_send =
+  [](auto const& cb, auto& sr, ::wtr::watcher::event const& ev, int fd) -> void
+{
+  if (sr.opts.stats || sr.opts.dirs_first)
+    st_push(sr.st, ev, fd);
+  else if (sr.opts.fold)
+    do_fo_push(cb, sr.fo, ev);
+  else
+    cb(ev);
+};
+
+inline auto do_st_send = [](auto const& cb, auto& sr) -> void
+{
+  auto const& evs = sr.st.evs;
+  auto send = [&](size_t i)
+  {
+    auto ev = sr.opts.stats ? stat_of(evs[i], sr.st.fds[i]) : evs[i];
+    if (sr.st.fds[i] >= 0) close(sr.st.fds[i]);
+    if (sr.opts.fold)
+      do_fo_push(cb, sr.fo, ev);
+    else
+      cb(ev);
+  };
+  auto is_first = sr.opts.dirs_first ? dirs_first_of(evs)
+                                     : std::vector<bool>(evs.size());
+  for (size_t i = 0; i < evs.size(); ++i)
+    if (is_first[i]) send(i);
+  for (size_t i = 0; i < evs.size(); ++i)
+    if (! is_first[i]) send(i);
+  sr.st.evs.clear();
+  sr.st.fds.clear();
+};
+
 inline auto is_dir(char const* const path) -> bool
 {
   struct stat s;
@@ -147,26 +619,260 @@ inline auto is_dir(char const* const path) -> bool
     watching before we're done this
     hot find-and-mark path, despite
     not having a full picture.
+
+    The function we're given returns
+    whether or not to walk into the
+    directory it was just given. We
+    don't walk into the directories
+    which someone else (the poller)
+    has already taken care of, or
+    which the user excluded.
+
+    We may also be given a function
+    to look at every entry within the
+    directories we walk into.
+
+    And how many directories deep to
+    walk. We don't walk any deeper
+    than that, but we still look at
+    the entries there.
 */
-template<class Fn>
-inline auto walkdir_do(char const* const path, Fn const& f) -> void
+template<class Fn, class Ent>
+inline auto walkdir_do(
+  char const* const path,
+  Fn const& f,
+  Ent const& ent,
+  int depth_ulim = -1) -> void
 {
   if (DIR* d = opendir(path)) {
-    f(path);
-    while (dirent* de = readdir(d)) {
+    bool descend = f(path);
+    while (dirent* de = descend ? readdir(d) : nullptr) {
       char next[PATH_MAX];
       char real[PATH_MAX];
-      if (de->d_type != DT_DIR) continue;
       if (strcmp(de->d_name, ".") == 0) continue;
       if (strcmp(de->d_name, "..") == 0) continue;
+      ent(path, de);
+      if (de->d_type != DT_DIR || depth_ulim == 0) continue;
       if (snprintf(next, PATH_MAX, "%s/%s", path, de->d_name) <= 0) continue;
       if (! realpath(next, real)) continue;
-      walkdir_do(real, f);
+      walkdir_do(real, f, ent, depth_ulim - 1);
     }
     (void)closedir(d);
   }
 }
 
+template<class Fn>
+inline auto walkdir_do(char const* const path, Fn const& f) -> void
+{
+  walkdir_do(path, f, [](char const* const, dirent const* const) {});
+}
+
+/*  Walks the path, or, with a set of files, marks only
+    the directories which they're in, without walking
+    into them. */
+template<class Fn, class Ent>
+inline auto walk_do(
+  char const* const path,
+  ::wtr::watcher::watch_options const& opts,
+  Fn const& f,
+  Ent const& ent) -> void
+{
+  if (opts.files.empty()) return walkdir_do(path, f, ent, opts.max_depth);
+  for (auto const& dir : dirs_of(opts.files)) f(dir.c_str());
+}
+
+/*  Whether what's in a new directory is deeper than
+    we watch, so that we don't mark it. The base path
+    is real, as are the paths we mark. */
+inline auto is_too_deep_to_mark(
+  ::wtr::watcher::watch_options const& opts,
+  std::string const& base,
+  std::string const& dir) -> bool
+{
+  return opts.max_depth >= 0 && depth_of(base, dir) + 1 > opts.max_depth;
+}
+
+/*  The real path, or the path if we can't have it */
+inline auto realpath_of(char const* const path) -> std::string
+{
+  char real[PATH_MAX];
+  return realpath(path, real) ? real : path;
+}
+
+/*  One of a few kernel instances which watch the same
+    tree, each read on its own thread.
+    Every one of us marks the base path. Each directory
+    in it is marked, with everything beneath it, by one
+    of us: by the hash of its name when we begin, by the
+    first of us when it's made (or moved in) later, and
+    by whoever had it when it's renamed. We keep the
+    names of those which are ours in `tops`.
+    Whatever happens beneath a directory is only seen by
+    whoever marked it, so each path's events stay in
+    order. What happens in the base path is seen by all
+    of us, and only reported by whoever it belongs to.
+    A rename from beneath one of us to beneath another
+    is reported in two halves, one by each of us, as a
+    rename out of and into the tree would be. */
+struct shard {
+  int nth = 0;
+  int count = 1;
+  std::unordered_set<std::string> tops{};
+};
+
+/*  Whether we walk into (and mark) a directory while we
+    walk the tree. The base path is everyone's. */
+inline auto
+is_ours(shard& sh, std::string const& base, char const* const dir) -> bool
+{
+  if (sh.count < 2 || depth_of(base, dir) != 0) return true;
+  auto name = std::string_view{dir}.substr(base.size() + 1);
+  auto h = std::hash<std::string_view>{}(name);
+  if (h % (size_t)sh.count != (size_t)sh.nth) return false;
+  return sh.tops.emplace(name), true;
+}
+
+/*  Which of an event's names are ours to report */
+struct claim {
+  bool from = true;
+  bool to = true;
+};
+
+/*  What's in the base path is ours if it's a directory
+    we have, or something new and we're the first of
+    us. Everything else belongs to the first of us. */
+inline auto claim_of(
+  shard& sh,
+  std::string const& base,
+  ::wtr::watcher::event const& ev) -> claim
+{
+  using et = enum ::wtr::watcher::event::effect_type;
+  using pt = enum ::wtr::watcher::event::path_type;
+  if (sh.count < 2) return {};
+  auto is_dir = ev.path_type == pt::dir;
+  auto is_top = [&](std::string const& p) { return depth_of(base, p) == 0; };
+  auto name_of = [&](std::string const& p)
+  { return p.substr(base.size() + 1); };
+  auto is_mine = [&](std::string const& p, bool is_arriving)
+  {
+    return ! is_top(p) ? true
+         : ! is_dir    ? sh.nth == 0
+         : sh.tops.count(name_of(p)) || (sh.nth == 0 && is_arriving);
+  };
+  auto keep = [&](std::string const& p, bool is_arriving)
+  {
+    if (! is_dir || ! is_top(p)) return;
+    if (is_arriving)
+      sh.tops.emplace(name_of(p));
+    else
+      sh.tops.erase(name_of(p));
+  };
+  auto const& from = ev.path_name.native();
+  auto c = claim{false, false};
+  if (ev.effect_type == et::rename && ev.associated) {
+    auto const& to = ev.associated->path_name.native();
+    c.from = is_mine(from, false);
+    c.to = is_top(from) && is_top(to) ? c.from : is_mine(to, true);
+    if (c.from) keep(from, false);
+    if (c.to) keep(to, true);
+    return c;
+  }
+  struct stat s;
+  auto is_arriving = ev.effect_type == et::create
+                  || (ev.effect_type == et::rename && is_dir && is_top(from)
+                      && lstat(from.c_str(), &s) == 0);
+  auto is_leaving =
+    ev.effect_type == et::destroy || ev.effect_type == et::rename;
+  c.from = is_mine(from, is_arriving);
+  if (c.from && (is_arriving || is_leaving)) keep(from, is_arriving);
+  return c;
+}
+
+/*  The part of an event which we claimed */
+inline auto part_of(::wtr::watcher::event const& ev, claim c)
+  -> ::wtr::watcher::event
+{
+  using event = ::wtr::watcher::event;
+  return ! ev.associated || (c.from && c.to) ? ev
+       : c.from ? event{ev.path_name, ev.effect_type, ev.path_type}
+                : event{*ev.associated};
+}
+
+/*  Whether a directory was renamed into what we watch
+    (as opposed to out of it), when we only saw one of
+    its names. We can only tell by whether it's there. */
+inline auto is_moved_in(::wtr::watcher::event const& ev) -> bool
+{
+  struct stat s;
+  return lstat(ev.path_name.c_str(), &s) == 0 && S_ISDIR(s.st_mode);
+}
+
+/*  Whether a directory was renamed, and we only saw one
+    of its names, or only claimed one of them */
+inline auto is_half_moved_dir(::wtr::watcher::event const& ev) -> bool
+{
+  return ev.effect_type == ::wtr::watcher::event::effect_type::rename
+      && ev.path_type == ::wtr::watcher::event::path_type::dir
+      && ! ev.associated;
+}
+
+/*  Whether a path is, or is beneath, a directory */
+inline auto is_at_or_beneath(std::string const& dir, std::string const& path)
+  -> bool
+{
+  return path == dir || depth_of(dir, path) >= 0;
+}
+
+/*  What we find while walking, for the user's inventory.
+    We send it along in batches, in the order we walked.
+    Every directory is marked before we look inside of
+    it, and we read our events only once we're done, so
+    what changes after we've seen it is an event, which
+    comes after the inventory. Something may be in the
+    inventory and have an event, but nothing has neither.
+    The inventory's events are about the `other` effect. */
+struct iv {
+  static constexpr auto batch_len = 1024;
+
+  ::wtr::watcher::watch_options const& opts;
+  std::vector<::wtr::watcher::event> evs{};
+
+  inline auto push(std::string&& path, enum ::wtr::watcher::event::path_type pt)
+    -> void
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    if (! this->opts.on_inventory || is_excluded(this->opts, path)) return;
+    this->evs.emplace_back(std::move(path), et::other, pt);
+    if (this->evs.size() >= batch_len) send();
+  }
+
+  inline auto push(char const* const dir, dirent const* const de) -> void
+  {
+    using pt = enum ::wtr::watcher::event::path_type;
+    if (! this->opts.on_inventory) return;
+    auto path = std::string{dir} + '/' + de->d_name;
+    auto t = de->d_type;
+    struct stat s;
+    if (t == DT_UNKNOWN && lstat(path.c_str(), &s) == 0)
+      t = S_ISDIR(s.st_mode) ? DT_DIR
+        : S_ISREG(s.st_mode) ? DT_REG
+        : S_ISLNK(s.st_mode) ? DT_LNK
+                             : DT_UNKNOWN;
+    push(
+      std::move(path),
+      t == DT_DIR   ? pt::dir
+      : t == DT_REG ? pt::file
+      : t == DT_LNK ? pt::sym_link
+                    : pt::other);
+  }
+
+  inline auto send() -> void
+  {
+    if (! this->evs.empty()) this->opts.on_inventory(this->evs);
+    this->evs.clear();
+  }
+};
+
 } /*  namespace detail::wtr::watcher::adapter */
 
 #endif
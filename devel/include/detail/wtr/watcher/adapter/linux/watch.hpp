@@ -10,23 +10,87 @@
 #endif
 
 #include "wtr/watcher.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <mutex>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 namespace detail::wtr::watcher::adapter {
 
-inline auto watch =
-  [](auto const& path, auto const& cb, auto const& living) -> bool
+/*  We take an inventory while we walk. See `iv`. */
+inline constexpr bool has_inventory = true;
+
+/*  How many of us there are. See `shard`. */
+inline constexpr int shard_ulim = 64;
+
+inline auto watch_shard = [](
+                             auto const& path,
+                             auto const& cb,
+                             auto const& living,
+                             auto const& opts,
+                             shard const& sh) -> bool
 {
-  auto platform_watch = [&](auto make_sysres, auto do_ev_recv) -> result
+  auto platform_watch =
+    [&](auto make_sysres, auto do_ev_recv, auto do_ev_recv_buf) -> result
   {
-    auto sr = make_sysres(path.c_str(), cb, living);
+    auto sr = make_sysres(path.c_str(), cb, living, opts, sh);
+    auto ur = adapter::ur{};
+    if (sr.ok < result::complete && sr.opts.io_uring)
+      ur = make_ur(
+        sr.ke.fd,
+        sr.ke.buf.data(),
+        (unsigned)sr.ke.buf.size(),
+        sr.il.fd,
+        sr.pl.fd);
     auto is_ev_of = [&](int nth, int fd) -> bool
     { return sr.ep.interests[nth].data.fd == fd; };
+    auto sooner = [](int a, int b) -> int
+    { return a < 0 ? b : b < 0 ? a : a < b ? a : b; };
+    auto pl_cb = [&](::wtr::watcher::event const& ev)
+    {
+      auto dir = [&] { return ev.path_name.parent_path().string(); };
+      if (is_excluded(sr.opts, ev.path_name.native()))
+        return;
+      else if (sr.ct.period_ms)
+        ct_push(sr.ct, dir(), ev.effect_type, 1);
+      else if (sr.opts.coarse)
+        cw_push(sr.cw, dir());
+      else
+        cb(ev);
+    };
+
+    /*  In the io-uring mode, the ring reads for us. See
+        `ur`. We use `epoll` if we can't have a ring. */
+    auto ur_cb = [&](uint64_t tag, int res)
+    {
+      if (tag == ur::il_poll)
+        sr.ok = result::complete;
+      else if (tag == ur::pl_poll)
+        sr.ok = do_poll_recv(pl_cb, sr.pl);
+      else if (res < 0)
+        errno = -res, sr.ok = do_ev_recv_buf(cb, sr, -1);
+      else
+        sr.ok = do_ev_recv_buf(cb, sr, res);
+    };
 
+    /*  A signal, such as a child's exit, may wake us
+        before any events do. That isn't an error. */
     while (sr.ok < result::complete) {
-      int ep_c =
-        epoll_wait(sr.ep.fd, sr.ep.interests, sr.ep.q_ulim, sr.ep.wake_ms);
-      if (ep_c < 0)
+      auto wake_ms = sooner(cw_wait_ms(sr.cw), ct_wait_ms(sr.ct));
+      wake_ms = sooner(wake_ms, fo_wait_ms(sr.fo));
+      int ep_c = 0;
+      if (ur.fd < 0)
+        ep_c = epoll_wait(
+          sr.ep.fd,
+          sr.ep.interests.data(),
+          (int)sr.ep.interests.size(),
+          wake_ms);
+      do_bl_sample(sr.opts, cb, sr.bl, sr.ke.fd, sr.base);
+      if (ur.fd >= 0 && ! ur_wait(ur, wake_ms, ur_cb))
+        sr.ok = result::e_sys_api_io_uring;
+      else if (ep_c < 0 && errno != EINTR)
         sr.ok = result::e_sys_api_epoll;
       else
         for (int n = 0; n < ep_c; ++n)
@@ -34,8 +98,14 @@ inline auto watch =
             sr.ok = result::complete;
           else if (is_ev_of(n, sr.ke.fd))
             sr.ok = do_ev_recv(cb, sr);
+          else if (is_ev_of(n, sr.pl.fd))
+            sr.ok = do_poll_recv(pl_cb, sr.pl);
           else
             sr.ok = result::e_sys_api_epoll;
+      do_st_send(cb, sr);
+      do_fo_send(cb, sr.fo, sr.ok >= result::complete);
+      do_cw_send(cb, sr.cw, sr.ok >= result::complete);
+      do_ct_send(sr.opts, sr.ct, sr.ok >= result::complete);
     }
 
     /*  We aren't worried about losing data after
@@ -53,7 +123,8 @@ inline auto watch =
         the out-of-file-descriptors case will be
         handled in `make_sysres()`.
     */
-    return close(sr.ke.fd), close(sr.ep.fd), sr.ok;
+    close_ur(ur);
+    return close(sr.ke.fd), close(sr.pl.fd), close(sr.ep.fd), sr.ok;
   };
 
   /*  e_sys_api_fanotify
@@ -66,26 +137,121 @@ inline auto watch =
       root but lack permission to use fanotify.
 
       The same error applies to being built on a kernel
-      which doesn't have the fanotify api.
+      which doesn't have the fanotify api, to running
+      without root on a kernel older than 5.13, and to
+      watching a filesystem which fanotify can't report
+      on for us.
   */
   auto try_fanotify = [&]()
   {
 #if (KERNEL_VERSION(5, 9, 0) <= LINUX_VERSION_CODE) && ! __ANDROID_API__
-    if (geteuid() == 0)
-      return platform_watch(fanotify::make_sysres, fanotify::do_ev_recv);
-#endif
+    return platform_watch(
+      fanotify::make_sysres,
+      fanotify::do_ev_recv,
+      fanotify::do_ev_recv_buf);
+#else
     return result::e_sys_api_fanotify;
+#endif
   };
 
+  do_reader_sched(opts);
   auto r = try_fanotify();
   if (r == result::e_sys_api_fanotify)
-    r = platform_watch(inotify::make_sysres, inotify::do_ev_recv);
+    r = platform_watch(
+      inotify::make_sysres,
+      inotify::do_ev_recv,
+      inotify::do_ev_recv_buf);
   if (r >= result::e)
     return send_msg(r, path.c_str(), cb), false;
   else
     return true;
 };
 
+/*  How many shards we can use. The batched modes, and a
+    set of files, mark what they mark without walking,
+    so they aren't split up. Neither is a tree we poll,
+    or one which we only watch the top of. */
+inline auto shard_count_of(
+  char const* const path,
+  ::wtr::watcher::watch_options const& opts) -> int
+{
+  auto is_split = opts.shards > 1 && ! opts.coarse && ! opts.on_counts
+               && opts.files.empty() && opts.max_depth != 0
+               && ! is_pollfs(path);
+  return is_split ? std::min(opts.shards, shard_ulim) : 1;
+}
+
+/*  The shards' backlogs, added up. The peaks are the
+    most they've added up to. */
+inline auto bl_sum_of(
+  std::vector<::wtr::watcher::backlog_stats> const& bls,
+  ::wtr::watcher::backlog_stats const& was) -> ::wtr::watcher::backlog_stats
+{
+  auto sum = ::wtr::watcher::backlog_stats{};
+  for (auto const& st : bls) {
+    sum.bytes += st.bytes;
+    sum.events += st.events;
+    sum.limit += st.limit;
+    sum.near_ns += st.near_ns;
+    sum.overflows += st.overflows;
+    sum.samples += st.samples;
+  }
+  sum.peak_bytes = std::max(was.peak_bytes, sum.bytes);
+  sum.peak_events = std::max(was.peak_events, sum.events);
+  return sum;
+}
+
+/*  With more than one shard, each has its own kernel
+    instance, read on its own thread, and they take
+    turns with the callbacks. We're done when they
+    all are. */
+inline auto watch = [](
+                       auto const& path,
+                       auto const& cb,
+                       auto const& living,
+                       auto const& opts) -> bool
+{
+  auto shard_c = shard_count_of(path.c_str(), opts);
+  if (shard_c < 2) return watch_shard(path, cb, living, opts, shard{});
+  auto mtx = std::mutex{};
+  auto turn_cb = [&](::wtr::watcher::event const& ev)
+  {
+    auto _ = std::scoped_lock{mtx};
+    cb(ev);
+  };
+  auto turn_opts = opts;
+  if (opts.on_inventory)
+    turn_opts.on_inventory = [&](std::vector<::wtr::watcher::event> const& evs)
+    {
+      auto _ = std::scoped_lock{mtx};
+      opts.on_inventory(evs);
+    };
+  auto bls = std::vector<::wtr::watcher::backlog_stats>(shard_c);
+  auto bl_all = ::wtr::watcher::backlog_stats{};
+  auto bl_cb = [&](int nth, ::wtr::watcher::backlog_stats const& st)
+  {
+    auto _ = std::scoped_lock{mtx};
+    bls[nth] = st;
+    bl_all = bl_sum_of(bls, bl_all);
+    opts.on_backlog(bl_all);
+  };
+  auto oks = std::vector<char>(shard_c, false);
+  auto shard_do = [&](int nth)
+  {
+    auto sh = shard{.nth = nth, .count = shard_c};
+    auto sh_opts = turn_opts;
+    if (opts.on_backlog)
+      sh_opts.on_backlog = [&, nth](::wtr::watcher::backlog_stats const& st)
+      { bl_cb(nth, st); };
+    oks[nth] = watch_shard(path, turn_cb, living, sh_opts, sh);
+  };
+  auto threads = std::vector<std::thread>{};
+  for (int nth = 1; nth < shard_c; ++nth) threads.emplace_back(shard_do, nth);
+  shard_do(0);
+  for (auto& t : threads) t.join();
+  return std::all_of(oks.begin(), oks.end(), [](char ok) { return ok; });
+};
+
 } /*  namespace detail::wtr::watcher::adapter */
 
 #endif
@@ -31,14 +31,24 @@ inline constexpr std::filesystem::directory_options scan_dir_opts =
 using bucket_type =
   std::unordered_map<std::string, std::filesystem::file_time_type>;
 
+/*  Whether we're as deep as we were asked to scan */
+inline bool is_deepest(
+  std::filesystem::recursive_directory_iterator const& file,
+  int max_depth) noexcept
+{
+  return max_depth >= 0 && file.depth() >= max_depth;
+}
+
 /*  - Scans `path` for changes.
     - Updates our bucket to match the changes.
     - Calls `send_event` when changes happen.
-    - Returns false if the file tree cannot be scanned. */
+    - Returns false if the file tree cannot be scanned.
+    - Doesn't descend past `max_depth`, if it's not less than 0. */
 inline bool scan(
   std::filesystem::path const& path,
   auto const& send_event,
-  bucket_type& bucket) noexcept
+  bucket_type& bucket,
+  int max_depth) noexcept
 {
   /*  - Scans a (single) file for changes.
       - Updates our bucket to match the changes.
@@ -97,11 +107,14 @@ inline bool scan(
     using namespace std::filesystem;
     if (is_directory(dir)) {
       auto ec = std::error_code{};
-      for (auto file : recursive_directory_iterator(dir, scan_dir_opts, ec))
+      auto file = recursive_directory_iterator(dir, scan_dir_opts, ec);
+      for (; file != recursive_directory_iterator{}; file.increment(ec))
         if (ec)
           return false;
-        else
-          scan_file(file.path(), send_event);
+        else {
+          if (is_deepest(file, max_depth)) file.disable_recursion_pending();
+          scan_file(file->path(), send_event);
+        }
       return true;
     }
     else
@@ -118,7 +131,8 @@ inline bool scan(
 inline bool tend_bucket(
   std::filesystem::path const& path,
   auto const& send_event,
-  bucket_type& bucket) noexcept
+  bucket_type& bucket,
+  int max_depth) noexcept
 {
   /*  Creates a file map, the "bucket", from `path`. */
   auto populate = [&](std::filesystem::path const& path) -> bool
@@ -133,14 +147,15 @@ inline bool tend_bucket(
     else if (! is_directory(path))
       bucket[path] = last_write_time(path);
     else {
-      for (auto file :
-           recursive_directory_iterator(path, scan_dir_opts, dir_ec)) {
+      auto file = recursive_directory_iterator(path, scan_dir_opts, dir_ec);
+      for (; file != recursive_directory_iterator{}; file.increment(dir_ec)) {
+        if (is_deepest(file, max_depth)) file.disable_recursion_pending();
         if (! dir_ec) {
-          auto lwt = last_write_time(file, lwt_ec);
+          auto lwt = last_write_time(*file, lwt_ec);
           if (! lwt_ec)
-            bucket[file.path()] = lwt;
+            bucket[file->path()] = lwt;
           else
-            bucket[file.path()] = last_write_time(path);
+            bucket[file->path()] = last_write_time(path);
         }
       }
       return true;
@@ -188,10 +203,14 @@ inline bool tend_bucket(
 
 } /* namespace */
 
+/*  We don't take an inventory. The `watch` does. */
+inline constexpr bool has_inventory = false;
+
 inline auto watch(
   std::filesystem::path const& path,
   ::wtr::watcher::event::callback const& callback,
-  semabin const& living) noexcept -> bool
+  semabin const& living,
+  ::wtr::watcher::watch_options const& opts) noexcept -> bool
 {
   using std::this_thread::sleep_for;
   using namespace std::chrono_literals;
@@ -203,8 +222,8 @@ inline auto watch(
         - No errors occured while scanning
       Otherwise, stop and return false. */
   while (living.state() == semabin::state::pending) {
-    if (! tend_bucket(path, callback, bucket)) return false;
-    if (! scan(path, callback, bucket)) return false;
+    if (! tend_bucket(path, callback, bucket, opts.max_depth)) return false;
+    if (! scan(path, callback, bucket, opts.max_depth)) return false;
     sleep_for(16ms);
   }
   return true;
@@ -208,6 +208,9 @@ inline auto do_event_send(
 
 }  // namespace
 
+/*  We don't take an inventory. The `watch` does. */
+inline constexpr bool has_inventory = false;
+
 /*  while living
     watch for events
     return when dead
@@ -215,7 +218,8 @@ inline auto do_event_send(
 inline auto watch(
   std::filesystem::path const& path,
   ::wtr::watcher::event::callback const& callback,
-  semabin const& living) noexcept -> bool
+  semabin const& living,
+  ::wtr::watcher::watch_options const&) noexcept -> bool
 {
   using namespace ::wtr::watcher;
   auto w = watch_event_proxy{path};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <mutex>
+
+namespace detail::wtr::watcher {
+
+/*  The last we heard of how far behind the kernel we
+    are. We're told from the watcher's thread (or its
+    shards') and asked from the user's, so we take
+    turns with a mutex. */
+
+class backlog_gauge {
+public:
+  using stats = ::wtr::watcher::backlog_stats;
+
+private:
+  std::mutex mtx{};
+  stats st{};
+
+public:
+  inline auto push(stats const& st) -> void
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    this->st = st;
+  }
+
+  inline auto now() -> stats
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    return this->st;
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
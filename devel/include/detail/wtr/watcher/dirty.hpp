@@ -0,0 +1,210 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <filesystem>
+#include <mutex>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace detail::wtr::watcher {
+
+/*  The distinct paths which changed since someone last
+    asked, each with the strongest effect it saw. We're
+    filled from the watcher's thread and drained from
+    the user's, so we take turns with a mutex.
+
+    Draining swaps the paths out for an empty set. They
+    are never copied, and we never hold onto more than
+    one entry for each path, however many events there
+    are between drains.
+
+    From the weakest to the strongest, the effects are:
+      other, owner, modify, rename, create, destroy
+    Both the old and the new name of a rename are
+    dirty. */
+
+class dirty_set {
+public:
+  using effect = enum ::wtr::watcher::event::effect_type;
+
+  struct hash {
+    inline auto operator()(std::filesystem::path const& p) const noexcept
+      -> size_t
+    {
+      return std::filesystem::hash_value(p);
+    }
+  };
+
+  using paths = std::unordered_map<std::filesystem::path, effect, hash>;
+
+private:
+  std::mutex mtx{};
+  paths set{};
+
+  static inline auto strength(effect et) noexcept -> int
+  {
+    /*  In the order of `effect_type` */
+    constexpr int strengths[] = {3, 2, 4, 5, 1, 0};
+    return strengths[(size_t)et];
+  }
+
+public:
+  /*  When a directory's event stands for what was
+      destroyed beneath it, we have whatever we kept
+      beneath it as destroyed, too. */
+  inline auto push(::wtr::watcher::event const& ev) noexcept -> void
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    if (ev.folded && ev.effect_type == effect::destroy) {
+      auto const& dir = ev.path_name.native();
+      auto sep = std::filesystem::path::preferred_separator;
+      for (auto& [p, et] : this->set) {
+        auto const& k = p.native();
+        if (k.size() > dir.size() && k[dir.size()] == sep)
+          if (k.compare(0, dir.size(), dir) == 0) et = effect::destroy;
+      }
+    }
+    for (auto e = &ev; e; e = e->associated.get()) {
+      auto [at, is_new] = this->set.try_emplace(e->path_name, e->effect_type);
+      if (! is_new && strength(e->effect_type) > strength(at->second))
+        at->second = e->effect_type;
+    }
+  }
+
+  inline auto drain() noexcept -> paths
+  {
+    auto drained = paths{};
+    auto _ = std::scoped_lock{this->mtx};
+    return std::swap(this->set, drained), drained;
+  }
+};
+
+/*  When something last changed at, or beneath, each
+    path we've heard about. Those times are generations,
+    which go up by one with every event. The user asks
+    for the current generation (a cursor) and, later,
+    whether anything beneath some path has changed
+    since then.
+
+    Each event updates its path and that path's
+    ancestors, so a question about a path is answered
+    without looking at any events. The ancestors are
+    only asked whether they were created, destroyed or
+    renamed themselves, which would change everything
+    beneath them as well.
+
+    A path which is destroyed, with nothing we know of
+    beneath it, is forgotten, so that a tree with a lot
+    of churn (build directories, temporary files) doesn't
+    grow us without bound. Its parent remembers when
+    the last of the paths beneath it were forgotten. A
+    question about a path we don't know of is answered
+    by its nearest ancestor which we do. */
+
+class dirty_tree {
+public:
+  using cursor = unsigned long long;
+
+private:
+  using path = std::filesystem::path;
+  using view = std::basic_string_view<path::value_type>;
+  using key = std::basic_string<path::value_type>;
+
+  struct gens {
+    cursor self = 0;
+    cursor below = 0;
+    cursor gone = 0;
+    size_t kids = 0;
+  };
+
+  std::mutex mtx{};
+  cursor gen = 0;
+  std::unordered_map<key, gens> tree{};
+
+  static inline auto parent_of(view p) noexcept -> view
+  {
+    auto n = p.find_last_of(path::preferred_separator);
+    return n == view::npos ? view{}
+         : n == 0          ? p.substr(0, p.size() > 1 ? 1 : 0)
+                           : p.substr(0, n);
+  }
+
+  /*  Forgets a destroyed path, if nothing we know of
+      is beneath it, into its parent */
+  inline auto forget(key const& p, cursor now) -> void
+  {
+    auto at = this->tree.find(p);
+    if (at == this->tree.end() || at->second.kids > 0) return;
+    this->tree.erase(at);
+    auto up = this->tree.find(key{parent_of(p)});
+    if (up == this->tree.end()) return;
+    up->second.kids--;
+    up->second.gone = now;
+  }
+
+  static inline auto is_structural(::wtr::watcher::event const& ev) noexcept
+    -> bool
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    return ev.effect_type == et::create || ev.effect_type == et::destroy
+        || ev.effect_type == et::rename;
+  }
+
+public:
+  /*  Both names of a rename share a generation. We
+      stop climbing at the ancestors they share. */
+  inline auto push(::wtr::watcher::event const& ev) noexcept -> void
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    auto _ = std::scoped_lock{this->mtx};
+    auto now = ++this->gen;
+    for (auto e = &ev; e; e = e->associated.get()) {
+      auto const& p = e->path_name.native();
+      auto is_kid_new = false;
+      for (auto at = view{p}; ! at.empty(); at = parent_of(at)) {
+        auto [it, is_new] = this->tree.try_emplace(key{at});
+        auto& g = it->second;
+        if (is_kid_new) g.kids++;
+        is_kid_new = is_new;
+        if (g.below == now) break;
+        g.below = now;
+      }
+      if (is_structural(*e)) this->tree[p].self = now;
+      if (e->effect_type == et::destroy) forget(p, now);
+    }
+  }
+
+  inline auto now() noexcept -> cursor
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    return this->gen;
+  }
+
+  inline auto changed_since(path const& p, cursor since) noexcept -> bool
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    auto at = this->tree.find(p.native());
+    auto is_known = at != this->tree.end();
+    if (is_known && at->second.below > since) return true;
+    for (auto a = parent_of(p.native()); ! a.empty(); a = parent_of(a)) {
+      at = this->tree.find(key{a});
+      if (at == this->tree.end()) continue;
+      if (at->second.self > since) return true;
+      if (! is_known && at->second.gone > since) return true;
+      is_known = true;
+    }
+    return false;
+  }
+
+  /*  How many paths we know of */
+  inline auto size() noexcept -> size_t
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    return this->tree.size();
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <unordered_set>
+#include <vector>
+
+namespace detail::wtr::watcher {
+
+/*  The files we were asked to watch, instead of
+    everything beneath a path, as from a manifest.
+
+    We look events up by their (absolute) names as
+    they go by. A rename is about one of our files
+    when either of its names is. An empty set has
+    everything in it. */
+class file_set {
+  using path = std::filesystem::path;
+  using key = path::string_type;
+
+  std::unordered_set<key> files{};
+
+public:
+  inline file_set(std::vector<path> const& files) noexcept
+  {
+    this->files.reserve(files.size());
+    for (auto const& f : files) this->files.insert(f.native());
+  }
+
+  inline auto contains(::wtr::watcher::event const& ev) const noexcept -> bool
+  {
+    auto const* to = ev.associated.get();
+    return this->files.empty() || this->files.count(ev.path_name.native())
+        || (to && this->files.count(to->path_name.native()));
+  }
+};
+
+/*  The distinct directories which the files are in,
+    for the adapters to watch (and nothing else) */
+inline auto dirs_of(std::vector<std::filesystem::path> const& files)
+  -> std::vector<std::filesystem::path>
+{
+  auto dirs = std::vector<std::filesystem::path>{};
+  dirs.reserve(files.size());
+  for (auto const& f : files) dirs.push_back(f.parent_path());
+  std::sort(dirs.begin(), dirs.end());
+  dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+  return dirs;
+}
+
+} /*  namespace detail::wtr::watcher */
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+namespace detail::wtr::watcher {
+
+/*  Small, dense numbers for the paths we tell the user
+    about, so that they can keep what they know about
+    each path in an array instead of a map.
+
+    A path keeps its number until it's destroyed. The
+    number is given to the next new path after that.
+    A rename takes its number along to the new name.
+    When a directory is renamed, the paths beneath it
+    keep their numbers, under their new names. When a
+    directory's event stands for what was destroyed
+    beneath it (see `event::folded`), those numbers
+    are given up as well.
+
+    We're filled from the watcher's thread and asked
+    about from the user's, so we take turns with a
+    mutex. The paths are kept in order, so that what's
+    beneath a directory is all in one place. */
+
+class path_ids {
+public:
+  using id = uint32_t;
+  static constexpr id none = ::wtr::watcher::event::no_path_id;
+
+private:
+  using path = std::filesystem::path;
+  using key = path::string_type;
+
+  std::mutex mtx{};
+  std::map<key, id> ids{};
+  std::vector<path> paths{};
+  std::vector<id> unused{};
+
+  inline auto intern(key const& k) -> id
+  {
+    auto at = this->ids.find(k);
+    if (at != this->ids.end()) return at->second;
+    auto i = id{};
+    if (this->unused.empty())
+      i = (id)this->paths.size(), this->paths.emplace_back(k);
+    else
+      i = this->unused.back(), this->unused.pop_back(), this->paths[i] = k;
+    return this->ids.emplace(k, i), i;
+  }
+
+  inline auto forget(key const& k) -> void
+  {
+    auto at = this->ids.find(k);
+    if (at == this->ids.end()) return;
+    this->paths[at->second].clear();
+    this->unused.push_back(at->second);
+    this->ids.erase(at);
+  }
+
+  static inline auto is_beneath(key const& p, key const& dir) -> bool
+  {
+    return p.size() > dir.size() && p[dir.size()] == path::preferred_separator
+        && p.compare(0, dir.size(), dir) == 0;
+  }
+
+  /*  Everything beneath a directory */
+  inline auto beneath(key const& dir) -> std::vector<key>
+  {
+    auto found = std::vector<key>{};
+    auto at = this->ids.lower_bound(dir + path::preferred_separator);
+    for (; at != this->ids.end() && is_beneath(at->first, dir); ++at)
+      found.push_back(at->first);
+    return found;
+  }
+
+  inline auto move(key const& from, key const& to) -> id
+  {
+    auto at = this->ids.find(from);
+    if (at == this->ids.end()) return intern(to);
+    auto i = at->second;
+    this->ids.erase(at);
+    forget(to);
+    this->paths[i] = to;
+    return this->ids.emplace(to, i), i;
+  }
+
+public:
+  /*  The event, with the ids of its paths */
+  inline auto stamp(::wtr::watcher::event const& ev) noexcept
+    -> ::wtr::watcher::event
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    auto _ = std::scoped_lock{this->mtx};
+    auto const& from = ev.path_name.native();
+    auto const* to = ev.associated.get();
+    auto is_dir = ev.path_type == ::wtr::watcher::event::path_type::dir;
+    if (to && ev.effect_type == et::rename) {
+      auto const& dest = to->path_name.native();
+      if (is_dir)
+        for (auto const& k : beneath(from))
+          move(k, dest + k.substr(from.size()));
+      auto i = move(from, dest);
+      return ev.with_path_ids(i, i);
+    }
+    auto i = intern(from);
+    auto j = to ? intern(to->path_name.native()) : none;
+    if (ev.effect_type == et::destroy && is_dir && ev.folded)
+      for (auto const& k : beneath(from)) forget(k);
+    if (ev.effect_type == et::destroy) forget(from);
+    return ev.with_path_ids(i, j);
+  }
+
+  inline auto id_of(path const& p) noexcept -> id
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    auto at = this->ids.find(p.native());
+    return at == this->ids.end() ? none : at->second;
+  }
+
+  /*  Empty if the id isn't in use */
+  inline auto path_of(id i) noexcept -> path
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    return i < this->paths.size() ? this->paths[i] : path{};
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
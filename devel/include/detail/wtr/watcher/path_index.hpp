@@ -0,0 +1,343 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace detail::wtr::watcher {
+
+/*  The directories (and, if asked for, the files) beneath
+    the path we watch, kept current with our events.
+
+    Readers on other threads are given snapshots, which
+    never change once they're published, and which they
+    can hold onto for as long as they like. If nothing
+    changed since the last snapshot, loading it is a
+    single atomic load.
+
+    The watcher's thread never waits on the readers to
+    make a snapshot. It only appends the events to a log.
+    Whoever asks for a snapshot next applies the log to a
+    copy of the last one and publishes it. The copy shares
+    everything but what the log changes with the last one,
+    so it costs about as much as the log. If no one asks
+    for a while, the watcher's thread does that itself,
+    now and then, to keep the log short.
+
+    The index is filled by the inventory we take when
+    we begin watching, and by the changes after that.
+
+    A rename from outside the tree adds only the path
+    itself, not what's beneath it. */
+
+class path_index {
+public:
+  using path = std::filesystem::path;
+  using key = path::string_type;
+
+  class snapshot {
+  private:
+    using view = std::basic_string_view<path::value_type>;
+    using chunk = std::vector<key>;
+    static constexpr auto sep = path::preferred_separator;
+    static constexpr size_t chunk_ulim = 1 << 9;
+
+    friend class path_index;
+    path root{};
+    bool files = false;
+    size_t count = 0;
+
+    /*  The paths, in order, in chunks. Each chunk is in
+        order, and comes before the next one. A snapshot
+        shares its chunks with the snapshot it was copied
+        from until it changes them. */
+    std::vector<std::shared_ptr<chunk>> chunks{};
+
+    inline auto key_of(path const& p) const -> key
+    {
+      auto abs = (p.is_absolute() ? p : this->root / p).lexically_normal();
+      return abs.has_filename() ? abs.native() : abs.parent_path().native();
+    }
+
+    /*  Everything beneath a path sorts between the path
+        followed by a separator and the path followed by
+        the character after the separator. */
+    static inline auto range_of(key const& k) -> std::pair<key, key>
+    {
+      return {k + sep, k + (path::value_type)(sep + 1)};
+    }
+
+    /*  The last chunk which begins at or before a key */
+    inline auto chunk_of(key const& k) const -> size_t
+    {
+      auto at = std::upper_bound(
+        this->chunks.begin(),
+        this->chunks.end(),
+        k,
+        [](key const& k, auto const& c) { return k < c->front(); });
+      return at == this->chunks.begin() ? 0 : at - this->chunks.begin() - 1;
+    }
+
+    /*  A chunk which we may change. We copy it first if
+        another snapshot has it. */
+    inline auto chunk_at(size_t i) -> chunk&
+    {
+      auto& c = this->chunks[i];
+      if (c.use_count() > 1) c = std::make_shared<chunk>(*c);
+      return *c;
+    }
+
+    /*  Calls `fn` with each path from `lo` up to `hi` */
+    template<class Fn>
+    inline auto each(key const& lo, key const& hi, Fn const& fn) const -> void
+    {
+      auto i = chunk_of(lo);
+      for (; i < this->chunks.size() && this->chunks[i]->front() < hi; i++) {
+        auto const& c = *this->chunks[i];
+        auto at = std::lower_bound(c.begin(), c.end(), lo);
+        for (; at != c.end() && *at < hi; ++at) fn(*at);
+      }
+    }
+
+    inline auto has(key const& k) const -> bool
+    {
+      if (this->chunks.empty()) return false;
+      auto const& c = *this->chunks[chunk_of(k)];
+      return std::binary_search(c.begin(), c.end(), k);
+    }
+
+    inline auto insert(key const& k) -> void
+    {
+      if (this->chunks.empty()) {
+        this->chunks.push_back(std::make_shared<chunk>(1, k));
+        this->count = 1;
+        return;
+      }
+      auto i = chunk_of(k);
+      auto const& seen = *this->chunks[i];
+      if (std::binary_search(seen.begin(), seen.end(), k)) return;
+      auto& c = chunk_at(i);
+      c.insert(std::lower_bound(c.begin(), c.end(), k), k);
+      this->count++;
+      if (c.size() > chunk_ulim) {
+        auto half = c.begin() + c.size() / 2;
+        auto next = std::make_shared<chunk>(half, c.end());
+        c.erase(half, c.end());
+        this->chunks.insert(this->chunks.begin() + i + 1, std::move(next));
+      }
+    }
+
+    /*  Erases the paths from `lo` up to `hi` */
+    inline auto erase(key const& lo, key const& hi) -> void
+    {
+      auto i = chunk_of(lo);
+      while (i < this->chunks.size() && this->chunks[i]->front() < hi) {
+        auto const& seen = *this->chunks[i];
+        auto a = std::lower_bound(seen.begin(), seen.end(), lo);
+        auto b = std::lower_bound(a, seen.end(), hi);
+        auto from = a - seen.begin();
+        auto len = b - a;
+        if (len == 0) {
+          i++;
+          continue;
+        }
+        auto& c = chunk_at(i);
+        c.erase(c.begin() + from, c.begin() + from + len);
+        this->count -= len;
+        if (c.empty())
+          this->chunks.erase(this->chunks.begin() + i);
+        else
+          i++;
+      }
+    }
+
+    /*  Erases a path and everything beneath it */
+    inline auto erase(key const& k) -> void
+    {
+      auto [lo, hi] = range_of(k);
+      erase(lo, hi);
+      erase(k, k + path::value_type{});
+    }
+
+    inline auto is_kept(::wtr::watcher::event const& ev) const -> bool
+    {
+      using pt = enum ::wtr::watcher::event::path_type;
+      return ev.path_type == pt::dir
+          || (this->files && ev.path_type != pt::watcher);
+    }
+
+    inline auto
+    move(key const& from, key const& to, ::wtr::watcher::event const& ev)
+      -> void
+    {
+      auto moved = std::vector<key>{};
+      auto [lo, hi] = range_of(from);
+      each(
+        lo,
+        hi,
+        [&](key const& k) { moved.push_back(to + k.substr(from.size())); });
+      erase(from);
+      erase(to);
+      if (is_kept(ev)) insert(to);
+      for (auto const& k : moved) insert(k);
+    }
+
+    inline auto apply(::wtr::watcher::event const& ev) -> void
+    {
+      using et = enum ::wtr::watcher::event::effect_type;
+      auto const& p = ev.path_name.native();
+      auto const* to = ev.associated.get();
+      if (ev.effect_type == et::destroy)
+        erase(p);
+      else if (ev.effect_type == et::rename && to)
+        move(p, to->path_name.native(), *to);
+      else if (ev.effect_type == et::rename && has(p))
+        erase(p);
+      else if (is_kept(ev))
+        insert(p);
+    }
+
+  public:
+    unsigned long long version = 0;
+
+    inline auto size() const noexcept -> size_t { return this->count; }
+
+    inline auto contains(path const& p) const -> bool
+    {
+      return has(key_of(p));
+    }
+
+    /*  Everything beneath a path, in order */
+    inline auto below(path const& p) const -> std::vector<path>
+    {
+      auto in = std::vector<path>{};
+      auto [lo, hi] = range_of(key_of(p));
+      each(lo, hi, [&](key const& k) { in.emplace_back(k); });
+      return in;
+    }
+
+    /*  What's directly beneath a path, in order */
+    inline auto within(path const& p) const -> std::vector<path>
+    {
+      auto k = key_of(p);
+      auto in = std::vector<path>{};
+      auto [lo, hi] = range_of(k);
+      each(
+        lo,
+        hi,
+        [&](key const& at)
+        {
+          if (view{at}.find(sep, k.size() + 1) == view::npos)
+            in.emplace_back(at);
+        });
+      return in;
+    }
+  };
+
+  using snapshot_ptr = std::shared_ptr<snapshot const>;
+
+private:
+  static constexpr size_t log_ulim = 1 << 16;
+
+  /*  The free functions for atomic shared pointers are
+      deprecated once there's a specialization. */
+#if defined(__cpp_lib_atomic_shared_ptr)
+  std::atomic<snapshot_ptr> published{};
+
+  inline auto load() const -> snapshot_ptr { return this->published.load(); }
+
+  inline auto store(snapshot_ptr s) -> void
+  {
+    this->published.store(std::move(s));
+  }
+#else
+  snapshot_ptr published{};
+
+  inline auto load() const -> snapshot_ptr
+  {
+    return std::atomic_load(&this->published);
+  }
+
+  inline auto store(snapshot_ptr s) -> void
+  {
+    std::atomic_store(&this->published, std::move(s));
+  }
+#endif
+
+  std::mutex log_mtx{};
+  std::vector<::wtr::watcher::event> log{};
+  std::atomic<bool> is_stale = false;
+  std::mutex build_mtx{};
+
+  /*  With the build mutex */
+  inline auto publish() -> void
+  {
+    auto log = std::vector<::wtr::watcher::event>{};
+    {
+      auto _ = std::scoped_lock{this->log_mtx};
+      std::swap(log, this->log);
+      this->is_stale = false;
+    }
+    auto last = load();
+    if (log.empty() || ! last) return;
+    auto next = std::make_shared<snapshot>(*last);
+    for (auto const& ev : log) next->apply(ev);
+    next->version++;
+    store(std::move(next));
+  }
+
+public:
+  /*  Publishes the first, empty, snapshot. It's filled
+      by the inventory. */
+  inline auto begin(path const& root, bool files) noexcept -> void
+  {
+    auto first = std::make_shared<snapshot>();
+    first->root = root;
+    first->files = files;
+    store(std::move(first));
+  }
+
+  inline auto push(::wtr::watcher::event const& ev) noexcept -> void
+  {
+    push(&ev, &ev + 1);
+  }
+
+  inline auto push(std::vector<::wtr::watcher::event> const& evs) noexcept
+    -> void
+  {
+    push(evs.data(), evs.data() + evs.size());
+  }
+
+  inline auto push(
+    ::wtr::watcher::event const* const evs,
+    ::wtr::watcher::event const* const end) noexcept -> void
+  {
+    auto len = size_t{0};
+    {
+      auto _ = std::scoped_lock{this->log_mtx};
+      for (auto ev = evs; ev != end; ++ev) this->log.push_back(*ev);
+      this->is_stale = true;
+      len = this->log.size();
+    }
+    if (len >= log_ulim && this->build_mtx.try_lock())
+      publish(), this->build_mtx.unlock();
+  }
+
+  /*  Null until we've begun */
+  inline auto now() noexcept -> snapshot_ptr
+  {
+    if (this->is_stale) {
+      auto _ = std::scoped_lock{this->build_mtx};
+      publish();
+    }
+    return load();
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
@@ -0,0 +1,316 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace detail::wtr::watcher {
+
+/*  XXH64, a fast, non-cryptographic hash, fed in
+    pieces. Four independent lanes of 64-bit words,
+    which the compiler is free to keep in registers
+    (or in vectors) while we stream a file through. */
+struct xxh64 {
+  static constexpr uint64_t p1 = 0x9e3779b185ebca87ULL;
+  static constexpr uint64_t p2 = 0xc2b2ae3d27d4eb4fULL;
+  static constexpr uint64_t p3 = 0x165667b19e3779f9ULL;
+  static constexpr uint64_t p4 = 0x85ebca77c2b2ae63ULL;
+  static constexpr uint64_t p5 = 0x27d4eb2f165667c5ULL;
+
+  uint64_t lanes[4]{p1 + p2, p2, 0, 0 - p1};
+  unsigned char tail[32]{};
+  size_t tail_len = 0;
+  uint64_t total_len = 0;
+
+  static inline auto rotl(uint64_t x, int r) -> uint64_t
+  {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  static inline auto round(uint64_t acc, uint64_t in) -> uint64_t
+  {
+    return rotl(acc + in * p2, 31) * p1;
+  }
+
+  static inline auto merge(uint64_t acc, uint64_t lane) -> uint64_t
+  {
+    return (acc ^ round(0, lane)) * p1 + p4;
+  }
+
+  /*  Little-endian, wherever we are */
+  static inline auto u64_of(unsigned char const* p) -> uint64_t
+  {
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; --i) x = (x << 8) | p[i];
+    return x;
+  }
+
+  static inline auto u32_of(unsigned char const* p) -> uint64_t
+  {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+         | (uint64_t)p[3] << 24;
+  }
+
+  inline auto stripe(unsigned char const* p) -> void
+  {
+    for (int i = 0; i < 4; ++i)
+      this->lanes[i] = round(this->lanes[i], u64_of(p + i * 8));
+  }
+
+  inline auto push(void const* data, size_t len) -> void
+  {
+    auto p = (unsigned char const*)data;
+    auto end = p + len;
+    this->total_len += len;
+    if (this->tail_len) {
+      auto n = std::min(len, sizeof(this->tail) - this->tail_len);
+      memcpy(this->tail + this->tail_len, p, n);
+      this->tail_len += n, p += n;
+      if (this->tail_len < sizeof(this->tail)) return;
+      stripe(this->tail), this->tail_len = 0;
+    }
+    for (; end - p >= 32; p += 32) stripe(p);
+    memcpy(this->tail, p, end - p);
+    this->tail_len = end - p;
+  }
+
+  inline auto digest() const -> uint64_t
+  {
+    auto const* l = this->lanes;
+    auto h = this->total_len >= 32
+             ? merge(
+                 merge(
+                   merge(
+                     merge(
+                       rotl(l[0], 1) + rotl(l[1], 7) + rotl(l[2], 12)
+                         + rotl(l[3], 18),
+                       l[0]),
+                     l[1]),
+                   l[2]),
+                 l[3])
+             : l[2] + p5;
+    h += this->total_len;
+    auto p = this->tail;
+    auto end = p + this->tail_len;
+    for (; end - p >= 8; p += 8)
+      h = rotl(h ^ round(0, u64_of(p)), 27) * p1 + p4;
+    if (end - p >= 4) h = rotl(h ^ (u32_of(p) * p1), 23) * p2 + p3, p += 4;
+    for (; p < end; ++p) h = rotl(h ^ (*p * p5), 11) * p1;
+    h ^= h >> 33, h *= p2, h ^= h >> 29, h *= p3, h ^= h >> 32;
+    return h;
+  }
+};
+
+/*  Drops the `modify` events of files whose contents
+    are the same as when we last sent one.
+
+    The reader gives us every event, in order, and
+    goes back to the kernel. Our workers look at the
+    files which were modified, in parallel, and send
+    the events along in the order they were given to
+    us, one at a time, from whichever worker finished
+    the oldest of them.
+
+    We keep each file's size, modification time and
+    hash. If the size and the time haven't changed,
+    the contents haven't either, and we don't read
+    the file. Otherwise, we read it in pieces, so a
+    large file never needs to fit in memory.
+    Whether the contents are the same is decided as
+    the events are sent, in order. When in doubt,
+    we send the event.
+
+    The first change we see to a file is always sent,
+    because we don't know what was there before it.
+    A new file's contents are unknown until it's
+    modified. */
+class rewrites {
+public:
+  using send_fn = std::function<void(::wtr::watcher::event const&)>;
+
+private:
+  using path = std::filesystem::path;
+  using key = path::string_type;
+  static constexpr size_t read_len = 1 << 16;
+
+  struct seen {
+    uintmax_t size = 0;
+    long long mtime = 0;
+    uint64_t hash = 0;
+    bool is_hashed = false;
+  };
+
+  struct slot {
+    ::wtr::watcher::event ev;
+    bool is_ready = false;
+    bool is_stat = false;
+    seen now{};
+  };
+
+  send_fn send{};
+  std::vector<std::thread> workers{};
+
+  std::mutex q_mtx{};
+  std::condition_variable q_cv{};
+  std::deque<slot> q{};
+  std::deque<slot*> todo{};
+  bool is_closing = false;
+
+  std::mutex send_mtx{};
+
+  std::mutex seen_mtx{};
+  std::unordered_map<key, seen> files{};
+
+  static inline auto is_hashed(::wtr::watcher::event const& ev) -> bool
+  {
+    using pt = enum ::wtr::watcher::event::path_type;
+    return ev.effect_type == ::wtr::watcher::event::effect_type::modify
+        && (ev.path_type == pt::file || ev.path_type == pt::hard_link);
+  }
+
+  static inline auto hash_of(path const& p, uint64_t* hash) -> bool
+  {
+    auto buf = std::vector<char>(read_len);
+    auto f = std::ifstream{p, std::ios::binary};
+    auto h = xxh64{};
+    while (f.read(buf.data(), read_len) || f.gcount() > 0)
+      h.push(buf.data(), (size_t)f.gcount());
+    return f.eof() && (*hash = h.digest(), true);
+  }
+
+  /*  Off the reader's thread */
+  inline auto look(slot& s) -> void
+  {
+    auto ec = std::error_code{};
+    auto const& p = s.ev.path_name;
+    auto size = std::filesystem::file_size(p, ec);
+    auto mtime = ec ? 0 : std::filesystem::last_write_time(p, ec)
+                            .time_since_epoch()
+                            .count();
+    if (ec) return;
+    s.now = seen{size, (long long)mtime};
+    s.is_stat = true;
+    {
+      auto _ = std::scoped_lock{this->seen_mtx};
+      auto at = this->files.find(p.native());
+      if (at != this->files.end() && at->second.size == size
+          && at->second.mtime == s.now.mtime)
+        return;
+    }
+    s.now.is_hashed = hash_of(p, &s.now.hash);
+  }
+
+  /*  In order. Keeps what we know about each file in
+      step with what we've sent. */
+  inline auto is_same(slot const& s) -> bool
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    auto _ = std::scoped_lock{this->seen_mtx};
+    auto const& ev = s.ev;
+    auto const& p = ev.path_name.native();
+    if (is_hashed(ev)) {
+      if (! s.is_stat) return this->files.erase(p), false;
+      auto at = this->files.find(p);
+      if (at == this->files.end()) {
+        if (s.now.is_hashed) this->files.insert_or_assign(p, s.now);
+        return false;
+      }
+      auto& was = at->second;
+      if (was.size == s.now.size && was.mtime == s.now.mtime) return true;
+      if (! s.now.is_hashed) return this->files.erase(at), false;
+      auto is_hash_same = was.hash == s.now.hash;
+      return was = s.now, is_hash_same;
+    }
+    if (ev.effect_type == et::rename && ev.associated) {
+      auto const& to = ev.associated->path_name.native();
+      auto n = this->files.extract(p);
+      this->files.erase(to);
+      if (n) n.key() = to, this->files.insert(std::move(n));
+    }
+    else if (ev.effect_type != et::modify && ev.effect_type != et::owner)
+      this->files.erase(p);
+    return false;
+  }
+
+  /*  Whatever's ready at the front of the line */
+  inline auto send_ready() -> void
+  {
+    auto _ = std::scoped_lock{this->send_mtx};
+    for (;;) {
+      auto lk = std::unique_lock{this->q_mtx};
+      if (this->q.empty() || ! this->q.front().is_ready) return;
+      auto s = std::move(this->q.front());
+      this->q.pop_front();
+      lk.unlock();
+      if (! is_same(s)) this->send(s.ev);
+    }
+  }
+
+  inline auto work() -> void
+  {
+    for (;;) {
+      auto lk = std::unique_lock{this->q_mtx};
+      this->q_cv.wait(
+        lk,
+        [this] { return this->is_closing || ! this->todo.empty(); });
+      if (this->todo.empty()) return;
+      auto s = this->todo.front();
+      this->todo.pop_front();
+      lk.unlock();
+      if (is_hashed(s->ev)) look(*s);
+      lk.lock();
+      s->is_ready = true;
+      lk.unlock();
+      send_ready();
+    }
+  }
+
+public:
+  static inline auto worker_count() -> unsigned
+  {
+    return std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+  }
+
+  inline rewrites(send_fn const& send, unsigned workers) noexcept
+      : send{send}
+  {
+    for (unsigned i = 0; i < workers; ++i)
+      this->workers.emplace_back([this] { work(); });
+  }
+
+  inline auto push(::wtr::watcher::event const& ev) noexcept -> void
+  {
+    {
+      auto _ = std::scoped_lock{this->q_mtx};
+      this->todo.push_back(&this->q.emplace_back(slot{ev}));
+    }
+    this->q_cv.notify_one();
+  }
+
+  /*  Sends whatever we were given, then stops */
+  inline auto close() noexcept -> void
+  {
+    {
+      auto _ = std::scoped_lock{this->q_mtx};
+      this->is_closing = true;
+    }
+    this->q_cv.notify_all();
+    for (auto& w : this->workers)
+      if (w.joinable()) w.join();
+  }
+
+  inline ~rewrites() noexcept { close(); }
+};
+
+} /*  namespace detail::wtr::watcher */
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <filesystem>
+#include <stddef.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if ! defined(_WIN32)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace detail::wtr::watcher {
+
+/*  The sizes of the files we tail, for the bytes which
+    were appended to them.
+
+    We keep each file open, so that its size is one
+    `fstat` away, and so that a file keeps its size
+    when it's renamed, as logs are when they're rotated.
+    Past `fd_ulim` files, we ask for sizes by path.
+    (There are no descriptors to keep on Windows.)
+
+    A new file begins empty, so its first write is
+    appended from the beginning. So is the first write
+    to a file we didn't know about. A file which is
+    smaller than it was was truncated.
+
+    We're only used from one thread at a time. */
+class tails {
+  using path = std::filesystem::path;
+  using key = path::string_type;
+  using size_type = unsigned long long;
+  static constexpr size_t fd_ulim = 256;
+
+  struct file {
+    int fd = -1;
+    size_type size = 0;
+  };
+
+  std::vector<path> roots{};
+  std::unordered_map<key, file> files{};
+  size_t fd_c = 0;
+
+#if defined(_WIN32)
+  static inline auto open_of(path const&) -> int { return -1; }
+
+  static inline auto close_of(int) -> void {}
+#else
+  static inline auto open_of(path const& p) -> int
+  {
+    struct stat s;
+    int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd >= 0 && (fstat(fd, &s) != 0 || ! S_ISREG(s.st_mode)))
+      close(fd), fd = -1;
+    return fd;
+  }
+
+  static inline auto close_of(int fd) -> void
+  {
+    if (fd >= 0) close(fd);
+  }
+#endif
+
+  static inline auto size_of(file const& f, path const& p, size_type* size)
+    -> bool
+  {
+#if ! defined(_WIN32)
+    struct stat s;
+    if (f.fd >= 0) return fstat(f.fd, &s) == 0 && (*size = s.st_size, true);
+#endif
+    auto ec = std::error_code{};
+    *size = std::filesystem::file_size(p, ec);
+    return ! ec;
+  }
+
+  inline auto is_tailed(key const& p) const -> bool
+  {
+    constexpr auto sep = path::preferred_separator;
+    for (auto const& r : this->roots) {
+      auto const& k = r.native();
+      auto is_under = p.size() > k.size() && p[k.size()] == sep;
+      auto is_same = p.size() == k.size();
+      if ((is_same || is_under) && p.compare(0, k.size(), k) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  inline auto forget(key const& p) -> void
+  {
+    auto at = this->files.find(p);
+    if (at == this->files.end()) return;
+    if (at->second.fd >= 0) close_of(at->second.fd), this->fd_c--;
+    this->files.erase(at);
+  }
+
+  inline auto keep(key const& p) -> file&
+  {
+    auto [at, is_new] = this->files.try_emplace(p);
+    if (is_new && this->fd_c < fd_ulim) at->second.fd = open_of(p);
+    if (is_new && at->second.fd >= 0) this->fd_c++;
+    return at->second;
+  }
+
+public:
+  inline tails(std::vector<path> const& roots) noexcept
+      : roots{roots}
+  {}
+
+  /*  What's there when we begin */
+  inline auto begin() noexcept -> void
+  {
+    namespace fs = std::filesystem;
+    auto ec = std::error_code{};
+    auto opt = fs::directory_options::skip_permission_denied;
+    auto seed = [this](path const& p)
+    {
+      auto& f = keep(p.native());
+      if (! size_of(f, p, &f.size)) f.size = 0;
+    };
+    for (auto const& r : this->roots) {
+      if (fs::is_regular_file(r, ec)) seed(r);
+      if (! fs::is_directory(r, ec)) continue;
+      auto at = fs::recursive_directory_iterator(r, opt, ec);
+      auto end = fs::recursive_directory_iterator{};
+      for (; ! ec && at != end; at.increment(ec)) {
+        auto file_ec = std::error_code{};
+        if (at->is_regular_file(file_ec)) seed(at->path());
+      }
+    }
+  }
+
+  /*  The event, with what was appended if it's a write
+      to a file we tail */
+  inline auto stamp(::wtr::watcher::event const& ev) noexcept
+    -> ::wtr::watcher::event
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    using pt = enum ::wtr::watcher::event::path_type;
+    using range = ::wtr::watcher::event::byte_range;
+    auto const& p = ev.path_name.native();
+    auto const* to = ev.associated.get();
+    if (ev.path_type != pt::file && ev.path_type != pt::hard_link) return ev;
+    if (ev.effect_type == et::rename && to) {
+      auto const& dest = to->path_name.native();
+      auto n = this->files.extract(p);
+      forget(dest);
+      if (n && is_tailed(dest))
+        n.key() = dest, this->files.insert(std::move(n));
+      else if (n && n.mapped().fd >= 0)
+        close_of(n.mapped().fd), this->fd_c--;
+      return ev;
+    }
+    if (! is_tailed(p)) return ev;
+    if (ev.effect_type == et::create) forget(p), keep(p).size = 0;
+    if (ev.effect_type == et::destroy || ev.effect_type == et::rename)
+      forget(p);
+    if (ev.effect_type != et::modify) return ev;
+    auto& f = keep(p);
+    auto size = size_type{0};
+    if (! size_of(f, ev.path_name, &size)) return ev;
+    auto is_truncated = size < f.size;
+    auto begin = is_truncated ? 0 : f.size;
+    f.size = size;
+    return ev.with_appended(range{begin, size, is_truncated});
+  }
+
+  inline ~tails() noexcept
+  {
+    for (auto& [_, f] : this->files) close_of(f.fd);
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace detail::wtr::watcher {
+
+/*  The deepest part of a path which exists, which may
+    be the path itself. Whatever's there counts, even
+    a link to nowhere. */
+inline auto deepest_of(std::filesystem::path const& path)
+  -> std::filesystem::path
+{
+  auto at = path;
+  auto ec = std::error_code{};
+  while (! std::filesystem::exists(std::filesystem::symlink_status(at, ec))
+         && at.has_relative_path())
+    at = at.parent_path();
+  return at;
+}
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+
+/*  Waits for an (absolute) path to exist. True if it
+    does, false if we were closed first.
+
+    We mark the deepest directory along the path which
+    exists, and nothing else. When something is made
+    (or moved) there, we look again, and move our mark
+    further down the path. When the directory we marked
+    goes away, we move it back up. We look again after
+    every move, for whatever was made in the meantime.
+    One mark, and a few `stat`s each time we wake.
+
+    If `inotify` won't have us, we poll. */
+inline auto wait_for(std::filesystem::path const& path, semabin const& living)
+  -> bool
+{
+  using namespace std::chrono_literals;
+  constexpr auto msk = IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+                     | IN_ONLYDIR;
+  constexpr auto buf_len = 4096;
+  alignas(inotify_event) char buf[buf_len];
+  int in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  int wd = -1;
+  auto marked = std::filesystem::path{};
+  auto is_there = false;
+  /*  Our mark goes away (or along) with its directory */
+  auto forget_if_gone = [&](inotify_event const* const in_ev)
+  {
+    auto is_gone = in_ev->mask & (IN_IGNORED | IN_MOVE_SELF);
+    if (in_ev->wd == wd && is_gone) wd = -1, marked.clear();
+  };
+  while (! is_there && living.state() == semabin::pending) {
+    auto at = deepest_of(path);
+    auto ec = std::error_code{};
+    if ((is_there = at == path)) break;
+    if (! std::filesystem::is_directory(at, ec)) at = at.parent_path();
+    if (in_fd >= 0 && at != marked) {
+      if (wd >= 0) inotify_rm_watch(in_fd, wd);
+      wd = inotify_add_watch(in_fd, at.c_str(), msk);
+      marked = wd >= 0 ? at : std::filesystem::path{};
+      if (wd >= 0) continue;
+    }
+    if (in_fd < 0 || wd < 0) {
+      std::this_thread::sleep_for(16ms);
+      continue;
+    }
+    pollfd fds[] = {{in_fd, POLLIN, 0}, {living.fd, POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+    for (ssize_t len; (len = read(in_fd, buf, buf_len)) > 0;)
+      for (auto p = buf; p < buf + len;) {
+        auto in_ev = (inotify_event const*)p;
+        forget_if_gone(in_ev);
+        p += sizeof(inotify_event) + in_ev->len;
+      }
+  }
+  if (in_fd >= 0) close(in_fd);
+  return is_there;
+}
+
+#else
+
+/*  Waits for an (absolute) path to exist. True if it
+    does, false if we were closed first. There's no
+    one mark to move down the path here, so we poll. */
+inline auto wait_for(std::filesystem::path const& path, semabin const& living)
+  -> bool
+{
+  using namespace std::chrono_literals;
+  while (living.state() == semabin::pending)
+    if (deepest_of(path) == path)
+      return true;
+    else
+      std::this_thread::sleep_for(16ms);
+  return false;
+}
+
+#endif
+
+} /*  namespace detail::wtr::watcher */
@@ -3,6 +3,7 @@
 #include <array>
 #include <charconv>
 #include <chrono>
+#include <cstdint>
 #include <filesystem>
 #include <functional>
 #include <ios>
@@ -11,6 +12,7 @@
 #include <string>
 #include <string_view>
 #include <type_traits>
+#include <utility>
 
 namespace wtr {
 inline namespace watcher {
@@ -37,6 +39,20 @@ inline namespace watcher {
         - other
       - `effect_time`:
         The time of the event in nanoseconds since epoch.
+      - `path_id`:
+        A small number for the path, if asked for. See
+        `watch_options::path_ids`.
+      - `folded`:
+        How many events beneath a destroyed directory
+        this one stands for. See `watch_options::fold`.
+      - `appended`:
+        The bytes written to a file we tail, from the
+        size we saw last to its size now. See
+        `watch_options::tail`.
+      - `stat`:
+        The path's inode, device, size, modification
+        time, mode and link count, as we saw it. See
+        `watch_options::stats`.
 
     The `watcher` type is special.
     Events with this type will include messages from
@@ -96,16 +112,106 @@ public:
                                 TimePoint{Clock::now()}.time_since_epoch())
                                 .count()};
 
+  static constexpr std::uint32_t no_path_id = UINT32_MAX;
+
+  std::uint32_t const path_id{no_path_id};
+
+  std::size_t const folded{0};
+
+  /*  From `begin` to `end`. A file which was truncated
+      was written to from the beginning. */
+  struct byte_range {
+    unsigned long long begin = 0;
+    unsigned long long end = 0;
+    bool is_truncated = false;
+  };
+
+  byte_range const appended{};
+
+  /*  All zero if we didn't look, or couldn't. The `mtime`
+      is in the same units as the `effect_time`. */
+  struct file_stat {
+    unsigned long long inode = 0;
+    unsigned long long device = 0;
+    unsigned long long size = 0;
+    long long mtime = 0;
+    unsigned mode = 0;
+    unsigned links = 0;
+  };
+
+  file_stat const stat{};
+
   std::unique_ptr<event> const associated{nullptr};
 
   inline event(event const& from) noexcept
-      : path_name{from.path_name}
-      , effect_type{from.effect_type}
-      , path_type{from.path_type}
-      , effect_time{from.effect_time}
-      , associated{
-          from.associated ? std::make_unique<event>(*from.associated)
-                          : nullptr} {};
+      : event{
+        from,
+        from.path_type,
+        from.path_id,
+        from.folded,
+        from.appended,
+        from.stat,
+        from.associated_copy()} {};
+
+  /*  A copy, with the ids of our path and of the
+      associated event's path. */
+  inline auto with_path_ids(
+    std::uint32_t path_id,
+    std::uint32_t associated_path_id) const noexcept -> event
+  {
+    auto const* to = this->associated.get();
+    return {
+      *this,
+      this->path_type,
+      path_id,
+      this->folded,
+      this->appended,
+      this->stat,
+      to ? std::make_unique<event>(
+        to->with_path_ids(associated_path_id, no_path_id))
+         : nullptr};
+  }
+
+  /*  A copy, which stands for `folded` other events */
+  inline auto with_folded(std::size_t folded) const noexcept -> event
+  {
+    return {
+      *this,
+      this->path_type,
+      this->path_id,
+      folded,
+      this->appended,
+      this->stat,
+      associated_copy()};
+  }
+
+  /*  A copy, with what was appended */
+  inline auto with_appended(byte_range appended) const noexcept -> event
+  {
+    return {
+      *this,
+      this->path_type,
+      this->path_id,
+      this->folded,
+      appended,
+      this->stat,
+      associated_copy()};
+  }
+
+  /*  A copy, with what we saw of the path, which may be
+      a hard link */
+  inline auto with_stat(enum path_type path_type, file_stat const& stat)
+    const noexcept -> event
+  {
+    return {
+      *this,
+      path_type,
+      this->path_id,
+      this->folded,
+      this->appended,
+      stat,
+      associated_copy()};
+  }
 
   inline event(
     std::filesystem::path const& path_name,
@@ -138,6 +244,31 @@ public:
   {
     return ! (l == r);
   }
+
+private:
+  inline event(
+    event const& from,
+    enum path_type path_type,
+    std::uint32_t path_id,
+    std::size_t folded,
+    byte_range appended,
+    file_stat const& stat,
+    std::unique_ptr<event> associated) noexcept
+      : path_name{from.path_name}
+      , effect_type{from.effect_type}
+      , path_type{path_type}
+      , effect_time{from.effect_time}
+      , path_id{path_id}
+      , folded{folded}
+      , appended{appended}
+      , stat{stat}
+      , associated{std::move(associated)} {};
+
+  inline auto associated_copy() const noexcept -> std::unique_ptr<event>
+  {
+    return this->associated ? std::make_unique<event>(*this->associated)
+                            : nullptr;
+  }
 };
 
 } /*  namespace watcher */
@@ -0,0 +1,383 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <array>
+#include <filesystem>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+namespace wtr {
+inline namespace watcher {
+
+/*  Options for a `watch`.
+    The defaults are what you get without them.
+
+    @param exclude:
+      Paths which we won't watch, along with everything
+      beneath them. Relative paths are relative to the
+      path being watched.
+      Where the kernel lets us, we don't ask it about
+      these paths at all. Whatever it tells us anyway
+      is dropped before it reaches the callback.
+
+    @param exclude_pids:
+      Processes whose changes we don't report. Only
+      the fanotify adapter knows who made a change,
+      and, without root, only when it was us.
+
+    @param exclude_self:
+      Don't report our own changes. The same as adding
+      this process to `exclude_pids`.
+
+    @param coarse:
+      Report that something in a directory changed, but
+      not what. Each directory is reported (as a `modify`
+      of a `dir`) at most once in a short window of time,
+      at the window's end. Only the Linux adapters do
+      this.
+
+    @param on_counts:
+      Count events instead of sending them. Every
+      `counts_period_ms`, and once more when we're
+      done, this is called with the counts since the
+      last call. Events are counted where we read
+      them, without finding out which paths they're
+      about. The callback given to `watch` still has
+      our messages. Only the Linux adapters do this.
+
+    @param counts_period_ms:
+      How often `on_counts` is called.
+
+    @param dirty:
+      Keep the paths which changed, instead of sending
+      them, until they're taken with `watch::drain()`.
+      Each path is kept once, with the strongest effect
+      it saw. The callback still has our messages.
+
+    @param generations:
+      Keep track of when something last changed beneath
+      each directory, for `watch::changed_since()`.
+
+    @param path_ids:
+      Give each path a small number, its `path_id`,
+      which is unique among the paths that exist. The
+      numbers begin at zero, and the numbers of the
+      destroyed paths are given to new ones, so they
+      can index into an array. A renamed path keeps
+      its number.
+
+    @param index:
+      Keep an index of the directories beneath the path,
+      for `watch::snapshot()`.
+
+    @param index_files:
+      Keep the files (and everything else which isn't
+      a directory) in the index as well.
+
+    @param on_inventory:
+      Called with everything beneath the path when we
+      begin watching, in batches of events with the
+      `other` effect. Every batch comes before the first
+      change is sent. Whatever changes after we've seen
+      it is sent as well, so nothing is missed between
+      the inventory and the changes. (Some paths may be
+      in both.) The Linux adapters take the inventory
+      while they walk the tree to watch it. Elsewhere,
+      we walk it before we begin.
+
+    @param fold:
+      When a directory is destroyed, with everything
+      beneath it, send one event for the directory
+      instead of one for everything. How many events
+      it stands for is in its `folded`. We hold onto
+      what was destroyed until nothing else has been
+      for a moment, or until something else happens.
+      Not with `coarse` or `on_counts`. Only the Linux
+      adapters do this. (A renamed directory is always
+      one event. Either way, we keep the names of the
+      paths beneath it up to date.)
+
+    @param skip_rewrites:
+      Drop the `modify` events of files whose contents
+      are the same as when we last sent one, like those
+      rewritten by formatters. We hash the files on a
+      few threads of our own, so that we keep reading
+      from the kernel, and send the events in the same
+      order as we would otherwise. The first change we
+      see to a file is always sent. The callback is
+      called from those threads.
+
+    @param close_write:
+      Send a `modify` when a file which was written to
+      is closed, instead of one for each write. A large
+      copy is one event, once it's done, instead of
+      thousands of them while it's being made. Only the
+      Linux adapters do this. (The subtrees we poll
+      are still reported as they're written to.)
+
+    @param tail:
+      Files, and directories of files, which are only
+      appended to, like logs. The `modify` events of
+      these files have the bytes which were appended
+      since the last one in their `appended`, so that
+      only those need to be read. A truncated file is
+      reported as such. Relative paths are relative
+      to the path being watched.
+
+    @param stats:
+      Look at each path as we send it, for its `stat`.
+      We look at a read's worth of events at once, once
+      we're done reading. A file with more than one link
+      is reported as a `hard_link`. When the fanotify
+      adapter runs as root, we look at what the kernel
+      told us changed, rather than at whatever has its
+      name now. Only the Linux adapters do this.
+
+    @param files:
+      Watch only these files, as from a manifest (such
+      as `git ls-files`), instead of everything beneath
+      the path. Relative paths are relative to the path
+      being watched. Only the events about these files
+      are sent. (A rename is, if either name is.) The
+      Linux adapters only watch the directories these
+      files are in, and nothing beneath them, or made
+      after we begin. Elsewhere, we watch the path and
+      drop what isn't in the set. With `coarse` or
+      `on_counts`, every change in those directories
+      is reported.
+      Watching a file, instead of a directory, is the
+      same as watching its directory with only it in
+      this set.
+
+    @param max_depth:
+      How many directories deep we watch beneath the
+      path. What's in the path itself is at depth 0,
+      so 0 watches only the path, and not what's in
+      its directories. A directory at the deepest
+      depth we watch is reported on, but not what's
+      in it. Less than 0 (the default) is as deep as
+      the tree goes. Where we can, we don't ask the
+      kernel about (or scan) what's deeper at all.
+
+    @param dirs_first:
+      During a storm of changes, send what changes
+      which directories there are (their creation,
+      destruction and renaming) ahead of everything
+      else we read at the same time. We mark the new
+      directories before we send anything, so that we
+      miss less of what's made in them. Nothing goes
+      ahead of something earlier about its own path,
+      or about what's beneath it. Not with `coarse` or
+      `on_counts`. Only the Linux adapters do this.
+
+    @param shards:
+      How many kernel instances to split a large tree
+      across, each read on a thread of its own, for when
+      one thread can't keep up with what changes. The
+      directories in the path are split between them,
+      each with everything beneath it, so what happens
+      to a path is still sent in order. The callbacks
+      are called from those threads, one at a time.
+      A rename between directories which two of them
+      watch is sent in two halves, as if it were out of
+      the tree and into it. Not with `coarse`, `files`,
+      `on_counts`, or a `max_depth` of 0. Only the Linux
+      adapters do this.
+
+    @param io_uring:
+      Wait for the kernel's events with io_uring, rather
+      than with `epoll`. We keep a read posted behind a
+      poll of the kernel's descriptor, into a buffer
+      we've registered with the ring, so each wakeup is
+      one system call, which has already read what we
+      were woken for. Where io_uring isn't there (before
+      Linux 5.11), or isn't allowed, we use `epoll`. Only
+      the Linux adapters do this.
+
+    @param read_buf_len:
+      How many bytes of events we read from the kernel
+      at once. More is fewer reads in a storm, and more
+      to look through (and hold onto, in the stats and
+      dirs-first modes) after each. There's a floor,
+      which is enough for the largest event. Only the
+      Linux adapters do this.
+
+    @param epoll_q_len:
+      How many of `epoll`'s events we take at once.
+      Only the Linux adapters do this.
+
+    @param reader_cpus:
+      The CPUs which the threads that read from the
+      kernel (and call the callback) may run on. Empty
+      (the default) is any of them. Only the Linux
+      adapters do this.
+
+    @param reader_nice:
+      How much nicer than the rest of the process those
+      threads are, as with `nice`. Less than 0 is less
+      nice, where we're allowed. Only the Linux adapters
+      do this.
+      The kernel's own queues are sized by the system
+      (`fs.inotify.max_queued_events`) for everyone, or
+      unlimited for fanotify, when we're privileged, so
+      they aren't here.
+
+    @param backlog:
+      Keep track of how far behind the kernel we are,
+      for `watch::backlog()`. Each time we're woken, we
+      ask the kernel how much is waiting for us. Only
+      the Linux adapters do this.
+
+    @param on_backlog:
+      Called with what we've kept track of each time we
+      ask, from the thread which reads from the kernel,
+      so it should be quick. The same as `backlog`, but
+      as it happens.
+
+    @param backlog_near_pct:
+      How full (as a percent) the kernel's queue is when
+      we're near its limit. Once we are, we send a
+      `w/sys/q_near` message, with the watcher's other
+      messages, and count the time until we've caught
+      up to half of that again. A queue without a limit
+      is never near it. */
+
+/*  How far behind the kernel we are, as of the last
+    time we asked. The kernel tells us how many bytes
+    are waiting to be read. Its limit is on events,
+    so we guess how many events that is, from the
+    events we've read so far.
+    The `limit` is how many events the kernel will
+    hold for us before it drops them. 0 is no limit.
+    We're near it for as long as `near_ns` says. The
+    `overflows` are the times the kernel told us it
+    dropped some. With `shards`, each shard's kernel
+    queue is added up. */
+struct backlog_stats {
+  unsigned long long bytes = 0;
+  unsigned long long peak_bytes = 0;
+  unsigned long long events = 0;
+  unsigned long long peak_events = 0;
+  unsigned long long limit = 0;
+  long long near_ns = 0;
+  unsigned long long overflows = 0;
+  unsigned long long samples = 0;
+};
+
+/*  How many events of each effect happened in each
+    directory over some period of time. Directories
+    where nothing happened are left out.
+    The times are in the same units as an event's
+    `effect_time`. The counts are indexed by the
+    `effect_type`. A rename is counted in both the
+    directory it came from and the one it went to. */
+struct event_counts {
+  using effects =
+    std::array<unsigned long long, (size_t)event::effect_type::other + 1>;
+
+  struct dir {
+    std::filesystem::path path_name{};
+    effects counts{};
+  };
+
+  long long begin_time = 0;
+  long long end_time = 0;
+  std::vector<dir> dirs{};
+};
+
+struct watch_options {
+  std::vector<std::filesystem::path> exclude{};
+  std::vector<int> exclude_pids{};
+  bool exclude_self = false;
+  bool coarse = false;
+  std::function<void(event_counts const&)> on_counts{};
+  int counts_period_ms = 1000;
+  bool dirty = false;
+  bool generations = false;
+  bool path_ids = false;
+  bool index = false;
+  bool index_files = false;
+  std::function<void(std::vector<event> const&)> on_inventory{};
+  bool fold = false;
+  bool skip_rewrites = false;
+  bool close_write = false;
+  std::vector<std::filesystem::path> tail{};
+  bool stats = false;
+  std::vector<std::filesystem::path> files{};
+  int max_depth = -1;
+  bool dirs_first = false;
+  int shards = 1;
+  bool io_uring = false;
+  unsigned read_buf_len = 4096;
+  int epoll_q_len = 64;
+  std::vector<int> reader_cpus{};
+  int reader_nice = 0;
+  bool backlog = false;
+  std::function<void(backlog_stats const&)> on_backlog{};
+  int backlog_near_pct = 75;
+};
+
+} /*  namespace watcher */
+} /*  namespace wtr   */
+
+namespace detail::wtr::watcher {
+
+/*  Whether a path is (or is beneath) an excluded path.
+    The `watch` makes the exclusions absolute before
+    the adapters see them. */
+inline auto is_excluded(
+  ::wtr::watcher::watch_options const& opts,
+  std::basic_string_view<std::filesystem::path::value_type> path) noexcept
+  -> bool
+{
+  constexpr auto sep = std::filesystem::path::preferred_separator;
+  for (auto const& ex : opts.exclude) {
+    auto const& e = ex.native();
+    auto is_under = path.size() > e.size() && path[e.size()] == sep;
+    auto is_same = path.size() == e.size();
+    if ((is_same || is_under) && path.compare(0, e.size(), e) == 0)
+      return true;
+  }
+  return false;
+}
+
+/*  How deep a path is beneath the base path, counting
+    what's in the base path as depth 0. Less than 0 if
+    it isn't beneath the base path. */
+inline auto depth_of(
+  std::basic_string_view<std::filesystem::path::value_type> base,
+  std::basic_string_view<std::filesystem::path::value_type> path) noexcept
+  -> int
+{
+  constexpr auto sep = std::filesystem::path::preferred_separator;
+  if (! base.empty() && base.back() == sep) base.remove_suffix(1);
+  auto is_under = path.size() > base.size() && path[base.size()] == sep;
+  if (! is_under || path.compare(0, base.size(), base) != 0) return -1;
+  int depth = -1;
+  for (auto i = base.size(); i < path.size(); ++i) depth += path[i] == sep;
+  return depth;
+}
+
+/*  Whether a path is deeper than we were asked to watch */
+inline auto is_too_deep(
+  ::wtr::watcher::watch_options const& opts,
+  std::basic_string_view<std::filesystem::path::value_type> base,
+  std::basic_string_view<std::filesystem::path::value_type> path) noexcept
+  -> bool
+{
+  return opts.max_depth >= 0 && depth_of(base, path) > opts.max_depth;
+}
+
+/*  Whether a process's changes are excluded. The
+    adapters which can tell add `self` to the pids. */
+inline auto
+is_excluded_pid(::wtr::watcher::watch_options const& opts, int pid) noexcept
+  -> bool
+{
+  for (auto ex : opts.exclude_pids)
+    if (ex == pid) return true;
+  return false;
+}
+
+} /*  namespace detail::wtr::watcher */
@@ -18,11 +18,38 @@ inline namespace watcher {
 
     @param path:
       The root path to watch for filesystem events.
+      A file is watched from its directory. (See
+      `watch_options::files`.)
 
     @param callback:
       Something (such as a closure) to be called when events
       occur in the path being watched.
 
+    @param options:
+      Optional. See `watch_options`.
+
+    With the `dirty` option, `drain()` takes the paths
+    which changed since it was last called. Building
+    something? Drain before each build.
+
+    With the `generations` option, `now()` gives a
+    cursor, and `changed_since(path, cursor)` tells us
+    whether anything at or beneath the path changed
+    after the cursor was taken.
+
+    With the `path_ids` option, every event carries
+    a `path_id`, and `id_of(path)` and `path_of(id)`
+    go between them.
+
+    With the `index` option, `snapshot()` gives us the
+    paths beneath the watched path, as they are now.
+    The snapshot won't change. We can ask it what's
+    `below()` or `within()` a path, and whether it
+    `contains()` a path.
+
+    With the `backlog` option, `backlog()` tells us how
+    far behind the kernel we were when we last looked.
+
     This is an adaptor "switch" that chooses the ideal
     adaptor for the host platform.
 
@@ -51,23 +78,175 @@ inline namespace watcher {
 
     Happy hacking. */
 class watch {
+public:
+  using dirty_paths = ::detail::wtr::watcher::dirty_set::paths;
+  using cursor = ::detail::wtr::watcher::dirty_tree::cursor;
+  using path_id = ::detail::wtr::watcher::path_ids::id;
+  using index_snapshot = ::detail::wtr::watcher::path_index::snapshot_ptr;
+
 private:
   using sb = ::detail::wtr::watcher::semabin;
   sb living{};
+  ::detail::wtr::watcher::dirty_set dirty{};
+  ::detail::wtr::watcher::dirty_tree tree{};
+  ::detail::wtr::watcher::path_ids ids{};
+  ::detail::wtr::watcher::path_index index{};
+  ::detail::wtr::watcher::backlog_gauge gauge{};
+  std::filesystem::path const root{};
   std::future<bool> watching{};
 
+  /*  The adapters see absolute paths, in the same form
+      as the paths they report. So do our questions. */
+  static inline auto absolute_of(
+    std::filesystem::path const& base,
+    std::filesystem::path const& path) -> std::filesystem::path
+  {
+    auto ec = std::error_code{};
+    auto abs = std::filesystem::weakly_canonical(base / path, ec);
+    if (ec) abs = (base / path).lexically_normal();
+    return abs.has_filename() ? abs : abs.parent_path();
+  }
+
+  static inline auto
+  absolute_of(std::filesystem::path const& base, watch_options options)
+    -> watch_options
+  {
+    for (auto& ex : options.exclude) ex = absolute_of(base, ex);
+    for (auto& t : options.tail) t = absolute_of(base, t);
+    for (auto& f : options.files) f = absolute_of(base, f);
+    return options;
+  }
+
+  /*  A file is watched from its directory */
+  static inline auto root_of(std::filesystem::path const& path)
+    -> std::filesystem::path
+  {
+    auto ec = std::error_code{};
+    auto abs = absolute_of({}, path);
+    return std::filesystem::is_regular_file(abs, ec) ? abs.parent_path() : abs;
+  }
+
+  /*  For the adapters which don't take an inventory,
+      and for a set of files, which isn't walked */
+  static inline auto
+  inventory_of(std::filesystem::path const& base, watch_options const& opts)
+    -> void
+  {
+    namespace fs = std::filesystem;
+    using ::detail::wtr::watcher::is_excluded;
+    using pt = enum event::path_type;
+    auto evs = std::vector<event>{};
+    auto push = [&](fs::path const& p, fs::file_status st)
+    {
+      evs.emplace_back(
+        p,
+        event::effect_type::other,
+        fs::is_directory(st)      ? pt::dir
+        : fs::is_regular_file(st) ? pt::file
+        : fs::is_symlink(st)      ? pt::sym_link
+                                  : pt::other);
+      if (evs.size() >= 1024) opts.on_inventory(evs), evs.clear();
+    };
+    for (auto const& f : opts.files) {
+      auto st_ec = std::error_code{};
+      auto st = fs::symlink_status(f, st_ec);
+      if (fs::exists(st) && ! is_excluded(opts, f.native())) push(f, st);
+    }
+    auto ec = std::error_code{};
+    auto opt = fs::directory_options::skip_permission_denied;
+    using walk = fs::recursive_directory_iterator;
+    auto at = opts.files.empty() ? walk{base, opt, ec} : walk{};
+    for (; ! ec && at != walk{}; at.increment(ec)) {
+      auto st_ec = std::error_code{};
+      if (is_excluded(opts, at->path().native()))
+        at.disable_recursion_pending();
+      else
+        push(at->path(), at->symlink_status(st_ec));
+    }
+    if (! evs.empty()) opts.on_inventory(evs);
+  }
+
 public:
   inline watch(
     std::filesystem::path const& path,
-    event::callback const& callback) noexcept
-      : watching{std::async(
+    event::callback const& callback,
+    watch_options const& options) noexcept
+      : root{root_of(path)}
+      , watching{std::async(
           std::launch::async,
-          [this, path, callback]
+          [this, path, callback, options]
           {
+            using ::detail::wtr::watcher::file_set;
+            using ::detail::wtr::watcher::is_excluded;
+            using ::detail::wtr::watcher::is_too_deep;
+            using ::detail::wtr::watcher::rewrites;
+            using ::detail::wtr::watcher::tails;
+            using ::detail::wtr::watcher::adapter::has_inventory;
             using ::detail::wtr::watcher::adapter::watch;
             auto ec = std::error_code{};
-            auto abs_path = std::filesystem::absolute(path, ec);
-            auto pre_ok = ! ec && std::filesystem::is_directory(abs_path, ec)
+            auto abs_path = absolute_of({}, path);
+            auto is_file =
+              ! ec && std::filesystem::is_regular_file(abs_path, ec);
+            auto base = is_file ? abs_path.parent_path() : abs_path;
+            auto opts = absolute_of(base, options);
+            if (is_file) opts.files.push_back(absolute_of(base, abs_path));
+            auto on_inventory = [this, options](std::vector<event> const& evs)
+            {
+              this->index.push(evs);
+              if (options.on_inventory) options.on_inventory(evs);
+            };
+            if (opts.index) this->index.begin(base, opts.index_files);
+            if (opts.index) opts.on_inventory = on_inventory;
+            auto on_backlog = [this, options](backlog_stats const& st)
+            {
+              this->gauge.push(st);
+              if (options.on_backlog) options.on_backlog(st);
+            };
+            if (opts.backlog) opts.on_backlog = on_backlog;
+            auto send = [this, &callback, &opts](event const& ev)
+            {
+              if (opts.generations) this->tree.push(ev);
+              if (opts.index) this->index.push(ev);
+              if (opts.dirty)
+                this->dirty.push(ev);
+              else
+                callback(ev);
+            };
+            auto tl = tails{opts.tail};
+            auto pass = [this, &callback, &opts, &send, &tl](event const& ev)
+            {
+              auto is_tailed = ! opts.tail.empty();
+              if (ev.path_type == event::path_type::watcher)
+                callback(ev);
+              else if (is_tailed && opts.path_ids)
+                send(this->ids.stamp(tl.stamp(ev)));
+              else if (is_tailed)
+                send(tl.stamp(ev));
+              else if (opts.path_ids)
+                send(this->ids.stamp(ev));
+              else
+                send(ev);
+            };
+            auto rw = rewrites{
+              pass,
+              opts.skip_rewrites ? rewrites::worker_count() : 0};
+            auto fls = file_set{opts.files};
+            auto cb = [&opts, &pass, &rw, &fls, &base](event const& ev)
+            {
+              auto const& p = ev.path_name.native();
+              auto is_ev = ev.path_type != event::path_type::watcher;
+              if (is_ev && is_excluded(opts, p))
+                return;
+              else if (is_ev && ! fls.contains(ev))
+                return;
+              else if (is_ev && is_too_deep(opts, base.native(), p))
+                return;
+              else if (opts.skip_rewrites)
+                rw.push(ev);
+              else
+                pass(ev);
+            };
+            auto pre_ok = ! ec && std::filesystem::is_directory(base, ec)
                        && ! ec && this->living.state() == sb::state::pending;
             auto live_msg =
               (pre_ok ? "s/self/live@" : "e/self/live@") + abs_path.string();
@@ -75,7 +254,13 @@ public:
               {live_msg,
                event::effect_type::create,
                event::path_type::watcher});
-            auto post_ok = pre_ok && watch(abs_path, callback, this->living);
+            if (pre_ok && ! opts.tail.empty()) tl.begin();
+            auto is_walked = opts.files.empty();
+            if (pre_ok && opts.on_inventory && ! (has_inventory && is_walked))
+              inventory_of(base, opts);
+            if (! is_walked) opts.on_inventory = {};
+            auto post_ok = pre_ok && watch(base, cb, this->living, opts);
+            rw.close();
             auto die_msg =
               (post_ok ? "s/self/die@" : "e/self/die@") + abs_path.string();
             callback(
@@ -86,6 +271,43 @@ public:
           })}
   {}
 
+  inline watch(
+    std::filesystem::path const& path,
+    event::callback const& callback) noexcept
+      : watch(path, callback, watch_options{})
+  {}
+
+  inline auto drain() noexcept -> dirty_paths { return this->dirty.drain(); }
+
+  inline auto now() noexcept -> cursor { return this->tree.now(); }
+
+  inline auto
+  changed_since(std::filesystem::path const& path, cursor since) noexcept
+    -> bool
+  {
+    return this->tree.changed_since(absolute_of(this->root, path), since);
+  }
+
+  inline auto id_of(std::filesystem::path const& path) noexcept -> path_id
+  {
+    return this->ids.id_of(absolute_of(this->root, path));
+  }
+
+  inline auto path_of(path_id id) noexcept -> std::filesystem::path
+  {
+    return this->ids.path_of(id);
+  }
+
+  inline auto snapshot() noexcept -> index_snapshot
+  {
+    return this->index.now();
+  }
+
+  inline auto backlog() noexcept -> backlog_stats
+  {
+    return this->gauge.now();
+  }
+
   inline auto close() noexcept -> bool
   {
     return this->living.release() != sb::state::error
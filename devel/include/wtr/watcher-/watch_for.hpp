@@ -0,0 +1,92 @@
+#pragma once
+
+#include "wtr/watcher.hpp"
+#include <filesystem>
+#include <future>
+
+namespace wtr {
+inline namespace watcher {
+
+/*  Watches for a path to appear, such as a lock file
+    or a marker that something is done, whether or not
+    its parent directories exist yet.
+
+    Begins watching when constructed.
+
+    The callback is called once, with a `create` event
+    for the path, once the path exists (right away, if
+    it already does). Our messages (the events about
+    the `watcher`) are sent as they are for a `watch`.
+
+    On Linux, we only ever watch one directory: the
+    deepest one along the path which exists. We move
+    down the path as it's made. Elsewhere, we poll.
+
+    `wait()` blocks until the path exists, or until
+    we're closed. Either returns whether the path
+    appeared (and nothing went wrong).
+
+    @param path:
+      The path to watch for. Relative paths are relative
+      to the current directory, as of when we begin.
+
+    @param callback:
+      Called when the path exists. */
+class watch_for {
+  using sb = ::detail::wtr::watcher::semabin;
+  sb living{};
+  std::future<bool> watching{};
+
+public:
+  inline watch_for(
+    std::filesystem::path const& path,
+    event::callback const& callback) noexcept
+      : watching{std::async(
+          std::launch::async,
+          [this, path, callback]
+          {
+            namespace fs = std::filesystem;
+            using ::detail::wtr::watcher::wait_for;
+            using pt = enum event::path_type;
+            auto ec = std::error_code{};
+            auto abs_path = fs::absolute(path, ec).lexically_normal();
+            auto pre_ok = ! ec && this->living.state() == sb::state::pending;
+            auto live_msg =
+              (pre_ok ? "s/self/live@" : "e/self/live@") + abs_path.string();
+            callback({live_msg, event::effect_type::create, pt::watcher});
+            auto is_there = pre_ok && wait_for(abs_path, this->living);
+            if (is_there) {
+              auto st = fs::symlink_status(abs_path, ec);
+              callback(
+                {abs_path,
+                 event::effect_type::create,
+                 fs::is_directory(st)      ? pt::dir
+                 : fs::is_regular_file(st) ? pt::file
+                 : fs::is_symlink(st)      ? pt::sym_link
+                                           : pt::other});
+            }
+            auto post_ok = pre_ok && this->living.state() != sb::state::error;
+            auto die_msg =
+              (post_ok ? "s/self/die@" : "e/self/die@") + abs_path.string();
+            callback({die_msg, event::effect_type::destroy, pt::watcher});
+            return is_there && post_ok;
+          })}
+  {}
+
+  inline auto wait() noexcept -> bool
+  {
+    if (this->watching.valid()) this->watching.wait();
+    return this->close();
+  }
+
+  inline auto close() noexcept -> bool
+  {
+    return this->living.release() != sb::state::error
+        && this->watching.valid() && this->watching.get();
+  };
+
+  inline ~watch_for() noexcept { this->close(); }
+};
+
+} /*  namespace watcher */
+} /*  namespace wtr   */
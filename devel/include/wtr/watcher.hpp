@@ -5,13 +5,25 @@
 
 // clang-format off
 #include "wtr/watcher-/event.hpp"
+#include "wtr/watcher-/options.hpp"
 #include "detail/wtr/watcher/semabin.hpp"
+#include "detail/wtr/watcher/dirty.hpp"
+#include "detail/wtr/watcher/path_ids.hpp"
+#include "detail/wtr/watcher/path_index.hpp"
+#include "detail/wtr/watcher/backlog.hpp"
+#include "detail/wtr/watcher/rewrites.hpp"
+#include "detail/wtr/watcher/tails.hpp"
+#include "detail/wtr/watcher/file_set.hpp"
+#include "detail/wtr/watcher/wait_for.hpp"
 #include "detail/wtr/watcher/adapter/darwin/watch.hpp"
 #include "detail/wtr/watcher/adapter/linux/sysres.hpp"
+#include "detail/wtr/watcher/adapter/linux/poll.hpp"
+#include "detail/wtr/watcher/adapter/linux/ring.hpp"
 #include "detail/wtr/watcher/adapter/linux/fanotify/watch.hpp"
 #include "detail/wtr/watcher/adapter/linux/inotify/watch.hpp"
 #include "detail/wtr/watcher/adapter/linux/watch.hpp"
 #include "detail/wtr/watcher/adapter/windows/watch.hpp"
 #include "detail/wtr/watcher/adapter/warthog/watch.hpp"
 #include "wtr/watcher-/watch.hpp"
+#include "wtr/watcher-/watch_for.hpp"
 // clang-format on
@@ -2,9 +2,16 @@
 #include "test_watcher/event.hpp"
 #include "test_watcher/test_watcher.hpp"
 #include "wtr/watcher.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 /* Test that files are scanned */
 TEST_CASE(
@@ -22,3 +29,85 @@ TEST_CASE(
     event_count_per_watcher,
     concurrency_level));
 };
+
+/* Test that a tree split across shards is reported on
+   once, and that a renamed directory keeps its shard */
+TEST_CASE("Shards", "[concurrent][file][dir][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Shards";
+  static constexpr auto dir_count = 8;
+  auto const tmpdir = make_local_tmp_dir();
+  auto const r = tmpdir / "r.txt";
+  auto const d0 = tmpdir / "d0";
+  auto const e0 = tmpdir / "e0";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  for (int i = 0; i < dir_count; ++i)
+    REQUIRE(fs::create_directory(tmpdir / ("d" + std::to_string(i))));
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    },
+    watch_options{.shards = 4});
+
+  std::this_thread::sleep_for(100ms);
+
+  auto files = std::vector<fs::path>{r};
+  for (int i = 0; i < dir_count; ++i) {
+    auto d = tmpdir / ("d" + std::to_string(i));
+    files.push_back(d / "f.txt");
+    files.push_back(d / "s" / "f.txt");
+    REQUIRE(fs::create_directory(d / "s"));
+  }
+  std::this_thread::sleep_for(100ms);
+  for (auto const& f : files) REQUIRE((std::ofstream{f} << "hi").good());
+  std::this_thread::sleep_for(100ms);
+  fs::rename(d0, e0);
+  std::this_thread::sleep_for(100ms);
+  files.push_back(e0 / "s" / "g.txt");
+  REQUIRE((std::ofstream{files.back()} << "hi").good());
+
+  auto count_of = [&](fs::path const& p, enum event::effect_type et)
+  {
+    auto n = 0;
+    for (auto const& ev : event_recv_list)
+      n += ev.path_name == p && ev.effect_type == et;
+    return n;
+  };
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    if (count_of(files.back(), event::effect_type::create)) break;
+  }
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  for (auto const& f : files)
+    CHECK(count_of(f, event::effect_type::create) == 1);
+  REQUIRE(count_of(d0, event::effect_type::rename) == 1);
+  for (auto const& ev : event_recv_list)
+    if (ev.path_name == d0 && ev.effect_type == event::effect_type::rename) {
+      REQUIRE(ev.associated);
+      CHECK(ev.associated->path_name == e0);
+    }
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
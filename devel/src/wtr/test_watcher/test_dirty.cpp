@@ -0,0 +1,438 @@
+#include "snitch/snitch.hpp"
+#include "test_watcher/test_watcher.hpp"
+#include "wtr/watcher.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Test that a dirty watcher keeps each path which changed
+   once, with its strongest effect, until it's drained */
+TEST_CASE("Dirty", "[dir][file][dirty][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 3;
+  static constexpr auto title = "Dirty";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const path_of = [&](int i)
+  { return tmpdir / ("file" + std::to_string(i) + ".txt"); };
+  auto const has_all = [&](watch::dirty_paths const& paths)
+  {
+    for (int i = 0; i < path_count; i++)
+      if (! paths.count(path_of(i))) return false;
+    return true;
+  };
+  /*  A path's events may be split between two drains.
+      The later modifications don't matter to us. */
+  auto const is_drained = [&](watch& w, watch::dirty_paths& into)
+  {
+    for (int i = 0; i < 100 && ! has_all(into); i++) {
+      for (auto& [path, et] : w.drain())
+        if (et != event::effect_type::modify || ! into.count(path))
+          into.insert_or_assign(path, et);
+      std::this_thread::sleep_for(10ms);
+    }
+    return has_all(into);
+  };
+  auto only_msgs = std::atomic<bool>{true};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type != event::path_type::watcher) only_msgs = false;
+    },
+    watch_options{.dirty = true});
+
+  std::this_thread::sleep_for(10ms);
+
+  for (int i = 0; i < path_count; i++)
+    for (int j = 0; j < 10; j++)
+      std::ofstream{path_of(i), std::ios::app} << "hello";
+
+  auto created = watch::dirty_paths{};
+  REQUIRE(is_drained(lifetime, created));
+  for (int i = 0; i < path_count; i++)
+    CHECK(created[path_of(i)] == event::effect_type::create);
+
+  for (int i = 0; i < path_count; i++) {
+    std::ofstream{path_of(i), std::ios::app} << "hello";
+    fs::remove(path_of(i));
+  }
+
+  auto destroyed = watch::dirty_paths{};
+  REQUIRE(is_drained(lifetime, destroyed));
+  for (int i = 0; i < path_count; i++)
+    CHECK(destroyed[path_of(i)] == event::effect_type::destroy);
+
+  REQUIRE(lifetime.close());
+  REQUIRE(lifetime.drain().empty());
+  REQUIRE(only_msgs);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/* Test that we can ask whether anything beneath a path
+   changed since some point in time */
+TEST_CASE("Generations", "[dir][file][dirty][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Generations";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const is_changed = [](watch& w, fs::path const& p, watch::cursor c)
+  {
+    for (int i = 0; i < 100 && ! w.changed_since(p, c); i++)
+      std::this_thread::sleep_for(10ms);
+    return w.changed_since(p, c);
+  };
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  for (auto pkg : {"pkg0", "pkg1/sub", "pkg2/sub"})
+    REQUIRE(fs::create_directories(tmpdir / pkg));
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+    },
+    watch_options{.generations = true});
+
+  std::this_thread::sleep_for(10ms);
+
+  auto const before_write = lifetime.now();
+  std::ofstream{tmpdir / "pkg1/sub/file.txt"} << "hello";
+
+  REQUIRE(is_changed(lifetime, "pkg1", before_write));
+  CHECK(lifetime.changed_since("pkg1/sub/file.txt", before_write));
+  CHECK(lifetime.changed_since(tmpdir / "pkg1/sub", before_write));
+  CHECK(! lifetime.changed_since("pkg0", before_write));
+  CHECK(! lifetime.changed_since("pkg2", before_write));
+
+  std::this_thread::sleep_for(100ms);
+
+  auto const before_rename = lifetime.now();
+  fs::rename(tmpdir / "pkg2", tmpdir / "pkg3");
+
+  REQUIRE(is_changed(lifetime, "pkg3", before_rename));
+  CHECK(lifetime.changed_since("pkg2/sub", before_rename));
+  CHECK(! lifetime.changed_since("pkg1", before_rename));
+  CHECK(lifetime.changed_since("pkg1", before_write));
+
+  REQUIRE(lifetime.close());
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/* Test that destroyed paths are forgotten, but that we
+   can still ask whether they changed */
+TEST_CASE("Generations churn", "[dir][file][dirty][not-perf]")
+{
+  using namespace wtr::watcher;
+  using et = enum event::effect_type;
+  using pt = enum event::path_type;
+
+  std::cerr << "Generations churn" << std::endl;
+
+  auto tree = detail::wtr::watcher::dirty_tree{};
+  tree.push(event{"/tmp/build", et::create, pt::dir});
+  auto const known = tree.size();
+
+  auto const before = tree.now();
+  for (int i = 0; i < 100; i++) {
+    auto const p = "/tmp/build/" + std::to_string(i) + ".o";
+    tree.push(event{p, et::create, pt::file});
+    tree.push(event{p, et::modify, pt::file});
+    tree.push(event{p, et::destroy, pt::file});
+  }
+  auto const after = tree.now();
+
+  CHECK(tree.size() == known);
+  CHECK(tree.changed_since("/tmp/build/7.o", before));
+  CHECK(tree.changed_since("/tmp/build", before));
+  CHECK(! tree.changed_since("/tmp/build/7.o", after));
+  CHECK(! tree.changed_since("/tmp/other", before));
+
+  tree.push(event{"/tmp/build/sub/file", et::create, pt::file});
+  tree.push(event{"/tmp/build/sub", et::destroy, pt::dir});
+  CHECK(tree.size() == known + 2);
+  tree.push(event{"/tmp/build/sub/file", et::destroy, pt::file});
+  tree.push(event{"/tmp/build/sub", et::destroy, pt::dir});
+  CHECK(tree.size() == known);
+};
+
+/* Test that paths are given small numbers, which are
+   reused after they're destroyed and kept on renames */
+TEST_CASE("Path ids", "[dir][file][ids][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Path ids";
+  auto const tmpdir = make_local_tmp_dir();
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+  auto const id_of = [&](fs::path const& p, enum event::effect_type et)
+  {
+    for (int i = 0; i < 100; i++) {
+      {
+        auto _ = std::scoped_lock{event_recv_list_mtx};
+        for (auto const& ev : event_recv_list)
+          if (ev.path_name == p && ev.effect_type == et) return ev.path_id;
+      }
+      std::this_thread::sleep_for(10ms);
+    }
+    return event::no_path_id;
+  };
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    },
+    watch_options{.path_ids = true});
+
+  std::this_thread::sleep_for(10ms);
+
+  std::ofstream{tmpdir / "a.txt"};
+  std::ofstream{tmpdir / "b.txt"};
+  auto const a = id_of(tmpdir / "a.txt", event::effect_type::create);
+  auto const b = id_of(tmpdir / "b.txt", event::effect_type::create);
+  REQUIRE(a != event::no_path_id);
+  REQUIRE(b != event::no_path_id);
+  CHECK(a != b);
+  CHECK(lifetime.id_of("b.txt") == b);
+  CHECK(lifetime.path_of(b) == tmpdir / "b.txt");
+
+  fs::remove(tmpdir / "a.txt");
+  CHECK(id_of(tmpdir / "a.txt", event::effect_type::destroy) == a);
+  CHECK(lifetime.id_of("a.txt") == event::no_path_id);
+
+  std::ofstream{tmpdir / "c.txt"};
+  CHECK(id_of(tmpdir / "c.txt", event::effect_type::create) == a);
+
+  fs::rename(tmpdir / "b.txt", tmpdir / "d.txt");
+  CHECK(id_of(tmpdir / "b.txt", event::effect_type::rename) == b);
+  CHECK(lifetime.id_of("d.txt") == b);
+
+  REQUIRE(lifetime.close());
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/* Test that the index begins with what's in the tree and
+   keeps up with what changes */
+TEST_CASE("Index", "[dir][file][index][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Index";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const is_eventually = [](auto const& f)
+  {
+    for (int i = 0; i < 100 && ! f(); i++) std::this_thread::sleep_for(10ms);
+    return f();
+  };
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directories(tmpdir / "a/b"));
+  REQUIRE((std::ofstream{tmpdir / "a/file.txt"} << "").good());
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+    },
+    watch_options{.index = true, .index_files = true});
+
+  REQUIRE(is_eventually([&] { return lifetime.snapshot() != nullptr; }));
+  auto const first = lifetime.snapshot();
+  CHECK(first->size() == 3);
+  CHECK(first->contains("a/b"));
+  CHECK(first->contains(tmpdir / "a/file.txt"));
+  CHECK(first->within("a").size() == 2);
+
+  REQUIRE(fs::create_directory(tmpdir / "c"));
+  std::this_thread::sleep_for(50ms);
+  std::ofstream{tmpdir / "c/file.txt"};
+  fs::rename(tmpdir / "a", tmpdir / "d");
+
+  REQUIRE(is_eventually(
+    [&]
+    {
+      auto now = lifetime.snapshot();
+      return now->contains("d/b") && now->contains("c/file.txt");
+    }));
+  auto const moved = lifetime.snapshot();
+  CHECK(! moved->contains("a"));
+  CHECK(moved->contains("d/file.txt"));
+  CHECK(moved->below(".").size() == 5);
+  CHECK(first->contains("a/b"));
+
+  fs::remove_all(tmpdir / "c");
+
+  REQUIRE(is_eventually([&] { return ! lifetime.snapshot()->contains("c"); }));
+  CHECK(lifetime.snapshot()->size() == 3);
+
+  REQUIRE(lifetime.close());
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/* Test that a large index stays in order as it changes,
+   and that the snapshots we hold onto don't change */
+TEST_CASE("Index churn", "[dir][file][index][not-perf]")
+{
+  using namespace wtr::watcher;
+  using et = enum event::effect_type;
+  using pt = enum event::path_type;
+
+  std::cerr << "Index churn" << std::endl;
+
+  auto const sep = std::string{std::filesystem::path::preferred_separator};
+  auto const root = sep + "root";
+  auto const name_of = [&](char const* dir, int i)
+  { return root + sep + dir + sep + std::to_string(i); };
+  auto index = detail::wtr::watcher::path_index{};
+  index.begin(root, true);
+
+  for (auto dir : {"a", "b", "c"}) {
+    index.push(event{root + sep + dir, et::create, pt::dir});
+    for (int i = 0; i < 1000; i++)
+      index.push(event{name_of(dir, i), et::create, pt::file});
+  }
+  auto const first = index.now();
+  REQUIRE(first->size() == 3003);
+  CHECK(first->within("b").size() == 1000);
+
+  index.push(event{
+    event{root + sep + "b", et::rename, pt::dir},
+    event{root + sep + "d", et::rename, pt::dir}});
+  index.push(event{root + sep + "a", et::destroy, pt::dir});
+  index.push(event{name_of("c", 7), et::destroy, pt::file});
+  auto const next = index.now();
+
+  CHECK(next->size() == 2001);
+  CHECK(! next->contains("a/7"));
+  CHECK(! next->contains("b"));
+  CHECK(next->contains("d/999"));
+  CHECK(next->below("d").size() == 1000);
+  CHECK(! next->contains("c/7"));
+  CHECK(next->within(".").size() == 2);
+
+  CHECK(first->size() == 3003);
+  CHECK(first->contains("a/7"));
+  CHECK(first->contains("c/7"));
+  CHECK(first->below("b").size() == 1000);
+  CHECK(! first->contains("d"));
+};
+
+/* Test that the inventory has everything which was there
+   when we began, and that it comes before any change */
+TEST_CASE("Inventory", "[dir][file][inventory][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Inventory";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const excluded = tmpdir / "excluded";
+  auto seen = std::vector<std::string>{};
+  auto seen_mtx = std::mutex{};
+  auto is_changed = std::atomic<bool>{false};
+  auto is_late = std::atomic<bool>{false};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directories(tmpdir / "a/b"));
+  REQUIRE(fs::create_directory(excluded));
+  REQUIRE((std::ofstream{tmpdir / "a/file.txt"} << "").good());
+  REQUIRE((std::ofstream{excluded / "file.txt"} << "").good());
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type != event::path_type::watcher) is_changed = true;
+    },
+    watch_options{
+      .exclude = {"excluded"},
+      .on_inventory =
+        [&](std::vector<event> const& evs)
+      {
+        auto _ = std::scoped_lock{seen_mtx};
+        if (is_changed) is_late = true;
+        for (auto const& ev : evs) {
+          CHECK(ev.effect_type == event::effect_type::other);
+          seen.push_back(ev.path_name.lexically_relative(tmpdir).string());
+        }
+      }});
+
+  std::this_thread::sleep_for(100ms);
+  std::ofstream{tmpdir / "a/b/file.txt"};
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  std::sort(seen.begin(), seen.end());
+  auto const sep = std::string{fs::path::preferred_separator};
+  auto const want = std::vector<std::string>{
+    "a",
+    "a" + sep + "b",
+    "a" + sep + "file.txt",
+  };
+  CHECK(seen == want);
+  CHECK(! is_late);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
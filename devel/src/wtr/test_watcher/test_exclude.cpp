@@ -0,0 +1,205 @@
+#include "snitch/snitch.hpp"
+#include "test_watcher/test_watcher.hpp"
+#include "wtr/watcher.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+#include <fcntl.h>
+#include <linux/version.h>
+#include <sys/fanotify.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/* Test that excluded paths, and everything beneath them,
+   never reach the callback */
+TEST_CASE("Exclude", "[dir][file][exclude][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 3;
+  static constexpr auto title = "Exclude";
+  static auto verbose = is_verbose();
+  auto const tmpdir = make_local_tmp_dir();
+  auto const kept = tmpdir / "kept";
+  auto const excluded_dir = tmpdir / "excluded";
+  auto const excluded_file = kept / "excluded.txt";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+  auto event_sent_list = std::vector<event>{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directory(kept));
+  REQUIRE(fs::create_directory(excluded_dir));
+  REQUIRE((std::ofstream{excluded_file} << "").good());
+
+  std::this_thread::sleep_for(100ms);
+
+  event_sent_list.push_back(
+    {std::string("s/self/live@").append(tmpdir.string()),
+     event::effect_type::create,
+     event::path_type::watcher});
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+#ifdef _WIN32
+      if (
+        ev.path_type == wtr::event::path_type::dir
+        && ev.effect_type == wtr::event::effect_type::modify)
+        return;
+#endif
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      if (verbose) std::cerr << ev << std::endl;
+      event_recv_list.push_back(ev);
+    },
+    watch_options{.exclude = {"excluded", excluded_file}});
+
+  std::this_thread::sleep_for(10ms);
+
+  for (int i = 0; i < path_count; i++) {
+    auto const name = "file" + std::to_string(i) + ".txt";
+    auto const new_dir_path = excluded_dir / ("dir" + std::to_string(i));
+    REQUIRE(fs::create_directory(new_dir_path));
+    std::ofstream{new_dir_path / name} << "hello";
+    std::ofstream{excluded_dir / name} << "hello";
+    std::ofstream{excluded_file, std::ios::app} << "hello";
+    std::this_thread::sleep_for(10ms);
+    std::ofstream{kept / name};
+    event_sent_list.push_back(
+      event{kept / name, event::effect_type::create, event::path_type::file});
+    std::this_thread::sleep_for(10ms);
+  }
+
+  for (int i = 0;; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock<std::mutex>{event_recv_list_mtx};
+    if (event_sent_list.size() <= event_recv_list.size()) break;
+    if (i > 100) break;
+  }
+
+  event_sent_list.push_back(
+    {std::string("s/self/die@").append(tmpdir.string()),
+     event::effect_type::destroy,
+     event::path_type::watcher});
+
+  auto dead = lifetime.close();
+
+  REQUIRE(dead);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+
+  check_event_lists_eq(event_sent_list, event_recv_list);
+};
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+#if (KERNEL_VERSION(5, 9, 0) <= LINUX_VERSION_CODE) && ! __ANDROID_API__
+
+/* Test that, with `exclude_self`, our own changes never
+   reach the callback, while another process's do. Only
+   the fanotify adapter knows who made a change, so we
+   skip this where we can't have fanotify. */
+TEST_CASE("Exclude self", "[file][exclude][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 3;
+  static constexpr auto title = "Exclude self";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const theirs = tmpdir / "theirs.txt";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+
+  using ke_t = detail::wtr::watcher::adapter::fanotify::ke_fa_ev;
+  int probe_fd = fanotify_init(ke_t::init_flags_unprivileged, 0);
+  auto is_fa = probe_fd >= 0
+            && fanotify_mark(
+                 probe_fd,
+                 FAN_MARK_ADD,
+                 ke_t::recv_flags,
+                 AT_FDCWD,
+                 tmpdir.c_str())
+                 == 0;
+  if (probe_fd >= 0) close(probe_fd);
+  if (! is_fa) {
+    REQUIRE(fs::remove_all(tmpdir));
+    std::cerr << title << ": fanotify isn't allowed here, skipped\n";
+    return;
+  }
+
+  auto watcher = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    },
+    watch_options{.exclude_self = true});
+
+  std::this_thread::sleep_for(100ms);
+
+  for (int i = 0; i < path_count; i++) {
+    auto const ours = tmpdir / ("ours" + std::to_string(i) + ".txt");
+    std::ofstream{ours} << "hello";
+    fs::rename(ours, tmpdir / ("renamed" + std::to_string(i) + ".txt"));
+  }
+  fs::create_directory(tmpdir / "dir");
+
+  /*  Someone else, so that we know when we're done */
+  if (auto pid = fork(); pid == 0) {
+    int fd = open(theirs.c_str(), O_CREAT | O_WRONLY, 0644);
+    _exit(fd < 0);
+  }
+  else {
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+  }
+
+  auto const real_theirs = fs::canonical(theirs);
+  auto is_done = [&]
+  {
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    for (auto const& ev : event_recv_list)
+      if (ev.path_name == real_theirs) return true;
+    return false;
+  };
+  for (int i = 0; i < 100 && ! is_done(); i++)
+    std::this_thread::sleep_for(10ms);
+
+  REQUIRE(watcher.close());
+
+  CHECK(is_done());
+  for (auto const& ev : event_recv_list) CHECK(ev.path_name == real_theirs);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#endif
+
+#endif
@@ -0,0 +1,274 @@
+#include "snitch/snitch.hpp"
+#include "test_watcher/test_watcher.hpp"
+#include "wtr/watcher.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Test that only the files in a set are reported on,
+   and that they're all in the inventory */
+TEST_CASE("File set", "[file][files][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "File set";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const x = tmpdir / "a" / "x.txt";
+  auto const y = tmpdir / "b" / "y.txt";
+  auto const z = tmpdir / "a" / "z.txt";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+  auto inventory = std::vector<fs::path>{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directories(tmpdir / "a"));
+  REQUIRE(fs::create_directories(tmpdir / "b"));
+  for (auto const& p : {x, y, z}) REQUIRE((std::ofstream{p} << "").good());
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    },
+    watch_options{
+      .on_inventory =
+        [&](std::vector<event> const& evs)
+      {
+        for (auto const& ev : evs) inventory.push_back(ev.path_name);
+      },
+      .files = {"a/x.txt", "b/y.txt"},
+    });
+
+  std::this_thread::sleep_for(100ms);
+
+  for (auto const& p : {z, x, y}) REQUIRE((std::ofstream{p} << "hi").good());
+  REQUIRE(fs::create_directories(tmpdir / "a" / "c"));
+  REQUIRE((std::ofstream{tmpdir / "a" / "c" / "x.txt"} << "hi").good());
+
+  auto is_seen = [&](fs::path const& p)
+  {
+    for (auto const& ev : event_recv_list)
+      if (ev.path_name == p) return true;
+    return false;
+  };
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    if (is_seen(x) && is_seen(y)) break;
+  }
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  CHECK(is_seen(x));
+  CHECK(is_seen(y));
+  for (auto const& ev : event_recv_list)
+    CHECK((ev.path_name == x || ev.path_name == y));
+
+  REQUIRE(inventory.size() == 2);
+  CHECK(inventory[0] == x);
+  CHECK(inventory[1] == y);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/* Test that a file can be watched on its own */
+TEST_CASE("Single file", "[file][files][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Single file";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const x = tmpdir / "x.txt";
+  auto const z = tmpdir / "z.txt";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+  auto is_live = false;
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE((std::ofstream{x} << "").good());
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    x,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      if (ev.path_type == event::path_type::watcher)
+        is_live = is_live || ev.path_name.string().find("s/self/live@") == 0;
+      else
+        event_recv_list.push_back(ev);
+    });
+
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE((std::ofstream{z} << "hi").good());
+  REQUIRE((std::ofstream{x} << "hi").good());
+
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    if (! event_recv_list.empty()) break;
+  }
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  CHECK(is_live);
+  REQUIRE(! event_recv_list.empty());
+  for (auto const& ev : event_recv_list) CHECK(ev.path_name == x);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/* Test that nothing deeper than we were asked to watch
+   is reported on, even in new directories */
+TEST_CASE("Max depth", "[dir][file][files][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Max depth";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const x = tmpdir / "x.txt";
+  auto const c = tmpdir / "c";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directories(tmpdir / "a" / "b"));
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    },
+    watch_options{.max_depth = 0});
+
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE((std::ofstream{tmpdir / "a" / "y.txt"} << "hi").good());
+  REQUIRE((std::ofstream{tmpdir / "a" / "b" / "z.txt"} << "hi").good());
+  REQUIRE(fs::create_directory(c));
+  std::this_thread::sleep_for(100ms);
+  REQUIRE((std::ofstream{c / "w.txt"} << "hi").good());
+  REQUIRE((std::ofstream{x} << "hi").good());
+
+  auto is_seen = [&](fs::path const& p)
+  {
+    for (auto const& ev : event_recv_list)
+      if (ev.path_name == p) return true;
+    return false;
+  };
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    if (is_seen(x) && is_seen(c)) break;
+  }
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  CHECK(is_seen(x));
+  CHECK(is_seen(c));
+  for (auto const& ev : event_recv_list)
+    CHECK((ev.path_name == x || ev.path_name == c));
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/* Test that the depth is counted from where the path
+   leads, when we watch it through a symlink */
+TEST_CASE("Max depth symlink", "[dir][file][files][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Max depth symlink";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const real = tmpdir / "real";
+  auto const link = tmpdir / "link";
+  auto names = std::vector<fs::path>{};
+  auto names_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directories(real / "a" / "b"));
+  auto ec = std::error_code{};
+  fs::create_directory_symlink(real, link, ec);
+  REQUIRE(! ec);
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    link,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{names_mtx};
+      names.push_back(ev.path_name.filename());
+    },
+    watch_options{.max_depth = 0});
+
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE((std::ofstream{real / "a" / "b" / "z.txt"} << "hi").good());
+  REQUIRE((std::ofstream{real / "a" / "y.txt"} << "hi").good());
+  std::this_thread::sleep_for(100ms);
+  REQUIRE((std::ofstream{real / "x.txt"} << "hi").good());
+
+  auto is_seen = [&](fs::path const& name)
+  {
+    auto _ = std::scoped_lock{names_mtx};
+    for (auto const& n : names)
+      if (n == name) return true;
+    return false;
+  };
+  for (int i = 0; i < 100 && ! is_seen("x.txt"); i++)
+    std::this_thread::sleep_for(10ms);
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  CHECK(is_seen("x.txt"));
+  for (auto const& n : names) CHECK(n == "x.txt");
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
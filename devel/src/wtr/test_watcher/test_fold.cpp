@@ -0,0 +1,214 @@
+#include "snitch/snitch.hpp"
+#include "test_watcher/test_watcher.hpp"
+#include "wtr/watcher.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+
+/* Test that a directory which was destroyed, along with
+   everything beneath it, is one event in the fold mode */
+TEST_CASE("Fold", "[dir][file][fold][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 3;
+  static constexpr auto title = "Fold";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const top = tmpdir / "a";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directories(top / "b"));
+  for (int i = 0; i < path_count; i++) {
+    auto const name = "file" + std::to_string(i) + ".txt";
+    REQUIRE((std::ofstream{top / name} << "").good());
+    REQUIRE((std::ofstream{top / "b" / name} << "").good());
+  }
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    },
+    watch_options{.fold = true});
+
+  std::this_thread::sleep_for(10ms);
+
+  REQUIRE(fs::remove_all(top) == path_count * 2 + 2);
+
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    if (! event_recv_list.empty()) break;
+  }
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  REQUIRE(event_recv_list.size() == 1);
+  auto const& ev = event_recv_list.front();
+  CHECK(ev.path_name == top);
+  CHECK(ev.effect_type == event::effect_type::destroy);
+  CHECK(ev.path_type == event::path_type::dir);
+  CHECK(ev.folded == path_count * 2 + 1);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#endif
+
+/* Test that what happens beneath a renamed directory is
+   reported by its new name */
+TEST_CASE("Renamed directories", "[dir][file][fold][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Renamed directories";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const from = tmpdir / "from";
+  auto const to = tmpdir / "to";
+  auto const file = to / "sub" / "file.txt";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+  auto const has_file = [&]
+  {
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    for (auto const& ev : event_recv_list)
+      if (ev.path_name == file) return true;
+    return false;
+  };
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directories(from / "sub"));
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    });
+
+  std::this_thread::sleep_for(10ms);
+
+  fs::rename(from, to);
+  std::this_thread::sleep_for(100ms);
+  REQUIRE((std::ofstream{file} << "hello").good());
+
+  for (int i = 0; i < 100 && ! has_file(); i++)
+    std::this_thread::sleep_for(10ms);
+
+  REQUIRE(lifetime.close());
+
+  CHECK(has_file());
+  for (auto const& ev : event_recv_list)
+    CHECK(ev.path_name.parent_path() != from / "sub");
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#if defined(__linux__)
+
+/* Test that a new directory is sent ahead of the writes
+   we read along with it in the dirs-first mode, and that
+   each path's events are still in order */
+TEST_CASE("Dirs first", "[dir][file][fold][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 50;
+  static constexpr auto title = "Dirs first";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const dir = tmpdir / "new";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+  auto name_of = [&](int i) { return tmpdir / ("file" + std::to_string(i)); };
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  for (int i = 0; i <= path_count; i++)
+    REQUIRE((std::ofstream{name_of(i)} << "").good());
+
+  std::this_thread::sleep_for(100ms);
+
+  /*  We're slow to take the first event, so that what
+      happens meanwhile is read all at once */
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+      if (event_recv_list.size() == 1) std::this_thread::sleep_for(200ms);
+    },
+    watch_options{.dirs_first = true});
+
+  std::this_thread::sleep_for(10ms);
+
+  REQUIRE((std::ofstream{name_of(0)} << "hi").good());
+  std::this_thread::sleep_for(50ms);
+  for (int i = 1; i <= path_count; i++)
+    REQUIRE((std::ofstream{name_of(i)} << "hi").good());
+  REQUIRE(fs::create_directory(dir));
+  REQUIRE((std::ofstream{name_of(1)} << "again").good());
+
+  auto index_of = [&](fs::path const& p, size_t from = 0)
+  {
+    for (auto i = from; i < event_recv_list.size(); i++)
+      if (event_recv_list[i].path_name == p) return i;
+    return event_recv_list.size();
+  };
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    if (index_of(dir) < event_recv_list.size()) break;
+  }
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  auto dir_at = index_of(dir);
+  REQUIRE(dir_at < event_recv_list.size());
+  CHECK(event_recv_list[dir_at].effect_type == event::effect_type::create);
+  CHECK(dir_at < index_of(name_of(path_count)));
+  for (int i = 1; i <= path_count; i++)
+    CHECK(index_of(name_of(i)) < event_recv_list.size());
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#endif
@@ -0,0 +1,267 @@
+#include "snitch/snitch.hpp"
+#include "test_watcher/test_watcher.hpp"
+#include "wtr/watcher.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+
+#include <linux/version.h>
+#include <sys/fanotify.h>
+#include <unistd.h>
+
+/* Test that a subtree which we poll, instead of asking
+   the kernel about, has its creations, modifications
+   and destructions reported. We hand the subtree to
+   the poller directly, as the adapters do for the
+   filesystems (or the limits) which need it. */
+TEST_CASE("Poll", "[dir][file][poll][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+  using namespace detail::wtr::watcher::adapter;
+
+  static constexpr auto title = "Poll";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const root = tmpdir / "polled";
+  auto const file = root / "file.txt";
+  auto const dir = root / "dir";
+  auto event_recv_list = std::vector<event>{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directory(root));
+  auto const real_root = fs::canonical(root);
+  auto const real_file = real_root / "file.txt";
+  auto const real_dir = real_root / "dir";
+
+  auto cb = [&](event const& ev)
+  {
+    if (is_verbose()) std::cerr << ev << std::endl;
+    event_recv_list.push_back(ev);
+  };
+  auto is_seen = [&](fs::path const& p, enum event::effect_type et)
+  {
+    for (auto const& ev : event_recv_list)
+      if (ev.path_name == p && ev.effect_type == et) return true;
+    return false;
+  };
+  auto pl = make_pl();
+  auto scan = [&]
+  {
+    std::this_thread::sleep_for(10ms);
+    event_recv_list.clear();
+    return do_poll_recv(cb, pl);
+  };
+
+  REQUIRE(pl.fd >= 0);
+  CHECK(do_poll_mark(real_root.c_str(), pl, cb) == result::w_sys_polled);
+  auto polled_msg = "w/sys/polled@" + real_root.string();
+  CHECK(is_seen(polled_msg, event::effect_type::other));
+
+  std::ofstream(file).close();
+  REQUIRE(fs::create_directory(dir));
+  CHECK(scan() == result::pending);
+  CHECK(is_seen(real_file, event::effect_type::create));
+  CHECK(is_seen(real_dir, event::effect_type::create));
+
+  /*  The size changes too, in case the timestamps
+      are too coarse to tell us */
+  std::ofstream(file) << "something";
+  CHECK(scan() == result::pending);
+  CHECK(is_seen(real_file, event::effect_type::modify));
+  CHECK(! is_seen(real_dir, event::effect_type::modify));
+
+  REQUIRE(fs::remove(file));
+  REQUIRE(fs::remove(dir));
+  CHECK(scan() == result::pending);
+  CHECK(is_seen(real_file, event::effect_type::destroy));
+  CHECK(is_seen(real_dir, event::effect_type::destroy));
+
+  CHECK(scan() == result::pending);
+  CHECK(event_recv_list.empty());
+
+  close(pl.fd);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#if (KERNEL_VERSION(5, 9, 0) <= LINUX_VERSION_CODE) && ! __ANDROID_API__
+
+/* Test that the fanotify adapter can be had, with or
+   without root, wherever the kernel lets anyone have
+   fanotify (5.13 and later, unprivileged), and that
+   changes reach us through it. */
+TEST_CASE("Fanotify", "[dir][file][fanotify][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+  using namespace detail::wtr::watcher::adapter;
+
+  static constexpr auto title = "Fanotify";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const file = tmpdir / "file.txt";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  int probe_fd = fanotify_init(
+    fanotify::ke_fa_ev::init_flags_unprivileged,
+    fanotify::ke_fa_ev::init_io_flags);
+  if (probe_fd < 0) {
+    std::cerr << title << ": fanotify isn't allowed here, skipped\n";
+    return;
+  }
+  close(probe_fd);
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  auto const real_file = fs::canonical(tmpdir) / "file.txt";
+
+  auto cb = [&](event const& ev)
+  {
+    if (is_verbose()) std::cerr << ev << std::endl;
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    event_recv_list.push_back(ev);
+  };
+  auto is_seen = [&](fs::path const& p, enum event::effect_type et)
+  {
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    for (auto const& ev : event_recv_list)
+      if (ev.path_name == p && ev.effect_type == et) return true;
+    return false;
+  };
+
+  /*  The adapter we'd use, as whoever we're running as.
+      Without root, the kernel refuses the privileged
+      flags, and we do without them. */
+  if (geteuid() != 0) {
+    int fd = fanotify_init(
+      fanotify::ke_fa_ev::init_flags,
+      fanotify::ke_fa_ev::init_io_flags);
+    CHECK(fd < 0);
+    if (fd >= 0) close(fd);
+  }
+  {
+    auto living = detail::wtr::watcher::semabin{};
+    auto sr = fanotify::make_sysres(
+      tmpdir.c_str(),
+      cb,
+      living,
+      watch_options{},
+      shard{});
+    CHECK(sr.ok == result::pending);
+    CHECK(sr.ke.dm.size() == 1);
+    if (sr.ok < result::e)
+      close(sr.ke.fd), close(sr.pl.fd), close(sr.ep.fd);
+  }
+
+  auto watcher = wtr::watch(tmpdir, cb);
+
+  std::this_thread::sleep_for(100ms);
+
+  /*  fanotify merges what happens to a path while it
+      waits for us, so we give it a moment in between */
+  std::ofstream(file).close();
+  std::this_thread::sleep_for(50ms);
+  std::ofstream(file) << "something";
+  std::this_thread::sleep_for(50ms);
+  REQUIRE(fs::remove(file));
+
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    if (is_seen(real_file, event::effect_type::destroy)) break;
+  }
+
+  REQUIRE(watcher.close());
+
+  CHECK(is_seen(real_file, event::effect_type::create));
+  CHECK(is_seen(real_file, event::effect_type::modify));
+  CHECK(is_seen(real_file, event::effect_type::destroy));
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/* Test that, through fanotify, a rename arrives as one
+   event, with the new name in its `associated` event,
+   both within a directory and between two of them. We
+   read from the adapter directly, so that we know it's
+   fanotify which we're hearing from. */
+TEST_CASE("Fanotify rename", "[dir][file][fanotify][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+  using namespace detail::wtr::watcher::adapter;
+
+  static constexpr auto title = "Fanotify rename";
+  auto const tmpdir = make_local_tmp_dir();
+  auto event_recv_list = std::vector<event>{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  auto const real = fs::canonical(tmpdir);
+  REQUIRE(fs::create_directory(real / "a"));
+  REQUIRE(fs::create_directory(real / "b"));
+  std::ofstream(real / "a" / "x").close();
+
+  auto cb = [&](event const& ev)
+  {
+    if (is_verbose()) std::cerr << ev << std::endl;
+    if (ev.path_type != event::path_type::watcher)
+      event_recv_list.push_back(ev);
+  };
+  auto living = detail::wtr::watcher::semabin{};
+  auto sr =
+    fanotify::make_sysres(real.c_str(), cb, living, watch_options{}, shard{});
+  if (sr.ok != result::pending) {
+    std::cerr << title << ": fanotify isn't allowed here, skipped\n";
+    return;
+  }
+
+  auto renames_of = [&](fs::path const& from, fs::path const& to)
+  {
+    event_recv_list.clear();
+    fs::rename(from, to);
+    /*  Reading when there's nothing to read is an error,
+        which the adapter never does, but we may */
+    for (int i = 0; i < 100 && event_recv_list.empty(); i++) {
+      std::this_thread::sleep_for(10ms);
+      fanotify::do_ev_recv(cb, sr);
+    }
+    std::this_thread::sleep_for(10ms);
+    fanotify::do_ev_recv(cb, sr);
+    auto n = 0;
+    for (auto const& ev : event_recv_list)
+      n += ev.effect_type == event::effect_type::rename && ev.associated
+        && ev.path_name == from && ev.associated->path_name == to;
+    return n == 1 && event_recv_list.size() == 1;
+  };
+
+  CHECK(renames_of(real / "a" / "x", real / "a" / "y"));
+  CHECK(renames_of(real / "a" / "y", real / "b" / "y"));
+  CHECK(renames_of(real / "b", real / "c"));
+  CHECK(renames_of(real / "c" / "y", real / "a" / "z"));
+
+  close(sr.ke.fd), close(sr.pl.fd), close(sr.ep.fd);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#endif
+
+#endif
@@ -1,7 +1,14 @@
 #include "snitch/snitch.hpp"
 #include "test_watcher/test_watcher.hpp"
 #include "wtr/watcher.hpp"
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 // clang-format off
 
@@ -47,3 +54,72 @@ TEST_CASE("Performance", "[concurrent][file][perf]")
 };
 
 // clang-format on
+
+/*  How long it takes for a burst of new files to reach
+    us, with each of the tunables turned one way or the
+    other. We only check that everything arrives. How
+    long it took is for whoever is tuning. */
+TEST_CASE("Tunables", "[file][perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 2000;
+
+  struct knob {
+    char const* name;
+    watch_options opts;
+  };
+
+  auto const knobs = std::vector<knob>{
+    {"defaults", {}},
+    {"read_buf_len=1024", {.read_buf_len = 1024}},
+    {"read_buf_len=65536", {.read_buf_len = 65536}},
+    {"epoll_q_len=1", {.epoll_q_len = 1}},
+    {"epoll_q_len=256", {.epoll_q_len = 256}},
+    {"reader_cpus={0}", {.reader_cpus = {0}}},
+    {"reader_nice=10", {.reader_nice = 10}},
+    {"io_uring", {.io_uring = true}},
+  };
+
+  fprintf(stderr, "Tunables\n");
+
+  for (auto const& k : knobs) {
+    auto const tmpdir = make_local_tmp_dir();
+    REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+
+    auto seen = std::atomic<int>{0};
+    auto cb = [&](event const& ev)
+    {
+      auto is_new_file = ev.path_type == event::path_type::file
+                      && ev.effect_type == event::effect_type::create;
+      if (is_new_file) seen++;
+    };
+    auto watcher = watch(tmpdir, cb, k.opts);
+
+    std::this_thread::sleep_for(100ms);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < path_count; ++i)
+      std::ofstream(tmpdir / std::to_string(i)).close();
+    for (int i = 0; i < 5000 && seen < path_count; ++i)
+      std::this_thread::sleep_for(1ms);
+    auto took = std::chrono::steady_clock::now() - start;
+
+    REQUIRE(watcher.close());
+
+    fprintf(
+      stderr,
+      "  %-20s %6lld us, %d/%d events\n",
+      k.name,
+      (long long)std::chrono::duration_cast<std::chrono::microseconds>(took)
+        .count(),
+      seen.load(),
+      path_count);
+    CHECK(seen == path_count);
+
+    REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+  }
+};
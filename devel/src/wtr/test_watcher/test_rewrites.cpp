@@ -0,0 +1,298 @@
+#include "snitch/snitch.hpp"
+#include "test_watcher/test_watcher.hpp"
+#include "wtr/watcher.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Test that rewriting a file with the same contents
+   is quiet, and that changing them isn't */
+TEST_CASE("Rewrites", "[file][rewrites][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Rewrites";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const file = tmpdir / "file.txt";
+  auto modified = 0;
+  auto modified_mtx = std::mutex{};
+  auto const modified_count = [&]
+  {
+    auto _ = std::scoped_lock{modified_mtx};
+    return modified;
+  };
+  auto const overwrite = [&](char const* with)
+  {
+    auto mode = std::ios::in | std::ios::out | std::ios::binary;
+    REQUIRE((std::fstream{file, mode} << with).good());
+  };
+  auto const is_eventually = [](auto const& f)
+  {
+    for (int i = 0; i < 100 && ! f(); i++) std::this_thread::sleep_for(10ms);
+    return f();
+  };
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE((std::ofstream{file} << "hello").good());
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.effect_type != event::effect_type::modify) return;
+      if (ev.path_name != file) return;
+      auto _ = std::scoped_lock{modified_mtx};
+      modified++;
+    },
+    watch_options{.skip_rewrites = true});
+
+  std::this_thread::sleep_for(10ms);
+
+  overwrite("world");
+  REQUIRE(is_eventually([&] { return modified_count() > 0; }));
+  std::this_thread::sleep_for(100ms);
+  auto const first = modified_count();
+
+  for (int i = 0; i < 3; i++) {
+    overwrite("world");
+    std::this_thread::sleep_for(20ms);
+  }
+  std::this_thread::sleep_for(100ms);
+  CHECK(modified_count() == first);
+
+  overwrite("again");
+  CHECK(is_eventually([&] { return modified_count() > first; }));
+
+  REQUIRE(lifetime.close());
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#if defined(__linux__)
+
+/* Test that a file which is written to many times, then
+   closed, is modified once in the close-write mode */
+TEST_CASE("Close write", "[file][rewrites][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Close write";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const file = tmpdir / "file.txt";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    },
+    watch_options{.close_write = true});
+
+  std::this_thread::sleep_for(10ms);
+
+  {
+    auto out = std::ofstream{file};
+    for (int i = 0; i < 10; i++) {
+      REQUIRE((out << "hello" << std::flush).good());
+      std::this_thread::sleep_for(10ms);
+    }
+  }
+
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    if (event_recv_list.size() >= 2) break;
+  }
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  REQUIRE(event_recv_list.size() == 2);
+  CHECK(event_recv_list[0].path_name == file);
+  CHECK(event_recv_list[0].effect_type == event::effect_type::create);
+  CHECK(event_recv_list[1].path_name == file);
+  CHECK(event_recv_list[1].effect_type == event::effect_type::modify);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#endif
+
+/* Test that the writes to a file we tail carry the bytes
+   which were appended, and that truncation is noticed */
+TEST_CASE("Tail", "[file][tail][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Tail";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const log = tmpdir / "logs" / "app.log";
+  auto ranges = std::vector<event::byte_range>{};
+  auto ranges_mtx = std::mutex{};
+  auto const last_end = [&]
+  {
+    auto _ = std::scoped_lock{ranges_mtx};
+    return ranges.empty() ? -1LL : (long long)ranges.back().end;
+  };
+  auto const is_eventually = [](auto const& f)
+  {
+    for (int i = 0; i < 100 && ! f(); i++) std::this_thread::sleep_for(10ms);
+    return f();
+  };
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directory(tmpdir / "logs"));
+  REQUIRE((std::ofstream{log} << "0123456789").good());
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.effect_type != event::effect_type::modify) return;
+      if (ev.path_name != log) return;
+      auto _ = std::scoped_lock{ranges_mtx};
+      ranges.push_back(ev.appended);
+    },
+    watch_options{.tail = {"logs"}});
+
+  std::this_thread::sleep_for(10ms);
+
+  REQUIRE((std::ofstream{log, std::ios::app} << "abcde").good());
+  REQUIRE(is_eventually([&] { return last_end() == 15; }));
+  fs::resize_file(log, 0);
+  std::this_thread::sleep_for(50ms);
+  REQUIRE((std::ofstream{log, std::ios::app} << "xy").good());
+  REQUIRE(is_eventually([&] { return last_end() == 2; }));
+
+  REQUIRE(lifetime.close());
+
+  REQUIRE(ranges.size() >= 2);
+  CHECK(ranges.front().begin == 10);
+  CHECK(! ranges.front().is_truncated);
+  auto is_truncated = false;
+  for (auto const& r : ranges) is_truncated = is_truncated || r.is_truncated;
+  CHECK(is_truncated);
+  for (size_t i = 1; i < ranges.size(); i++)
+    if (! ranges[i].is_truncated) CHECK(ranges[i].begin == ranges[i - 1].end);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#if defined(__linux__)
+
+/* Test that events carry what we saw of their paths in
+   the stats mode, and that hard links are noticed */
+TEST_CASE("Stats", "[file][stats][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Stats";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const file = tmpdir / "file.txt";
+  auto const link = tmpdir / "link.txt";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+
+  std::this_thread::sleep_for(100ms);
+
+  auto lifetime = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    },
+    watch_options{.stats = true});
+
+  std::this_thread::sleep_for(10ms);
+
+  REQUIRE((std::ofstream{file} << "hello").good());
+  std::this_thread::sleep_for(100ms);
+  fs::create_hard_link(file, link);
+
+  auto is_link_seen = [&]
+  {
+    for (auto const& ev : event_recv_list)
+      if (ev.path_name == link) return true;
+    return false;
+  };
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    if (is_link_seen()) break;
+  }
+  std::this_thread::sleep_for(100ms);
+
+  REQUIRE(lifetime.close());
+
+  /*  The kernel may tell us about the create and the
+      write at once. Either way, the last we hear of the
+      file is after it was written to. */
+  auto inode = (unsigned long long)0;
+  auto size = (unsigned long long)0;
+  for (auto const& ev : event_recv_list) {
+    if (ev.path_name != file) continue;
+    CHECK(ev.stat.inode != 0);
+    CHECK(ev.stat.links >= 1);
+    inode = ev.stat.inode;
+    size = ev.stat.size;
+  }
+  CHECK(inode != 0);
+  CHECK(size == 5);
+
+  REQUIRE(is_link_seen());
+  for (auto const& ev : event_recv_list) {
+    if (ev.path_name != link) continue;
+    CHECK(ev.path_type == event::path_type::hard_link);
+    CHECK(ev.stat.inode == inode);
+    CHECK(ev.stat.links == 2);
+  }
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+#endif
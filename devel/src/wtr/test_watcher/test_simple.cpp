@@ -1,8 +1,11 @@
 #include "snitch/snitch.hpp"
 #include "test_watcher/test_watcher.hpp"
 #include "wtr/watcher.hpp"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <future>
 #include <iostream>
 #include <mutex>
@@ -105,3 +108,338 @@ TEST_CASE("Simple", "[dir][file][simple][not-perf]")
 
   check_event_lists_eq(event_sent_list, event_recv_list);
 };
+
+/* Test that the io-uring mode sees what epoll would,
+   and that it wakes for the coarse mode's windows */
+TEST_CASE("Io uring", "[dir][file][simple][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 3;
+  static constexpr auto title = "Io uring";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const sub = tmpdir / "sub";
+  auto event_recv_list = std::vector<event>{};
+  auto coarse_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+  auto files = std::vector<fs::path>{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directory(sub));
+
+  std::this_thread::sleep_for(10ms);
+
+  auto gather = [&](std::vector<event>& list)
+  {
+    return [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      list.push_back(ev);
+    };
+  };
+  auto watcher =
+    watch(tmpdir, gather(event_recv_list), watch_options{.io_uring = true});
+  auto coarse = watch(
+    tmpdir,
+    gather(coarse_recv_list),
+    watch_options{.coarse = true, .io_uring = true});
+
+  std::this_thread::sleep_for(100ms);
+
+  for (int i = 0; i < path_count; ++i) {
+    files.push_back(sub / ("new_file" + std::to_string(i) + ".txt"));
+    std::ofstream(files.back()).close();
+    REQUIRE(fs::is_regular_file(files.back()));
+  }
+
+  auto is_seen = [&](std::vector<event> const& list, fs::path const& p)
+  {
+    for (auto const& ev : list)
+      if (ev.path_name == p) return true;
+    return false;
+  };
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    auto is_done = is_seen(event_recv_list, files.back())
+                && is_seen(coarse_recv_list, sub);
+    if (is_done) break;
+  }
+
+  REQUIRE(watcher.close());
+  REQUIRE(coarse.close());
+
+  for (auto const& f : files) CHECK(is_seen(event_recv_list, f));
+  CHECK(is_seen(coarse_recv_list, sub));
+  for (auto const& ev : coarse_recv_list) CHECK(ev.path_name == sub);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/*  We stall the callback until a burst of files is made,
+    so that the kernel holds onto them for us. Then, we
+    should have seen the backlog, and, where the kernel
+    has a limit, come near it. */
+TEST_CASE("Backlog", "[file][simple][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 1000;
+  static constexpr auto title = "Backlog";
+  auto const tmpdir = make_local_tmp_dir();
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+  auto sample_count = std::atomic<int>{0};
+  auto is_made = std::atomic<bool>{false};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+
+  std::this_thread::sleep_for(10ms);
+
+  auto is_stalled = false;
+  auto cb = [&](event const& ev)
+  {
+    if (is_verbose()) std::cerr << ev << std::endl;
+    auto is_ev = ev.path_type != event::path_type::watcher;
+    for (int i = 0; is_ev && ! is_stalled && ! is_made && i < 5000; i++)
+      std::this_thread::sleep_for(1ms);
+    if (is_ev) is_stalled = true;
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    event_recv_list.push_back(ev);
+  };
+  auto watcher = watch(
+    tmpdir,
+    cb,
+    watch_options{
+      .backlog = true,
+      .on_backlog = [&](backlog_stats const&) { sample_count++; },
+      .backlog_near_pct = 1,
+    });
+
+  std::this_thread::sleep_for(100ms);
+
+  for (int i = 0; i < path_count; ++i)
+    std::ofstream(tmpdir / std::to_string(i)).close();
+  is_made = true;
+
+  auto last = tmpdir / std::to_string(path_count - 1);
+  auto is_seen = [&](std::string const& prefix)
+  {
+    for (auto const& ev : event_recv_list)
+      if (ev.path_name.string().rfind(prefix, 0) == 0) return true;
+    return false;
+  };
+  for (int i = 0; i < 500; i++) {
+    std::this_thread::sleep_for(10ms);
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    if (is_seen(last.string())) break;
+  }
+
+  REQUIRE(watcher.close());
+
+  auto st = watcher.backlog();
+  CHECK(is_seen(last.string()));
+  CHECK(sample_count > 0);
+  CHECK(st.samples > 0);
+  CHECK(st.peak_bytes > 0);
+  CHECK(st.peak_bytes >= st.bytes);
+  CHECK(st.peak_events >= st.events);
+  if (st.limit > 0) CHECK(is_seen("w/sys/q_near@"));
+  if (st.limit > 0) CHECK(st.near_ns > 0);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/*  A burst of changes in one directory is one `modify`
+    of that directory, in the coarse mode */
+TEST_CASE("Coarse", "[dir][file][simple][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 20;
+  static constexpr auto title = "Coarse";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const sub = tmpdir / "sub";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directory(sub));
+  auto const real_sub = fs::canonical(sub);
+
+  std::this_thread::sleep_for(10ms);
+
+  auto watcher = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    },
+    watch_options{.coarse = true});
+
+  std::this_thread::sleep_for(100ms);
+
+  for (int i = 0; i < path_count; ++i) {
+    auto const file = sub / ("file" + std::to_string(i) + ".txt");
+    std::ofstream(file) << "hello";
+    REQUIRE(fs::remove(file));
+  }
+
+  std::this_thread::sleep_for(200ms);
+
+  REQUIRE(watcher.close());
+
+  REQUIRE(event_recv_list.size() == 1);
+  CHECK(event_recv_list[0].path_name == real_sub);
+  CHECK(event_recv_list[0].effect_type == event::effect_type::modify);
+  CHECK(event_recv_list[0].path_type == event::path_type::dir);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/*  A directory renamed in the coarse mode changes both
+    of its parents, once each, and is watched by its new
+    name afterwards */
+TEST_CASE("Coarse rename", "[dir][simple][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Coarse rename";
+  auto const tmpdir = make_local_tmp_dir();
+  auto changed = std::vector<fs::path>{};
+  auto changed_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directories(tmpdir / "src" / "d"));
+  REQUIRE(fs::create_directory(tmpdir / "dst"));
+  auto const real = fs::canonical(tmpdir);
+
+  std::this_thread::sleep_for(10ms);
+
+  auto watcher = watch(
+    tmpdir,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{changed_mtx};
+      changed.push_back(ev.path_name);
+    },
+    watch_options{.coarse = true});
+
+  std::this_thread::sleep_for(100ms);
+
+  fs::rename(tmpdir / "src" / "d", tmpdir / "dst" / "d");
+  std::this_thread::sleep_for(100ms);
+  std::ofstream(tmpdir / "dst" / "d" / "file.txt") << "hello";
+  std::this_thread::sleep_for(200ms);
+
+  REQUIRE(watcher.close());
+
+  std::sort(changed.begin(), changed.end());
+  auto const want = std::vector<fs::path>{
+    real / "dst",
+    real / "dst" / "d",
+    real / "src",
+  };
+  CHECK(changed == want);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
+
+/*  What's counted in the counting mode adds up to what
+    happened, and what's left when we close is sent */
+TEST_CASE("Counts", "[dir][file][simple][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto path_count = 50;
+  static constexpr auto title = "Counts";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const sub = tmpdir / "sub";
+  auto counts_list = std::vector<event_counts>{};
+  auto counts_list_mtx = std::mutex{};
+  auto is_closed = std::atomic<bool>{false};
+  auto counts_before_close = std::atomic<int>{0};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+  REQUIRE(fs::create_directory(sub));
+  auto const real_sub = fs::canonical(sub);
+
+  std::this_thread::sleep_for(10ms);
+
+  /*  The period is longer than the test, so everything
+      we count is sent when we close */
+  auto watcher = watch(
+    tmpdir,
+    [](event const&) {},
+    watch_options{
+      .on_counts =
+        [&](event_counts const& c)
+      {
+        auto _ = std::scoped_lock{counts_list_mtx};
+        if (! is_closed) counts_before_close++;
+        counts_list.push_back(c);
+      },
+      .counts_period_ms = 60000,
+    });
+
+  std::this_thread::sleep_for(100ms);
+
+  for (int i = 0; i < path_count; ++i)
+    std::ofstream(sub / ("file" + std::to_string(i) + ".txt")).close();
+  /*  fanotify merges what happens to a path while it
+      waits for us, so we let it catch up */
+  std::this_thread::sleep_for(100ms);
+  for (int i = 0; i < path_count; ++i)
+    REQUIRE(fs::remove(sub / ("file" + std::to_string(i) + ".txt")));
+
+  std::this_thread::sleep_for(100ms);
+
+  is_closed = true;
+  REQUIRE(watcher.close());
+
+  auto sum = event_counts::effects{};
+  for (auto const& c : counts_list)
+    for (auto const& d : c.dirs)
+      if (d.path_name == real_sub)
+        for (size_t i = 0; i < sum.size(); ++i) sum[i] += d.counts[i];
+
+  CHECK(counts_before_close == 0);
+  REQUIRE(counts_list.size() == 1);
+  CHECK(counts_list[0].begin_time <= counts_list[0].end_time);
+  CHECK(sum[(size_t)event::effect_type::create] == path_count);
+  CHECK(sum[(size_t)event::effect_type::destroy] == path_count);
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
@@ -0,0 +1,68 @@
+#include "snitch/snitch.hpp"
+#include "test_watcher/test_watcher.hpp"
+#include "wtr/watcher.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Test that we hear about a path once, when it appears,
+   even when its parents didn't exist when we began, and
+   that we can stop waiting for a path which doesn't */
+TEST_CASE("Watch for", "[file][watch_for][not-perf]")
+{
+  namespace fs = std::filesystem;
+  using namespace std::chrono_literals;
+  using namespace wtr::watcher;
+  using namespace wtr::test_watcher;
+
+  static constexpr auto title = "Watch for";
+  auto const tmpdir = make_local_tmp_dir();
+  auto const dir = tmpdir / "a" / "b" / "c";
+  auto const file = dir / "done.txt";
+  auto event_recv_list = std::vector<event>{};
+  auto event_recv_list_mtx = std::mutex{};
+
+  std::cerr << title << std::endl;
+
+  REQUIRE(fs::exists(tmpdir) || fs::create_directory(tmpdir));
+
+  auto waiter = watch_for(
+    file,
+    [&](event const& ev)
+    {
+      if (is_verbose()) std::cerr << ev << std::endl;
+      if (ev.path_type == event::path_type::watcher) return;
+      auto _ = std::scoped_lock{event_recv_list_mtx};
+      event_recv_list.push_back(ev);
+    });
+
+  for (auto const& d : {tmpdir / "a", tmpdir / "a" / "b", dir}) {
+    std::this_thread::sleep_for(50ms);
+    REQUIRE(fs::create_directory(d));
+    REQUIRE((std::ofstream{d / "not.txt"} << "").good());
+  }
+  std::this_thread::sleep_for(50ms);
+  {
+    auto _ = std::scoped_lock{event_recv_list_mtx};
+    CHECK(event_recv_list.empty());
+  }
+  REQUIRE((std::ofstream{file} << "").good());
+
+  REQUIRE(waiter.wait());
+
+  REQUIRE(event_recv_list.size() == 1);
+  CHECK(event_recv_list[0].path_name == file);
+  CHECK(event_recv_list[0].effect_type == event::effect_type::create);
+  CHECK(event_recv_list[0].path_type == event::path_type::file);
+
+  auto never = watch_for(tmpdir / "x" / "y", [](event const&) {});
+  std::this_thread::sleep_for(50ms);
+  CHECK(! never.close());
+
+  REQUIRE(! fs::exists(tmpdir) || fs::remove_all(tmpdir));
+};
@@ -4,6 +4,7 @@
 #include <array>
 #include <charconv>
 #include <chrono>
+#include <cstdint>
 #include <filesystem>
 #include <functional>
 #include <ios>
@@ -12,6 +13,7 @@
 #include <string>
 #include <string_view>
 #include <type_traits>
+#include <utility>
 
 namespace wtr {
 inline namespace watcher {
@@ -38,6 +40,20 @@ inline namespace watcher {
         - other
       - `effect_time`:
         The time of the event in nanoseconds since epoch.
+      - `path_id`:
+        A small number for the path, if asked for. See
+        `watch_options::path_ids`.
+      - `folded`:
+        How many events beneath a destroyed directory
+        this one stands for. See `watch_options::fold`.
+      - `appended`:
+        The bytes written to a file we tail, from the
+        size we saw last to its size now. See
+        `watch_options::tail`.
+      - `stat`:
+        The path's inode, device, size, modification
+        time, mode and link count, as we saw it. See
+        `watch_options::stats`.
 
     The `watcher` type is special.
     Events with this type will include messages from
@@ -97,16 +113,106 @@ public:
                                 TimePoint{Clock::now()}.time_since_epoch())
                                 .count()};
 
+  static constexpr std::uint32_t no_path_id = UINT32_MAX;
+
+  std::uint32_t const path_id{no_path_id};
+
+  std::size_t const folded{0};
+
+  /*  From `begin` to `end`. A file which was truncated
+      was written to from the beginning. */
+  struct byte_range {
+    unsigned long long begin = 0;
+    unsigned long long end = 0;
+    bool is_truncated = false;
+  };
+
+  byte_range const appended{};
+
+  /*  All zero if we didn't look, or couldn't. The `mtime`
+      is in the same units as the `effect_time`. */
+  struct file_stat {
+    unsigned long long inode = 0;
+    unsigned long long device = 0;
+    unsigned long long size = 0;
+    long long mtime = 0;
+    unsigned mode = 0;
+    unsigned links = 0;
+  };
+
+  file_stat const stat{};
+
   std::unique_ptr<event> const associated{nullptr};
 
   inline event(event const& from) noexcept
-      : path_name{from.path_name}
-      , effect_type{from.effect_type}
-      , path_type{from.path_type}
-      , effect_time{from.effect_time}
-      , associated{
-          from.associated ? std::make_unique<event>(*from.associated)
-                          : nullptr} {};
+      : event{
+        from,
+        from.path_type,
+        from.path_id,
+        from.folded,
+        from.appended,
+        from.stat,
+        from.associated_copy()} {};
+
+  /*  A copy, with the ids of our path and of the
+      associated event's path. */
+  inline auto with_path_ids(
+    std::uint32_t path_id,
+    std::uint32_t associated_path_id) const noexcept -> event
+  {
+    auto const* to = this->associated.get();
+    return {
+      *this,
+      this->path_type,
+      path_id,
+      this->folded,
+      this->appended,
+      this->stat,
+      to ? std::make_unique<event>(
+        to->with_path_ids(associated_path_id, no_path_id))
+         : nullptr};
+  }
+
+  /*  A copy, which stands for `folded` other events */
+  inline auto with_folded(std::size_t folded) const noexcept -> event
+  {
+    return {
+      *this,
+      this->path_type,
+      this->path_id,
+      folded,
+      this->appended,
+      this->stat,
+      associated_copy()};
+  }
+
+  /*  A copy, with what was appended */
+  inline auto with_appended(byte_range appended) const noexcept -> event
+  {
+    return {
+      *this,
+      this->path_type,
+      this->path_id,
+      this->folded,
+      appended,
+      this->stat,
+      associated_copy()};
+  }
+
+  /*  A copy, with what we saw of the path, which may be
+      a hard link */
+  inline auto with_stat(enum path_type path_type, file_stat const& stat)
+    const noexcept -> event
+  {
+    return {
+      *this,
+      path_type,
+      this->path_id,
+      this->folded,
+      this->appended,
+      stat,
+      associated_copy()};
+  }
 
   inline event(
     std::filesystem::path const& path_name,
@@ -139,6 +245,31 @@ public:
   {
     return ! (l == r);
   }
+
+private:
+  inline event(
+    event const& from,
+    enum path_type path_type,
+    std::uint32_t path_id,
+    std::size_t folded,
+    byte_range appended,
+    file_stat const& stat,
+    std::unique_ptr<event> associated) noexcept
+      : path_name{from.path_name}
+      , effect_type{from.effect_type}
+      , path_type{path_type}
+      , effect_time{from.effect_time}
+      , path_id{path_id}
+      , folded{folded}
+      , appended{appended}
+      , stat{stat}
+      , associated{std::move(associated)} {};
+
+  inline auto associated_copy() const noexcept -> std::unique_ptr<event>
+  {
+    return this->associated ? std::make_unique<event>(*this->associated)
+                            : nullptr;
+  }
 };
 
 } /*  namespace watcher */
@@ -354,6 +485,387 @@ inline auto operator<<(
 
 } /*  namespace wtr   */
 
+#include <array>
+#include <filesystem>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+namespace wtr {
+inline namespace watcher {
+
+/*  Options for a `watch`.
+    The defaults are what you get without them.
+
+    @param exclude:
+      Paths which we won't watch, along with everything
+      beneath them. Relative paths are relative to the
+      path being watched.
+      Where the kernel lets us, we don't ask it about
+      these paths at all. Whatever it tells us anyway
+      is dropped before it reaches the callback.
+
+    @param exclude_pids:
+      Processes whose changes we don't report. Only
+      the fanotify adapter knows who made a change,
+      and, without root, only when it was us.
+
+    @param exclude_self:
+      Don't report our own changes. The same as adding
+      this process to `exclude_pids`.
+
+    @param coarse:
+      Report that something in a directory changed, but
+      not what. Each directory is reported (as a `modify`
+      of a `dir`) at most once in a short window of time,
+      at the window's end. Only the Linux adapters do
+      this.
+
+    @param on_counts:
+      Count events instead of sending them. Every
+      `counts_period_ms`, and once more when we're
+      done, this is called with the counts since the
+      last call. Events are counted where we read
+      them, without finding out which paths they're
+      about. The callback given to `watch` still has
+      our messages. Only the Linux adapters do this.
+
+    @param counts_period_ms:
+      How often `on_counts` is called.
+
+    @param dirty:
+      Keep the paths which changed, instead of sending
+      them, until they're taken with `watch::drain()`.
+      Each path is kept once, with the strongest effect
+      it saw. The callback still has our messages.
+
+    @param generations:
+      Keep track of when something last changed beneath
+      each directory, for `watch::changed_since()`.
+
+    @param path_ids:
+      Give each path a small number, its `path_id`,
+      which is unique among the paths that exist. The
+      numbers begin at zero, and the numbers of the
+      destroyed paths are given to new ones, so they
+      can index into an array. A renamed path keeps
+      its number.
+
+    @param index:
+      Keep an index of the directories beneath the path,
+      for `watch::snapshot()`.
+
+    @param index_files:
+      Keep the files (and everything else which isn't
+      a directory) in the index as well.
+
+    @param on_inventory:
+      Called with everything beneath the path when we
+      begin watching, in batches of events with the
+      `other` effect. Every batch comes before the first
+      change is sent. Whatever changes after we've seen
+      it is sent as well, so nothing is missed between
+      the inventory and the changes. (Some paths may be
+      in both.) The Linux adapters take the inventory
+      while they walk the tree to watch it. Elsewhere,
+      we walk it before we begin.
+
+    @param fold:
+      When a directory is destroyed, with everything
+      beneath it, send one event for the directory
+      instead of one for everything. How many events
+      it stands for is in its `folded`. We hold onto
+      what was destroyed until nothing else has been
+      for a moment, or until something else happens.
+      Not with `coarse` or `on_counts`. Only the Linux
+      adapters do this. (A renamed directory is always
+      one event. Either way, we keep the names of the
+      paths beneath it up to date.)
+
+    @param skip_rewrites:
+      Drop the `modify` events of files whose contents
+      are the same as when we last sent one, like those
+      rewritten by formatters. We hash the files on a
+      few threads of our own, so that we keep reading
+      from the kernel, and send the events in the same
+      order as we would otherwise. The first change we
+      see to a file is always sent. The callback is
+      called from those threads.
+
+    @param close_write:
+      Send a `modify` when a file which was written to
+      is closed, instead of one for each write. A large
+      copy is one event, once it's done, instead of
+      thousands of them while it's being made. Only the
+      Linux adapters do this. (The subtrees we poll
+      are still reported as they're written to.)
+
+    @param tail:
+      Files, and directories of files, which are only
+      appended to, like logs. The `modify` events of
+      these files have the bytes which were appended
+      since the last one in their `appended`, so that
+      only those need to be read. A truncated file is
+      reported as such. Relative paths are relative
+      to the path being watched.
+
+    @param stats:
+      Look at each path as we send it, for its `stat`.
+      We look at a read's worth of events at once, once
+      we're done reading. A file with more than one link
+      is reported as a `hard_link`. When the fanotify
+      adapter runs as root, we look at what the kernel
+      told us changed, rather than at whatever has its
+      name now. Only the Linux adapters do this.
+
+    @param files:
+      Watch only these files, as from a manifest (such
+      as `git ls-files`), instead of everything beneath
+      the path. Relative paths are relative to the path
+      being watched. Only the events about these files
+      are sent. (A rename is, if either name is.) The
+      Linux adapters only watch the directories these
+      files are in, and nothing beneath them, or made
+      after we begin. Elsewhere, we watch the path and
+      drop what isn't in the set. With `coarse` or
+      `on_counts`, every change in those directories
+      is reported.
+      Watching a file, instead of a directory, is the
+      same as watching its directory with only it in
+      this set.
+
+    @param max_depth:
+      How many directories deep we watch beneath the
+      path. What's in the path itself is at depth 0,
+      so 0 watches only the path, and not what's in
+      its directories. A directory at the deepest
+      depth we watch is reported on, but not what's
+      in it. Less than 0 (the default) is as deep as
+      the tree goes. Where we can, we don't ask the
+      kernel about (or scan) what's deeper at all.
+
+    @param dirs_first:
+      During a storm of changes, send what changes
+      which directories there are (their creation,
+      destruction and renaming) ahead of everything
+      else we read at the same time. We mark the new
+      directories before we send anything, so that we
+      miss less of what's made in them. Nothing goes
+      ahead of something earlier about its own path,
+      or about what's beneath it. Not with `coarse` or
+      `on_counts`. Only the Linux adapters do this.
+
+    @param shards:
+      How many kernel instances to split a large tree
+      across, each read on a thread of its own, for when
+      one thread can't keep up with what changes. The
+      directories in the path are split between them,
+      each with everything beneath it, so what happens
+      to a path is still sent in order. The callbacks
+      are called from those threads, one at a time.
+      A rename between directories which two of them
+      watch is sent in two halves, as if it were out of
+      the tree and into it. Not with `coarse`, `files`,
+      `on_counts`, or a `max_depth` of 0. Only the Linux
+      adapters do this.
+
+    @param io_uring:
+      Wait for the kernel's events with io_uring, rather
+      than with `epoll`. We keep a read posted behind a
+      poll of the kernel's descriptor, into a buffer
+      we've registered with the ring, so each wakeup is
+      one system call, which has already read what we
+      were woken for. Where io_uring isn't there (before
+      Linux 5.11), or isn't allowed, we use `epoll`. Only
+      the Linux adapters do this.
+
+    @param read_buf_len:
+      How many bytes of events we read from the kernel
+      at once. More is fewer reads in a storm, and more
+      to look through (and hold onto, in the stats and
+      dirs-first modes) after each. There's a floor,
+      which is enough for the largest event. Only the
+      Linux adapters do this.
+
+    @param epoll_q_len:
+      How many of `epoll`'s events we take at once.
+      Only the Linux adapters do this.
+
+    @param reader_cpus:
+      The CPUs which the threads that read from the
+      kernel (and call the callback) may run on. Empty
+      (the default) is any of them. Only the Linux
+      adapters do this.
+
+    @param reader_nice:
+      How much nicer than the rest of the process those
+      threads are, as with `nice`. Less than 0 is less
+      nice, where we're allowed. Only the Linux adapters
+      do this.
+      The kernel's own queues are sized by the system
+      (`fs.inotify.max_queued_events`) for everyone, or
+      unlimited for fanotify, when we're privileged, so
+      they aren't here.
+
+    @param backlog:
+      Keep track of how far behind the kernel we are,
+      for `watch::backlog()`. Each time we're woken, we
+      ask the kernel how much is waiting for us. Only
+      the Linux adapters do this.
+
+    @param on_backlog:
+      Called with what we've kept track of each time we
+      ask, from the thread which reads from the kernel,
+      so it should be quick. The same as `backlog`, but
+      as it happens.
+
+    @param backlog_near_pct:
+      How full (as a percent) the kernel's queue is when
+      we're near its limit. Once we are, we send a
+      `w/sys/q_near` message, with the watcher's other
+      messages, and count the time until we've caught
+      up to half of that again. A queue without a limit
+      is never near it. */
+
+/*  How far behind the kernel we are, as of the last
+    time we asked. The kernel tells us how many bytes
+    are waiting to be read. Its limit is on events,
+    so we guess how many events that is, from the
+    events we've read so far.
+    The `limit` is how many events the kernel will
+    hold for us before it drops them. 0 is no limit.
+    We're near it for as long as `near_ns` says. The
+    `overflows` are the times the kernel told us it
+    dropped some. With `shards`, each shard's kernel
+    queue is added up. */
+struct backlog_stats {
+  unsigned long long bytes = 0;
+  unsigned long long peak_bytes = 0;
+  unsigned long long events = 0;
+  unsigned long long peak_events = 0;
+  unsigned long long limit = 0;
+  long long near_ns = 0;
+  unsigned long long overflows = 0;
+  unsigned long long samples = 0;
+};
+
+/*  How many events of each effect happened in each
+    directory over some period of time. Directories
+    where nothing happened are left out.
+    The times are in the same units as an event's
+    `effect_time`. The counts are indexed by the
+    `effect_type`. A rename is counted in both the
+    directory it came from and the one it went to. */
+struct event_counts {
+  using effects =
+    std::array<unsigned long long, (size_t)event::effect_type::other + 1>;
+
+  struct dir {
+    std::filesystem::path path_name{};
+    effects counts{};
+  };
+
+  long long begin_time = 0;
+  long long end_time = 0;
+  std::vector<dir> dirs{};
+};
+
+struct watch_options {
+  std::vector<std::filesystem::path> exclude{};
+  std::vector<int> exclude_pids{};
+  bool exclude_self = false;
+  bool coarse = false;
+  std::function<void(event_counts const&)> on_counts{};
+  int counts_period_ms = 1000;
+  bool dirty = false;
+  bool generations = false;
+  bool path_ids = false;
+  bool index = false;
+  bool index_files = false;
+  std::function<void(std::vector<event> const&)> on_inventory{};
+  bool fold = false;
+  bool skip_rewrites = false;
+  bool close_write = false;
+  std::vector<std::filesystem::path> tail{};
+  bool stats = false;
+  std::vector<std::filesystem::path> files{};
+  int max_depth = -1;
+  bool dirs_first = false;
+  int shards = 1;
+  bool io_uring = false;
+  unsigned read_buf_len = 4096;
+  int epoll_q_len = 64;
+  std::vector<int> reader_cpus{};
+  int reader_nice = 0;
+  bool backlog = false;
+  std::function<void(backlog_stats const&)> on_backlog{};
+  int backlog_near_pct = 75;
+};
+
+} /*  namespace watcher */
+} /*  namespace wtr   */
+
+namespace detail::wtr::watcher {
+
+/*  Whether a path is (or is beneath) an excluded path.
+    The `watch` makes the exclusions absolute before
+    the adapters see them. */
+inline auto is_excluded(
+  ::wtr::watcher::watch_options const& opts,
+  std::basic_string_view<std::filesystem::path::value_type> path) noexcept
+  -> bool
+{
+  constexpr auto sep = std::filesystem::path::preferred_separator;
+  for (auto const& ex : opts.exclude) {
+    auto const& e = ex.native();
+    auto is_under = path.size() > e.size() && path[e.size()] == sep;
+    auto is_same = path.size() == e.size();
+    if ((is_same || is_under) && path.compare(0, e.size(), e) == 0)
+      return true;
+  }
+  return false;
+}
+
+/*  How deep a path is beneath the base path, counting
+    what's in the base path as depth 0. Less than 0 if
+    it isn't beneath the base path. */
+inline auto depth_of(
+  std::basic_string_view<std::filesystem::path::value_type> base,
+  std::basic_string_view<std::filesystem::path::value_type> path) noexcept
+  -> int
+{
+  constexpr auto sep = std::filesystem::path::preferred_separator;
+  if (! base.empty() && base.back() == sep) base.remove_suffix(1);
+  auto is_under = path.size() > base.size() && path[base.size()] == sep;
+  if (! is_under || path.compare(0, base.size(), base) != 0) return -1;
+  int depth = -1;
+  for (auto i = base.size(); i < path.size(); ++i) depth += path[i] == sep;
+  return depth;
+}
+
+/*  Whether a path is deeper than we were asked to watch */
+inline auto is_too_deep(
+  ::wtr::watcher::watch_options const& opts,
+  std::basic_string_view<std::filesystem::path::value_type> base,
+  std::basic_string_view<std::filesystem::path::value_type> path) noexcept
+  -> bool
+{
+  return opts.max_depth >= 0 && depth_of(base, path) > opts.max_depth;
+}
+
+/*  Whether a process's changes are excluded. The
+    adapters which can tell add `self` to the pids. */
+inline auto
+is_excluded_pid(::wtr::watcher::watch_options const& opts, int pid) noexcept
+  -> bool
+{
+  for (auto ex : opts.exclude_pids)
+    if (ex == pid) return true;
+  return false;
+}
+
+} /*  namespace detail::wtr::watcher */
+
 #include <atomic>
 
 #ifdef __linux__
@@ -467,166 +979,1529 @@ public:
 
 } /*  namespace detail::wtr::watcher */
 
-#if defined(__APPLE__)
-
-#include <CoreFoundation/CoreFoundation.h>
-#include <CoreServices/CoreServices.h>
-#include <dispatch/dispatch.h>
 #include <filesystem>
 #include <mutex>
+#include <stddef.h>
 #include <string>
-#include <unordered_set>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 
-namespace detail {
-namespace wtr {
-namespace watcher {
-namespace adapter {
-namespace {
+namespace detail::wtr::watcher {
 
-// clang-format off
+/*  The distinct paths which changed since someone last
+    asked, each with the strongest effect it saw. We're
+    filled from the watcher's thread and drained from
+    the user's, so we take turns with a mutex.
 
-/*  If we want less "sleepy" time after a period of time
-    without receiving filesystem events, we could OR like:
-    `fsev_flag_listen | kFSEventStreamCreateFlagNoDefer`.
-    We're talking about saving a maximum latency of `delay_s`
-    after some period of inactivity, which is not likely to
-    be noticeable. I'm not sure what Darwin sets the "period
-    of inactivity" to, and I'm not sure it matters. */
-inline constexpr unsigned fsev_listen_for
-  = kFSEventStreamCreateFlagFileEvents;
-inline constexpr auto fsev_listen_since
-  = kFSEventStreamEventIdSinceNow;
-inline constexpr unsigned fsev_flag_path_file
-  = kFSEventStreamEventFlagItemIsFile;
-inline constexpr unsigned fsev_flag_path_dir
-  = kFSEventStreamEventFlagItemIsDir;
-inline constexpr unsigned fsev_flag_path_sym_link
-  = kFSEventStreamEventFlagItemIsSymlink;
-inline constexpr unsigned fsev_flag_path_hard_link
-  = kFSEventStreamEventFlagItemIsHardlink
-  | kFSEventStreamEventFlagItemIsLastHardlink;
-inline constexpr unsigned fsev_flag_effect_create
-  = kFSEventStreamEventFlagItemCreated;
-inline constexpr unsigned fsev_flag_effect_remove
-  = kFSEventStreamEventFlagItemRemoved;
-inline constexpr unsigned fsev_flag_effect_modify_any
-  = kFSEventStreamEventFlagItemModified
-  | kFSEventStreamEventFlagItemChangeOwner
-  | kFSEventStreamEventFlagItemXattrMod
-  | kFSEventStreamEventFlagItemFinderInfoMod
-  | kFSEventStreamEventFlagItemInodeMetaMod;
-inline constexpr unsigned fsev_flag_effect_modify
-  = fsev_flag_effect_modify_any
-  & ~kFSEventStreamEventFlagItemInodeMetaMod;
-inline constexpr unsigned fsev_flag_effect_rename
-  = kFSEventStreamEventFlagItemRenamed;
-inline constexpr unsigned fsev_flag_effect_any
-  = fsev_flag_effect_create
-  | fsev_flag_effect_remove
-  | fsev_flag_effect_modify_any
-  | fsev_flag_effect_rename;
+    Draining swaps the paths out for an empty set. They
+    are never copied, and we never hold onto more than
+    one entry for each path, however many events there
+    are between drains.
 
-// clang-format on
+    From the weakest to the strongest, the effects are:
+      other, owner, modify, rename, create, destroy
+    Both the old and the new name of a rename are
+    dirty. */
 
-struct ContextData {
-  using fspath = std::filesystem::path;
-  /*  `fs::path` has no hash function, so we use this. */
-  using pathset = std::unordered_set<std::string>;
+class dirty_set {
+public:
+  using effect = enum ::wtr::watcher::event::effect_type;
 
-  ::wtr::watcher::event::callback const& callback{};
-  pathset* seen_created_paths{nullptr};
-  fspath* last_rename_path{nullptr};
-  std::mutex* mtx{nullptr};
-};
+  struct hash {
+    inline auto operator()(std::filesystem::path const& p) const noexcept
+      -> size_t
+    {
+      return std::filesystem::hash_value(p);
+    }
+  };
 
-inline auto event_recv_one(ContextData& ctx, char const* path, unsigned flags)
-{
-  using pty = enum ::wtr::watcher::event::path_type;
-  using ety = enum ::wtr::watcher::event::effect_type;
+  using paths = std::unordered_map<std::filesystem::path, effect, hash>;
 
-  /*  A single path won't have different "types". */
-  auto pt = flags & fsev_flag_path_file      ? pty::file
-          : flags & fsev_flag_path_dir       ? pty::dir
-          : flags & fsev_flag_path_sym_link  ? pty::sym_link
-          : flags & fsev_flag_path_hard_link ? pty::hard_link
-                                             : pty::other;
-  /*  More than one thing can happen to the same path.
-      (So these `if`s are mostly not exclusive.)
-      We want to report odd events (even with an empty path)
-      but we can bail early if we don't recognize the effect
-      because everything else we do depends on that. */
-  if (! (flags & fsev_flag_effect_any)) {
-    ctx.callback({path, ety::other, pt});
-    return;
+private:
+  std::mutex mtx{};
+  paths set{};
+
+  static inline auto strength(effect et) noexcept -> int
+  {
+    /*  In the order of `effect_type` */
+    constexpr int strengths[] = {3, 2, 4, 5, 1, 0};
+    return strengths[(size_t)et];
   }
-  if (flags & fsev_flag_effect_create) {
-    auto at = ctx.seen_created_paths->find(path);
-    if (at == ctx.seen_created_paths->end()) {
-      ctx.seen_created_paths->emplace(path);
-      ctx.callback({path, ety::create, pt});
+
+public:
+  /*  When a directory's event stands for what was
+      destroyed beneath it, we have whatever we kept
+      beneath it as destroyed, too. */
+  inline auto push(::wtr::watcher::event const& ev) noexcept -> void
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    if (ev.folded && ev.effect_type == effect::destroy) {
+      auto const& dir = ev.path_name.native();
+      auto sep = std::filesystem::path::preferred_separator;
+      for (auto& [p, et] : this->set) {
+        auto const& k = p.native();
+        if (k.size() > dir.size() && k[dir.size()] == sep)
+          if (k.compare(0, dir.size(), dir) == 0) et = effect::destroy;
+      }
+    }
+    for (auto e = &ev; e; e = e->associated.get()) {
+      auto [at, is_new] = this->set.try_emplace(e->path_name, e->effect_type);
+      if (! is_new && strength(e->effect_type) > strength(at->second))
+        at->second = e->effect_type;
     }
   }
-  if (flags & fsev_flag_effect_remove) {
-    auto at = ctx.seen_created_paths->find(path);
-    if (at != ctx.seen_created_paths->end()) {
-      ctx.seen_created_paths->erase(at);
-      ctx.callback({path, ety::destroy, pt});
+
+  inline auto drain() noexcept -> paths
+  {
+    auto drained = paths{};
+    auto _ = std::scoped_lock{this->mtx};
+    return std::swap(this->set, drained), drained;
+  }
+};
+
+/*  When something last changed at, or beneath, each
+    path we've heard about. Those times are generations,
+    which go up by one with every event. The user asks
+    for the current generation (a cursor) and, later,
+    whether anything beneath some path has changed
+    since then.
+
+    Each event updates its path and that path's
+    ancestors, so a question about a path is answered
+    without looking at any events. The ancestors are
+    only asked whether they were created, destroyed or
+    renamed themselves, which would change everything
+    beneath them as well.
+
+    A path which is destroyed, with nothing we know of
+    beneath it, is forgotten, so that a tree with a lot
+    of churn (build directories, temporary files) doesn't
+    grow us without bound. Its parent remembers when
+    the last of the paths beneath it were forgotten. A
+    question about a path we don't know of is answered
+    by its nearest ancestor which we do. */
+
+class dirty_tree {
+public:
+  using cursor = unsigned long long;
+
+private:
+  using path = std::filesystem::path;
+  using view = std::basic_string_view<path::value_type>;
+  using key = std::basic_string<path::value_type>;
+
+  struct gens {
+    cursor self = 0;
+    cursor below = 0;
+    cursor gone = 0;
+    size_t kids = 0;
+  };
+
+  std::mutex mtx{};
+  cursor gen = 0;
+  std::unordered_map<key, gens> tree{};
+
+  static inline auto parent_of(view p) noexcept -> view
+  {
+    auto n = p.find_last_of(path::preferred_separator);
+    return n == view::npos ? view{}
+         : n == 0          ? p.substr(0, p.size() > 1 ? 1 : 0)
+                           : p.substr(0, n);
+  }
+
+  /*  Forgets a destroyed path, if nothing we know of
+      is beneath it, into its parent */
+  inline auto forget(key const& p, cursor now) -> void
+  {
+    auto at = this->tree.find(p);
+    if (at == this->tree.end() || at->second.kids > 0) return;
+    this->tree.erase(at);
+    auto up = this->tree.find(key{parent_of(p)});
+    if (up == this->tree.end()) return;
+    up->second.kids--;
+    up->second.gone = now;
+  }
+
+  static inline auto is_structural(::wtr::watcher::event const& ev) noexcept
+    -> bool
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    return ev.effect_type == et::create || ev.effect_type == et::destroy
+        || ev.effect_type == et::rename;
+  }
+
+public:
+  /*  Both names of a rename share a generation. We
+      stop climbing at the ancestors they share. */
+  inline auto push(::wtr::watcher::event const& ev) noexcept -> void
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    auto _ = std::scoped_lock{this->mtx};
+    auto now = ++this->gen;
+    for (auto e = &ev; e; e = e->associated.get()) {
+      auto const& p = e->path_name.native();
+      auto is_kid_new = false;
+      for (auto at = view{p}; ! at.empty(); at = parent_of(at)) {
+        auto [it, is_new] = this->tree.try_emplace(key{at});
+        auto& g = it->second;
+        if (is_kid_new) g.kids++;
+        is_kid_new = is_new;
+        if (g.below == now) break;
+        g.below = now;
+      }
+      if (is_structural(*e)) this->tree[p].self = now;
+      if (e->effect_type == et::destroy) forget(p, now);
     }
   }
-  if (flags & fsev_flag_effect_modify) {
-    ctx.callback({path, ety::modify, pt});
+
+  inline auto now() noexcept -> cursor
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    return this->gen;
   }
-  if (flags & fsev_flag_effect_rename) {
-    /*  Assumes that the last "renamed-from" path
-        is "honestly" correlated to the current
-        "rename-to" path.
-        For non-destructive rename events, we
-        usually receive events in this order:
-          1. A rename event on the "from-path"
-          2. A rename event on the "to-path"
-        As long as that pattern holds, we can
-        store the first path in a set, look it
-        up, test it against the current path
-        for inequality, and check that it no
-        longer exists -- In which case, we can
-        say that we were renamed from that path
-        to the current path.
-        We want to store the last rename-from
-        path in a set on the heap because the
-        rename events might not be batched, and
-        we don't want to trample on some other
-        watcher with a static.
-        This pattern breaks down if there are
-        intervening rename events.
-        For thoughts on recognizing destructive
-        rename events, see this directory's
-        notes (in the `notes.md` file).
-    */
-    auto lr_path = *ctx.last_rename_path;
-    auto differs = ! lr_path.empty() && lr_path != path;
-    auto missing = access(lr_path.c_str(), F_OK) == -1;
-    if (differs && missing)
-      ctx.callback({
-        {lr_path, ety::rename, pt},
-        {   path, ety::rename, pt}
-      }),
-        ctx.last_rename_path->clear();
-    else
-      *ctx.last_rename_path = path;
+
+  inline auto changed_since(path const& p, cursor since) noexcept -> bool
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    auto at = this->tree.find(p.native());
+    auto is_known = at != this->tree.end();
+    if (is_known && at->second.below > since) return true;
+    for (auto a = parent_of(p.native()); ! a.empty(); a = parent_of(a)) {
+      at = this->tree.find(key{a});
+      if (at == this->tree.end()) continue;
+      if (at->second.self > since) return true;
+      if (! is_known && at->second.gone > since) return true;
+      is_known = true;
+    }
+    return false;
   }
-}
 
-/*  Sometimes events are batched together and re-sent
-    (despite having already been sent).
-    Example:
-      [first batch of events from the os]
-      file 'a' created
-      -> create event for 'a' is sent
-      [some tiny delay, 1 ms or so]
-      [second batch of events from the os]
-      file 'a' destroyed
-      -> create event for 'a' is sent
-      -> destroy event for 'a' is sent
+  /*  How many paths we know of */
+  inline auto size() noexcept -> size_t
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    return this->tree.size();
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
+
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+namespace detail::wtr::watcher {
+
+/*  Small, dense numbers for the paths we tell the user
+    about, so that they can keep what they know about
+    each path in an array instead of a map.
+
+    A path keeps its number until it's destroyed. The
+    number is given to the next new path after that.
+    A rename takes its number along to the new name.
+    When a directory is renamed, the paths beneath it
+    keep their numbers, under their new names. When a
+    directory's event stands for what was destroyed
+    beneath it (see `event::folded`), those numbers
+    are given up as well.
+
+    We're filled from the watcher's thread and asked
+    about from the user's, so we take turns with a
+    mutex. The paths are kept in order, so that what's
+    beneath a directory is all in one place. */
+
+class path_ids {
+public:
+  using id = uint32_t;
+  static constexpr id none = ::wtr::watcher::event::no_path_id;
+
+private:
+  using path = std::filesystem::path;
+  using key = path::string_type;
+
+  std::mutex mtx{};
+  std::map<key, id> ids{};
+  std::vector<path> paths{};
+  std::vector<id> unused{};
+
+  inline auto intern(key const& k) -> id
+  {
+    auto at = this->ids.find(k);
+    if (at != this->ids.end()) return at->second;
+    auto i = id{};
+    if (this->unused.empty())
+      i = (id)this->paths.size(), this->paths.emplace_back(k);
+    else
+      i = this->unused.back(), this->unused.pop_back(), this->paths[i] = k;
+    return this->ids.emplace(k, i), i;
+  }
+
+  inline auto forget(key const& k) -> void
+  {
+    auto at = this->ids.find(k);
+    if (at == this->ids.end()) return;
+    this->paths[at->second].clear();
+    this->unused.push_back(at->second);
+    this->ids.erase(at);
+  }
+
+  static inline auto is_beneath(key const& p, key const& dir) -> bool
+  {
+    return p.size() > dir.size() && p[dir.size()] == path::preferred_separator
+        && p.compare(0, dir.size(), dir) == 0;
+  }
+
+  /*  Everything beneath a directory */
+  inline auto beneath(key const& dir) -> std::vector<key>
+  {
+    auto found = std::vector<key>{};
+    auto at = this->ids.lower_bound(dir + path::preferred_separator);
+    for (; at != this->ids.end() && is_beneath(at->first, dir); ++at)
+      found.push_back(at->first);
+    return found;
+  }
+
+  inline auto move(key const& from, key const& to) -> id
+  {
+    auto at = this->ids.find(from);
+    if (at == this->ids.end()) return intern(to);
+    auto i = at->second;
+    this->ids.erase(at);
+    forget(to);
+    this->paths[i] = to;
+    return this->ids.emplace(to, i), i;
+  }
+
+public:
+  /*  The event, with the ids of its paths */
+  inline auto stamp(::wtr::watcher::event const& ev) noexcept
+    -> ::wtr::watcher::event
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    auto _ = std::scoped_lock{this->mtx};
+    auto const& from = ev.path_name.native();
+    auto const* to = ev.associated.get();
+    auto is_dir = ev.path_type == ::wtr::watcher::event::path_type::dir;
+    if (to && ev.effect_type == et::rename) {
+      auto const& dest = to->path_name.native();
+      if (is_dir)
+        for (auto const& k : beneath(from))
+          move(k, dest + k.substr(from.size()));
+      auto i = move(from, dest);
+      return ev.with_path_ids(i, i);
+    }
+    auto i = intern(from);
+    auto j = to ? intern(to->path_name.native()) : none;
+    if (ev.effect_type == et::destroy && is_dir && ev.folded)
+      for (auto const& k : beneath(from)) forget(k);
+    if (ev.effect_type == et::destroy) forget(from);
+    return ev.with_path_ids(i, j);
+  }
+
+  inline auto id_of(path const& p) noexcept -> id
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    auto at = this->ids.find(p.native());
+    return at == this->ids.end() ? none : at->second;
+  }
+
+  /*  Empty if the id isn't in use */
+  inline auto path_of(id i) noexcept -> path
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    return i < this->paths.size() ? this->paths[i] : path{};
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace detail::wtr::watcher {
+
+/*  The directories (and, if asked for, the files) beneath
+    the path we watch, kept current with our events.
+
+    Readers on other threads are given snapshots, which
+    never change once they're published, and which they
+    can hold onto for as long as they like. If nothing
+    changed since the last snapshot, loading it is a
+    single atomic load.
+
+    The watcher's thread never waits on the readers to
+    make a snapshot. It only appends the events to a log.
+    Whoever asks for a snapshot next applies the log to a
+    copy of the last one and publishes it. The copy shares
+    everything but what the log changes with the last one,
+    so it costs about as much as the log. If no one asks
+    for a while, the watcher's thread does that itself,
+    now and then, to keep the log short.
+
+    The index is filled by the inventory we take when
+    we begin watching, and by the changes after that.
+
+    A rename from outside the tree adds only the path
+    itself, not what's beneath it. */
+
+class path_index {
+public:
+  using path = std::filesystem::path;
+  using key = path::string_type;
+
+  class snapshot {
+  private:
+    using view = std::basic_string_view<path::value_type>;
+    using chunk = std::vector<key>;
+    static constexpr auto sep = path::preferred_separator;
+    static constexpr size_t chunk_ulim = 1 << 9;
+
+    friend class path_index;
+    path root{};
+    bool files = false;
+    size_t count = 0;
+
+    /*  The paths, in order, in chunks. Each chunk is in
+        order, and comes before the next one. A snapshot
+        shares its chunks with the snapshot it was copied
+        from until it changes them. */
+    std::vector<std::shared_ptr<chunk>> chunks{};
+
+    inline auto key_of(path const& p) const -> key
+    {
+      auto abs = (p.is_absolute() ? p : this->root / p).lexically_normal();
+      return abs.has_filename() ? abs.native() : abs.parent_path().native();
+    }
+
+    /*  Everything beneath a path sorts between the path
+        followed by a separator and the path followed by
+        the character after the separator. */
+    static inline auto range_of(key const& k) -> std::pair<key, key>
+    {
+      return {k + sep, k + (path::value_type)(sep + 1)};
+    }
+
+    /*  The last chunk which begins at or before a key */
+    inline auto chunk_of(key const& k) const -> size_t
+    {
+      auto at = std::upper_bound(
+        this->chunks.begin(),
+        this->chunks.end(),
+        k,
+        [](key const& k, auto const& c) { return k < c->front(); });
+      return at == this->chunks.begin() ? 0 : at - this->chunks.begin() - 1;
+    }
+
+    /*  A chunk which we may change. We copy it first if
+        another snapshot has it. */
+    inline auto chunk_at(size_t i) -> chunk&
+    {
+      auto& c = this->chunks[i];
+      if (c.use_count() > 1) c = std::make_shared<chunk>(*c);
+      return *c;
+    }
+
+    /*  Calls `fn` with each path from `lo` up to `hi` */
+    template<class Fn>
+    inline auto each(key const& lo, key const& hi, Fn const& fn) const -> void
+    {
+      auto i = chunk_of(lo);
+      for (; i < this->chunks.size() && this->chunks[i]->front() < hi; i++) {
+        auto const& c = *this->chunks[i];
+        auto at = std::lower_bound(c.begin(), c.end(), lo);
+        for (; at != c.end() && *at < hi; ++at) fn(*at);
+      }
+    }
+
+    inline auto has(key const& k) const -> bool
+    {
+      if (this->chunks.empty()) return false;
+      auto const& c = *this->chunks[chunk_of(k)];
+      return std::binary_search(c.begin(), c.end(), k);
+    }
+
+    inline auto insert(key const& k) -> void
+    {
+      if (this->chunks.empty()) {
+        this->chunks.push_back(std::make_shared<chunk>(1, k));
+        this->count = 1;
+        return;
+      }
+      auto i = chunk_of(k);
+      auto const& seen = *this->chunks[i];
+      if (std::binary_search(seen.begin(), seen.end(), k)) return;
+      auto& c = chunk_at(i);
+      c.insert(std::lower_bound(c.begin(), c.end(), k), k);
+      this->count++;
+      if (c.size() > chunk_ulim) {
+        auto half = c.begin() + c.size() / 2;
+        auto next = std::make_shared<chunk>(half, c.end());
+        c.erase(half, c.end());
+        this->chunks.insert(this->chunks.begin() + i + 1, std::move(next));
+      }
+    }
+
+    /*  Erases the paths from `lo` up to `hi` */
+    inline auto erase(key const& lo, key const& hi) -> void
+    {
+      auto i = chunk_of(lo);
+      while (i < this->chunks.size() && this->chunks[i]->front() < hi) {
+        auto const& seen = *this->chunks[i];
+        auto a = std::lower_bound(seen.begin(), seen.end(), lo);
+        auto b = std::lower_bound(a, seen.end(), hi);
+        auto from = a - seen.begin();
+        auto len = b - a;
+        if (len == 0) {
+          i++;
+          continue;
+        }
+        auto& c = chunk_at(i);
+        c.erase(c.begin() + from, c.begin() + from + len);
+        this->count -= len;
+        if (c.empty())
+          this->chunks.erase(this->chunks.begin() + i);
+        else
+          i++;
+      }
+    }
+
+    /*  Erases a path and everything beneath it */
+    inline auto erase(key const& k) -> void
+    {
+      auto [lo, hi] = range_of(k);
+      erase(lo, hi);
+      erase(k, k + path::value_type{});
+    }
+
+    inline auto is_kept(::wtr::watcher::event const& ev) const -> bool
+    {
+      using pt = enum ::wtr::watcher::event::path_type;
+      return ev.path_type == pt::dir
+          || (this->files && ev.path_type != pt::watcher);
+    }
+
+    inline auto
+    move(key const& from, key const& to, ::wtr::watcher::event const& ev)
+      -> void
+    {
+      auto moved = std::vector<key>{};
+      auto [lo, hi] = range_of(from);
+      each(
+        lo,
+        hi,
+        [&](key const& k) { moved.push_back(to + k.substr(from.size())); });
+      erase(from);
+      erase(to);
+      if (is_kept(ev)) insert(to);
+      for (auto const& k : moved) insert(k);
+    }
+
+    inline auto apply(::wtr::watcher::event const& ev) -> void
+    {
+      using et = enum ::wtr::watcher::event::effect_type;
+      auto const& p = ev.path_name.native();
+      auto const* to = ev.associated.get();
+      if (ev.effect_type == et::destroy)
+        erase(p);
+      else if (ev.effect_type == et::rename && to)
+        move(p, to->path_name.native(), *to);
+      else if (ev.effect_type == et::rename && has(p))
+        erase(p);
+      else if (is_kept(ev))
+        insert(p);
+    }
+
+  public:
+    unsigned long long version = 0;
+
+    inline auto size() const noexcept -> size_t { return this->count; }
+
+    inline auto contains(path const& p) const -> bool
+    {
+      return has(key_of(p));
+    }
+
+    /*  Everything beneath a path, in order */
+    inline auto below(path const& p) const -> std::vector<path>
+    {
+      auto in = std::vector<path>{};
+      auto [lo, hi] = range_of(key_of(p));
+      each(lo, hi, [&](key const& k) { in.emplace_back(k); });
+      return in;
+    }
+
+    /*  What's directly beneath a path, in order */
+    inline auto within(path const& p) const -> std::vector<path>
+    {
+      auto k = key_of(p);
+      auto in = std::vector<path>{};
+      auto [lo, hi] = range_of(k);
+      each(
+        lo,
+        hi,
+        [&](key const& at)
+        {
+          if (view{at}.find(sep, k.size() + 1) == view::npos)
+            in.emplace_back(at);
+        });
+      return in;
+    }
+  };
+
+  using snapshot_ptr = std::shared_ptr<snapshot const>;
+
+private:
+  static constexpr size_t log_ulim = 1 << 16;
+
+  /*  The free functions for atomic shared pointers are
+      deprecated once there's a specialization. */
+#if defined(__cpp_lib_atomic_shared_ptr)
+  std::atomic<snapshot_ptr> published{};
+
+  inline auto load() const -> snapshot_ptr { return this->published.load(); }
+
+  inline auto store(snapshot_ptr s) -> void
+  {
+    this->published.store(std::move(s));
+  }
+#else
+  snapshot_ptr published{};
+
+  inline auto load() const -> snapshot_ptr
+  {
+    return std::atomic_load(&this->published);
+  }
+
+  inline auto store(snapshot_ptr s) -> void
+  {
+    std::atomic_store(&this->published, std::move(s));
+  }
+#endif
+
+  std::mutex log_mtx{};
+  std::vector<::wtr::watcher::event> log{};
+  std::atomic<bool> is_stale = false;
+  std::mutex build_mtx{};
+
+  /*  With the build mutex */
+  inline auto publish() -> void
+  {
+    auto log = std::vector<::wtr::watcher::event>{};
+    {
+      auto _ = std::scoped_lock{this->log_mtx};
+      std::swap(log, this->log);
+      this->is_stale = false;
+    }
+    auto last = load();
+    if (log.empty() || ! last) return;
+    auto next = std::make_shared<snapshot>(*last);
+    for (auto const& ev : log) next->apply(ev);
+    next->version++;
+    store(std::move(next));
+  }
+
+public:
+  /*  Publishes the first, empty, snapshot. It's filled
+      by the inventory. */
+  inline auto begin(path const& root, bool files) noexcept -> void
+  {
+    auto first = std::make_shared<snapshot>();
+    first->root = root;
+    first->files = files;
+    store(std::move(first));
+  }
+
+  inline auto push(::wtr::watcher::event const& ev) noexcept -> void
+  {
+    push(&ev, &ev + 1);
+  }
+
+  inline auto push(std::vector<::wtr::watcher::event> const& evs) noexcept
+    -> void
+  {
+    push(evs.data(), evs.data() + evs.size());
+  }
+
+  inline auto push(
+    ::wtr::watcher::event const* const evs,
+    ::wtr::watcher::event const* const end) noexcept -> void
+  {
+    auto len = size_t{0};
+    {
+      auto _ = std::scoped_lock{this->log_mtx};
+      for (auto ev = evs; ev != end; ++ev) this->log.push_back(*ev);
+      this->is_stale = true;
+      len = this->log.size();
+    }
+    if (len >= log_ulim && this->build_mtx.try_lock())
+      publish(), this->build_mtx.unlock();
+  }
+
+  /*  Null until we've begun */
+  inline auto now() noexcept -> snapshot_ptr
+  {
+    if (this->is_stale) {
+      auto _ = std::scoped_lock{this->build_mtx};
+      publish();
+    }
+    return load();
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
+
+#include <mutex>
+
+namespace detail::wtr::watcher {
+
+/*  The last we heard of how far behind the kernel we
+    are. We're told from the watcher's thread (or its
+    shards') and asked from the user's, so we take
+    turns with a mutex. */
+
+class backlog_gauge {
+public:
+  using stats = ::wtr::watcher::backlog_stats;
+
+private:
+  std::mutex mtx{};
+  stats st{};
+
+public:
+  inline auto push(stats const& st) -> void
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    this->st = st;
+  }
+
+  inline auto now() -> stats
+  {
+    auto _ = std::scoped_lock{this->mtx};
+    return this->st;
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace detail::wtr::watcher {
+
+/*  XXH64, a fast, non-cryptographic hash, fed in
+    pieces. Four independent lanes of 64-bit words,
+    which the compiler is free to keep in registers
+    (or in vectors) while we stream a file through. */
+struct xxh64 {
+  static constexpr uint64_t p1 = 0x9e3779b185ebca87ULL;
+  static constexpr uint64_t p2 = 0xc2b2ae3d27d4eb4fULL;
+  static constexpr uint64_t p3 = 0x165667b19e3779f9ULL;
+  static constexpr uint64_t p4 = 0x85ebca77c2b2ae63ULL;
+  static constexpr uint64_t p5 = 0x27d4eb2f165667c5ULL;
+
+  uint64_t lanes[4]{p1 + p2, p2, 0, 0 - p1};
+  unsigned char tail[32]{};
+  size_t tail_len = 0;
+  uint64_t total_len = 0;
+
+  static inline auto rotl(uint64_t x, int r) -> uint64_t
+  {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  static inline auto round(uint64_t acc, uint64_t in) -> uint64_t
+  {
+    return rotl(acc + in * p2, 31) * p1;
+  }
+
+  static inline auto merge(uint64_t acc, uint64_t lane) -> uint64_t
+  {
+    return (acc ^ round(0, lane)) * p1 + p4;
+  }
+
+  /*  Little-endian, wherever we are */
+  static inline auto u64_of(unsigned char const* p) -> uint64_t
+  {
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; --i) x = (x << 8) | p[i];
+    return x;
+  }
+
+  static inline auto u32_of(unsigned char const* p) -> uint64_t
+  {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+         | (uint64_t)p[3] << 24;
+  }
+
+  inline auto stripe(unsigned char const* p) -> void
+  {
+    for (int i = 0; i < 4; ++i)
+      this->lanes[i] = round(this->lanes[i], u64_of(p + i * 8));
+  }
+
+  inline auto push(void const* data, size_t len) -> void
+  {
+    auto p = (unsigned char const*)data;
+    auto end = p + len;
+    this->total_len += len;
+    if (this->tail_len) {
+      auto n = std::min(len, sizeof(this->tail) - this->tail_len);
+      memcpy(this->tail + this->tail_len, p, n);
+      this->tail_len += n, p += n;
+      if (this->tail_len < sizeof(this->tail)) return;
+      stripe(this->tail), this->tail_len = 0;
+    }
+    for (; end - p >= 32; p += 32) stripe(p);
+    memcpy(this->tail, p, end - p);
+    this->tail_len = end - p;
+  }
+
+  inline auto digest() const -> uint64_t
+  {
+    auto const* l = this->lanes;
+    auto h = this->total_len >= 32
+             ? merge(
+                 merge(
+                   merge(
+                     merge(
+                       rotl(l[0], 1) + rotl(l[1], 7) + rotl(l[2], 12)
+                         + rotl(l[3], 18),
+                       l[0]),
+                     l[1]),
+                   l[2]),
+                 l[3])
+             : l[2] + p5;
+    h += this->total_len;
+    auto p = this->tail;
+    auto end = p + this->tail_len;
+    for (; end - p >= 8; p += 8)
+      h = rotl(h ^ round(0, u64_of(p)), 27) * p1 + p4;
+    if (end - p >= 4) h = rotl(h ^ (u32_of(p) * p1), 23) * p2 + p3, p += 4;
+    for (; p < end; ++p) h = rotl(h ^ (*p * p5), 11) * p1;
+    h ^= h >> 33, h *= p2, h ^= h >> 29, h *= p3, h ^= h >> 32;
+    return h;
+  }
+};
+
+/*  Drops the `modify` events of files whose contents
+    are the same as when we last sent one.
+
+    The reader gives us every event, in order, and
+    goes back to the kernel. Our workers look at the
+    files which were modified, in parallel, and send
+    the events along in the order they were given to
+    us, one at a time, from whichever worker finished
+    the oldest of them.
+
+    We keep each file's size, modification time and
+    hash. If the size and the time haven't changed,
+    the contents haven't either, and we don't read
+    the file. Otherwise, we read it in pieces, so a
+    large file never needs to fit in memory.
+    Whether the contents are the same is decided as
+    the events are sent, in order. When in doubt,
+    we send the event.
+
+    The first change we see to a file is always sent,
+    because we don't know what was there before it.
+    A new file's contents are unknown until it's
+    modified. */
+class rewrites {
+public:
+  using send_fn = std::function<void(::wtr::watcher::event const&)>;
+
+private:
+  using path = std::filesystem::path;
+  using key = path::string_type;
+  static constexpr size_t read_len = 1 << 16;
+
+  struct seen {
+    uintmax_t size = 0;
+    long long mtime = 0;
+    uint64_t hash = 0;
+    bool is_hashed = false;
+  };
+
+  struct slot {
+    ::wtr::watcher::event ev;
+    bool is_ready = false;
+    bool is_stat = false;
+    seen now{};
+  };
+
+  send_fn send{};
+  std::vector<std::thread> workers{};
+
+  std::mutex q_mtx{};
+  std::condition_variable q_cv{};
+  std::deque<slot> q{};
+  std::deque<slot*> todo{};
+  bool is_closing = false;
+
+  std::mutex send_mtx{};
+
+  std::mutex seen_mtx{};
+  std::unordered_map<key, seen> files{};
+
+  static inline auto is_hashed(::wtr::watcher::event const& ev) -> bool
+  {
+    using pt = enum ::wtr::watcher::event::path_type;
+    return ev.effect_type == ::wtr::watcher::event::effect_type::modify
+        && (ev.path_type == pt::file || ev.path_type == pt::hard_link);
+  }
+
+  static inline auto hash_of(path const& p, uint64_t* hash) -> bool
+  {
+    auto buf = std::vector<char>(read_len);
+    auto f = std::ifstream{p, std::ios::binary};
+    auto h = xxh64{};
+    while (f.read(buf.data(), read_len) || f.gcount() > 0)
+      h.push(buf.data(), (size_t)f.gcount());
+    return f.eof() && (*hash = h.digest(), true);
+  }
+
+  /*  Off the reader's thread */
+  inline auto look(slot& s) -> void
+  {
+    auto ec = std::error_code{};
+    auto const& p = s.ev.path_name;
+    auto size = std::filesystem::file_size(p, ec);
+    auto mtime = ec ? 0 : std::filesystem::last_write_time(p, ec)
+                            .time_since_epoch()
+                            .count();
+    if (ec) return;
+    s.now = seen{size, (long long)mtime};
+    s.is_stat = true;
+    {
+      auto _ = std::scoped_lock{this->seen_mtx};
+      auto at = this->files.find(p.native());
+      if (at != this->files.end() && at->second.size == size
+          && at->second.mtime == s.now.mtime)
+        return;
+    }
+    s.now.is_hashed = hash_of(p, &s.now.hash);
+  }
+
+  /*  In order. Keeps what we know about each file in
+      step with what we've sent. */
+  inline auto is_same(slot const& s) -> bool
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    auto _ = std::scoped_lock{this->seen_mtx};
+    auto const& ev = s.ev;
+    auto const& p = ev.path_name.native();
+    if (is_hashed(ev)) {
+      if (! s.is_stat) return this->files.erase(p), false;
+      auto at = this->files.find(p);
+      if (at == this->files.end()) {
+        if (s.now.is_hashed) this->files.insert_or_assign(p, s.now);
+        return false;
+      }
+      auto& was = at->second;
+      if (was.size == s.now.size && was.mtime == s.now.mtime) return true;
+      if (! s.now.is_hashed) return this->files.erase(at), false;
+      auto is_hash_same = was.hash == s.now.hash;
+      return was = s.now, is_hash_same;
+    }
+    if (ev.effect_type == et::rename && ev.associated) {
+      auto const& to = ev.associated->path_name.native();
+      auto n = this->files.extract(p);
+      this->files.erase(to);
+      if (n) n.key() = to, this->files.insert(std::move(n));
+    }
+    else if (ev.effect_type != et::modify && ev.effect_type != et::owner)
+      this->files.erase(p);
+    return false;
+  }
+
+  /*  Whatever's ready at the front of the line */
+  inline auto send_ready() -> void
+  {
+    auto _ = std::scoped_lock{this->send_mtx};
+    for (;;) {
+      auto lk = std::unique_lock{this->q_mtx};
+      if (this->q.empty() || ! this->q.front().is_ready) return;
+      auto s = std::move(this->q.front());
+      this->q.pop_front();
+      lk.unlock();
+      if (! is_same(s)) this->send(s.ev);
+    }
+  }
+
+  inline auto work() -> void
+  {
+    for (;;) {
+      auto lk = std::unique_lock{this->q_mtx};
+      this->q_cv.wait(
+        lk,
+        [this] { return this->is_closing || ! this->todo.empty(); });
+      if (this->todo.empty()) return;
+      auto s = this->todo.front();
+      this->todo.pop_front();
+      lk.unlock();
+      if (is_hashed(s->ev)) look(*s);
+      lk.lock();
+      s->is_ready = true;
+      lk.unlock();
+      send_ready();
+    }
+  }
+
+public:
+  static inline auto worker_count() -> unsigned
+  {
+    return std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+  }
+
+  inline rewrites(send_fn const& send, unsigned workers) noexcept
+      : send{send}
+  {
+    for (unsigned i = 0; i < workers; ++i)
+      this->workers.emplace_back([this] { work(); });
+  }
+
+  inline auto push(::wtr::watcher::event const& ev) noexcept -> void
+  {
+    {
+      auto _ = std::scoped_lock{this->q_mtx};
+      this->todo.push_back(&this->q.emplace_back(slot{ev}));
+    }
+    this->q_cv.notify_one();
+  }
+
+  /*  Sends whatever we were given, then stops */
+  inline auto close() noexcept -> void
+  {
+    {
+      auto _ = std::scoped_lock{this->q_mtx};
+      this->is_closing = true;
+    }
+    this->q_cv.notify_all();
+    for (auto& w : this->workers)
+      if (w.joinable()) w.join();
+  }
+
+  inline ~rewrites() noexcept { close(); }
+};
+
+} /*  namespace detail::wtr::watcher */
+
+#include <filesystem>
+#include <stddef.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if ! defined(_WIN32)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace detail::wtr::watcher {
+
+/*  The sizes of the files we tail, for the bytes which
+    were appended to them.
+
+    We keep each file open, so that its size is one
+    `fstat` away, and so that a file keeps its size
+    when it's renamed, as logs are when they're rotated.
+    Past `fd_ulim` files, we ask for sizes by path.
+    (There are no descriptors to keep on Windows.)
+
+    A new file begins empty, so its first write is
+    appended from the beginning. So is the first write
+    to a file we didn't know about. A file which is
+    smaller than it was was truncated.
+
+    We're only used from one thread at a time. */
+class tails {
+  using path = std::filesystem::path;
+  using key = path::string_type;
+  using size_type = unsigned long long;
+  static constexpr size_t fd_ulim = 256;
+
+  struct file {
+    int fd = -1;
+    size_type size = 0;
+  };
+
+  std::vector<path> roots{};
+  std::unordered_map<key, file> files{};
+  size_t fd_c = 0;
+
+#if defined(_WIN32)
+  static inline auto open_of(path const&) -> int { return -1; }
+
+  static inline auto close_of(int) -> void {}
+#else
+  static inline auto open_of(path const& p) -> int
+  {
+    struct stat s;
+    int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd >= 0 && (fstat(fd, &s) != 0 || ! S_ISREG(s.st_mode)))
+      close(fd), fd = -1;
+    return fd;
+  }
+
+  static inline auto close_of(int fd) -> void
+  {
+    if (fd >= 0) close(fd);
+  }
+#endif
+
+  static inline auto size_of(file const& f, path const& p, size_type* size)
+    -> bool
+  {
+#if ! defined(_WIN32)
+    struct stat s;
+    if (f.fd >= 0) return fstat(f.fd, &s) == 0 && (*size = s.st_size, true);
+#endif
+    auto ec = std::error_code{};
+    *size = std::filesystem::file_size(p, ec);
+    return ! ec;
+  }
+
+  inline auto is_tailed(key const& p) const -> bool
+  {
+    constexpr auto sep = path::preferred_separator;
+    for (auto const& r : this->roots) {
+      auto const& k = r.native();
+      auto is_under = p.size() > k.size() && p[k.size()] == sep;
+      auto is_same = p.size() == k.size();
+      if ((is_same || is_under) && p.compare(0, k.size(), k) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  inline auto forget(key const& p) -> void
+  {
+    auto at = this->files.find(p);
+    if (at == this->files.end()) return;
+    if (at->second.fd >= 0) close_of(at->second.fd), this->fd_c--;
+    this->files.erase(at);
+  }
+
+  inline auto keep(key const& p) -> file&
+  {
+    auto [at, is_new] = this->files.try_emplace(p);
+    if (is_new && this->fd_c < fd_ulim) at->second.fd = open_of(p);
+    if (is_new && at->second.fd >= 0) this->fd_c++;
+    return at->second;
+  }
+
+public:
+  inline tails(std::vector<path> const& roots) noexcept
+      : roots{roots}
+  {}
+
+  /*  What's there when we begin */
+  inline auto begin() noexcept -> void
+  {
+    namespace fs = std::filesystem;
+    auto ec = std::error_code{};
+    auto opt = fs::directory_options::skip_permission_denied;
+    auto seed = [this](path const& p)
+    {
+      auto& f = keep(p.native());
+      if (! size_of(f, p, &f.size)) f.size = 0;
+    };
+    for (auto const& r : this->roots) {
+      if (fs::is_regular_file(r, ec)) seed(r);
+      if (! fs::is_directory(r, ec)) continue;
+      auto at = fs::recursive_directory_iterator(r, opt, ec);
+      auto end = fs::recursive_directory_iterator{};
+      for (; ! ec && at != end; at.increment(ec)) {
+        auto file_ec = std::error_code{};
+        if (at->is_regular_file(file_ec)) seed(at->path());
+      }
+    }
+  }
+
+  /*  The event, with what was appended if it's a write
+      to a file we tail */
+  inline auto stamp(::wtr::watcher::event const& ev) noexcept
+    -> ::wtr::watcher::event
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    using pt = enum ::wtr::watcher::event::path_type;
+    using range = ::wtr::watcher::event::byte_range;
+    auto const& p = ev.path_name.native();
+    auto const* to = ev.associated.get();
+    if (ev.path_type != pt::file && ev.path_type != pt::hard_link) return ev;
+    if (ev.effect_type == et::rename && to) {
+      auto const& dest = to->path_name.native();
+      auto n = this->files.extract(p);
+      forget(dest);
+      if (n && is_tailed(dest))
+        n.key() = dest, this->files.insert(std::move(n));
+      else if (n && n.mapped().fd >= 0)
+        close_of(n.mapped().fd), this->fd_c--;
+      return ev;
+    }
+    if (! is_tailed(p)) return ev;
+    if (ev.effect_type == et::create) forget(p), keep(p).size = 0;
+    if (ev.effect_type == et::destroy || ev.effect_type == et::rename)
+      forget(p);
+    if (ev.effect_type != et::modify) return ev;
+    auto& f = keep(p);
+    auto size = size_type{0};
+    if (! size_of(f, ev.path_name, &size)) return ev;
+    auto is_truncated = size < f.size;
+    auto begin = is_truncated ? 0 : f.size;
+    f.size = size;
+    return ev.with_appended(range{begin, size, is_truncated});
+  }
+
+  inline ~tails() noexcept
+  {
+    for (auto& [_, f] : this->files) close_of(f.fd);
+  }
+};
+
+} /*  namespace detail::wtr::watcher */
+
+#include <algorithm>
+#include <filesystem>
+#include <unordered_set>
+#include <vector>
+
+namespace detail::wtr::watcher {
+
+/*  The files we were asked to watch, instead of
+    everything beneath a path, as from a manifest.
+
+    We look events up by their (absolute) names as
+    they go by. A rename is about one of our files
+    when either of its names is. An empty set has
+    everything in it. */
+class file_set {
+  using path = std::filesystem::path;
+  using key = path::string_type;
+
+  std::unordered_set<key> files{};
+
+public:
+  inline file_set(std::vector<path> const& files) noexcept
+  {
+    this->files.reserve(files.size());
+    for (auto const& f : files) this->files.insert(f.native());
+  }
+
+  inline auto contains(::wtr::watcher::event const& ev) const noexcept -> bool
+  {
+    auto const* to = ev.associated.get();
+    return this->files.empty() || this->files.count(ev.path_name.native())
+        || (to && this->files.count(to->path_name.native()));
+  }
+};
+
+/*  The distinct directories which the files are in,
+    for the adapters to watch (and nothing else) */
+inline auto dirs_of(std::vector<std::filesystem::path> const& files)
+  -> std::vector<std::filesystem::path>
+{
+  auto dirs = std::vector<std::filesystem::path>{};
+  dirs.reserve(files.size());
+  for (auto const& f : files) dirs.push_back(f.parent_path());
+  std::sort(dirs.begin(), dirs.end());
+  dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+  return dirs;
+}
+
+} /*  namespace detail::wtr::watcher */
+
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace detail::wtr::watcher {
+
+/*  The deepest part of a path which exists, which may
+    be the path itself. Whatever's there counts, even
+    a link to nowhere. */
+inline auto deepest_of(std::filesystem::path const& path)
+  -> std::filesystem::path
+{
+  auto at = path;
+  auto ec = std::error_code{};
+  while (! std::filesystem::exists(std::filesystem::symlink_status(at, ec))
+         && at.has_relative_path())
+    at = at.parent_path();
+  return at;
+}
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+
+/*  Waits for an (absolute) path to exist. True if it
+    does, false if we were closed first.
+
+    We mark the deepest directory along the path which
+    exists, and nothing else. When something is made
+    (or moved) there, we look again, and move our mark
+    further down the path. When the directory we marked
+    goes away, we move it back up. We look again after
+    every move, for whatever was made in the meantime.
+    One mark, and a few `stat`s each time we wake.
+
+    If `inotify` won't have us, we poll. */
+inline auto wait_for(std::filesystem::path const& path, semabin const& living)
+  -> bool
+{
+  using namespace std::chrono_literals;
+  constexpr auto msk = IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+                     | IN_ONLYDIR;
+  constexpr auto buf_len = 4096;
+  alignas(inotify_event) char buf[buf_len];
+  int in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  int wd = -1;
+  auto marked = std::filesystem::path{};
+  auto is_there = false;
+  /*  Our mark goes away (or along) with its directory */
+  auto forget_if_gone = [&](inotify_event const* const in_ev)
+  {
+    auto is_gone = in_ev->mask & (IN_IGNORED | IN_MOVE_SELF);
+    if (in_ev->wd == wd && is_gone) wd = -1, marked.clear();
+  };
+  while (! is_there && living.state() == semabin::pending) {
+    auto at = deepest_of(path);
+    auto ec = std::error_code{};
+    if ((is_there = at == path)) break;
+    if (! std::filesystem::is_directory(at, ec)) at = at.parent_path();
+    if (in_fd >= 0 && at != marked) {
+      if (wd >= 0) inotify_rm_watch(in_fd, wd);
+      wd = inotify_add_watch(in_fd, at.c_str(), msk);
+      marked = wd >= 0 ? at : std::filesystem::path{};
+      if (wd >= 0) continue;
+    }
+    if (in_fd < 0 || wd < 0) {
+      std::this_thread::sleep_for(16ms);
+      continue;
+    }
+    pollfd fds[] = {{in_fd, POLLIN, 0}, {living.fd, POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+    for (ssize_t len; (len = read(in_fd, buf, buf_len)) > 0;)
+      for (auto p = buf; p < buf + len;) {
+        auto in_ev = (inotify_event const*)p;
+        forget_if_gone(in_ev);
+        p += sizeof(inotify_event) + in_ev->len;
+      }
+  }
+  if (in_fd >= 0) close(in_fd);
+  return is_there;
+}
+
+#else
+
+/*  Waits for an (absolute) path to exist. True if it
+    does, false if we were closed first. There's no
+    one mark to move down the path here, so we poll. */
+inline auto wait_for(std::filesystem::path const& path, semabin const& living)
+  -> bool
+{
+  using namespace std::chrono_literals;
+  while (living.state() == semabin::pending)
+    if (deepest_of(path) == path)
+      return true;
+    else
+      std::this_thread::sleep_for(16ms);
+  return false;
+}
+
+#endif
+
+} /*  namespace detail::wtr::watcher */
+
+#if defined(__APPLE__)
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <CoreServices/CoreServices.h>
+#include <dispatch/dispatch.h>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+namespace detail {
+namespace wtr {
+namespace watcher {
+namespace adapter {
+namespace {
+
+// clang-format off
+
+/*  If we want less "sleepy" time after a period of time
+    without receiving filesystem events, we could OR like:
+    `fsev_flag_listen | kFSEventStreamCreateFlagNoDefer`.
+    We're talking about saving a maximum latency of `delay_s`
+    after some period of inactivity, which is not likely to
+    be noticeable. I'm not sure what Darwin sets the "period
+    of inactivity" to, and I'm not sure it matters. */
+inline constexpr unsigned fsev_listen_for
+  = kFSEventStreamCreateFlagFileEvents;
+inline constexpr auto fsev_listen_since
+  = kFSEventStreamEventIdSinceNow;
+inline constexpr unsigned fsev_flag_path_file
+  = kFSEventStreamEventFlagItemIsFile;
+inline constexpr unsigned fsev_flag_path_dir
+  = kFSEventStreamEventFlagItemIsDir;
+inline constexpr unsigned fsev_flag_path_sym_link
+  = kFSEventStreamEventFlagItemIsSymlink;
+inline constexpr unsigned fsev_flag_path_hard_link
+  = kFSEventStreamEventFlagItemIsHardlink
+  | kFSEventStreamEventFlagItemIsLastHardlink;
+inline constexpr unsigned fsev_flag_effect_create
+  = kFSEventStreamEventFlagItemCreated;
+inline constexpr unsigned fsev_flag_effect_remove
+  = kFSEventStreamEventFlagItemRemoved;
+inline constexpr unsigned fsev_flag_effect_modify_any
+  = kFSEventStreamEventFlagItemModified
+  | kFSEventStreamEventFlagItemChangeOwner
+  | kFSEventStreamEventFlagItemXattrMod
+  | kFSEventStreamEventFlagItemFinderInfoMod
+  | kFSEventStreamEventFlagItemInodeMetaMod;
+inline constexpr unsigned fsev_flag_effect_modify
+  = fsev_flag_effect_modify_any
+  & ~kFSEventStreamEventFlagItemInodeMetaMod;
+inline constexpr unsigned fsev_flag_effect_rename
+  = kFSEventStreamEventFlagItemRenamed;
+inline constexpr unsigned fsev_flag_effect_any
+  = fsev_flag_effect_create
+  | fsev_flag_effect_remove
+  | fsev_flag_effect_modify_any
+  | fsev_flag_effect_rename;
+
+// clang-format on
+
+struct ContextData {
+  using fspath = std::filesystem::path;
+  /*  `fs::path` has no hash function, so we use this. */
+  using pathset = std::unordered_set<std::string>;
+
+  ::wtr::watcher::event::callback const& callback{};
+  pathset* seen_created_paths{nullptr};
+  fspath* last_rename_path{nullptr};
+  std::mutex* mtx{nullptr};
+};
+
+inline auto event_recv_one(ContextData& ctx, char const* path, unsigned flags)
+{
+  using pty = enum ::wtr::watcher::event::path_type;
+  using ety = enum ::wtr::watcher::event::effect_type;
+
+  /*  A single path won't have different "types". */
+  auto pt = flags & fsev_flag_path_file      ? pty::file
+          : flags & fsev_flag_path_dir       ? pty::dir
+          : flags & fsev_flag_path_sym_link  ? pty::sym_link
+          : flags & fsev_flag_path_hard_link ? pty::hard_link
+                                             : pty::other;
+  /*  More than one thing can happen to the same path.
+      (So these `if`s are mostly not exclusive.)
+      We want to report odd events (even with an empty path)
+      but we can bail early if we don't recognize the effect
+      because everything else we do depends on that. */
+  if (! (flags & fsev_flag_effect_any)) {
+    ctx.callback({path, ety::other, pt});
+    return;
+  }
+  if (flags & fsev_flag_effect_create) {
+    auto at = ctx.seen_created_paths->find(path);
+    if (at == ctx.seen_created_paths->end()) {
+      ctx.seen_created_paths->emplace(path);
+      ctx.callback({path, ety::create, pt});
+    }
+  }
+  if (flags & fsev_flag_effect_remove) {
+    auto at = ctx.seen_created_paths->find(path);
+    if (at != ctx.seen_created_paths->end()) {
+      ctx.seen_created_paths->erase(at);
+      ctx.callback({path, ety::destroy, pt});
+    }
+  }
+  if (flags & fsev_flag_effect_modify) {
+    ctx.callback({path, ety::modify, pt});
+  }
+  if (flags & fsev_flag_effect_rename) {
+    /*  Assumes that the last "renamed-from" path
+        is "honestly" correlated to the current
+        "rename-to" path.
+        For non-destructive rename events, we
+        usually receive events in this order:
+          1. A rename event on the "from-path"
+          2. A rename event on the "to-path"
+        As long as that pattern holds, we can
+        store the first path in a set, look it
+        up, test it against the current path
+        for inequality, and check that it no
+        longer exists -- In which case, we can
+        say that we were renamed from that path
+        to the current path.
+        We want to store the last rename-from
+        path in a set on the heap because the
+        rename events might not be batched, and
+        we don't want to trample on some other
+        watcher with a static.
+        This pattern breaks down if there are
+        intervening rename events.
+        For thoughts on recognizing destructive
+        rename events, see this directory's
+        notes (in the `notes.md` file).
+    */
+    auto lr_path = *ctx.last_rename_path;
+    auto differs = ! lr_path.empty() && lr_path != path;
+    auto missing = access(lr_path.c_str(), F_OK) == -1;
+    if (differs && missing)
+      ctx.callback({
+        {lr_path, ety::rename, pt},
+        {   path, ety::rename, pt}
+      }),
+        ctx.last_rename_path->clear();
+    else
+      *ctx.last_rename_path = path;
+  }
+}
+
+/*  Sometimes events are batched together and re-sent
+    (despite having already been sent).
+    Example:
+      [first batch of events from the os]
+      file 'a' created
+      -> create event for 'a' is sent
+      [some tiny delay, 1 ms or so]
+      [second batch of events from the os]
+      file 'a' destroyed
+      -> create event for 'a' is sent
+      -> destroy event for 'a' is sent
     So, we filter out duplicate events when they're sent
     in a batch. We do this by storing and pruning the
     set of paths which we've seen created. */
@@ -786,6 +2661,9 @@ close_event_stream(FSEventStreamRef stream, ContextData& ctx) -> bool
 
 } /*  namespace */
 
+/*  We don't take an inventory. The `watch` does. */
+inline constexpr bool has_inventory = false;
+
 /*  Lifetimes
     We will ensure that the queue, context and callback
     are alive at least until we close the event stream.
@@ -798,7 +2676,8 @@ close_event_stream(FSEventStreamRef stream, ContextData& ctx) -> bool
 inline auto watch(
   std::filesystem::path const& path,
   ::wtr::watcher::event::callback const& cb,
-  semabin const& living) -> bool
+  semabin const& living,
+  ::wtr::watcher::watch_options const&) -> bool
 {
   auto seen_created_paths = ContextData::pathset{};
   auto last_rename_path = ContextData::fspath{};
@@ -820,17 +2699,30 @@ inline auto watch(
 #if (defined(__linux__) || __ANDROID_API__) \
   && ! defined(WATER_WATCHER_USE_WARTHOG)
 
+#include <algorithm>
+#include <array>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <string_view>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 namespace detail::wtr::watcher::adapter {
 
@@ -846,10 +2738,12 @@ enum class result : unsigned short {
   pending = 0,
   w,
   w_sys_not_watched,
+  w_sys_polled,
   w_sys_phantom,
   w_sys_bad_fd,
   w_sys_bad_meta,
   w_sys_q_overflow,
+  w_sys_q_near,
   complete,
   e,
   e_sys_api_inotify,
@@ -857,6 +2751,8 @@ enum class result : unsigned short {
   e_sys_api_epoll,
   e_sys_api_read,
   e_sys_api_eventfd,
+  e_sys_api_timerfd,
+  e_sys_api_io_uring,
   e_sys_ret,
   e_sys_lim_kernel_version,
   e_self_noent,
@@ -873,6 +2769,8 @@ struct ep {
       We don't lose events if we 'miss'
       them, the events are still waiting
       in the next call to `epoll_wait`.
+      This is the default. The user may
+      ask for another (`epoll_q_len`).
   */
   static constexpr auto q_ulim = 64;
   /*  The delay, in milliseconds, while
@@ -884,7 +2782,7 @@ struct ep {
   static constexpr auto wake_ms = -1;
 
   int fd = -1;
-  epoll_event interests[q_ulim]{};
+  std::vector<epoll_event> interests{};
 };
 
 inline constexpr auto to_str(result r)
@@ -894,10 +2792,12 @@ inline constexpr auto to_str(result r)
     case result::pending:                            return "pending@";
     case result::w:                                  return "w@";
     case result::w_sys_not_watched:                  return "w/sys/not_watched@";
+    case result::w_sys_polled:                       return "w/sys/polled@";
     case result::w_sys_phantom:                      return "w/sys/phantom@";
     case result::w_sys_bad_fd:                       return "w/sys/bad_fd@";
     case result::w_sys_bad_meta:                     return "w/sys/bad_meta@";
     case result::w_sys_q_overflow:                   return "w/sys/q_overflow@";
+    case result::w_sys_q_near:                       return "w/sys/q_near@";
     case result::complete:                           return "complete@";
     case result::e:                                  return "e@";
     case result::e_sys_api_inotify:                  return "e/sys/api/inotify@";
@@ -905,6 +2805,8 @@ inline constexpr auto to_str(result r)
     case result::e_sys_api_epoll:                    return "e/sys/api/epoll@";
     case result::e_sys_api_read:                     return "e/sys/api/read@";
     case result::e_sys_api_eventfd:                  return "e/sys/api/eventfd@";
+    case result::e_sys_api_timerfd:                  return "e/sys/api/timerfd@";
+    case result::e_sys_api_io_uring:                 return "e/sys/api/io_uring@";
     case result::e_sys_ret:                          return "e/sys/ret@";
     case result::e_sys_lim_kernel_version:           return "e/sys/lim/kernel_version@";
     case result::e_self_noent:                       return "e/self/noent@";
@@ -922,7 +2824,8 @@ inline auto send_msg = [](result r, auto path, auto const& cb)
   cb({msg + path, et::other, pt::watcher});
 };
 
-inline auto make_ep(int ev_fs_fd, int ev_il_fd) -> ep
+inline auto
+make_ep(int ev_fs_fd, int ev_il_fd, int ev_pl_fd, int q_len = ep::q_ulim) -> ep
 {
 #if __ANDROID_API__
   int fd = epoll_create(1);
@@ -931,13 +2834,461 @@ inline auto make_ep(int ev_fs_fd, int ev_il_fd) -> ep
 #endif
   auto want_ev_fs = epoll_event{.events = EPOLLIN, .data{.fd = ev_fs_fd}};
   auto want_ev_il = epoll_event{.events = EPOLLIN, .data{.fd = ev_il_fd}};
+  auto want_ev_pl = epoll_event{.events = EPOLLIN, .data{.fd = ev_pl_fd}};
   bool ctl_ok = fd >= 0
              && epoll_ctl(fd, EPOLL_CTL_ADD, ev_fs_fd, &want_ev_fs) >= 0
-             && epoll_ctl(fd, EPOLL_CTL_ADD, ev_il_fd, &want_ev_il) >= 0;
+             && epoll_ctl(fd, EPOLL_CTL_ADD, ev_il_fd, &want_ev_il) >= 0
+             && epoll_ctl(fd, EPOLL_CTL_ADD, ev_pl_fd, &want_ev_pl) >= 0;
   if (! ctl_ok && fd >= 0) close(fd), fd = -1;
-  return ep{.fd = fd};
+  auto interests = std::vector<epoll_event>(q_len > 0 ? q_len : 1);
+  return ep{.fd = fd, .interests = std::move(interests)};
+}
+
+/*  How many bytes of events we read at once. Never less
+    than `floor`, which the adapters keep large enough
+    for their largest event. */
+inline auto buf_len_of(
+  ::wtr::watcher::watch_options const& opts,
+  unsigned floor) -> unsigned
+{
+  constexpr unsigned ceil = 1 << 24;
+  return std::clamp(opts.read_buf_len, floor, ceil);
+}
+
+/*  Pins the thread we're on (which reads, and calls the
+    callback) to the user's CPUs, and makes it nicer, if
+    we were asked to. Where we aren't allowed to, the
+    thread is left as it was. */
+inline auto do_reader_sched(::wtr::watcher::watch_options const& opts) -> void
+{
+  if (! opts.reader_cpus.empty()) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (auto cpu : opts.reader_cpus)
+      if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+  }
+  if (opts.reader_nice) {
+    auto tid = (id_t)syscall(SYS_gettid);
+    errno = 0;
+    int was = getpriority(PRIO_PROCESS, tid);
+    if (errno == 0) setpriority(PRIO_PROCESS, tid, was + opts.reader_nice);
+  }
+}
+
+/*  The directories which changed recently, for the
+    coarse mode. The adapters add to these as they
+    read their events. We send them along once the
+    window opened by the first of them has passed,
+    so each is sent at most once in that window.
+    Until then, `epoll` waits no longer than the end
+    of the window for us.
+    We send them in the order they first changed, and
+    look them up in a set, since a busy tree has a lot
+    of them. */
+struct cw {
+  static constexpr auto window_ms = 50;
+
+  long long due_ms = 0;
+  std::vector<std::string> dirs{};
+  std::unordered_set<std::string> seen{};
+};
+
+inline auto now_ms() -> long long
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+inline auto cw_push(cw& cw, std::string&& dir) -> void
+{
+  if (! cw.seen.insert(dir).second) return;
+  if (cw.dirs.empty()) cw.due_ms = now_ms() + cw::window_ms;
+  cw.dirs.push_back(std::move(dir));
+}
+
+inline auto cw_wait_ms(cw const& cw) -> int
+{
+  auto left = cw.due_ms - now_ms();
+  return cw.dirs.empty() ? ep::wake_ms : left > 0 ? (int)left : 0;
+}
+
+inline auto do_cw_send = [](auto const& cb, cw& cw, bool is_final) -> void
+{
+  using ev = ::wtr::watcher::event;
+  if (cw.dirs.empty() || (now_ms() < cw.due_ms && ! is_final)) return;
+  for (auto const& d : cw.dirs)
+    cb(ev(d, ev::effect_type::modify, ev::path_type::dir));
+  cw.dirs.clear();
+  cw.seen.clear();
+};
+
+/*  The event counts, by directory, for the counting
+    mode. The adapters count what they read into these
+    and, each period, we send them to the user. We keep
+    `epoll` from waiting past the end of the period.
+    A period of 0 means we aren't counting. */
+struct ct {
+  using effects = ::wtr::watcher::event_counts::effects;
+  static constexpr auto effect_c = std::tuple_size_v<effects>;
+
+  long long period_ms = 0;
+  long long due_ms = 0;
+  long long begin_time = 0;
+  std::unordered_map<std::string, effects> dirs{};
+};
+
+inline auto now_ns() -> long long
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+inline auto make_ct(::wtr::watcher::watch_options const& opts) -> ct
+{
+  if (! opts.on_counts) return ct{};
+  auto period_ms = opts.counts_period_ms > 0 ? opts.counts_period_ms : 1;
+  return ct{period_ms, now_ms() + period_ms, now_ns()};
+}
+
+inline auto ct_push(
+  ct& ct,
+  std::string&& dir,
+  enum ::wtr::watcher::event::effect_type et,
+  unsigned n) -> void
+{
+  ct.dirs[std::move(dir)][(size_t)et] += n;
+}
+
+/*  Some of each effect, in one directory */
+inline auto ct_push(
+  ct& ct,
+  std::string&& dir,
+  std::array<unsigned, ct::effect_c> const& n) -> void
+{
+  auto& effects = ct.dirs[std::move(dir)];
+  for (size_t i = 0; i < ct::effect_c; ++i) effects[i] += n[i];
+}
+
+inline auto ct_wait_ms(ct const& ct) -> int
+{
+  auto left = ct.due_ms - now_ms();
+  return ! ct.period_ms ? ep::wake_ms : left > 0 ? (int)left : 0;
+}
+
+/*  Sends what we've counted since the last period,
+    if this one is over. We start counting the next
+    period from now, not from when this one was due,
+    so that a slow user doesn't get a flurry of calls
+    to catch up. */
+inline auto do_ct_send =
+  [](::wtr::watcher::watch_options const& opts, ct& ct, bool is_final) -> void
+{
+  using ec = ::wtr::watcher::event_counts;
+  if (! ct.period_ms || (now_ms() < ct.due_ms && ! is_final)) return;
+  auto counts = ec{.begin_time = ct.begin_time, .end_time = now_ns()};
+  counts.dirs.reserve(ct.dirs.size());
+  for (auto& [dir, effects] : ct.dirs)
+    counts.dirs.push_back(ec::dir{dir, effects});
+  ct.dirs.clear();
+  ct.begin_time = counts.end_time;
+  ct.due_ms = now_ms() + ct.period_ms;
+  opts.on_counts(counts);
+};
+
+/*  How far behind the kernel we are, for the backlog
+    gauge. See `backlog_stats`.
+    Each time we're woken, we ask the kernel how many
+    bytes are waiting (with `FIONREAD`). In the io-uring
+    mode, we ask before we wait, after the ring's last
+    read. The kernel's limit is on events, not bytes,
+    so we guess how many events that is from the length
+    of the events we've read. While we're near the
+    limit, we add up the time between our looks. */
+struct bl {
+  /*  How long we guess an event is, until we've read
+      some. A header and a short name. */
+  static constexpr unsigned long long ev_len_guess = 32;
+
+  bool is_on = false;
+  unsigned long long near = 0;
+  bool is_near = false;
+  long long near_since = 0;
+  unsigned long long read_bytes = 0;
+  unsigned long long read_evs = 0;
+  ::wtr::watcher::backlog_stats st{};
+};
+
+/*  A number from a file, such as a sysctl's */
+inline auto number_of(char const* const path, unsigned long long fallback)
+  -> unsigned long long
+{
+  auto f = fopen(path, "re");
+  if (! f) return fallback;
+  auto n = fallback;
+  if (fscanf(f, "%llu", &n) != 1) n = fallback;
+  return fclose(f), n;
+}
+
+/*  The `limit` is how many events the kernel holds
+    for us, or 0 for as many as there are */
+inline auto
+make_bl(::wtr::watcher::watch_options const& opts, unsigned long long limit)
+  -> bl
+{
+  if (! opts.on_backlog) return bl{};
+  auto pct = std::clamp(opts.backlog_near_pct, 1, 100);
+  auto b = bl{.is_on = true, .near = limit * pct / 100};
+  b.st.limit = limit;
+  return b;
+}
+
+/*  What we read, for how long an event is */
+inline auto bl_read(bl& bl, ssize_t read_len, unsigned ev_c) -> void
+{
+  if (! bl.is_on || read_len <= 0) return;
+  bl.read_bytes += (unsigned long long)read_len;
+  bl.read_evs += ev_c;
+}
+
+/*  Looks at what's waiting for us. Tells the user once
+    when we come near the limit, and again only after
+    we've caught up to half of that. */
+inline auto do_bl_sample = [](
+                             ::wtr::watcher::watch_options const& opts,
+                             auto const& cb,
+                             bl& bl,
+                             int fd,
+                             std::string const& base) -> void
+{
+  int waiting = 0;
+  if (! bl.is_on || ioctl(fd, FIONREAD, &waiting) < 0) return;
+  auto& st = bl.st;
+  auto ev_len = bl.read_evs ? bl.read_bytes / bl.read_evs : bl::ev_len_guess;
+  auto now = now_ns();
+  st.bytes = (unsigned long long)(waiting > 0 ? waiting : 0);
+  st.events = st.bytes / (ev_len ? ev_len : 1);
+  st.peak_bytes = std::max(st.peak_bytes, st.bytes);
+  st.peak_events = std::max(st.peak_events, st.events);
+  st.samples++;
+  if (bl.is_near) st.near_ns += now - bl.near_since, bl.near_since = now;
+  if (bl.near && ! bl.is_near && st.events >= bl.near) {
+    bl.is_near = true, bl.near_since = now;
+    send_msg(result::w_sys_q_near, base.c_str(), cb);
+  }
+  else if (bl.is_near && st.events < bl.near / 2)
+    bl.is_near = false;
+  opts.on_backlog(st);
+};
+
+/*  What was destroyed recently, for the fold mode.
+    A directory can only be removed once it's empty,
+    so, when one is, what we hold beneath it went
+    with it. We fold those into the directory's event
+    as we go. They're usually the last ones we held.
+    We send what we hold once nothing else has been
+    destroyed for a moment, and before anything else
+    which happens, so that nothing is out of order.
+    Until then, `epoll` waits no longer than that
+    moment for us. */
+struct fo {
+  static constexpr auto window_ms = 50;
+
+  long long due_ms = 0;
+  std::vector<::wtr::watcher::event> evs{};
+};
+
+inline auto fo_wait_ms(fo const& fo) -> int
+{
+  auto left = fo.due_ms - now_ms();
+  return fo.evs.empty() ? ep::wake_ms : left > 0 ? (int)left : 0;
+}
+
+inline auto do_fo_send = [](auto const& cb, fo& fo, bool is_final) -> void
+{
+  if (fo.evs.empty() || (now_ms() < fo.due_ms && ! is_final)) return;
+  for (auto const& ev : fo.evs) cb(ev);
+  fo.evs.clear();
+};
+
+/*  Holds onto what was destroyed, folding what was
+    beneath a directory into it. Sends everything else
+    along, after whatever we held. */
+inline auto do_fo_push =
+  [](auto const& cb, fo& fo, ::wtr::watcher::event const& ev) -> void
+{
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  using ev_pt = enum ::wtr::watcher::event::path_type;
+  if (ev.effect_type != ev_et::destroy)
+    return do_fo_send(cb, fo, true), cb(ev);
+  auto const& dir = ev.path_name.native();
+  auto is_beneath = [&](::wtr::watcher::event const& e)
+  {
+    auto const& p = e.path_name.native();
+    return p.size() > dir.size() && p[dir.size()] == '/'
+        && p.compare(0, dir.size(), dir) == 0;
+  };
+  auto folded = size_t{0};
+  while (ev.path_type == ev_pt::dir && ! fo.evs.empty()
+         && is_beneath(fo.evs.back()))
+    folded += 1 + fo.evs.back().folded, fo.evs.pop_back();
+  fo.due_ms = now_ms() + fo::window_ms;
+  fo.evs.push_back(ev.with_folded(folded));
+};
+
+/*  What we've read, for the stats and the dirs-first
+    modes, until we're done reading.
+    In the stats mode, we look at all of it at once,
+    rather than between reads. Where the kernel gave
+    us a descriptor for what changed (an `O_PATH` one,
+    from the fanotify adapter), we look at that, since
+    its name may have changed since. Otherwise, we
+    look at the path, or at where it was renamed to. */
+struct st {
+  std::vector<::wtr::watcher::event> evs{};
+  std::vector<int> fds{};
+};
+
+inline auto st_push(st& st, ::wtr::watcher::event const& ev, int fd) -> void
+{
+  st.evs.emplace_back(ev);
+  st.fds.push_back(fd);
+}
+
+/*  A file with more than one link is a hard link */
+inline auto stat_of(::wtr::watcher::event const& ev, int fd)
+  -> ::wtr::watcher::event
+{
+  using ev_pt = enum ::wtr::watcher::event::path_type;
+  using file_stat = ::wtr::watcher::event::file_stat;
+  auto const& to = ev.associated ? *ev.associated : ev;
+  auto const* path = fd >= 0 ? "" : to.path_name.c_str();
+  auto at = fd >= 0 ? fd : AT_FDCWD;
+  auto fs = file_stat{};
+#if defined(STATX_BASIC_STATS)
+  auto flags = fd >= 0 ? AT_EMPTY_PATH : AT_SYMLINK_NOFOLLOW;
+  auto mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE
+            | STATX_MTIME;
+  struct statx s;
+  if (statx(at, path, flags, mask, &s) != 0) return ev;
+  fs.inode = s.stx_ino;
+  fs.device = makedev(s.stx_dev_major, s.stx_dev_minor);
+  fs.size = s.stx_size;
+  fs.mtime = s.stx_mtime.tv_sec * 1000000000LL + s.stx_mtime.tv_nsec;
+  fs.mode = s.stx_mode;
+  fs.links = s.stx_nlink;
+#else
+  auto flags = fd >= 0 ? AT_EMPTY_PATH : AT_SYMLINK_NOFOLLOW;
+  struct stat s;
+  if (fstatat(at, path, &s, flags) != 0) return ev;
+  fs.inode = s.st_ino;
+  fs.device = s.st_dev;
+  fs.size = s.st_size;
+  fs.mtime = s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+  fs.mode = s.st_mode;
+  fs.links = s.st_nlink;
+#endif
+  auto is_hard_link =
+    ev.path_type == ev_pt::file && S_ISREG(fs.mode) && fs.links > 1;
+  return ev.with_stat(is_hard_link ? ev_pt::hard_link : ev.path_type, fs);
+}
+
+/*  For the dirs-first mode, which of what we held goes
+    first: what changes which directories there are,
+    (their creation, destruction and renaming), unless
+    something before it was about its path, about
+    something beneath it, or about a directory above
+    it which changed. Then it waits its turn.
+    What waits is remembered by the hashes of its path
+    and of the directories above it, so a (rare) hash
+    collision only means something waits when it didn't
+    need to. */
+inline auto dirs_first_of(std::vector<::wtr::watcher::event> const& evs)
+  -> std::vector<bool>
+{
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  using ev_pt = enum ::wtr::watcher::event::path_type;
+  using sv = std::string_view;
+  auto is_first = std::vector<bool>(evs.size());
+  auto is_structural = [](::wtr::watcher::event const& ev) -> bool
+  {
+    return ev.path_type == ev_pt::dir
+        && (ev.effect_type == ev_et::create || ev.effect_type == ev_et::destroy
+            || ev.effect_type == ev_et::rename);
+  };
+  if (std::none_of(evs.begin(), evs.end(), is_structural)) return is_first;
+  auto hash = std::hash<sv>{};
+  auto held = std::unordered_set<size_t>{};
+  auto held_dirs = std::vector<sv>{};
+  auto hold = [&](sv p)
+  {
+    for (auto at = p.size(); at != 0 && at != sv::npos; at = p.rfind('/'))
+      held.insert(hash(p = p.substr(0, at)));
+  };
+  auto is_above = [](sv dir, sv p) -> bool
+  {
+    return p.size() > dir.size() && p[dir.size()] == '/'
+        && p.compare(0, dir.size(), dir) == 0;
+  };
+  auto is_held = [&](sv p) -> bool
+  {
+    if (held.count(hash(p))) return true;
+    for (auto dir : held_dirs)
+      if (dir == p || is_above(dir, p)) return true;
+    return false;
+  };
+  for (size_t i = 0; i < evs.size(); ++i) {
+    auto const& ev = evs[i];
+    auto p = sv{ev.path_name.native()};
+    auto to = ev.associated ? sv{ev.associated->path_name.native()} : sv{};
+    auto is_dir_ev = is_structural(ev);
+    is_first[i] = is_dir_ev && ! is_held(p) && (to.empty() || ! is_held(to));
+    if (is_first[i]) continue;
+    hold(p);
+    if (! to.empty()) hold(to);
+    if (is_dir_ev) held_dirs.push_back(p);
+    if (is_dir_ev && ! to.empty()) held_dirs.push_back(to);
+  }
+  return is_first;
 }
 
+/*  Sends an event along: to wait until we're done
+    reading, to be folded, or to the user */
+inline auto do_send =
+  [](auto const& cb, auto& sr, ::wtr::watcher::event const& ev, int fd) -> void
+{
+  if (sr.opts.stats || sr.opts.dirs_first)
+    st_push(sr.st, ev, fd);
+  else if (sr.opts.fold)
+    do_fo_push(cb, sr.fo, ev);
+  else
+    cb(ev);
+};
+
+inline auto do_st_send = [](auto const& cb, auto& sr) -> void
+{
+  auto const& evs = sr.st.evs;
+  auto send = [&](size_t i)
+  {
+    auto ev = sr.opts.stats ? stat_of(evs[i], sr.st.fds[i]) : evs[i];
+    if (sr.st.fds[i] >= 0) close(sr.st.fds[i]);
+    if (sr.opts.fold)
+      do_fo_push(cb, sr.fo, ev);
+    else
+      cb(ev);
+  };
+  auto is_first = sr.opts.dirs_first ? dirs_first_of(evs)
+                                     : std::vector<bool>(evs.size());
+  for (size_t i = 0; i < evs.size(); ++i)
+    if (is_first[i]) send(i);
+  for (size_t i = 0; i < evs.size(); ++i)
+    if (! is_first[i]) send(i);
+  sr.st.evs.clear();
+  sr.st.fds.clear();
+};
+
 inline auto is_dir(char const* const path) -> bool
 {
   struct stat s;
@@ -963,26 +3314,695 @@ inline auto is_dir(char const* const path) -> bool
     watching before we're done this
     hot find-and-mark path, despite
     not having a full picture.
+
+    The function we're given returns
+    whether or not to walk into the
+    directory it was just given. We
+    don't walk into the directories
+    which someone else (the poller)
+    has already taken care of, or
+    which the user excluded.
+
+    We may also be given a function
+    to look at every entry within the
+    directories we walk into.
+
+    And how many directories deep to
+    walk. We don't walk any deeper
+    than that, but we still look at
+    the entries there.
 */
-template<class Fn>
-inline auto walkdir_do(char const* const path, Fn const& f) -> void
+template<class Fn, class Ent>
+inline auto walkdir_do(
+  char const* const path,
+  Fn const& f,
+  Ent const& ent,
+  int depth_ulim = -1) -> void
 {
   if (DIR* d = opendir(path)) {
-    f(path);
-    while (dirent* de = readdir(d)) {
+    bool descend = f(path);
+    while (dirent* de = descend ? readdir(d) : nullptr) {
       char next[PATH_MAX];
       char real[PATH_MAX];
-      if (de->d_type != DT_DIR) continue;
       if (strcmp(de->d_name, ".") == 0) continue;
       if (strcmp(de->d_name, "..") == 0) continue;
+      ent(path, de);
+      if (de->d_type != DT_DIR || depth_ulim == 0) continue;
       if (snprintf(next, PATH_MAX, "%s/%s", path, de->d_name) <= 0) continue;
       if (! realpath(next, real)) continue;
-      walkdir_do(real, f);
+      walkdir_do(real, f, ent, depth_ulim - 1);
     }
     (void)closedir(d);
   }
 }
 
+template<class Fn>
+inline auto walkdir_do(char const* const path, Fn const& f) -> void
+{
+  walkdir_do(path, f, [](char const* const, dirent const* const) {});
+}
+
+/*  Walks the path, or, with a set of files, marks only
+    the directories which they're in, without walking
+    into them. */
+template<class Fn, class Ent>
+inline auto walk_do(
+  char const* const path,
+  ::wtr::watcher::watch_options const& opts,
+  Fn const& f,
+  Ent const& ent) -> void
+{
+  if (opts.files.empty()) return walkdir_do(path, f, ent, opts.max_depth);
+  for (auto const& dir : dirs_of(opts.files)) f(dir.c_str());
+}
+
+/*  Whether what's in a new directory is deeper than
+    we watch, so that we don't mark it. The base path
+    is real, as are the paths we mark. */
+inline auto is_too_deep_to_mark(
+  ::wtr::watcher::watch_options const& opts,
+  std::string const& base,
+  std::string const& dir) -> bool
+{
+  return opts.max_depth >= 0 && depth_of(base, dir) + 1 > opts.max_depth;
+}
+
+/*  The real path, or the path if we can't have it */
+inline auto realpath_of(char const* const path) -> std::string
+{
+  char real[PATH_MAX];
+  return realpath(path, real) ? real : path;
+}
+
+/*  One of a few kernel instances which watch the same
+    tree, each read on its own thread.
+    Every one of us marks the base path. Each directory
+    in it is marked, with everything beneath it, by one
+    of us: by the hash of its name when we begin, by the
+    first of us when it's made (or moved in) later, and
+    by whoever had it when it's renamed. We keep the
+    names of those which are ours in `tops`.
+    Whatever happens beneath a directory is only seen by
+    whoever marked it, so each path's events stay in
+    order. What happens in the base path is seen by all
+    of us, and only reported by whoever it belongs to.
+    A rename from beneath one of us to beneath another
+    is reported in two halves, one by each of us, as a
+    rename out of and into the tree would be. */
+struct shard {
+  int nth = 0;
+  int count = 1;
+  std::unordered_set<std::string> tops{};
+};
+
+/*  Whether we walk into (and mark) a directory while we
+    walk the tree. The base path is everyone's. */
+inline auto
+is_ours(shard& sh, std::string const& base, char const* const dir) -> bool
+{
+  if (sh.count < 2 || depth_of(base, dir) != 0) return true;
+  auto name = std::string_view{dir}.substr(base.size() + 1);
+  auto h = std::hash<std::string_view>{}(name);
+  if (h % (size_t)sh.count != (size_t)sh.nth) return false;
+  return sh.tops.emplace(name), true;
+}
+
+/*  Which of an event's names are ours to report */
+struct claim {
+  bool from = true;
+  bool to = true;
+};
+
+/*  What's in the base path is ours if it's a directory
+    we have, or something new and we're the first of
+    us. Everything else belongs to the first of us. */
+inline auto claim_of(
+  shard& sh,
+  std::string const& base,
+  ::wtr::watcher::event const& ev) -> claim
+{
+  using et = enum ::wtr::watcher::event::effect_type;
+  using pt = enum ::wtr::watcher::event::path_type;
+  if (sh.count < 2) return {};
+  auto is_dir = ev.path_type == pt::dir;
+  auto is_top = [&](std::string const& p) { return depth_of(base, p) == 0; };
+  auto name_of = [&](std::string const& p)
+  { return p.substr(base.size() + 1); };
+  auto is_mine = [&](std::string const& p, bool is_arriving)
+  {
+    return ! is_top(p) ? true
+         : ! is_dir    ? sh.nth == 0
+         : sh.tops.count(name_of(p)) || (sh.nth == 0 && is_arriving);
+  };
+  auto keep = [&](std::string const& p, bool is_arriving)
+  {
+    if (! is_dir || ! is_top(p)) return;
+    if (is_arriving)
+      sh.tops.emplace(name_of(p));
+    else
+      sh.tops.erase(name_of(p));
+  };
+  auto const& from = ev.path_name.native();
+  auto c = claim{false, false};
+  if (ev.effect_type == et::rename && ev.associated) {
+    auto const& to = ev.associated->path_name.native();
+    c.from = is_mine(from, false);
+    c.to = is_top(from) && is_top(to) ? c.from : is_mine(to, true);
+    if (c.from) keep(from, false);
+    if (c.to) keep(to, true);
+    return c;
+  }
+  struct stat s;
+  auto is_arriving = ev.effect_type == et::create
+                  || (ev.effect_type == et::rename && is_dir && is_top(from)
+                      && lstat(from.c_str(), &s) == 0);
+  auto is_leaving =
+    ev.effect_type == et::destroy || ev.effect_type == et::rename;
+  c.from = is_mine(from, is_arriving);
+  if (c.from && (is_arriving || is_leaving)) keep(from, is_arriving);
+  return c;
+}
+
+/*  The part of an event which we claimed */
+inline auto part_of(::wtr::watcher::event const& ev, claim c)
+  -> ::wtr::watcher::event
+{
+  using event = ::wtr::watcher::event;
+  return ! ev.associated || (c.from && c.to) ? ev
+       : c.from ? event{ev.path_name, ev.effect_type, ev.path_type}
+                : event{*ev.associated};
+}
+
+/*  Whether a directory was renamed into what we watch
+    (as opposed to out of it), when we only saw one of
+    its names. We can only tell by whether it's there. */
+inline auto is_moved_in(::wtr::watcher::event const& ev) -> bool
+{
+  struct stat s;
+  return lstat(ev.path_name.c_str(), &s) == 0 && S_ISDIR(s.st_mode);
+}
+
+/*  Whether a directory was renamed, and we only saw one
+    of its names, or only claimed one of them */
+inline auto is_half_moved_dir(::wtr::watcher::event const& ev) -> bool
+{
+  return ev.effect_type == ::wtr::watcher::event::effect_type::rename
+      && ev.path_type == ::wtr::watcher::event::path_type::dir
+      && ! ev.associated;
+}
+
+/*  Whether a path is, or is beneath, a directory */
+inline auto is_at_or_beneath(std::string const& dir, std::string const& path)
+  -> bool
+{
+  return path == dir || depth_of(dir, path) >= 0;
+}
+
+/*  What we find while walking, for the user's inventory.
+    We send it along in batches, in the order we walked.
+    Every directory is marked before we look inside of
+    it, and we read our events only once we're done, so
+    what changes after we've seen it is an event, which
+    comes after the inventory. Something may be in the
+    inventory and have an event, but nothing has neither.
+    The inventory's events are about the `other` effect. */
+struct iv {
+  static constexpr auto batch_len = 1024;
+
+  ::wtr::watcher::watch_options const& opts;
+  std::vector<::wtr::watcher::event> evs{};
+
+  inline auto push(std::string&& path, enum ::wtr::watcher::event::path_type pt)
+    -> void
+  {
+    using et = enum ::wtr::watcher::event::effect_type;
+    if (! this->opts.on_inventory || is_excluded(this->opts, path)) return;
+    this->evs.emplace_back(std::move(path), et::other, pt);
+    if (this->evs.size() >= batch_len) send();
+  }
+
+  inline auto push(char const* const dir, dirent const* const de) -> void
+  {
+    using pt = enum ::wtr::watcher::event::path_type;
+    if (! this->opts.on_inventory) return;
+    auto path = std::string{dir} + '/' + de->d_name;
+    auto t = de->d_type;
+    struct stat s;
+    if (t == DT_UNKNOWN && lstat(path.c_str(), &s) == 0)
+      t = S_ISDIR(s.st_mode) ? DT_DIR
+        : S_ISREG(s.st_mode) ? DT_REG
+        : S_ISLNK(s.st_mode) ? DT_LNK
+                             : DT_UNKNOWN;
+    push(
+      std::move(path),
+      t == DT_DIR   ? pt::dir
+      : t == DT_REG ? pt::file
+      : t == DT_LNK ? pt::sym_link
+                    : pt::other);
+  }
+
+  inline auto send() -> void
+  {
+    if (! this->evs.empty()) this->opts.on_inventory(this->evs);
+    this->evs.clear();
+  }
+};
+
+} /*  namespace detail::wtr::watcher::adapter */
+
+#endif
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace detail::wtr::watcher::adapter {
+
+/*  A warthog-style poller for the subtrees which
+    the kernel can't (or won't) tell us about.
+
+    Some filesystems never report changes made by
+    other hosts, and some of them reject our marks
+    outright. We also run out of marks when the
+    user's limits (`fs.inotify.max_user_watches`,
+    `fs.fanotify.max_user_marks`) are exhausted.
+
+    Those subtrees are handed to us instead of being
+    left unwatched. We scan them on a timer, which
+    we give to `epoll` along with everything else.
+    The events we find are sent through the same
+    callback, on the same thread, as the events
+    from the kernel.
+
+    Scans are not free, so we take our time between
+    them. A scan on a network filesystem is at least
+    one round-trip per entry. */
+struct pl {
+  static constexpr auto wake_ms = 256;
+
+  struct ent {
+    long long mtim = 0;
+    long long size = 0;
+    unsigned gen = 0;
+    enum ::wtr::watcher::event::path_type pt {};
+  };
+
+  /*  Every path beneath some root, but not the root
+      itself. The root's parent is watched by the
+      kernel, which tells us about the root. */
+  using bucket = std::unordered_map<std::string, ent>;
+
+  int fd = -1;
+  unsigned gen = 0;
+  std::unordered_map<std::string, bucket> roots{};
+};
+
+/*  Network and userspace filesystems. Changes made
+    through the local mount *may* be reported, but
+    changes made anywhere else never are. Overlays
+    are not here: changes made through them are
+    reported, and, where fanotify can't mark them,
+    we learn about that from `fanotify_mark()`. */
+inline auto is_pollfs(struct statfs const& s) -> bool
+{
+  static constexpr uint32_t magics[] = {
+    0x6969,     /*  NFS_SUPER_MAGIC */
+    0x517b,     /*  SMB_SUPER_MAGIC */
+    0xff534d42, /*  CIFS_SUPER_MAGIC */
+    0xfe534d42, /*  SMB2_SUPER_MAGIC */
+    0x65735546, /*  FUSE_SUPER_MAGIC */
+    0x01021997, /*  V9FS_MAGIC */
+    0x00c36400, /*  CEPH_SUPER_MAGIC */
+    0x5346414f, /*  AFS_SUPER_MAGIC */
+    0x6b414653, /*  AFS_FS_MAGIC */
+    0x73757245, /*  CODA_SUPER_MAGIC */
+  };
+  for (auto magic : magics)
+    if ((uint32_t)s.f_type == magic) return true;
+  return false;
+}
+
+inline auto is_pollfs(char const* const path) -> bool
+{
+  struct statfs s;
+  return statfs(path, &s) == 0 && is_pollfs(s);
+}
+
+inline auto make_pl() -> pl
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  return pl{.fd = fd};
+}
+
+/*  Arms the timer while we have something to poll,
+    disarms it otherwise. */
+inline auto pl_arm(pl& pl) -> bool
+{
+  long ns = pl.roots.empty() ? 0 : pl::wake_ms * 1000000L;
+  auto t = timespec{.tv_sec = ns / 1000000000L, .tv_nsec = ns % 1000000000L};
+  auto it = itimerspec{.it_interval = t, .it_value = t};
+  return timerfd_settime(pl.fd, 0, &it, nullptr) == 0;
+}
+
+template<class Fn>
+inline auto pl_walk(std::string const& path, Fn const& f) -> bool
+{
+  if (DIR* d = opendir(path.c_str())) {
+    while (dirent* de = readdir(d)) {
+      struct stat s;
+      if (strcmp(de->d_name, ".") == 0) continue;
+      if (strcmp(de->d_name, "..") == 0) continue;
+      auto next = path + '/' + de->d_name;
+      if (lstat(next.c_str(), &s) != 0) continue;
+      f(next, s);
+      if (S_ISDIR(s.st_mode)) pl_walk(next, f);
+    }
+    return (void)closedir(d), true;
+  }
+  else
+    return false;
+}
+
+/*  Scans a root, comparing what we find against the
+    bucket. Anything which wasn't seen in this scan
+    (this generation) was destroyed.
+    We stay quiet while populating a new bucket.
+    Returns false when the root is gone. A root we
+    failed to read for any other reason (timeouts,
+    permissions, ...) is left as-is until later. */
+template<class Cb>
+inline auto pl_scan(
+  std::string const& root,
+  pl::bucket& bk,
+  unsigned gen,
+  Cb const& cb,
+  bool quiet) -> bool
+{
+  using ev_pt = enum ::wtr::watcher::event::path_type;
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  auto pt_of = [](mode_t m)
+  {
+    return S_ISDIR(m) ? ev_pt::dir
+         : S_ISREG(m) ? ev_pt::file
+         : S_ISLNK(m) ? ev_pt::sym_link
+                      : ev_pt::other;
+  };
+  auto on_ent = [&](std::string const& path, struct stat const& s)
+  {
+    auto mtim = s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+    auto now = pl::ent{mtim, (long long)s.st_size, gen, pt_of(s.st_mode)};
+    auto [at, is_new] = bk.try_emplace(path, now);
+    auto was = at->second;
+    auto is_mod = now.pt != ev_pt::dir
+               && (now.mtim != was.mtim || now.size != was.size);
+    at->second = now;
+    if (quiet) return;
+    if (is_new)
+      cb({path, ev_et::create, now.pt});
+    else if (is_mod)
+      cb({path, ev_et::modify, now.pt});
+  };
+  bool is_read = pl_walk(root, on_ent);
+  bool is_gone = ! is_read && (errno == ENOENT || errno == ENOTDIR);
+  for (auto at = bk.begin(); (is_read || is_gone) && at != bk.end();)
+    if (at->second.gen != gen)
+      cb({at->first, ev_et::destroy, at->second.pt}), at = bk.erase(at);
+    else
+      ++at;
+  return ! is_gone;
+}
+
+/*  Takes over a subtree which the kernel won't
+    watch for us. Lets the user know about it. */
+inline auto do_poll_mark =
+  [](char const* const dirpath, pl& pl, auto const& cb) -> result
+{
+  auto w = result::w_sys_polled;
+  auto e = result::w_sys_not_watched;
+  auto [at, is_new] = pl.roots.try_emplace(dirpath);
+  if (! is_new) return w;
+  if (pl.roots.size() == 1 && ! pl_arm(pl))
+    return pl.roots.erase(at), send_msg(e, dirpath, cb), e;
+  pl_scan(at->first, at->second, pl.gen, cb, true);
+  return send_msg(w, dirpath, cb), w;
+};
+
+/*  Everything we found beneath a root when we took
+    it over, for the inventory. */
+inline auto pl_inventory(pl const& pl, char const* const dirpath, iv& iv)
+  -> void
+{
+  char real[PATH_MAX];
+  auto at = realpath(dirpath, real) ? pl.roots.find(real) : pl.roots.end();
+  if (at == pl.roots.end()) return;
+  for (auto const& [path, ent] : at->second) iv.push(std::string{path}, ent.pt);
+}
+
+/*  Rescans everything we poll when our timer fires.
+    Roots which no longer exist are forgotten after
+    we've reported their contents as destroyed.
+    In the coarse and counting modes, the callback
+    we're given only notes the directories of what
+    we report. */
+inline auto do_poll_recv = [](auto const& cb, pl& pl) -> result
+{
+  uint64_t _ = 0;
+  if (read(pl.fd, &_, sizeof(_)) < 0 && errno != EAGAIN)
+    return result::e_sys_api_read;
+  pl.gen++;
+  for (auto at = pl.roots.begin(); at != pl.roots.end();)
+    if (pl_scan(at->first, at->second, pl.gen, cb, false))
+      ++at;
+    else
+      at = pl.roots.erase(at);
+  if (pl.roots.empty()) pl_arm(pl);
+  return result::pending;
+};
+
+} /*  namespace detail::wtr::watcher::adapter */
+
+#endif
+
+#if (defined(__linux__) || __ANDROID_API__) \
+  && ! defined(WATER_WATCHER_USE_WARTHOG)
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+namespace detail::wtr::watcher::adapter {
+
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+
+/*  An io_uring, for the io-uring mode, in place of
+    `epoll` and `read`.
+
+    We keep a read of the kernel's events posted, into
+    our buffer, linked behind a poll of the kernel's
+    descriptor. When there's something to read, the
+    kernel reads it for us, and we're woken with how
+    much it read. The buffer is registered with the
+    ring, so the kernel doesn't map it on every read.
+    We also poll the living semaphore and the poller's
+    timer. Each wakeup is one `io_uring_enter`, which
+    submits whatever we've posted since the last one,
+    and waits for the next completion, or for a timeout.
+    Nothing we post is submitted before that, so our
+    buffer is ours until we wait again.
+
+    We don't link to liburing. The ring is small, and
+    we're the only ones who post to it, or reap from it.
+    Without the features we need (Linux 5.11), or where
+    io_uring is disabled, we fall back to `epoll`. */
+struct ur {
+  static constexpr unsigned q_len = 8;
+
+  enum tag : uint64_t { ke_poll = 1, ke_read, il_poll, pl_poll };
+
+  int fd = -1;
+  int ke_fd = -1;
+  int il_fd = -1;
+  int pl_fd = -1;
+  char* buf = nullptr;
+  unsigned buf_len = 0;
+  bool is_fixed = false;
+  unsigned to_submit = 0;
+
+  void* ring = nullptr;
+  size_t ring_len = 0;
+  io_uring_sqe* sqes = nullptr;
+  size_t sqes_len = 0;
+  unsigned* sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned* sq_array = nullptr;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_cqe* cqes = nullptr;
+};
+
+inline auto ur_sqe_of(ur& ur) -> io_uring_sqe*
+{
+  auto tail = *ur.sq_tail;
+  auto idx = tail & ur.sq_mask;
+  auto sqe = &ur.sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ur.sq_array[idx] = idx;
+  __atomic_store_n(ur.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ur.to_submit++;
+  return sqe;
+}
+
+inline auto ur_poll(ur& ur, int fd, uint64_t tag, bool is_linked) -> void
+{
+  auto sqe = ur_sqe_of(ur);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->flags = is_linked ? IOSQE_IO_LINK : 0;
+  sqe->user_data = tag;
+}
+
+/*  A read, once there's something to read */
+inline auto ur_read(ur& ur) -> void
+{
+  ur_poll(ur, ur.ke_fd, ur::ke_poll, true);
+  auto sqe = ur_sqe_of(ur);
+  sqe->opcode = ur.is_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = ur.ke_fd;
+  sqe->addr = (uint64_t)ur.buf;
+  sqe->len = ur.buf_len;
+  sqe->buf_index = 0;
+  sqe->user_data = ur::ke_read;
+}
+
+inline auto close_ur(ur& ur) -> void
+{
+  if (ur.sqes) munmap(ur.sqes, ur.sqes_len);
+  if (ur.ring) munmap(ur.ring, ur.ring_len);
+  if (ur.fd >= 0) close(ur.fd);
+  ur = adapter::ur{};
+}
+
+/*  A ring, or one with `fd < 0` if we can't have it */
+inline auto
+make_ur(int ke_fd, char* buf, unsigned buf_len, int il_fd, int pl_fd) -> ur
+{
+  constexpr auto prot = PROT_READ | PROT_WRITE;
+  constexpr auto fl = MAP_SHARED | MAP_POPULATE;
+  constexpr auto feats = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG;
+  auto p = io_uring_params{};
+  auto u = ur{.ke_fd = ke_fd, .il_fd = il_fd, .pl_fd = pl_fd};
+  u.buf = buf, u.buf_len = buf_len;
+  u.fd = (int)syscall(__NR_io_uring_setup, ur::q_len, &p);
+  if (u.fd < 0) return u;
+  if ((p.features & feats) != feats) return close_ur(u), u;
+  auto sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  auto cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  u.ring_len = sq_len > cq_len ? sq_len : cq_len;
+  u.ring = mmap(0, u.ring_len, prot, fl, u.fd, IORING_OFF_SQ_RING);
+  if (u.ring == MAP_FAILED) return u.ring = nullptr, close_ur(u), u;
+  u.sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+  auto sqes = mmap(0, u.sqes_len, prot, fl, u.fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return close_ur(u), u;
+  auto at = [&](unsigned off) { return (unsigned*)((char*)u.ring + off); };
+  u.sqes = (io_uring_sqe*)sqes;
+  u.sq_tail = at(p.sq_off.tail);
+  u.sq_mask = *at(p.sq_off.ring_mask);
+  u.sq_array = at(p.sq_off.array);
+  u.cq_head = at(p.cq_off.head);
+  u.cq_tail = at(p.cq_off.tail);
+  u.cq_mask = *at(p.cq_off.ring_mask);
+  u.cqes = (io_uring_cqe*)((char*)u.ring + p.cq_off.cqes);
+  auto iov = iovec{buf, buf_len};
+  u.is_fixed =
+    syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_BUFFERS, &iov, 1)
+    == 0;
+  ur_read(u);
+  ur_poll(u, il_fd, ur::il_poll, false);
+  ur_poll(u, pl_fd, ur::pl_poll, false);
+  return u;
+}
+
+/*  Submits what we've posted and waits, no longer than
+    `wake_ms` (if it isn't negative), for completions.
+    Each is given to `on` with its tag and result, once
+    we've posted whatever follows it. A read which was
+    cut short (or found nothing) is posted again without
+    bothering `on`. False on errors. */
+template<class On>
+inline auto ur_wait(ur& ur, int wake_ms, On const& on) -> bool
+{
+  auto ts = __kernel_timespec{wake_ms / 1000, (wake_ms % 1000) * 1000000LL};
+  auto arg = io_uring_getevents_arg{};
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = wake_ms < 0 ? 0 : (uint64_t)&ts;
+  constexpr auto fl = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  auto n =
+    syscall(__NR_io_uring_enter, ur.fd, ur.to_submit, 1, fl, &arg, sizeof(arg));
+  if (n > 0) ur.to_submit -= (unsigned)n;
+  if (n < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+    return false;
+  auto head = *ur.cq_head;
+  auto tail = __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    auto const& cqe = ur.cqes[head & ur.cq_mask];
+    auto tag = cqe.user_data;
+    auto res = cqe.res;
+    __atomic_store_n(ur.cq_head, head + 1, __ATOMIC_RELEASE);
+    auto is_cut = res == -EAGAIN || res == -ECANCELED || res == -EINTR;
+    if (tag == ur::ke_read) ur_read(ur);
+    if (tag == ur::pl_poll) ur_poll(ur, ur.pl_fd, ur::pl_poll, false);
+    if (tag == ur::ke_poll || (tag == ur::ke_read && is_cut)) continue;
+    on(tag, res);
+  }
+  return true;
+}
+
+#else
+
+/*  Without io_uring's headers, we never have a ring */
+struct ur {
+  enum tag : uint64_t { ke_poll = 1, ke_read, il_poll, pl_poll };
+
+  int fd = -1;
+};
+
+inline auto make_ur(int, char*, unsigned, int, int) -> ur { return ur{}; }
+
+inline auto close_ur(ur&) -> void {}
+
+template<class On>
+inline auto ur_wait(ur&, int, On const&) -> bool
+{
+  return false;
+}
+
+#endif
+
 } /*  namespace detail::wtr::watcher::adapter */
 
 #endif
@@ -1002,36 +4022,61 @@ inline auto walkdir_do(char const* const path, Fn const& f) -> void
 #include <string>
 #include <sys/epoll.h>
 #include <sys/fanotify.h>
+#include <sys/vfs.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace detail::wtr::watcher::adapter::fanotify {
 
 /*  We request post-event reporting, non-blocking
-    IO and unlimited marks for fanotify. We need
-    sudo mode for the unlimited marks. If we were
-    making a filesystem auditor, we might use:
-      FAN_CLASS_PRE_CONTENT
-      | FAN_UNLIMITED_QUEUE
-      | FAN_UNLIMITED_MARKS
-    and some writable fields within the callback.
+    IO and, when we're privileged, an unlimited queue
+    and unlimited marks for fanotify.
+    Since Linux 5.13, unprivileged users can ask for
+    everything else. They have the same queue and mark
+    limits as inotify does, and we handle those limits
+    the same way: with overflow diagnostics and with
+    the poller.
+    Unprivileged users can't open the handles we are
+    given, so we keep a map of our directories' handles
+    to their paths. We need the directory itself to
+    tell us when it's destroyed to keep that map tidy.
+    Since Linux 5.17, a rename can be reported as one
+    event with both names and the handle of the object
+    which was renamed. We use it when we can. Otherwise,
+    we're left to pair the moved-from and moved-to
+    events ourselves, which can't always be done.
+    If we were making a filesystem auditor, we might
+    use FAN_CLASS_PRE_CONTENT and some writable fields
+    within the callback.
 */
 
 // clang-format off
 struct ke_fa_ev {
-  static constexpr auto buf_len = 4096;
-  static constexpr auto c_ulim = buf_len / sizeof(fanotify_event_metadata);
+  /*  The default size of our buffer, and the least we
+      allow, which is enough for a rename's two names
+      and their directories' handles. */
+  static constexpr unsigned buf_len = 4096;
+  static constexpr unsigned buf_len_floor = 1024;
+  /*  How many events the kernel holds for us, unless
+      we're privileged, when it holds all of them */
+  static constexpr auto q_len_path = "/proc/sys/fs/fanotify/max_queued_events";
+  static constexpr unsigned long long q_len = 16384;
   static constexpr auto init_io_flags
     = O_RDONLY
     | O_CLOEXEC
     | O_NONBLOCK;
-  static constexpr auto init_flags
+  static constexpr auto init_flags_unprivileged
     = FAN_CLASS_NOTIF
     | FAN_REPORT_FID
     | FAN_REPORT_DIR_FID
     | FAN_REPORT_NAME
-    | FAN_UNLIMITED_QUEUE
-    | FAN_UNLIMITED_MARKS
     | FAN_NONBLOCK;
+  static constexpr auto init_flags
+    = init_flags_unprivileged
+    | FAN_UNLIMITED_QUEUE
+    | FAN_UNLIMITED_MARKS;
   /*  todo: Support change of ownership w/ FAN_ATTRIB */
   static constexpr auto recv_flags
     = FAN_ONDIR
@@ -1039,10 +4084,49 @@ struct ke_fa_ev {
     | FAN_MODIFY
     | FAN_MOVE
     | FAN_DELETE
+    | FAN_DELETE_SELF
     | FAN_EVENT_ON_CHILD;
+#if defined(FAN_RENAME) && defined(FAN_REPORT_TARGET_FID)
+  static constexpr auto init_flags_target = FAN_REPORT_TARGET_FID;
+  static constexpr auto recv_flags_rename
+    = (recv_flags & ~FAN_MOVE)
+    | FAN_RENAME;
+  static constexpr int info_old_dir = FAN_EVENT_INFO_TYPE_OLD_DFID_NAME;
+  static constexpr int info_new_dir = FAN_EVENT_INFO_TYPE_NEW_DFID_NAME;
+#else
+  static constexpr auto init_flags_target = 0;
+  static constexpr auto recv_flags_rename = recv_flags;
+  static constexpr int info_old_dir = -1;
+  static constexpr int info_new_dir = -1;
+#endif
+  /*  In the close-write mode, we're told when a file
+      which was written to is closed, instead of about
+      each write. */
+  static constexpr auto recv_flags_close_write
+    = FAN_CLOSE_WRITE;
+  static constexpr auto mark_ignore_legacy
+    = FAN_MARK_IGNORED_MASK
+    | FAN_MARK_IGNORED_SURV_MODIFY;
+#ifdef FAN_MARK_IGNORE_SURV
+  static constexpr auto mark_ignore = FAN_MARK_IGNORE_SURV;
+#else
+  static constexpr auto mark_ignore = mark_ignore_legacy;
+#endif
+  /*  Directory handles (and their filesystem's id)
+      to paths */
+  using paths = std::unordered_map<std::string, std::string>;
 
   int fd = -1;
-  alignas(fanotify_event_metadata) char buf[buf_len]{0};
+  unsigned long long recv = recv_flags;
+  /*  Whether we may open the handles of what changed,
+      for the stats mode, until we're told otherwise */
+  bool is_by_handle = true;
+  paths dm{};
+  std::vector<char> buf = std::vector<char>(buf_len);
+
+  /*  The most events which could fit in our buffer */
+  inline auto c_ulim() const -> size_t
+  { return buf.size() / sizeof(fanotify_event_metadata); }
 };
 
 // clang-format on
@@ -1051,48 +4135,227 @@ struct sysres {
   result ok = result::e;
   ke_fa_ev ke{};
   semabin const& il{};
+  ::wtr::watcher::watch_options opts{};
+  std::string base{};
+  adapter::pl pl{};
+  adapter::cw cw{};
+  adapter::ct ct{};
+  adapter::fo fo{};
+  adapter::st st{};
   adapter::ep ep{};
+  adapter::shard shard{};
+  adapter::bl bl{};
 };
 
-inline auto do_mark =
-  [](char const* const dirpath, int fa_fd, auto const& cb) -> result
+/*  A handle is only unique within its filesystem,
+    so our keys begin with the filesystem's id. */
+inline auto dm_key(void const* fsid, file_handle const* fh) -> std::string
+{
+  static_assert(sizeof(__kernel_fsid_t) == sizeof(fsid_t));
+  auto k = std::string((char const*)fsid, sizeof(__kernel_fsid_t));
+  k.append((char const*)&fh->handle_type, sizeof(fh->handle_type));
+  k.append((char const*)fh->f_handle, fh->handle_bytes);
+  return k;
+}
+
+/*  The key which an event's directory would have.
+    Empty if we can't identify the path. */
+inline auto dm_key_of(char const* const path, struct statfs const& sfs)
+  -> std::string
+{
+  alignas(file_handle) char buf[sizeof(file_handle) + MAX_HANDLE_SZ];
+  auto fh = (file_handle*)buf;
+  fh->handle_bytes = MAX_HANDLE_SZ;
+  int mount_id = 0;
+  if (name_to_handle_at(AT_FDCWD, path, fh, &mount_id, 0) != 0) return {};
+  return dm_key(&sfs.f_fsid, fh);
+}
+
+inline auto dm_key_of(char const* const path) -> std::string
+{
+  struct statfs sfs;
+  return statfs(path, &sfs) == 0 ? dm_key_of(path, sfs) : std::string{};
+}
+
+/*  Marks a directory. Hands it to the poller if it
+    lives on a filesystem which won't tell us about
+    changes, if we're out of marks, or if fanotify
+    can't identify the filesystem's objects for us.
+    Some overlays are like that. */
+inline auto do_mark = [](
+                        char const* const dirpath,
+                        ke_fa_ev& ke,
+                        pl& pl,
+                        auto const& cb) -> result
 {
   auto e = result::w_sys_not_watched;
+  auto is_unmarkable = [](int ec)
+  { return ec == ENOSPC || ec == ENODEV || ec == EOPNOTSUPP || ec == EXDEV; };
   char real[PATH_MAX];
+  struct statfs sfs;
+  if (! realpath(dirpath, real) || ! is_dir(real) || statfs(real, &sfs) != 0)
+    return send_msg(e, dirpath, cb), e;
+  if (is_pollfs(sfs)) return do_poll_mark(real, pl, cb);
+  auto key = dm_key_of(real, sfs);
+  if (key.empty())
+    return is_unmarkable(errno) ? do_poll_mark(real, pl, cb)
+                                : (send_msg(e, dirpath, cb), e);
   int anonymous_wd =
-    realpath(dirpath, real) && is_dir(real)
-      ? fanotify_mark(fa_fd, FAN_MARK_ADD, ke_fa_ev::recv_flags, AT_FDCWD, real)
-      : -1;
+    fanotify_mark(ke.fd, FAN_MARK_ADD, ke.recv, AT_FDCWD, real);
   if (anonymous_wd == 0)
-    return result::complete;
+    return ke.dm.insert_or_assign(std::move(key), real), result::complete;
+  else if (is_unmarkable(errno))
+    return do_poll_mark(real, pl, cb);
   else
     return send_msg(e, dirpath, cb), e;
 };
 
+/*  Asks the kernel to keep changes to an excluded file
+    to itself. The file's parent is marked, so we'd
+    hear about it otherwise. (We never mark excluded
+    directories, so nothing beneath them is reported.)
+    Creation, destruction and renaming are reported on
+    the parent alone, so we drop those ourselves.
+    `FAN_MARK_IGNORE` (Linux 6.0) is the newer form of
+    the ignored mask. We fall back to the older one. */
+inline auto do_ignore(char const* const path, ke_fa_ev const& ke) -> bool
+{
+  auto add = [&](unsigned flags)
+  {
+    auto fl = FAN_MARK_ADD | flags;
+    auto msk = FAN_MODIFY | FAN_CLOSE_WRITE;
+    return fanotify_mark(ke.fd, fl, msk, AT_FDCWD, path) == 0;
+  };
+  if (is_dir(path)) return false;
+  return add(ke_fa_ev::mark_ignore)
+      || (errno == EINVAL && add(ke_fa_ev::mark_ignore_legacy));
+}
+
+/*  Whether fanotify can report on the filesystem the
+    base path lives on. Some filesystems can't encode
+    the handles we need. Others are marked, without
+    complaint, but never report anything. We'd rather
+    the inotify adapter handle those than the poller. */
+inline auto is_fa_capable(ke_fa_ev const& ke, char const* const base_path)
+  -> bool
+{
+  auto ec =
+    fanotify_mark(ke.fd, FAN_MARK_ADD, ke.recv, AT_FDCWD, base_path) == 0
+      ? 0
+      : errno;
+  return is_pollfs(base_path)
+      || ! (ec == ENODEV || ec == EOPNOTSUPP || ec == EXDEV);
+}
+
 /*  Grabs the resources we need from `fanotify`
     and `epoll`. Marks itself invalid on errors,
     sends diagnostics on warnings and errors.
+    We ask for the privileged flags first, and
+    try again without them if we're refused. The
+    same goes for the flags older kernels lack.
     Walks the given base path, recursively,
-    marking each directory along the way. */
+    marking each directory along the way, and
+    taking an inventory if we were asked to.
+    With a set of files, we only mark the
+    directories they're in. We don't walk any
+    deeper than we were asked to watch. As one
+    of a few shards, we only walk into what's
+    ours. See `shard`. */
 inline auto make_sysres = [](
                             char const* const base_path,
                             auto const& cb,
-                            semabin const& living) -> sysres
+                            semabin const& living,
+                            ::wtr::watcher::watch_options const& opts,
+                            shard sh) -> sysres
 {
-  int fa_fd = fanotify_init(ke_fa_ev::init_flags, ke_fa_ev::init_io_flags);
-  if (fa_fd < 1) return sysres{.ok = result::e_sys_api_fanotify, .il = living};
-  walkdir_do(base_path, [&](auto dir) { do_mark(dir, fa_fd, cb); });
-  auto ep = make_ep(fa_fd, living.fd);
+  using ke_t = ke_fa_ev;
+  constexpr unsigned init_flags_by_preference[] = {
+    ke_t::init_flags | ke_t::init_flags_target,
+    ke_t::init_flags,
+    ke_t::init_flags_unprivileged | ke_t::init_flags_target,
+    ke_t::init_flags_unprivileged,
+  };
+  auto ke = ke_t{};
+  auto flags = 0u;
+  for (auto f : init_flags_by_preference) {
+    ke.fd = fanotify_init(flags = f, ke_t::init_io_flags);
+    if (ke.fd >= 0 || (errno != EPERM && errno != EINVAL)) break;
+  }
+  if (ke.fd < 1) return sysres{.ok = result::e_sys_api_fanotify, .il = living};
+  if (flags & ke_t::init_flags_target) ke.recv = ke_t::recv_flags_rename;
+  if (opts.close_write)
+    ke.recv = (ke.recv & ~FAN_MODIFY) | ke_t::recv_flags_close_write;
+  int fa_fd = ke.fd;
+  if (! is_fa_capable(ke, base_path))
+    return close(fa_fd), sysres{.ok = result::e_sys_api_fanotify, .il = living};
+  auto pl = make_pl();
+  if (pl.fd < 0)
+    return close(fa_fd), sysres{.ok = result::e_sys_api_timerfd, .il = living};
+  auto iv = adapter::iv{opts};
+  auto base = realpath_of(base_path);
+  auto mark = [&](char const* const dir)
+  {
+    if (is_excluded(opts, dir) || ! is_ours(sh, base, dir)) return false;
+    auto r = do_mark(dir, ke, pl, cb);
+    if (r == result::w_sys_polled) pl_inventory(pl, dir, iv);
+    return r != result::w_sys_polled;
+  };
+  auto ent = [&](char const* const dir, dirent const* const de)
+  {
+    if (sh.nth == 0 || strcmp(dir, base_path) != 0) iv.push(dir, de);
+  };
+  walk_do(base_path, opts, mark, ent);
+  iv.send();
+  for (auto const& ex : opts.exclude) do_ignore(ex.c_str(), ke);
+  auto sr_opts = opts;
+  if (opts.exclude_self) sr_opts.exclude_pids.push_back(getpid());
+  auto ep = make_ep(fa_fd, living.fd, pl.fd, opts.epoll_q_len);
+  auto q_len = flags & FAN_UNLIMITED_QUEUE
+               ? 0
+               : number_of(ke_t::q_len_path, ke_t::q_len);
+  ke.buf.resize(buf_len_of(opts, ke_t::buf_len_floor));
   if (ep.fd < 1)
-    return close(fa_fd), sysres{.ok = result::e_sys_api_epoll, .il = living};
+    return close(fa_fd), close(pl.fd),
+           sysres{.ok = result::e_sys_api_epoll, .il = living};
   return sysres{
     .ok = result::pending,
-    .ke{.fd = fa_fd},
+    .ke = std::move(ke),
     .il = living,
+    .opts = std::move(sr_opts),
+    .base = std::move(base),
+    .pl = std::move(pl),
+    .ct = make_ct(opts),
     .ep = ep,
+    .shard = std::move(sh),
+    .bl = make_bl(opts, q_len),
   };
 };
 
+/*  The path of an event's directory, without the name
+    of the directory entry. We look the directory up in
+    our own map first. Only privileged users can open
+    the handle. */
+inline auto dirof(
+  fanotify_event_info_fid const* const dir_info,
+  ke_fa_ev::paths const& dm,
+  int* ec) -> std::string
+{
+  constexpr size_t path_ulim = PATH_MAX - sizeof('\0');
+  constexpr int ofl = O_RDONLY | O_CLOEXEC | O_PATH;
+  auto dir_fh = (file_handle*)(dir_info->handle);
+  auto at = dm.find(dm_key(&dir_info->fsid, dir_fh));
+  if (at != dm.end()) return at->second;
+  int fd = open_by_handle_at(AT_FDCWD, dir_fh, ofl);
+  if (fd <= 0) return *ec = errno, std::string{};
+  char path_buf[PATH_MAX];
+  char fs_ev_pidpath[32] = {0};
+  snprintf(fs_ev_pidpath, sizeof(fs_ev_pidpath), "/proc/self/fd/%d", fd);
+  auto path_len = readlink(fs_ev_pidpath, path_buf, path_ulim);
+  if (path_len <= 0) *ec = errno;
+  close(fd);
+  return path_len > 0 ? std::string{path_buf, (size_t)path_len} : std::string{};
+}
+
 /*  Parses a full path from an event's metadata.
     The shenanigans we do here depend on this event being
     `FAN_EVENT_INFO_TYPE_DFID_NAME`. The kernel passes us
@@ -1122,38 +4385,90 @@ inline auto make_sysres = [](
     The kernel guarentees that there is a null-terminated
     character string to the event's directory entry
     after the file handle to the directory.
-    Confusing, right? */
-inline auto
-pathof(fanotify_event_metadata const* const mtd, int* ec) -> std::string
+    Confusing, right?
+    The old and new names of a `FAN_RENAME` event have
+    the same layout. */
+inline auto pathof(
+  fanotify_event_info_fid const* const dir_info,
+  ke_fa_ev::paths const& dm,
+  int* ec) -> std::string
 {
-  constexpr size_t path_ulim = PATH_MAX - sizeof('\0');
-  constexpr int ofl = O_RDONLY | O_CLOEXEC | O_PATH;
-  auto dir_info = (fanotify_event_info_fid*)(mtd + 1);
   auto dir_fh = (file_handle*)(dir_info->handle);
-  char path_buf[PATH_MAX];
-  ssize_t file_name_offset = 0;
-  /*  Directory name */
-  int fd = open_by_handle_at(AT_FDCWD, dir_fh, ofl);
-  if (fd <= 0) {
-    *ec = errno;
-    return {};
-  }
-  char fs_ev_pidpath[32] = {0};
-  snprintf(fs_ev_pidpath, sizeof(fs_ev_pidpath), "/proc/self/fd/%d", fd);
-  file_name_offset = readlink(fs_ev_pidpath, path_buf, path_ulim);
-  close(fd);
-  path_buf[file_name_offset] = 0;
-  /*  File name ("Directory entry")
-      If we wrote the directory name before here, we
-      can start writing the file name after its offset. */
-  if (file_name_offset > 0) {
-    char* file_name = ((char*)dir_fh->f_handle + dir_fh->handle_bytes);
-    auto not_selfdir = strcmp(file_name, ".") != 0;
-    auto beg = path_buf + file_name_offset;
-    auto end = PATH_MAX - file_name_offset;
-    if (file_name && not_selfdir) snprintf(beg, end, "/%s", file_name);
+  char* file_name = ((char*)dir_fh->f_handle + dir_fh->handle_bytes);
+  auto is_selfdir = strcmp(file_name, ".") == 0;
+  auto dir = dirof(dir_info, dm, ec);
+  return dir.empty() || is_selfdir ? dir : dir + '/' + file_name;
+}
+
+/*  The records which follow an event's metadata.
+    Most events have the directory and name of what
+    happened. A `FAN_RENAME` event has the old name
+    (if we watch the directory it was in) and the new
+    name (if we watch the directory it's in now).
+    We may also have the object's own handle. */
+struct infos {
+  fanotify_event_info_fid const* dir = nullptr;
+  fanotify_event_info_fid const* old_dir = nullptr;
+  fanotify_event_info_fid const* new_dir = nullptr;
+  fanotify_event_info_fid const* self = nullptr;
+};
+
+inline auto infos_of(fanotify_event_metadata const* const m) -> infos
+{
+  auto ifs = infos{};
+  auto at = (char const*)m + m->metadata_len;
+  auto end = (char const*)m + m->event_len;
+  while (at + sizeof(fanotify_event_info_header) <= end) {
+    auto info = (fanotify_event_info_fid const*)at;
+    auto type = info->hdr.info_type;
+    if (info->hdr.len == 0) break;
+    if (type == FAN_EVENT_INFO_TYPE_DFID_NAME) ifs.dir = info;
+    if (type == ke_fa_ev::info_old_dir) ifs.old_dir = info;
+    if (type == ke_fa_ev::info_new_dir) ifs.new_dir = info;
+    if (type == FAN_EVENT_INFO_TYPE_FID) ifs.self = info;
+    at += info->hdr.len;
   }
-  return {path_buf};
+  return ifs;
+}
+
+/*  A descriptor for what changed, for the stats mode,
+    or -1. Only privileged users can open the handle,
+    so we stop trying once we're told we can't. */
+/*  As one of a few shards, the names of a rename whose
+    directories we don't watch belong to someone else
+    (or to what's outside the tree), so we leave them
+    out. Without both, it isn't ours at all. */
+inline auto seen_of(infos ifs, sysres const& sr) -> infos
+{
+  auto is_seen = [&](fanotify_event_info_fid const* const i)
+  { return i && sr.ke.dm.count(dm_key(&i->fsid, (file_handle*)i->handle)); };
+  if (sr.shard.count < 2) return ifs;
+  if (! is_seen(ifs.old_dir)) ifs.old_dir = nullptr;
+  if (! is_seen(ifs.new_dir)) ifs.new_dir = nullptr;
+  return ifs;
+}
+
+inline auto self_fd_of(infos const& ifs, ke_fa_ev& ke) -> int
+{
+  constexpr int ofl = O_RDONLY | O_CLOEXEC | O_PATH;
+  if (! ifs.self || ! ke.is_by_handle) return -1;
+  int fd = open_by_handle_at(AT_FDCWD, (file_handle*)ifs.self->handle, ofl);
+  if (fd < 0 && errno == EPERM) ke.is_by_handle = false;
+  return fd;
+}
+
+inline auto effect_of(unsigned long long msk, infos const& ifs)
+  -> enum ::wtr::watcher::event::effect_type
+{
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  return msk & FAN_CREATE      ? ev_et::create
+       : msk & FAN_DELETE      ? ev_et::destroy
+       : msk & FAN_MODIFY      ? ev_et::modify
+       : msk & FAN_CLOSE_WRITE ? ev_et::modify
+       : msk & FAN_MOVE        ? ev_et::rename
+       : ifs.old_dir           ? ev_et::rename
+       : ifs.new_dir           ? ev_et::rename
+                               : ev_et::other;
 }
 
 inline auto peek(fanotify_event_metadata const* const m, size_t read_len)
@@ -1174,48 +4489,196 @@ struct Parsed {
   unsigned this_len = 0;
 };
 
-inline auto
-parse_ev(fanotify_event_metadata const* const m, size_t read_len, int* ec)
-  -> Parsed
+inline auto parse_ev(
+  fanotify_event_metadata const* const m,
+  infos const& ifs,
+  size_t read_len,
+  ke_fa_ev::paths const& dm,
+  int* ec) -> Parsed
 {
   using ev = ::wtr::watcher::event;
   using ev_pt = enum ev::path_type;
   using ev_et = enum ev::effect_type;
   auto n = peek(m, read_len);
   auto pt = m->mask & FAN_ONDIR ? ev_pt::dir : ev_pt::file;
-  auto et = m->mask & FAN_CREATE ? ev_et::create
-          : m->mask & FAN_DELETE ? ev_et::destroy
-          : m->mask & FAN_MODIFY ? ev_et::modify
-          : m->mask & FAN_MOVE   ? ev_et::rename
-                                 : ev_et::other;
+  auto et = effect_of(m->mask, ifs);
   auto isfromto = [et](unsigned a, unsigned b) -> bool
   { return et == ev_et::rename && a & FAN_MOVED_FROM && b & FAN_MOVED_TO; };
+  auto at = [&](auto* info) { return ev(pathof(info, dm, ec), et, pt); };
   auto one = [&](auto* m) -> Parsed
-  { return {ev(pathof(m, ec), et, pt), n, m->event_len}; };
+  { return {at(infos_of(m).dir), n, m->event_len}; };
   auto assoc = [&](auto* m, auto* n) -> Parsed
   {
     auto nn = peek(n, read_len);
     auto here_to_nnn = m->event_len + n->event_len;
-    auto e = ev(ev(pathof(m, ec), et, pt), ev(pathof(n, ec), et, pt));
+    auto e = ev(at(infos_of(m).dir), at(infos_of(n).dir));
     return {e, nn, here_to_nnn};
   };
-  return ! n                        ? one(m)
+  auto renamed = [&](auto* from, auto* to) -> Parsed
+  {
+    return from && to ? Parsed{ev(at(from), at(to)), n, m->event_len}
+         : from       ? Parsed{at(from), n, m->event_len}
+                      : Parsed{at(to), n, m->event_len};
+  };
+  return ifs.old_dir || ifs.new_dir ? renamed(ifs.old_dir, ifs.new_dir)
+       : ! n                        ? one(m)
        : isfromto(m->mask, n->mask) ? assoc(m, n)
        : isfromto(n->mask, m->mask) ? assoc(n, m)
                                     : one(m);
 }
 
-inline auto do_mark_if_newdir =
-  [](::wtr::watcher::event const& ev, int fa_fd, auto const& cb) -> result
+inline auto do_mark_if_newdir = [](
+                                   ::wtr::watcher::event const& ev,
+                                   ke_fa_ev& ke,
+                                   pl& pl,
+                                   auto const& cb) -> result
 {
   auto is_newdir = ev.effect_type == ::wtr::watcher::event::effect_type::create
                 && ev.path_type == ::wtr::watcher::event::path_type::dir;
   if (is_newdir)
-    return do_mark(ev.path_name.c_str(), fa_fd, cb);
+    return do_mark(ev.path_name.c_str(), ke, pl, cb);
   else
     return result::complete;
 };
 
+inline auto do_ignore_if_newfile =
+  [](::wtr::watcher::event const& ev, ke_fa_ev const& ke) -> bool
+{
+  auto is_newfile = ev.effect_type == ::wtr::watcher::event::effect_type::create
+                 && ev.path_type != ::wtr::watcher::event::path_type::dir;
+  return is_newfile && do_ignore(ev.path_name.c_str(), ke);
+};
+
+/*  A directory keeps its handle when it's renamed, so
+    we move it, along with everything beneath it, in our
+    map. We're given the handle with `FAN_RENAME`, and
+    look it up by the directory's new name otherwise. */
+inline auto dm_move_if_dir(
+  ::wtr::watcher::event const& ev,
+  infos const& ifs,
+  ke_fa_ev::paths& dm) -> void
+{
+  auto is_dir_rename =
+    ev.effect_type == ::wtr::watcher::event::effect_type::rename
+    && ev.path_type == ::wtr::watcher::event::path_type::dir;
+  if (! is_dir_rename) return;
+  auto to = (ev.associated ? ev.associated->path_name : ev.path_name).string();
+  auto at = dm.find(
+    ifs.self ? dm_key(&ifs.self->fsid, (file_handle*)ifs.self->handle)
+             : dm_key_of(to.c_str()));
+  if (at == dm.end() || at->second == to) return;
+  auto from = at->second;
+  auto is_beneath = [&](std::string const& p)
+  { return p.size() > from.size() && p[from.size()] == '/'; };
+  for (auto& [_, path] : dm)
+    if (path.compare(0, from.size(), from) == 0)
+      if (path.size() == from.size() || is_beneath(path))
+        path = to + path.substr(from.size());
+}
+
+/*  A directory which we only saw (or claimed) one name
+    of was moved into, or out of, what we watch (or what
+    this shard watches). What was moved in is marked, as
+    far down as we watch. What was moved out is unmarked,
+    along with everything beneath it, when we know where
+    it went. Otherwise, we keep its paths until we do. */
+inline auto do_remark_if_moved = [](
+                                    ::wtr::watcher::event const& ev,
+                                    ::wtr::watcher::event const& whole,
+                                    sysres& sr,
+                                    auto const& cb) -> void
+{
+  auto mark = [&](char const* const dir)
+  {
+    if (is_excluded(sr.opts, dir)) return false;
+    if (is_too_deep_to_mark(sr.opts, sr.base, dir)) return false;
+    return do_mark(dir, sr.ke, sr.pl, cb) != result::w_sys_polled;
+  };
+  auto const& path = ev.path_name.native();
+  if (! is_half_moved_dir(ev))
+    return;
+  else if (is_moved_in(ev)) {
+    if (sr.opts.files.empty()) walkdir_do(path.c_str(), mark);
+  }
+  else if (whole.associated) {
+    auto const& to = whole.associated->path_name.native();
+    for (auto at = sr.ke.dm.begin(); at != sr.ke.dm.end();)
+      if (is_at_or_beneath(path, at->second)) {
+        auto now = to + at->second.substr(path.size());
+        fanotify_mark(
+          sr.ke.fd,
+          FAN_MARK_REMOVE,
+          sr.ke.recv,
+          AT_FDCWD,
+          now.c_str());
+        at = sr.ke.dm.erase(at);
+      }
+      else
+        ++at;
+  }
+};
+
+/*  Whether two records are about the same directory. */
+inline auto is_same_dir(
+  fanotify_event_info_fid const* const a,
+  fanotify_event_info_fid const* const b) -> bool
+{
+  auto fa = (file_handle const*)a->handle;
+  auto fb = (file_handle const*)b->handle;
+  return memcmp(&a->fsid, &b->fsid, sizeof(a->fsid)) == 0
+      && fa->handle_type == fb->handle_type
+      && fa->handle_bytes == fb->handle_bytes
+      && memcmp(fa->f_handle, fb->f_handle, fa->handle_bytes) == 0;
+}
+
+/*  The directories which changed in a batch of events,
+    and how many of each effect happened in them. For
+    the coarse and the counting modes. We compare their
+    handles, and only look for their paths once the
+    batch is read.
+    A record names one directory, or two for renames.
+    (Handles point into the buffer we read into, which
+    is why we can't hold onto them past this batch.) */
+struct batch_dirs {
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  std::vector<fanotify_event_info_fid const*> dirs{};
+  std::vector<std::array<unsigned, ct::effect_c>> counts{};
+
+  inline auto push(fanotify_event_info_fid const* const info, ev_et et)
+    -> void
+  {
+    if (! info) return;
+    size_t i = 0;
+    while (i < dirs.size() && ! is_same_dir(dirs[i], info)) ++i;
+    if (i == dirs.size()) dirs.push_back(info), counts.emplace_back();
+    counts[i][(size_t)et]++;
+  }
+
+  /*  Each record in the `len` bytes beginning at `m` */
+  inline auto push(fanotify_event_metadata const* m, size_t len) -> void
+  {
+    for (auto end = (char const*)m + len; (char const*)m < end;) {
+      auto ifs = infos_of(m);
+      auto et = effect_of(m->mask, ifs);
+      push(ifs.dir, et), push(ifs.old_dir, et), push(ifs.new_dir, et);
+      m = (fanotify_event_metadata const*)((char const*)m + m->event_len);
+    }
+  }
+
+  inline auto send(ke_fa_ev::paths const& dm, cw& cw, ct& ct) -> void
+  {
+    for (size_t i = 0; i < dirs.size(); ++i) {
+      int ec = 0;
+      auto path = dirof(dirs[i], dm, &ec);
+      if (ec || path.empty()) continue;
+      if (ct.period_ms)
+        ct_push(ct, std::move(path), counts[i]);
+      else
+        cw_push(cw, std::move(path));
+    }
+  }
+};
+
 /*  Read some events from what fanotify gives
     us. Sends (the valid) events to the user's
     callback. Send a diagnostic to the user on
@@ -1236,45 +4699,123 @@ inline auto do_mark_if_newdir =
     events by their file handles.
     The `metadata->vers` field may differ between
     kernel versions, so we check it against the
-    version we were compiled with. */
-inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
+    version we were compiled with.
+    A queue overflow is reported, but it isn't the
+    end of this batch. Neither is a directory being
+    destroyed, which we only use to forget about it.
+    (Its parent tells the user.)
+    Changes made by the processes we were asked to
+    ignore are dropped before we look for their path,
+    unless they change which directories we watch.
+    In the coarse and counting modes, we only look for
+    the paths of events which change which directories
+    we watch, or which might be excluded. The rest only
+    tell us which directories changed, and how.
+    In the fold mode, what's destroyed is held onto,
+    and folded into the directory it was beneath.
+    In the stats and dirs-first modes, everything is
+    held onto until the loop looks at it, once we're
+    done reading.
+    As one of a few shards, we only handle what's ours.
+    See `shard`. */
+inline auto do_ev_recv_buf = [](
+                              auto const& cb,
+                              sysres& sr,
+                              ssize_t read_len) -> result
 {
-  auto ev_info = [](fanotify_event_metadata const* const m)
-  { return (fanotify_event_info_fid*)(m + 1); };
-  auto ev_has_dirname = [&](fanotify_event_metadata const* const m) -> bool
-  { return ev_info(m)->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME; };
+  auto ev_has_dirname = [](fanotify_event_metadata const* const m) -> bool
+  {
+    auto ifs = infos_of(m);
+    return ifs.dir || ifs.old_dir || ifs.new_dir;
+  };
+  auto is_quiet = [&](fanotify_event_metadata const* const m) -> bool
+  { return is_excluded_pid(sr.opts, m->pid); };
+  auto is_unseen = [&](fanotify_event_metadata const* const m) -> bool
+  {
+    auto ifs = infos_of(m);
+    auto seen = seen_of(ifs, sr);
+    auto is_renamed = ifs.old_dir || ifs.new_dir;
+    return is_renamed && ! seen.old_dir && ! seen.new_dir;
+  };
 
+  auto batch = batch_dirs{};
+  auto is_batched = sr.opts.coarse || sr.ct.period_ms;
+  auto is_unnamed = is_batched && sr.opts.exclude.empty();
   unsigned read_ev_count = 0;
-  int read_len = read(sr.ke.fd, sr.ke.buf, sr.ke.buf_len);
-  auto const* mtd = (fanotify_event_metadata*)(sr.ke.buf);
+  auto const whole_read_len = read_len;
+  auto const* mtd = (fanotify_event_metadata*)(sr.ke.buf.data());
   if (read_len <= 0 && errno != EAGAIN)
     return result::pending;
   else if (read_len < 0)
     return result::e_sys_api_read;
   else
     while (mtd && FAN_EVENT_OK(mtd, read_len))
-      if (read_ev_count++ > sr.ke.c_ulim)
+      if (read_ev_count++ > sr.ke.c_ulim())
         return result::e_sys_ret;
       else if (mtd->vers != FANOTIFY_METADATA_VERSION)
         return result::e_sys_lim_kernel_version;
       else if (mtd->fd != FAN_NOFD)
         return result::w_sys_bad_fd;
-      else if (mtd->mask & FAN_Q_OVERFLOW)
-        return result::w_sys_q_overflow;
+      else if (mtd->mask & FAN_Q_OVERFLOW) {
+        sr.bl.st.overflows++;
+        send_msg(result::w_sys_q_overflow, sr.base.c_str(), cb);
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
+      }
       else if (! ev_has_dirname(mtd))
         return result::w_sys_bad_meta;
+      else if (mtd->mask & FAN_DELETE_SELF) {
+        if (auto self = infos_of(mtd).dir)
+          sr.ke.dm.erase(dm_key(&self->fsid, (file_handle*)self->handle));
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
+      }
+      else if (is_quiet(mtd) && ! (mtd->mask & FAN_ONDIR))
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
+      else if (is_unnamed && ! (mtd->mask & FAN_ONDIR)) {
+        batch.push(mtd, mtd->event_len);
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
+      }
+      else if (is_unseen(mtd))
+        mtd = FAN_EVENT_NEXT(mtd, read_len);
       else {
         int ec = 0;
-        auto [ev, n, l] = parse_ev(mtd, read_len, &ec);
+        auto ifs = seen_of(infos_of(mtd), sr);
+        auto [whole, n, l] = parse_ev(mtd, ifs, read_len, sr.ke.dm, &ec);
         if (ec) return result::w_sys_bad_fd;
-        do_mark_if_newdir(ev, sr.ke.fd, cb);
-        cb(ev);
+        auto part = claim_of(sr.shard, sr.base, whole);
+        auto ev = part_of(whole, part);
+        auto is_ex = is_excluded(sr.opts, ev.path_name.native());
+        auto quiet = is_ex || is_quiet(mtd) || ! (part.from || part.to);
+        if (part.from || part.to) dm_move_if_dir(ev, ifs, sr.ke.dm);
+        if (part.from || part.to) do_remark_if_moved(ev, whole, sr, cb);
+        if (is_ex)
+          do_ignore_if_newfile(ev, sr.ke);
+        else if (
+          sr.opts.files.empty() && (part.from || part.to)
+          && ! is_too_deep_to_mark(sr.opts, sr.base, ev.path_name.native()))
+          do_mark_if_newdir(ev, sr.ke, sr.pl, cb);
+        if (! quiet && ! is_batched)
+          do_send(
+            cb,
+            sr,
+            ev,
+            sr.opts.stats ? self_fd_of(infos_of(mtd), sr.ke) : -1);
+        if (! quiet && is_batched) batch.push(mtd, l);
         mtd = n;
         read_len -= l;
       }
+  bl_read(sr.bl, whole_read_len, read_ev_count);
+  batch.send(sr.ke.dm, sr.cw, sr.ct);
   return result::pending;
 };
 
+/*  Reads, then looks at what we read. In the io-uring
+    mode, the ring reads for us. See `ur`. */
+inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
+{
+  auto read_len = read(sr.ke.fd, sr.ke.buf.data(), sr.ke.buf.size());
+  return do_ev_recv_buf(cb, sr, read_len);
+};
+
 } /*  namespace detail::wtr::watcher::adapter::fanotify */
 
 #endif
@@ -1287,6 +4828,7 @@ inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
 
 #if (KERNEL_VERSION(2, 7, 0) <= LINUX_VERSION_CODE) || __ANDROID_API__
 
+#include <errno.h>
 #include <filesystem>
 #include <limits.h>
 #include <string.h>
@@ -1295,6 +4837,7 @@ inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 namespace detail::wtr::watcher::adapter::inotify {
 
@@ -1322,18 +4865,16 @@ struct ke_in_ev {
       `epoll` event loop and everything
       to do with `read()` calls which
       fill a buffer with batched events.
+      This is the default. The user may
+      ask for another (`read_buf_len`),
+      but never less than `one_ulim`.
   */
   static constexpr unsigned buf_len = 4096;
   static_assert(buf_len > one_ulim * 8, "capacity");
-  /*  The upper limit of how many events
-      we could possibly read into a buffer
-      which is `buf_len` bytes large.
-      Practically, if we come half-way
-      close to this value, we should
-      be skeptical of the `read`.
-  */
-  static constexpr unsigned c_ulim = buf_len / sizeof(inotify_event);
-  static_assert(c_ulim == 256);
+  static constexpr unsigned buf_len_floor = one_ulim;
+  /*  How many events the kernel holds for us */
+  static constexpr auto q_len_path = "/proc/sys/fs/inotify/max_queued_events";
+  static constexpr unsigned long long q_len = 16384;
   /*  These are the kinds of events which
       we're intersted in. Inotify *should*
       only send us these events, but that's
@@ -1364,14 +4905,32 @@ struct ke_in_ev {
     | IN_MOVE_SELF
     | IN_MOVED_FROM
     | IN_MOVED_TO;
+  /*  In the close-write mode, we're told
+      when a file which was written to is
+      closed, instead of about each write.
+      That's one event for each completed
+      write, however large it was.
+  */
+  static constexpr unsigned recv_mask_close_write
+    = (recv_mask & ~IN_MODIFY)
+    | IN_CLOSE_WRITE;
 
   int fd = -1;
+  unsigned recv = recv_mask;
   using paths = std::unordered_map<int, std::filesystem::path>;
   paths dm{};
-  alignas(inotify_event) char ev_buf[buf_len]{0};
-  int rm_wd_buf[buf_len]{0};
+  std::vector<char> buf = std::vector<char>(buf_len);
+  std::vector<int> rm_wd_buf = std::vector<int>(buf_len);
 
-  static_assert(sizeof(ev_buf) % sizeof(inotify_event) == 0, "alignment");
+  /*  The upper limit of how many events
+      we could possibly read into our
+      buffer.
+      Practically, if we come half-way
+      close to this value, we should
+      be skeptical of the `read`.
+  */
+  inline auto c_ulim() const -> size_t
+  { return buf.size() / sizeof(inotify_event); }
 };
 
 // clang-format on
@@ -1380,19 +4939,39 @@ struct sysres {
   result ok = result::e;
   ke_in_ev ke{};
   semabin const& il{};
+  ::wtr::watcher::watch_options opts{};
+  std::string base{};
+  adapter::pl pl{};
+  adapter::cw cw{};
+  adapter::ct ct{};
+  adapter::fo fo{};
+  adapter::st st{};
   adapter::ep ep{};
+  adapter::shard shard{};
+  adapter::bl bl{};
 };
 
-inline auto do_mark =
-  [](char const* const dirpath, int dirfd, auto& dm, auto const& cb) -> result
+/*  Marks a directory. Hands it to the poller if
+    it lives on a filesystem which won't tell us
+    about changes, or if we're out of watches. */
+inline auto do_mark = [](
+                        char const* const dirpath,
+                        int dirfd,
+                        unsigned recv,
+                        auto& dm,
+                        pl& pl,
+                        auto const& cb) -> result
 {
   auto e = result::w_sys_not_watched;
   char real[PATH_MAX];
-  int wd = realpath(dirpath, real) && is_dir(real)
-           ? inotify_add_watch(dirfd, real, ke_in_ev::recv_mask)
-           : -1;
+  if (! realpath(dirpath, real) || ! is_dir(real))
+    return send_msg(e, dirpath, cb), e;
+  if (is_pollfs(real)) return do_poll_mark(real, pl, cb);
+  int wd = inotify_add_watch(dirfd, real, recv);
   if (wd > 0)
     return dm.emplace(wd, real), result::complete;
+  else if (errno == ENOSPC)
+    return do_poll_mark(real, pl, cb);
   else
     return send_msg(e, dirpath, cb), e;
 };
@@ -1400,7 +4979,9 @@ inline auto do_mark =
 inline auto make_sysres = [](
                             char const* const base_path,
                             auto const& cb,
-                            semabin const& living) -> sysres
+                            semabin const& living,
+                            ::wtr::watcher::watch_options const& opts,
+                            shard sh) -> sysres
 {
   auto make_inotify = [](result* ok) -> int
   {
@@ -1410,35 +4991,71 @@ inline auto make_sysres = [](
     return in_fd;
   };
 
-  auto make_dm = [&](result* ok, int in_fd) -> ke_in_ev::paths
+  auto make_pl = [](result* ok) -> pl
+  {
+    if (*ok >= result::e) return pl{};
+    auto pl = adapter::make_pl();
+    if (pl.fd < 0) *ok = result::e_sys_api_timerfd;
+    return pl;
+  };
+
+  auto recv = opts.close_write ? ke_in_ev::recv_mask_close_write
+                               : ke_in_ev::recv_mask;
+
+  auto make_dm = [&](result* ok, int in_fd, pl& pl) -> ke_in_ev::paths
   {
     auto dm = ke_in_ev::paths{};
     if (*ok >= result::e) return dm;
-    walkdir_do(base_path, [&](auto dir) { do_mark(dir, in_fd, dm, cb); });
-    if (dm.empty()) *ok = result::e_self_noent;
+    auto iv = adapter::iv{opts};
+    auto base = realpath_of(base_path);
+    auto mark = [&](char const* const dir)
+    {
+      if (is_excluded(opts, dir) || ! is_ours(sh, base, dir)) return false;
+      auto r = do_mark(dir, in_fd, recv, dm, pl, cb);
+      if (r == result::w_sys_polled) pl_inventory(pl, dir, iv);
+      return r != result::w_sys_polled;
+    };
+    auto ent = [&](char const* const dir, dirent const* const de)
+    {
+      if (sh.nth == 0 || strcmp(dir, base_path) != 0) iv.push(dir, de);
+    };
+    walk_do(base_path, opts, mark, ent);
+    iv.send();
+    if (dm.empty() && pl.roots.empty()) *ok = result::e_self_noent;
     return dm;
   };
 
-  auto make_ep = [&](result* ok, int in_fd, int il_fd) -> ep
+  auto make_ep = [&](result* ok, int in_fd, int il_fd, int pl_fd) -> ep
   {
     if (*ok >= result::e) return ep{};
-    auto ep = adapter::make_ep(in_fd, il_fd);
+    auto ep = adapter::make_ep(in_fd, il_fd, pl_fd, opts.epoll_q_len);
     if (ep.fd < 0) *ok = result::e_sys_api_epoll;
     return ep;
   };
 
   auto ok = result::pending;
   auto in_fd = make_inotify(&ok);
-  auto dm = make_dm(&ok, in_fd);
-  auto ep = make_ep(&ok, in_fd, living.fd);
+  auto pl = make_pl(&ok);
+  auto dm = make_dm(&ok, in_fd, pl);
+  auto ep = make_ep(&ok, in_fd, living.fd, pl.fd);
+  auto buf_len = buf_len_of(opts, ke_in_ev::buf_len_floor);
   return sysres{
     .ok = ok,
     .ke{
         .fd = in_fd,
+        .recv = recv,
         .dm = std::move(dm),
+        .buf = std::vector<char>(buf_len),
+        .rm_wd_buf = std::vector<int>(buf_len),
         },
     .il = living,
+    .opts = opts,
+    .base = realpath_of(base_path),
+    .pl = std::move(pl),
+    .ct = make_ct(opts),
     .ep = ep,
+    .shard = std::move(sh),
+    .bl = make_bl(opts, number_of(ke_in_ev::q_len_path, ke_in_ev::q_len)),
   };
 };
 
@@ -1451,12 +5068,26 @@ inline auto peek = [](
   return next < ev_tail ? next : nullptr;
 };
 
+inline auto effect_of(unsigned msk) -> enum ::wtr::watcher::event::effect_type
+{
+  using ev_et = enum ::wtr::watcher::event::effect_type;
+  return msk & IN_CREATE      ? ev_et::create
+       : msk & IN_DELETE      ? ev_et::destroy
+       : msk & IN_MOVE        ? ev_et::rename
+       : msk & IN_MODIFY      ? ev_et::modify
+       : msk & IN_CLOSE_WRITE ? ev_et::modify
+                              : ev_et::other;
+}
+
 struct parsed {
   ::wtr::watcher::event ev;
   inotify_event* next = nullptr;
 };
 
+/*  The halves of a rename may be in different
+    directories, so we look for each one's own */
 inline auto parse_ev = [](
+                         ke_in_ev::paths const& dm,
                          std::filesystem::path const& dirname,
                          inotify_event const* const in,
                          inotify_event const* const tail) -> parsed
@@ -1465,13 +5096,13 @@ inline auto parse_ev = [](
   using ev_pt = enum ev::path_type;
   using ev_et = enum ev::effect_type;
   auto pathof = [&](inotify_event const* const m)
-  { return dirname / std::filesystem::path{m->name}; };
+  {
+    auto at = m->wd == in->wd ? dm.end() : dm.find(m->wd);
+    auto const& dir = at == dm.end() ? dirname : at->second;
+    return dir / std::filesystem::path{m->name};
+  };
   auto pt = in->mask & IN_ISDIR ? ev_pt::dir : ev_pt::file;
-  auto et = in->mask & IN_CREATE ? ev_et::create
-          : in->mask & IN_DELETE ? ev_et::destroy
-          : in->mask & IN_MOVE   ? ev_et::rename
-          : in->mask & IN_MODIFY ? ev_et::modify
-                                 : ev_et::other;
+  auto et = effect_of(in->mask);
   auto isassoc = [&](auto* a, auto* b) -> bool
   { return b && b->cookie && b->cookie == a->cookie && et == ev_et::rename; };
   auto isfromto = [](auto* a, auto* b) -> bool
@@ -1487,6 +5118,59 @@ inline auto parse_ev = [](
                              : one(in, next);
 };
 
+/*  A directory keeps its watch descriptor when it's
+    renamed, so we move it, along with everything
+    beneath it, in our map. Otherwise, what happens
+    beneath it would be reported by its old name.
+    We can only do that when we've seen both names. */
+inline auto dm_move_if_dir(
+  ::wtr::watcher::event const& ev,
+  ke_in_ev::paths& dm) -> void
+{
+  auto is_dir_rename =
+    ev.effect_type == ::wtr::watcher::event::effect_type::rename
+    && ev.path_type == ::wtr::watcher::event::path_type::dir && ev.associated;
+  if (! is_dir_rename) return;
+  auto const& from = ev.path_name.native();
+  auto const& to = ev.associated->path_name.native();
+  auto is_beneath = [&](std::string const& p)
+  { return p.size() > from.size() && p[from.size()] == '/'; };
+  for (auto& [_, path] : dm)
+    if (path.native().compare(0, from.size(), from) == 0)
+      if (path.native().size() == from.size() || is_beneath(path.native()))
+        path = to + path.native().substr(from.size());
+}
+
+/*  A directory which we only saw one name of was moved
+    into, or out of, what we watch (or what this shard
+    watches). What was moved in is marked, as far down
+    as we watch. What was moved out is forgotten, along
+    with everything beneath it. Its marks go with it,
+    so we'd hear about it by its old name otherwise. */
+inline auto do_remark_if_moved =
+  [](::wtr::watcher::event const& ev, sysres& sr, auto const& cb) -> void
+{
+  auto mark = [&](char const* const dir)
+  {
+    if (is_excluded(sr.opts, dir)) return false;
+    if (is_too_deep_to_mark(sr.opts, sr.base, dir)) return false;
+    auto r = do_mark(dir, sr.ke.fd, sr.ke.recv, sr.ke.dm, sr.pl, cb);
+    return r != result::w_sys_polled;
+  };
+  auto const& path = ev.path_name.native();
+  if (! is_half_moved_dir(ev))
+    return;
+  else if (is_moved_in(ev)) {
+    if (sr.opts.files.empty()) walkdir_do(path.c_str(), mark);
+  }
+  else
+    for (auto at = sr.ke.dm.begin(); at != sr.ke.dm.end();)
+      if (is_at_or_beneath(path, at->second.native()))
+        inotify_rm_watch(sr.ke.fd, at->first), at = sr.ke.dm.erase(at);
+      else
+        ++at;
+};
+
 struct defer_dm_rm_wd {
   ke_in_ev& ke;
   size_t back_idx = 0;
@@ -1498,7 +5182,7 @@ struct defer_dm_rm_wd {
       system invariant has been violated. */
   inline auto push(int wd) -> bool
   {
-    if (back_idx < ke.buf_len)
+    if (back_idx < ke.rm_wd_buf.size())
       return ke.rm_wd_buf[back_idx++] = wd, true;
     else
       return false;
@@ -1517,6 +5201,36 @@ struct defer_dm_rm_wd {
   };
 };
 
+/*  The directories which changed in a batch of events,
+    by their watch descriptors, and how many of each
+    effect happened in them. For the coarse and the
+    counting modes. We only look for their paths once
+    we're done with the batch. */
+struct batch_wds {
+  std::vector<int> wds{};
+  std::vector<std::array<unsigned, ct::effect_c>> counts{};
+
+  inline auto push(int wd, enum ::wtr::watcher::event::effect_type et) -> void
+  {
+    size_t i = 0;
+    while (i < wds.size() && wds[i] != wd) ++i;
+    if (i == wds.size()) wds.push_back(wd), counts.emplace_back();
+    counts[i][(size_t)et]++;
+  }
+
+  inline auto send(ke_in_ev::paths const& dm, cw& cw, ct& ct) -> void
+  {
+    for (size_t i = 0; i < wds.size(); ++i) {
+      auto at = dm.find(wds[i]);
+      if (at == dm.end()) continue;
+      if (ct.period_ms)
+        ct_push(ct, at->second.string(), counts[i]);
+      else
+        cw_push(cw, at->second.string());
+    }
+  }
+};
+
 /*  Parses each event's path name,
     path type and effect.
     Looks for the directory path
@@ -1588,51 +5302,158 @@ struct defer_dm_rm_wd {
     won't happen in that directory.
     If this happens for some other
     reason, we're in trouble.
+    With a set of files, we don't
+    mark new directories at all.
+    Nor do we mark those deeper than
+    we were asked to watch.
+
+    Renamed Directories --
+    We keep the paths in our map up
+    to date when a directory we watch
+    is renamed, in every mode.
+    When we only see one of its names,
+    it was moved in, and we mark it,
+    or out, and we forget it.
+
+    Shards --
+    As one of a few shards, we only
+    handle what's ours. See `shard`.
+
+    Folded Events --
+    In the fold mode, what's destroyed
+    is held onto, and folded into the
+    directory it was beneath. See `fo`.
+
+    Stats and Directories First --
+    In the stats mode, what we send is
+    held onto until we're done reading,
+    then looked at by its path. So it
+    is in the dirs-first mode, which
+    sends the directories' events first.
+    Either way, we mark what's new while
+    we read, before we send anything.
+    See `st`.
+
+    Coarse and Counted Events --
+    We only look at the names of
+    new directories, which we mark,
+    and, if the user excluded some
+    paths, the names of everything
+    else. Otherwise, we only note
+    the watch descriptor and the
+    effect. Once we're done with
+    this batch, we note each of
+    their directories as changed,
+    or count what happened there.
 */
-inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
+inline auto do_ev_recv_buf = [](
+                              auto const& cb,
+                              sysres& sr,
+                              ssize_t read_len) -> result
 {
   auto is_parity_lost = [](unsigned msk) -> bool
   { return msk & IN_DELETE_SELF && ! (msk & IN_MOVE_SELF); };
   auto is_real_event = [](unsigned msk) -> bool
   {
-    bool has_any = msk & ke_in_ev::recv_mask;
+    bool has_any = msk & (ke_in_ev::recv_mask | IN_CLOSE_WRITE);
     bool is_self_info = msk & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF);
     return has_any && ! is_self_info;
   };
 
-  auto read_len = read(sr.ke.fd, sr.ke.ev_buf, sizeof(sr.ke.ev_buf));
   if (read_len < 0 && errno != EAGAIN)
     return result::e_sys_api_read;
   else {
-    auto const* in_ev = (inotify_event*)(sr.ke.ev_buf);
-    auto const* const in_ev_tail = (inotify_event*)(sr.ke.ev_buf + read_len);
+    auto const* in_ev = (inotify_event*)(sr.ke.buf.data());
+    auto const* const in_ev_tail =
+      (inotify_event*)(sr.ke.buf.data() + read_len);
     unsigned in_ev_c = 0;
     auto dmrm = defer_dm_rm_wd{sr.ke};
+    auto batch = batch_wds{};
+    auto is_batched = sr.opts.coarse || sr.ct.period_ms;
     while (in_ev && in_ev < in_ev_tail) {
       auto in_ev_next = peek(in_ev, in_ev_tail);
       unsigned msk = in_ev->mask;
       auto dmhit = sr.ke.dm.find(in_ev->wd);
-      if (in_ev_c++ > ke_in_ev::c_ulim)
+      if (in_ev_c++ > sr.ke.c_ulim())
         return result::e_sys_ret;
       else if (is_parity_lost(msk) && ! dmrm.push(in_ev->wd))
         return result::e_sys_ret;
-      else if (dmhit == sr.ke.dm.end())
-        send_msg(result::w_sys_phantom, "", cb);
-      else if (msk & IN_Q_OVERFLOW)
-        send_msg(result::w_sys_q_overflow, dmhit->second.c_str(), cb);
+      else if (msk & IN_Q_OVERFLOW) {
+        sr.bl.st.overflows++;
+        send_msg(result::w_sys_q_overflow, sr.base.c_str(), cb);
+      }
+      else if (dmhit == sr.ke.dm.end()) {
+        if (! (msk & IN_IGNORED)) send_msg(result::w_sys_phantom, "", cb);
+      }
+      else if (is_real_event(msk) && is_batched) {
+        auto is_newdir = msk & IN_ISDIR && msk & IN_CREATE;
+        auto is_named = is_newdir || ! sr.opts.exclude.empty();
+        auto path = is_named ? dmhit->second / in_ev->name : "";
+        auto is_ex = is_named && is_excluded(sr.opts, path.native());
+        if (msk & IN_ISDIR && msk & IN_MOVE) {
+          auto [moved, next] =
+            parse_ev(sr.ke.dm, dmhit->second, in_ev, in_ev_tail);
+          auto const* to = next != in_ev_next ? in_ev_next : nullptr;
+          auto tohit = to ? sr.ke.dm.find(to->wd) : sr.ke.dm.end();
+          auto to_path = tohit != sr.ke.dm.end() && is_named
+                         ? tohit->second / to->name
+                         : "";
+          dm_move_if_dir(moved, sr.ke.dm);
+          do_remark_if_moved(moved, sr, cb);
+          /*  The other half of the pair is counted here, so
+              that we don't handle the rename twice */
+          if (to && ! (is_named && is_excluded(sr.opts, to_path.native())))
+            batch.push(to->wd, effect_of(to->mask));
+          in_ev_next = next;
+        }
+        auto is_walked =
+          sr.opts.files.empty()
+          && ! is_too_deep_to_mark(sr.opts, sr.base, path.native());
+        if (is_newdir && ! is_ex && is_walked)
+          do_mark(path.c_str(), sr.ke.fd, sr.ke.recv, sr.ke.dm, sr.pl, cb);
+        if (! is_ex) batch.push(in_ev->wd, effect_of(msk));
+      }
       else if (is_real_event(msk)) {
-        auto [ev, next] = parse_ev(dmhit->second, in_ev, in_ev_tail);
-        if (msk & IN_ISDIR && msk & IN_CREATE)
-          do_mark(ev.path_name.c_str(), sr.ke.fd, sr.ke.dm, cb);
-        cb(ev);
+        auto [whole, next] =
+          parse_ev(sr.ke.dm, dmhit->second, in_ev, in_ev_tail);
+        auto part = claim_of(sr.shard, sr.base, whole);
+        auto ev = part_of(whole, part);
+        auto is_claimed = part.from || part.to;
+        auto is_newdir = is_claimed && msk & IN_ISDIR && msk & IN_CREATE;
+        auto is_walked =
+          sr.opts.files.empty()
+          && ! is_too_deep_to_mark(sr.opts, sr.base, ev.path_name.native());
+        if (
+          is_newdir && is_walked
+          && ! is_excluded(sr.opts, ev.path_name.native()))
+          do_mark(
+            ev.path_name.c_str(),
+            sr.ke.fd,
+            sr.ke.recv,
+            sr.ke.dm,
+            sr.pl,
+            cb);
+        if (is_claimed) dm_move_if_dir(ev, sr.ke.dm);
+        if (is_claimed) do_remark_if_moved(ev, sr, cb);
+        if (is_claimed) do_send(cb, sr, ev, -1);
         in_ev_next = next;
       }
       in_ev = in_ev_next;
     }
+    bl_read(sr.bl, read_len, in_ev_c);
+    batch.send(sr.ke.dm, sr.cw, sr.ct);
     return result::pending;
   }
 };
 
+/*  Reads, then looks at what we read. In the io-uring
+    mode, the ring reads for us. See `ur`. */
+inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
+{
+  auto read_len = read(sr.ke.fd, sr.ke.buf.data(), sr.ke.buf.size());
+  return do_ev_recv_buf(cb, sr, read_len);
+};
+
 } /*  namespace detail::wtr::watcher::adapter::inotify */
 
 #endif
@@ -1647,23 +5468,87 @@ inline auto do_ev_recv = [](auto const& cb, sysres& sr) -> result
 #error "Define 'WATER_WATCHER_USE_WARTHOG' on kernel versions < 2.7.0"
 #endif
 
+#include <algorithm>
+#include <errno.h>
+#include <mutex>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 namespace detail::wtr::watcher::adapter {
 
-inline auto watch =
-  [](auto const& path, auto const& cb, auto const& living) -> bool
+/*  We take an inventory while we walk. See `iv`. */
+inline constexpr bool has_inventory = true;
+
+/*  How many of us there are. See `shard`. */
+inline constexpr int shard_ulim = 64;
+
+inline auto watch_shard = [](
+                             auto const& path,
+                             auto const& cb,
+                             auto const& living,
+                             auto const& opts,
+                             shard const& sh) -> bool
 {
-  auto platform_watch = [&](auto make_sysres, auto do_ev_recv) -> result
+  auto platform_watch =
+    [&](auto make_sysres, auto do_ev_recv, auto do_ev_recv_buf) -> result
   {
-    auto sr = make_sysres(path.c_str(), cb, living);
+    auto sr = make_sysres(path.c_str(), cb, living, opts, sh);
+    auto ur = adapter::ur{};
+    if (sr.ok < result::complete && sr.opts.io_uring)
+      ur = make_ur(
+        sr.ke.fd,
+        sr.ke.buf.data(),
+        (unsigned)sr.ke.buf.size(),
+        sr.il.fd,
+        sr.pl.fd);
     auto is_ev_of = [&](int nth, int fd) -> bool
     { return sr.ep.interests[nth].data.fd == fd; };
+    auto sooner = [](int a, int b) -> int
+    { return a < 0 ? b : b < 0 ? a : a < b ? a : b; };
+    auto pl_cb = [&](::wtr::watcher::event const& ev)
+    {
+      auto dir = [&] { return ev.path_name.parent_path().string(); };
+      if (is_excluded(sr.opts, ev.path_name.native()))
+        return;
+      else if (sr.ct.period_ms)
+        ct_push(sr.ct, dir(), ev.effect_type, 1);
+      else if (sr.opts.coarse)
+        cw_push(sr.cw, dir());
+      else
+        cb(ev);
+    };
+
+    /*  In the io-uring mode, the ring reads for us. See
+        `ur`. We use `epoll` if we can't have a ring. */
+    auto ur_cb = [&](uint64_t tag, int res)
+    {
+      if (tag == ur::il_poll)
+        sr.ok = result::complete;
+      else if (tag == ur::pl_poll)
+        sr.ok = do_poll_recv(pl_cb, sr.pl);
+      else if (res < 0)
+        errno = -res, sr.ok = do_ev_recv_buf(cb, sr, -1);
+      else
+        sr.ok = do_ev_recv_buf(cb, sr, res);
+    };
 
+    /*  A signal, such as a child's exit, may wake us
+        before any events do. That isn't an error. */
     while (sr.ok < result::complete) {
-      int ep_c =
-        epoll_wait(sr.ep.fd, sr.ep.interests, sr.ep.q_ulim, sr.ep.wake_ms);
-      if (ep_c < 0)
+      auto wake_ms = sooner(cw_wait_ms(sr.cw), ct_wait_ms(sr.ct));
+      wake_ms = sooner(wake_ms, fo_wait_ms(sr.fo));
+      int ep_c = 0;
+      if (ur.fd < 0)
+        ep_c = epoll_wait(
+          sr.ep.fd,
+          sr.ep.interests.data(),
+          (int)sr.ep.interests.size(),
+          wake_ms);
+      do_bl_sample(sr.opts, cb, sr.bl, sr.ke.fd, sr.base);
+      if (ur.fd >= 0 && ! ur_wait(ur, wake_ms, ur_cb))
+        sr.ok = result::e_sys_api_io_uring;
+      else if (ep_c < 0 && errno != EINTR)
         sr.ok = result::e_sys_api_epoll;
       else
         for (int n = 0; n < ep_c; ++n)
@@ -1671,8 +5556,14 @@ inline auto watch =
             sr.ok = result::complete;
           else if (is_ev_of(n, sr.ke.fd))
             sr.ok = do_ev_recv(cb, sr);
+          else if (is_ev_of(n, sr.pl.fd))
+            sr.ok = do_poll_recv(pl_cb, sr.pl);
           else
             sr.ok = result::e_sys_api_epoll;
+      do_st_send(cb, sr);
+      do_fo_send(cb, sr.fo, sr.ok >= result::complete);
+      do_cw_send(cb, sr.cw, sr.ok >= result::complete);
+      do_ct_send(sr.opts, sr.ct, sr.ok >= result::complete);
     }
 
     /*  We aren't worried about losing data after
@@ -1690,7 +5581,8 @@ inline auto watch =
         the out-of-file-descriptors case will be
         handled in `make_sysres()`.
     */
-    return close(sr.ke.fd), close(sr.ep.fd), sr.ok;
+    close_ur(ur);
+    return close(sr.ke.fd), close(sr.pl.fd), close(sr.ep.fd), sr.ok;
   };
 
   /*  e_sys_api_fanotify
@@ -1703,26 +5595,121 @@ inline auto watch =
       root but lack permission to use fanotify.
 
       The same error applies to being built on a kernel
-      which doesn't have the fanotify api.
+      which doesn't have the fanotify api, to running
+      without root on a kernel older than 5.13, and to
+      watching a filesystem which fanotify can't report
+      on for us.
   */
   auto try_fanotify = [&]()
   {
 #if (KERNEL_VERSION(5, 9, 0) <= LINUX_VERSION_CODE) && ! __ANDROID_API__
-    if (geteuid() == 0)
-      return platform_watch(fanotify::make_sysres, fanotify::do_ev_recv);
-#endif
+    return platform_watch(
+      fanotify::make_sysres,
+      fanotify::do_ev_recv,
+      fanotify::do_ev_recv_buf);
+#else
     return result::e_sys_api_fanotify;
+#endif
   };
 
+  do_reader_sched(opts);
   auto r = try_fanotify();
   if (r == result::e_sys_api_fanotify)
-    r = platform_watch(inotify::make_sysres, inotify::do_ev_recv);
+    r = platform_watch(
+      inotify::make_sysres,
+      inotify::do_ev_recv,
+      inotify::do_ev_recv_buf);
   if (r >= result::e)
     return send_msg(r, path.c_str(), cb), false;
   else
     return true;
 };
 
+/*  How many shards we can use. The batched modes, and a
+    set of files, mark what they mark without walking,
+    so they aren't split up. Neither is a tree we poll,
+    or one which we only watch the top of. */
+inline auto shard_count_of(
+  char const* const path,
+  ::wtr::watcher::watch_options const& opts) -> int
+{
+  auto is_split = opts.shards > 1 && ! opts.coarse && ! opts.on_counts
+               && opts.files.empty() && opts.max_depth != 0
+               && ! is_pollfs(path);
+  return is_split ? std::min(opts.shards, shard_ulim) : 1;
+}
+
+/*  The shards' backlogs, added up. The peaks are the
+    most they've added up to. */
+inline auto bl_sum_of(
+  std::vector<::wtr::watcher::backlog_stats> const& bls,
+  ::wtr::watcher::backlog_stats const& was) -> ::wtr::watcher::backlog_stats
+{
+  auto sum = ::wtr::watcher::backlog_stats{};
+  for (auto const& st : bls) {
+    sum.bytes += st.bytes;
+    sum.events += st.events;
+    sum.limit += st.limit;
+    sum.near_ns += st.near_ns;
+    sum.overflows += st.overflows;
+    sum.samples += st.samples;
+  }
+  sum.peak_bytes = std::max(was.peak_bytes, sum.bytes);
+  sum.peak_events = std::max(was.peak_events, sum.events);
+  return sum;
+}
+
+/*  With more than one shard, each has its own kernel
+    instance, read on its own thread, and they take
+    turns with the callbacks. We're done when they
+    all are. */
+inline auto watch = [](
+                       auto const& path,
+                       auto const& cb,
+                       auto const& living,
+                       auto const& opts) -> bool
+{
+  auto shard_c = shard_count_of(path.c_str(), opts);
+  if (shard_c < 2) return watch_shard(path, cb, living, opts, shard{});
+  auto mtx = std::mutex{};
+  auto turn_cb = [&](::wtr::watcher::event const& ev)
+  {
+    auto _ = std::scoped_lock{mtx};
+    cb(ev);
+  };
+  auto turn_opts = opts;
+  if (opts.on_inventory)
+    turn_opts.on_inventory = [&](std::vector<::wtr::watcher::event> const& evs)
+    {
+      auto _ = std::scoped_lock{mtx};
+      opts.on_inventory(evs);
+    };
+  auto bls = std::vector<::wtr::watcher::backlog_stats>(shard_c);
+  auto bl_all = ::wtr::watcher::backlog_stats{};
+  auto bl_cb = [&](int nth, ::wtr::watcher::backlog_stats const& st)
+  {
+    auto _ = std::scoped_lock{mtx};
+    bls[nth] = st;
+    bl_all = bl_sum_of(bls, bl_all);
+    opts.on_backlog(bl_all);
+  };
+  auto oks = std::vector<char>(shard_c, false);
+  auto shard_do = [&](int nth)
+  {
+    auto sh = shard{.nth = nth, .count = shard_c};
+    auto sh_opts = turn_opts;
+    if (opts.on_backlog)
+      sh_opts.on_backlog = [&, nth](::wtr::watcher::backlog_stats const& st)
+      { bl_cb(nth, st); };
+    oks[nth] = watch_shard(path, turn_cb, living, sh_opts, sh);
+  };
+  auto threads = std::vector<std::thread>{};
+  for (int nth = 1; nth < shard_c; ++nth) threads.emplace_back(shard_do, nth);
+  shard_do(0);
+  for (auto& t : threads) t.join();
+  return std::all_of(oks.begin(), oks.end(), [](char ok) { return ok; });
+};
+
 } /*  namespace detail::wtr::watcher::adapter */
 
 #endif
@@ -1934,6 +5921,9 @@ inline auto do_event_send(
 
 }  // namespace
 
+/*  We don't take an inventory. The `watch` does. */
+inline constexpr bool has_inventory = false;
+
 /*  while living
     watch for events
     return when dead
@@ -1941,7 +5931,8 @@ inline auto do_event_send(
 inline auto watch(
   std::filesystem::path const& path,
   ::wtr::watcher::event::callback const& callback,
-  semabin const& living) noexcept -> bool
+  semabin const& living,
+  ::wtr::watcher::watch_options const&) noexcept -> bool
 {
   using namespace ::wtr::watcher;
   auto w = watch_event_proxy{path};
@@ -2001,14 +5992,24 @@ inline constexpr std::filesystem::directory_options scan_dir_opts =
 using bucket_type =
   std::unordered_map<std::string, std::filesystem::file_time_type>;
 
+/*  Whether we're as deep as we were asked to scan */
+inline bool is_deepest(
+  std::filesystem::recursive_directory_iterator const& file,
+  int max_depth) noexcept
+{
+  return max_depth >= 0 && file.depth() >= max_depth;
+}
+
 /*  - Scans `path` for changes.
     - Updates our bucket to match the changes.
     - Calls `send_event` when changes happen.
-    - Returns false if the file tree cannot be scanned. */
+    - Returns false if the file tree cannot be scanned.
+    - Doesn't descend past `max_depth`, if it's not less than 0. */
 inline bool scan(
   std::filesystem::path const& path,
   auto const& send_event,
-  bucket_type& bucket) noexcept
+  bucket_type& bucket,
+  int max_depth) noexcept
 {
   /*  - Scans a (single) file for changes.
       - Updates our bucket to match the changes.
@@ -2067,11 +6068,14 @@ inline bool scan(
     using namespace std::filesystem;
     if (is_directory(dir)) {
       auto ec = std::error_code{};
-      for (auto file : recursive_directory_iterator(dir, scan_dir_opts, ec))
+      auto file = recursive_directory_iterator(dir, scan_dir_opts, ec);
+      for (; file != recursive_directory_iterator{}; file.increment(ec))
         if (ec)
           return false;
-        else
-          scan_file(file.path(), send_event);
+        else {
+          if (is_deepest(file, max_depth)) file.disable_recursion_pending();
+          scan_file(file->path(), send_event);
+        }
       return true;
     }
     else
@@ -2088,7 +6092,8 @@ inline bool scan(
 inline bool tend_bucket(
   std::filesystem::path const& path,
   auto const& send_event,
-  bucket_type& bucket) noexcept
+  bucket_type& bucket,
+  int max_depth) noexcept
 {
   /*  Creates a file map, the "bucket", from `path`. */
   auto populate = [&](std::filesystem::path const& path) -> bool
@@ -2103,14 +6108,15 @@ inline bool tend_bucket(
     else if (! is_directory(path))
       bucket[path] = last_write_time(path);
     else {
-      for (auto file :
-           recursive_directory_iterator(path, scan_dir_opts, dir_ec)) {
+      auto file = recursive_directory_iterator(path, scan_dir_opts, dir_ec);
+      for (; file != recursive_directory_iterator{}; file.increment(dir_ec)) {
+        if (is_deepest(file, max_depth)) file.disable_recursion_pending();
         if (! dir_ec) {
-          auto lwt = last_write_time(file, lwt_ec);
+          auto lwt = last_write_time(*file, lwt_ec);
           if (! lwt_ec)
-            bucket[file.path()] = lwt;
+            bucket[file->path()] = lwt;
           else
-            bucket[file.path()] = last_write_time(path);
+            bucket[file->path()] = last_write_time(path);
         }
       }
       return true;
@@ -2158,10 +6164,14 @@ inline bool tend_bucket(
 
 } /* namespace */
 
+/*  We don't take an inventory. The `watch` does. */
+inline constexpr bool has_inventory = false;
+
 inline auto watch(
   std::filesystem::path const& path,
   ::wtr::watcher::event::callback const& callback,
-  semabin const& living) noexcept -> bool
+  semabin const& living,
+  ::wtr::watcher::watch_options const& opts) noexcept -> bool
 {
   using std::this_thread::sleep_for;
   using namespace std::chrono_literals;
@@ -2173,8 +6183,8 @@ inline auto watch(
         - No errors occured while scanning
       Otherwise, stop and return false. */
   while (living.state() == semabin::state::pending) {
-    if (! tend_bucket(path, callback, bucket)) return false;
-    if (! scan(path, callback, bucket)) return false;
+    if (! tend_bucket(path, callback, bucket, opts.max_depth)) return false;
+    if (! scan(path, callback, bucket, opts.max_depth)) return false;
     sleep_for(16ms);
   }
   return true;
@@ -2204,11 +6214,38 @@ inline namespace watcher {
 
     @param path:
       The root path to watch for filesystem events.
+      A file is watched from its directory. (See
+      `watch_options::files`.)
 
     @param callback:
       Something (such as a closure) to be called when events
       occur in the path being watched.
 
+    @param options:
+      Optional. See `watch_options`.
+
+    With the `dirty` option, `drain()` takes the paths
+    which changed since it was last called. Building
+    something? Drain before each build.
+
+    With the `generations` option, `now()` gives a
+    cursor, and `changed_since(path, cursor)` tells us
+    whether anything at or beneath the path changed
+    after the cursor was taken.
+
+    With the `path_ids` option, every event carries
+    a `path_id`, and `id_of(path)` and `path_of(id)`
+    go between them.
+
+    With the `index` option, `snapshot()` gives us the
+    paths beneath the watched path, as they are now.
+    The snapshot won't change. We can ask it what's
+    `below()` or `within()` a path, and whether it
+    `contains()` a path.
+
+    With the `backlog` option, `backlog()` tells us how
+    far behind the kernel we were when we last looked.
+
     This is an adaptor "switch" that chooses the ideal
     adaptor for the host platform.
 
@@ -2237,23 +6274,175 @@ inline namespace watcher {
 
     Happy hacking. */
 class watch {
+public:
+  using dirty_paths = ::detail::wtr::watcher::dirty_set::paths;
+  using cursor = ::detail::wtr::watcher::dirty_tree::cursor;
+  using path_id = ::detail::wtr::watcher::path_ids::id;
+  using index_snapshot = ::detail::wtr::watcher::path_index::snapshot_ptr;
+
 private:
   using sb = ::detail::wtr::watcher::semabin;
   sb living{};
+  ::detail::wtr::watcher::dirty_set dirty{};
+  ::detail::wtr::watcher::dirty_tree tree{};
+  ::detail::wtr::watcher::path_ids ids{};
+  ::detail::wtr::watcher::path_index index{};
+  ::detail::wtr::watcher::backlog_gauge gauge{};
+  std::filesystem::path const root{};
   std::future<bool> watching{};
 
+  /*  The adapters see absolute paths, in the same form
+      as the paths they report. So do our questions. */
+  static inline auto absolute_of(
+    std::filesystem::path const& base,
+    std::filesystem::path const& path) -> std::filesystem::path
+  {
+    auto ec = std::error_code{};
+    auto abs = std::filesystem::weakly_canonical(base / path, ec);
+    if (ec) abs = (base / path).lexically_normal();
+    return abs.has_filename() ? abs : abs.parent_path();
+  }
+
+  static inline auto
+  absolute_of(std::filesystem::path const& base, watch_options options)
+    -> watch_options
+  {
+    for (auto& ex : options.exclude) ex = absolute_of(base, ex);
+    for (auto& t : options.tail) t = absolute_of(base, t);
+    for (auto& f : options.files) f = absolute_of(base, f);
+    return options;
+  }
+
+  /*  A file is watched from its directory */
+  static inline auto root_of(std::filesystem::path const& path)
+    -> std::filesystem::path
+  {
+    auto ec = std::error_code{};
+    auto abs = absolute_of({}, path);
+    return std::filesystem::is_regular_file(abs, ec) ? abs.parent_path() : abs;
+  }
+
+  /*  For the adapters which don't take an inventory,
+      and for a set of files, which isn't walked */
+  static inline auto
+  inventory_of(std::filesystem::path const& base, watch_options const& opts)
+    -> void
+  {
+    namespace fs = std::filesystem;
+    using ::detail::wtr::watcher::is_excluded;
+    using pt = enum event::path_type;
+    auto evs = std::vector<event>{};
+    auto push = [&](fs::path const& p, fs::file_status st)
+    {
+      evs.emplace_back(
+        p,
+        event::effect_type::other,
+        fs::is_directory(st)      ? pt::dir
+        : fs::is_regular_file(st) ? pt::file
+        : fs::is_symlink(st)      ? pt::sym_link
+                                  : pt::other);
+      if (evs.size() >= 1024) opts.on_inventory(evs), evs.clear();
+    };
+    for (auto const& f : opts.files) {
+      auto st_ec = std::error_code{};
+      auto st = fs::symlink_status(f, st_ec);
+      if (fs::exists(st) && ! is_excluded(opts, f.native())) push(f, st);
+    }
+    auto ec = std::error_code{};
+    auto opt = fs::directory_options::skip_permission_denied;
+    using walk = fs::recursive_directory_iterator;
+    auto at = opts.files.empty() ? walk{base, opt, ec} : walk{};
+    for (; ! ec && at != walk{}; at.increment(ec)) {
+      auto st_ec = std::error_code{};
+      if (is_excluded(opts, at->path().native()))
+        at.disable_recursion_pending();
+      else
+        push(at->path(), at->symlink_status(st_ec));
+    }
+    if (! evs.empty()) opts.on_inventory(evs);
+  }
+
 public:
   inline watch(
     std::filesystem::path const& path,
-    event::callback const& callback) noexcept
-      : watching{std::async(
+    event::callback const& callback,
+    watch_options const& options) noexcept
+      : root{root_of(path)}
+      , watching{std::async(
           std::launch::async,
-          [this, path, callback]
+          [this, path, callback, options]
           {
+            using ::detail::wtr::watcher::file_set;
+            using ::detail::wtr::watcher::is_excluded;
+            using ::detail::wtr::watcher::is_too_deep;
+            using ::detail::wtr::watcher::rewrites;
+            using ::detail::wtr::watcher::tails;
+            using ::detail::wtr::watcher::adapter::has_inventory;
             using ::detail::wtr::watcher::adapter::watch;
             auto ec = std::error_code{};
-            auto abs_path = std::filesystem::absolute(path, ec);
-            auto pre_ok = ! ec && std::filesystem::is_directory(abs_path, ec)
+            auto abs_path = absolute_of({}, path);
+            auto is_file =
+              ! ec && std::filesystem::is_regular_file(abs_path, ec);
+            auto base = is_file ? abs_path.parent_path() : abs_path;
+            auto opts = absolute_of(base, options);
+            if (is_file) opts.files.push_back(absolute_of(base, abs_path));
+            auto on_inventory = [this, options](std::vector<event> const& evs)
+            {
+              this->index.push(evs);
+              if (options.on_inventory) options.on_inventory(evs);
+            };
+            if (opts.index) this->index.begin(base, opts.index_files);
+            if (opts.index) opts.on_inventory = on_inventory;
+            auto on_backlog = [this, options](backlog_stats const& st)
+            {
+              this->gauge.push(st);
+              if (options.on_backlog) options.on_backlog(st);
+            };
+            if (opts.backlog) opts.on_backlog = on_backlog;
+            auto send = [this, &callback, &opts](event const& ev)
+            {
+              if (opts.generations) this->tree.push(ev);
+              if (opts.index) this->index.push(ev);
+              if (opts.dirty)
+                this->dirty.push(ev);
+              else
+                callback(ev);
+            };
+            auto tl = tails{opts.tail};
+            auto pass = [this, &callback, &opts, &send, &tl](event const& ev)
+            {
+              auto is_tailed = ! opts.tail.empty();
+              if (ev.path_type == event::path_type::watcher)
+                callback(ev);
+              else if (is_tailed && opts.path_ids)
+                send(this->ids.stamp(tl.stamp(ev)));
+              else if (is_tailed)
+                send(tl.stamp(ev));
+              else if (opts.path_ids)
+                send(this->ids.stamp(ev));
+              else
+                send(ev);
+            };
+            auto rw = rewrites{
+              pass,
+              opts.skip_rewrites ? rewrites::worker_count() : 0};
+            auto fls = file_set{opts.files};
+            auto cb = [&opts, &pass, &rw, &fls, &base](event const& ev)
+            {
+              auto const& p = ev.path_name.native();
+              auto is_ev = ev.path_type != event::path_type::watcher;
+              if (is_ev && is_excluded(opts, p))
+                return;
+              else if (is_ev && ! fls.contains(ev))
+                return;
+              else if (is_ev && is_too_deep(opts, base.native(), p))
+                return;
+              else if (opts.skip_rewrites)
+                rw.push(ev);
+              else
+                pass(ev);
+            };
+            auto pre_ok = ! ec && std::filesystem::is_directory(base, ec)
                        && ! ec && this->living.state() == sb::state::pending;
             auto live_msg =
               (pre_ok ? "s/self/live@" : "e/self/live@") + abs_path.string();
@@ -2261,7 +6450,13 @@ public:
               {live_msg,
                event::effect_type::create,
                event::path_type::watcher});
-            auto post_ok = pre_ok && watch(abs_path, callback, this->living);
+            if (pre_ok && ! opts.tail.empty()) tl.begin();
+            auto is_walked = opts.files.empty();
+            if (pre_ok && opts.on_inventory && ! (has_inventory && is_walked))
+              inventory_of(base, opts);
+            if (! is_walked) opts.on_inventory = {};
+            auto post_ok = pre_ok && watch(base, cb, this->living, opts);
+            rw.close();
             auto die_msg =
               (post_ok ? "s/self/die@" : "e/self/die@") + abs_path.string();
             callback(
@@ -2272,6 +6467,43 @@ public:
           })}
   {}
 
+  inline watch(
+    std::filesystem::path const& path,
+    event::callback const& callback) noexcept
+      : watch(path, callback, watch_options{})
+  {}
+
+  inline auto drain() noexcept -> dirty_paths { return this->dirty.drain(); }
+
+  inline auto now() noexcept -> cursor { return this->tree.now(); }
+
+  inline auto
+  changed_since(std::filesystem::path const& path, cursor since) noexcept
+    -> bool
+  {
+    return this->tree.changed_since(absolute_of(this->root, path), since);
+  }
+
+  inline auto id_of(std::filesystem::path const& path) noexcept -> path_id
+  {
+    return this->ids.id_of(absolute_of(this->root, path));
+  }
+
+  inline auto path_of(path_id id) noexcept -> std::filesystem::path
+  {
+    return this->ids.path_of(id);
+  }
+
+  inline auto snapshot() noexcept -> index_snapshot
+  {
+    return this->index.now();
+  }
+
+  inline auto backlog() noexcept -> backlog_stats
+  {
+    return this->gauge.now();
+  }
+
   inline auto close() noexcept -> bool
   {
     return this->living.release() != sb::state::error
@@ -2281,6 +6513,96 @@ public:
   inline ~watch() noexcept { this->close(); }
 };
 
+} /*  namespace watcher */
+} /*  namespace wtr   */
+
+#include <filesystem>
+#include <future>
+
+namespace wtr {
+inline namespace watcher {
+
+/*  Watches for a path to appear, such as a lock file
+    or a marker that something is done, whether or not
+    its parent directories exist yet.
+
+    Begins watching when constructed.
+
+    The callback is called once, with a `create` event
+    for the path, once the path exists (right away, if
+    it already does). Our messages (the events about
+    the `watcher`) are sent as they are for a `watch`.
+
+    On Linux, we only ever watch one directory: the
+    deepest one along the path which exists. We move
+    down the path as it's made. Elsewhere, we poll.
+
+    `wait()` blocks until the path exists, or until
+    we're closed. Either returns whether the path
+    appeared (and nothing went wrong).
+
+    @param path:
+      The path to watch for. Relative paths are relative
+      to the current directory, as of when we begin.
+
+    @param callback:
+      Called when the path exists. */
+class watch_for {
+  using sb = ::detail::wtr::watcher::semabin;
+  sb living{};
+  std::future<bool> watching{};
+
+public:
+  inline watch_for(
+    std::filesystem::path const& path,
+    event::callback const& callback) noexcept
+      : watching{std::async(
+          std::launch::async,
+          [this, path, callback]
+          {
+            namespace fs = std::filesystem;
+            using ::detail::wtr::watcher::wait_for;
+            using pt = enum event::path_type;
+            auto ec = std::error_code{};
+            auto abs_path = fs::absolute(path, ec).lexically_normal();
+            auto pre_ok = ! ec && this->living.state() == sb::state::pending;
+            auto live_msg =
+              (pre_ok ? "s/self/live@" : "e/self/live@") + abs_path.string();
+            callback({live_msg, event::effect_type::create, pt::watcher});
+            auto is_there = pre_ok && wait_for(abs_path, this->living);
+            if (is_there) {
+              auto st = fs::symlink_status(abs_path, ec);
+              callback(
+                {abs_path,
+                 event::effect_type::create,
+                 fs::is_directory(st)      ? pt::dir
+                 : fs::is_regular_file(st) ? pt::file
+                 : fs::is_symlink(st)      ? pt::sym_link
+                                           : pt::other});
+            }
+            auto post_ok = pre_ok && this->living.state() != sb::state::error;
+            auto die_msg =
+              (post_ok ? "s/self/die@" : "e/self/die@") + abs_path.string();
+            callback({die_msg, event::effect_type::destroy, pt::watcher});
+            return is_there && post_ok;
+          })}
+  {}
+
+  inline auto wait() noexcept -> bool
+  {
+    if (this->watching.valid()) this->watching.wait();
+    return this->close();
+  }
+
+  inline auto close() noexcept -> bool
+  {
+    return this->living.release() != sb::state::error
+        && this->watching.valid() && this->watching.get();
+  };
+
+  inline ~watch_for() noexcept { this->close(); }
+};
+
 } /*  namespace watcher */
 } /*  namespace wtr   */
 #endif /* W973564ED9F278A21F3E12037288412FBAF175F889 */
@@ -59,6 +59,35 @@ typedef void (* wtr_watcher_callback)(struct wtr_watcher_event event, void* cont
 
 void* wtr_watcher_open(char const* const path, wtr_watcher_callback callback, void* context);
 
+/*  Some of the options a watcher can be opened with.
+    Zero is the default for each of them.
+      - `read_buf_len`:
+        How many bytes of events are read from the kernel at once.
+      - `epoll_q_len`:
+        How many of `epoll`'s events are taken at once.
+      - `reader_cpus`:
+        A mask of the CPUs (the first 64) which the threads that
+        read from the kernel, and call the callback, may run on.
+      - `reader_nice`:
+        How much nicer than the rest of the process those threads are.
+      - `io_uring`:
+        Wait for the kernel's events with io_uring, rather than `epoll`.
+    Only the Linux adapters use these.
+*/
+struct wtr_watcher_options {
+  uint32_t read_buf_len;
+  int32_t epoll_q_len;
+  uint64_t reader_cpus;
+  int32_t reader_nice;
+  bool io_uring;
+};
+
+void* wtr_watcher_open_with_options(
+  char const* const path,
+  struct wtr_watcher_options const* const options,
+  wtr_watcher_callback callback,
+  void* context);
+
 bool wtr_watcher_close(void* watcher);
 
 #ifdef __cplusplus
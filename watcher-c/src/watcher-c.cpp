@@ -33,12 +33,11 @@ static int utf16_to_utf8(wchar_t const* utf16_buf, char* utf8_buf, int utf8_buf_
 }
 #endif
 
-void* wtr_watcher_open(
-  char const* const path,
+static wtr::watcher::event::callback wrap_callback(
   wtr_watcher_callback callback,
   void* context)
 {
-  auto wrapped_callback = [callback, context](wtr::watcher::event ev_owned)
+  return [callback, context](wtr::watcher::event ev_owned)
   {
     wtr_watcher_event ev_view = {};
 #ifdef _WIN32
@@ -63,7 +62,34 @@ void* wtr_watcher_open(
     ev_view.effect_time = ev_owned.effect_time;
     callback(ev_view, context);
   };
-  return (void*)new wtr::watcher::watch(path, wrapped_callback);
+}
+
+void* wtr_watcher_open(
+  char const* const path,
+  wtr_watcher_callback callback,
+  void* context)
+{
+  return (void*)new wtr::watcher::watch(path, wrap_callback(callback, context));
+}
+
+void* wtr_watcher_open_with_options(
+  char const* const path,
+  struct wtr_watcher_options const* const options,
+  wtr_watcher_callback callback,
+  void* context)
+{
+  auto opts = wtr::watcher::watch_options{};
+  if (options) {
+    if (options->read_buf_len) opts.read_buf_len = options->read_buf_len;
+    if (options->epoll_q_len) opts.epoll_q_len = options->epoll_q_len;
+    for (int cpu = 0; cpu < 64; ++cpu)
+      if (options->reader_cpus & (uint64_t{1} << cpu))
+        opts.reader_cpus.push_back(cpu);
+    opts.reader_nice = options->reader_nice;
+    opts.io_uring = options->io_uring;
+  }
+  auto cb = wrap_callback(callback, context);
+  return (void*)new wtr::watcher::watch(path, cb, opts);
 }
 
 bool wtr_watcher_close(void* watcher)